@@ -0,0 +1,1074 @@
+/*
+	ionstub.c:	in-process simulation of the ION APIs used by the UDP
+			delay convergence-layer engine.  See ionstub.h.
+
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#include "ionstub.h"
+#include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+
+/* Seconds between the Unix epoch and the DTN epoch (2000-01-01) */
+#define DTN_EPOCH_OFFSET	946684800ULL
+
+IonStub ionStub = {
+	.sdrXnNsec = 2000,
+	.zcoNsecPerKb = 250,
+	.acqNsec = 20000,
+	.memoNsec = 0,
+	.quiet = 0,
+	.bundleSize = 1024,
+	.bundleRate = 0.0,
+	.bundleLimit = 0,
+	.sourceNode = 1,
+	.lifetimeMsec = 86400000
+};
+
+struct IonStubSdr {
+	pthread_mutex_t	lock;
+};
+
+typedef struct StubZco {
+	vast		length;
+	int		held;		/* Dequeued with stewardship */
+	struct StubZco	*destroyedNext;	/* Destroyed in the open transaction */
+	unsigned char	bytes[];
+} StubZco;
+
+static struct IonStubSdr stubSdr = { PTHREAD_MUTEX_INITIALIZER };
+static int stubConfigured = 0;
+
+/* Outducts, found by name; a duct's semaphore is its index + 1 */
+#define	STUB_MAX_OUTDUCTS	64
+
+typedef struct {
+	VOutduct	vduct;		/* First: bpDequeue casts back */
+	volatile sig_atomic_t ended;
+	int		endPipe[2];	/* Readable once the duct has ended */
+} StubOutduct;
+
+static StubOutduct stubOutducts[STUB_MAX_OUTDUCTS];
+static int stubOutductCount = 0;
+static pthread_mutex_t stubDuctLock = PTHREAD_MUTEX_INITIALIZER;
+static VInduct stubInduct;
+static uvast stubBundleCount = 0;
+static struct timespec stubDequeueStart;
+static __thread int stubInXn = 0;
+static __thread StubZco *stubXnDestroyed = NULL;
+
+static unsigned long long stubNsec(int clockId)
+{
+	struct timespec now;
+
+	clock_gettime(clockId, &now);
+	return ((unsigned long long) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/* Burn CPU for the indicated time, like the work being simulated */
+static void spin(unsigned long nsec)
+{
+	unsigned long long until;
+
+	if (nsec == 0) {
+		return;
+	}
+
+	until = stubNsec(CLOCK_MONOTONIC) + nsec;
+	while (stubNsec(CLOCK_MONOTONIC) < until) {
+		/* busy */
+	}
+}
+
+static void count(uvast *counter, vast amount)
+{
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static unsigned long envNumber(const char *name, unsigned long dflt)
+{
+	char *value = getenv(name);
+
+	return value ? strtoul(value, NULL, 0) : dflt;
+}
+
+void ionStubConfigure(void)
+{
+	char *rate = getenv("STUB_RATE");
+
+	ionStub.sdrXnNsec = envNumber("STUB_SDR_XN_NS", ionStub.sdrXnNsec);
+	ionStub.zcoNsecPerKb = envNumber("STUB_ZCO_NS_PER_KB",
+			ionStub.zcoNsecPerKb);
+	ionStub.acqNsec = envNumber("STUB_ACQ_NS", ionStub.acqNsec);
+	ionStub.memoNsec = envNumber("STUB_MEMO_NS", ionStub.memoNsec);
+	ionStub.quiet = envNumber("STUB_QUIET", ionStub.quiet);
+	ionStub.bundleSize = envNumber("STUB_BUNDLE_SIZE", ionStub.bundleSize);
+	ionStub.bundleLimit = envNumber("STUB_BUNDLES", ionStub.bundleLimit);
+	ionStub.sourceNode = envNumber("STUB_SOURCE_NODE", ionStub.sourceNode);
+	ionStub.lifetimeMsec = envNumber("STUB_LIFETIME_MS",
+			ionStub.lifetimeMsec);
+	if (rate) {
+		ionStub.bundleRate = atof(rate);
+	}
+}
+
+void ionStubReport(void)
+{
+	fprintf(stderr, "ionstub: dequeued %llu bundles (%llu bytes), "
+			"acquired %llu bundles (%llu bytes), %llu canceled\n",
+			ionStub.bundlesDequeued, ionStub.bytesDequeued,
+			ionStub.bundlesAcquired, ionStub.bytesAcquired,
+			ionStub.acquisitionsCanceled);
+	fprintf(stderr, "ionstub: %llu ZCOs live (%llu bytes), %llu memory "
+			"allocations live (%llu bytes), %llu memos, %llu errors\n",
+			ionStub.zcosLive, ionStub.zcoBytesLive, ionStub.memAllocs,
+			ionStub.memBytesLive, ionStub.memos, ionStub.errmsgs);
+	if (ionStub.bundlesHeld || ionStub.xnViolations
+	|| ionStub.xnAbandoned) {
+		fprintf(stderr, "ionstub: %llu bundles (%llu bytes) held for "
+				"stewardship, %llu zco_destroy calls outside a "
+				"transaction, %llu abandoned by sdr_exit_xn\n",
+				ionStub.bundlesHeld, ionStub.bytesHeld,
+				ionStub.xnViolations, ionStub.xnAbandoned);
+	}
+}
+
+/*	*	*	Platform	*	*	*	*	*	*/
+
+typedef struct {
+	size_t	size;
+	size_t	pad;		/* Keep user memory 16-byte aligned */
+} StubBlock;
+
+void *allocFromIonMemory(const char *file, int line, size_t size)
+{
+	StubBlock *block = malloc(sizeof(StubBlock) + size);
+
+	if (block == NULL) {
+		return NULL;
+	}
+
+	block->size = size;
+	count(&ionStub.memAllocs, 1);
+	count(&ionStub.memBytesLive, size);
+	return block + 1;
+}
+
+void releaseToIonMemory(const char *file, int line, void *addr)
+{
+	StubBlock *block;
+
+	if (addr == NULL) {
+		return;
+	}
+
+	block = ((StubBlock *) addr) - 1;
+	count(&ionStub.memAllocs, -1);
+	count(&ionStub.memBytesLive, -(vast) block->size);
+	free(block);
+}
+
+void writeMemo(char *msg)
+{
+	count(&ionStub.memos, 1);
+	spin(ionStub.memoNsec);
+	if (!ionStub.quiet) {
+		time_t now = time(NULL);
+		struct tm ts;
+		char stamp[32];
+
+		localtime_r(&now, &ts);
+		strftime(stamp, sizeof stamp, "%Y/%m/%d-%H:%M:%S", &ts);
+		fprintf(stderr, "[%s] %s\n", stamp, msg);
+	}
+}
+
+void writeMemoNote(char *msg, char *note)
+{
+	char buffer[1024];
+
+	isprintf(buffer, sizeof buffer, "%s: %s", msg, note ? note : "");
+	writeMemo(buffer);
+}
+
+void writeErrmsgMemos(void)
+{
+	/* Errors are written as they are posted */
+}
+
+void _putErrmsg(const char *file, int line, const char *text,
+		const char *arg)
+{
+	char buffer[1024];
+
+	count(&ionStub.errmsgs, 1);
+	isprintf(buffer, sizeof buffer, "at line %d of %s, %s (%s)", line,
+			file, text, arg ? arg : "");
+	writeMemo(buffer);
+}
+
+void _putSysErrmsg(const char *file, int line, const char *text,
+		const char *arg)
+{
+	char buffer[1024];
+
+	isprintf(buffer, sizeof buffer, "%s: %s", text, strerror(errno));
+	_putErrmsg(file, line, buffer, arg);
+}
+
+int isprintf(char *buffer, int bufSize, char *format, ...)
+{
+	va_list args;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(buffer, bufSize, format, args);
+	va_end(args);
+	return length;
+}
+
+char *istrcpy(char *buffer, const char *from, size_t bufSize)
+{
+	size_t length = strlen(from);
+
+	if (length >= bufSize) {
+		length = bufSize - 1;
+	}
+
+	memcpy(buffer, from, length);
+	buffer[length] = '\0';
+	return buffer;
+}
+
+char *itoa(int value)
+{
+	static __thread char buffer[16];
+
+	snprintf(buffer, sizeof buffer, "%d", value);
+	return buffer;
+}
+
+void isignal(int signbr, void (*handler)(int))
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof action);
+	action.sa_handler = handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(signbr, &action, NULL);
+}
+
+void microsnooze(unsigned int usec)
+{
+	struct timespec interval;
+
+	interval.tv_sec = usec / 1000000;
+	interval.tv_nsec = (usec % 1000000) * 1000;
+	nanosleep(&interval, NULL);
+}
+
+int isendto(int fd, char *buf, int len, int flags,
+		const struct sockaddr *to, int tolen)
+{
+	int result;
+
+	do {
+		result = sendto(fd, buf, len, flags, to, tolen);
+	} while (result < 0 && errno == EINTR);
+
+	return result;
+}
+
+unsigned int getInternetAddress(char *hostName)
+{
+	struct addrinfo hints, *result;
+	unsigned int hostNbr;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	if (getaddrinfo(hostName, NULL, &hints, &result) != 0) {
+		return 0;
+	}
+
+	hostNbr = ntohl(((struct sockaddr_in *) result->ai_addr)
+			->sin_addr.s_addr);
+	freeaddrinfo(result);
+	return hostNbr;
+}
+
+void parseSocketSpec(char *socketSpec, unsigned short *portNbr,
+		unsigned int *ipAddress)
+{
+	char host[MAXHOSTNAMELEN + 1];
+	char *colon = strchr(socketSpec, ':');
+	size_t hostLength = colon ? (size_t) (colon - socketSpec)
+			: strlen(socketSpec);
+
+	*portNbr = colon ? (unsigned short) atoi(colon + 1) : 0;
+	if (hostLength > MAXHOSTNAMELEN) {
+		hostLength = MAXHOSTNAMELEN;
+	}
+
+	memcpy(host, socketSpec, hostLength);
+	host[hostLength] = '\0';
+	*ipAddress = (hostLength > 0) ? getInternetAddress(host) : 0;
+}
+
+void printDottedString(unsigned int hostNbr, char *buffer)
+{
+	sprintf(buffer, "%u.%u.%u.%u", (hostNbr >> 24) & 0xff,
+			(hostNbr >> 16) & 0xff, (hostNbr >> 8) & 0xff,
+			hostNbr & 0xff);
+}
+
+int sm_TaskIdSelf(void)
+{
+	return (int) getpid();
+}
+
+int sm_TaskExists(int task)
+{
+	return (kill(task, 0) == 0 || errno == EPERM);
+}
+
+void sm_SemEnd(sm_SemId semId)
+{
+	StubOutduct *duct;
+
+	/* Called from signal handlers: only async-signal-safe calls */
+	if (semId < 1 || semId > stubOutductCount) {
+		return;
+	}
+
+	duct = &stubOutducts[semId - 1];
+	duct->ended = 1;
+	oK(write(duct->endPipe[1], "", 1));
+}
+
+/* Reopens an ended semaphore for a process taking over its duct */
+void sm_SemUnend(sm_SemId semId)
+{
+	StubOutduct *duct;
+	char ends[16];
+
+	if (semId < 1 || semId > stubOutductCount) {
+		return;
+	}
+
+	duct = &stubOutducts[semId - 1];
+	while (read(duct->endPipe[0], ends, sizeof ends) > 0) {
+		continue;
+	}
+
+	duct->ended = 0;
+}
+
+int sm_SemEnded(sm_SemId semId)
+{
+	if (semId < 1 || semId > stubOutductCount) {
+		return 1;
+	}
+
+	return stubOutducts[semId - 1].ended;
+}
+
+/*	*	*	ION, SDR and ZCO	*	*	*	*	*/
+
+Sdr getIonsdr(void)
+{
+	return &stubSdr;
+}
+
+void ionDetach(void)
+{
+}
+
+void ionNoteMainThread(char *procName)
+{
+}
+
+void ionKillMainThread(char *procName)
+{
+	/* The delay CLI polls its running flag, nothing to interrupt */
+}
+
+int sdr_begin_xn(Sdr sdr)
+{
+	pthread_mutex_lock(&sdr->lock);
+	stubInXn = 1;
+	spin(ionStub.sdrXnNsec);
+	return 1;
+}
+
+/* Rolls back the transaction: ZCOs destroyed in it stay in the SDR */
+void sdr_exit_xn(Sdr sdr)
+{
+	StubZco *stubZco;
+
+	while ((stubZco = stubXnDestroyed) != NULL) {
+		stubXnDestroyed = stubZco->destroyedNext;
+		stubZco->destroyedNext = NULL;
+		count(&ionStub.xnAbandoned, 1);
+	}
+
+	stubInXn = 0;
+	pthread_mutex_unlock(&sdr->lock);
+}
+
+int sdr_end_xn(Sdr sdr)
+{
+	StubZco *stubZco;
+
+	while ((stubZco = stubXnDestroyed) != NULL) {
+		stubXnDestroyed = stubZco->destroyedNext;
+		count(&ionStub.zcosLive, -1);
+		count(&ionStub.zcoBytesLive, -stubZco->length);
+		free(stubZco);
+	}
+
+	stubInXn = 0;
+	pthread_mutex_unlock(&sdr->lock);
+	return 0;
+}
+
+vast zco_length(Sdr sdr, Object zco)
+{
+	return ((StubZco *) zco)->length;
+}
+
+void zco_destroy(Sdr sdr, Object zco)
+{
+	StubZco *stubZco = (StubZco *) zco;
+
+	/* ION requires a transaction and leaves the ZCO in place without */
+	if (!stubInXn) {
+		count(&ionStub.xnViolations, 1);
+		putErrmsg("zco_destroy outside a transaction.", NULL);
+		return;
+	}
+
+	/* Freed when the transaction commits */
+	stubZco->destroyedNext = stubXnDestroyed;
+	stubXnDestroyed = stubZco;
+}
+
+void zco_start_transmitting(Object zco, ZcoReader *reader)
+{
+	reader->zco = zco;
+	reader->offset = 0;
+}
+
+vast zco_transmit(Sdr sdr, ZcoReader *reader, vast length, char *buffer)
+{
+	StubZco *stubZco = (StubZco *) reader->zco;
+	uvast failures = __atomic_load_n(&ionStub.transmitFailures,
+			__ATOMIC_RELAXED);
+
+	while (failures > 0) {
+		if (__atomic_compare_exchange_n(&ionStub.transmitFailures,
+				&failures, failures - 1, 0, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED)) {
+			return 0;
+		}
+	}
+
+	if (length > stubZco->length - reader->offset) {
+		length = stubZco->length - reader->offset;
+	}
+
+	memcpy(buffer, stubZco->bytes + reader->offset, length);
+	reader->offset += length;
+	spin((length * ionStub.zcoNsecPerKb) / 1024);
+	return length;
+}
+
+/*	*	*	CBOR	*	*	*	*	*	*	*/
+
+static int encodeHead(int majorType, uvast value, unsigned char **cursor)
+{
+	unsigned char *c = *cursor;
+	int length;
+
+	if (value < 24) {
+		c[0] = (majorType << 5) | value;
+		length = 1;
+	} else if (value <= 0xff) {
+		c[0] = (majorType << 5) | 24;
+		length = 2;
+	} else if (value <= 0xffff) {
+		c[0] = (majorType << 5) | 25;
+		length = 3;
+	} else if (value <= 0xffffffffULL) {
+		c[0] = (majorType << 5) | 26;
+		length = 5;
+	} else {
+		c[0] = (majorType << 5) | 27;
+		length = 9;
+	}
+
+	for (int i = length - 1; i > 0; i--) {
+		c[i] = value & 0xff;
+		value >>= 8;
+	}
+
+	*cursor += length;
+	return length;
+}
+
+static int decodeHead(int *majorType, uvast *value, int *indefinite,
+		unsigned char **cursor, unsigned int *bytesBuffered)
+{
+	unsigned char *c = *cursor;
+	int additional, length;
+
+	if (*bytesBuffered < 1) {
+		return 0;
+	}
+
+	*majorType = c[0] >> 5;
+	additional = c[0] & 0x1f;
+	*indefinite = 0;
+	*value = 0;
+	if (additional < 24) {
+		*value = additional;
+		length = 1;
+	} else if (additional == 31) {
+		*indefinite = 1;
+		length = 1;
+	} else if (additional <= 27) {
+		length = 1 + (1 << (additional - 24));
+		if (*bytesBuffered < (unsigned int) length) {
+			return 0;
+		}
+
+		for (int i = 1; i < length; i++) {
+			*value = (*value << 8) | c[i];
+		}
+	} else {
+		return 0;
+	}
+
+	*cursor += length;
+	*bytesBuffered -= length;
+	return length;
+}
+
+int cbor_encode_integer(uvast value, unsigned char **cursor)
+{
+	return encodeHead(CborUnsignedInteger, value, cursor);
+}
+
+int cbor_encode_byte_string(unsigned char *value, uvast size,
+		unsigned char **cursor)
+{
+	int length = encodeHead(CborByteString, size, cursor);
+
+	if (value) {
+		memcpy(*cursor, value, size);
+	}
+
+	*cursor += size;
+	return length + size;
+}
+
+int cbor_encode_text_string(char *value, uvast size, unsigned char **cursor)
+{
+	int length = encodeHead(CborTextString, size, cursor);
+
+	if (value) {
+		memcpy(*cursor, value, size);
+	}
+
+	*cursor += size;
+	return length + size;
+}
+
+int cbor_encode_array_open(uvast size, unsigned char **cursor)
+{
+	if (size == (uvast) -1) {
+		**cursor = (CborArray << 5) | 31;
+		*cursor += 1;
+		return 1;
+	}
+
+	return encodeHead(CborArray, size, cursor);
+}
+
+int cbor_encode_break(unsigned char **cursor)
+{
+	**cursor = 0xff;
+	*cursor += 1;
+	return 1;
+}
+
+int cbor_decode_integer(uvast *value, int class, unsigned char **cursor,
+		unsigned int *bytesBuffered)
+{
+	unsigned char *start = *cursor;
+	unsigned int buffered = *bytesBuffered;
+	int majorType, indefinite;
+	int length = decodeHead(&majorType, value, &indefinite, cursor,
+			bytesBuffered);
+
+	if (length == 0 || majorType != CborUnsignedInteger || indefinite
+	|| (class != CborAny && length != 1 + (class == CborTiny ? 0 : class))) {
+		*cursor = start;
+		*bytesBuffered = buffered;
+		return 0;
+	}
+
+	return length;
+}
+
+int cbor_decode_text_string(char *value, uvast *size, unsigned char **cursor,
+		unsigned int *bytesBuffered)
+{
+	unsigned char *start = *cursor;
+	unsigned int buffered = *bytesBuffered;
+	int majorType, indefinite;
+	uvast stringLength;
+	int length = decodeHead(&majorType, &stringLength, &indefinite,
+			cursor, bytesBuffered);
+
+	if (length == 0 || majorType != CborTextString || indefinite
+	|| stringLength > *size) {
+		*cursor = start;
+		*bytesBuffered = buffered;
+		return 0;
+	}
+
+	*size = stringLength;
+	if (value == NULL) {
+		return length;
+	}
+
+	if (stringLength > *bytesBuffered) {
+		*cursor = start;
+		*bytesBuffered = buffered;
+		return 0;
+	}
+
+	memcpy(value, *cursor, stringLength);
+	*cursor += stringLength;
+	*bytesBuffered -= stringLength;
+	return length + stringLength;
+}
+
+int cbor_decode_array_open(uvast *size, unsigned char **cursor,
+		unsigned int *bytesBuffered)
+{
+	unsigned char *start = *cursor;
+	unsigned int buffered = *bytesBuffered;
+	int majorType, indefinite;
+	uvast items;
+	int length = decodeHead(&majorType, &items, &indefinite, cursor,
+			bytesBuffered);
+
+	if (length == 0 || majorType != CborArray) {
+		goto fail;
+	}
+
+	if (*size == (uvast) -1) {
+		if (!indefinite) {
+			goto fail;
+		}
+
+		return length;
+	}
+
+	if (indefinite) {
+		if (*size != 0) {
+			goto fail;
+		}
+
+		*size = (uvast) -1;
+		return length;
+	}
+
+	if (*size != 0 && *size != items) {
+		goto fail;
+	}
+
+	*size = items;
+	return length;
+
+fail:
+	*cursor = start;
+	*bytesBuffered = buffered;
+	return 0;
+}
+
+/*	*	*	BP	*	*	*	*	*	*	*/
+
+int bpAttach(void)
+{
+	if (!stubConfigured) {
+		ionStubConfigure();
+		stubConfigured = 1;
+	}
+
+	return 0;
+}
+
+/* Every name is an outduct: the first lookup adds it, a lookup after
+ * it has ended reopens it */
+void findOutduct(char *protocolName, char *ductName, VOutduct **vduct,
+		PsmAddress *vductElt)
+{
+	StubOutduct *duct;
+	int i;
+
+	*vduct = NULL;
+	*vductElt = 0;
+	pthread_mutex_lock(&stubDuctLock);
+	for (i = 0; i < stubOutductCount; i++) {
+		if (strcmp(stubOutducts[i].vduct.ductName, ductName) == 0) {
+			break;
+		}
+	}
+
+	duct = &stubOutducts[i];
+	if (i < stubOutductCount && duct->ended) {
+		/* Reopen it, as bpadmin restarting the duct would */
+		sm_SemUnend(i + 1);
+	}
+
+	if (i == stubOutductCount) {
+		if (i == STUB_MAX_OUTDUCTS || pipe(duct->endPipe) < 0) {
+			pthread_mutex_unlock(&stubDuctLock);
+			return;
+		}
+
+		fcntl(duct->endPipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(duct->endPipe[1], F_SETFL, O_NONBLOCK);
+
+		istrcpy(duct->vduct.protocolName, protocolName,
+				sizeof duct->vduct.protocolName);
+		istrcpy(duct->vduct.ductName, ductName,
+				sizeof duct->vduct.ductName);
+		duct->vduct.outductElt = i + 1;
+		duct->vduct.cloPid = ERROR;
+		duct->vduct.semaphore = i + 1;
+		stubOutductCount++;
+	}
+
+	pthread_mutex_unlock(&stubDuctLock);
+	*vduct = &duct->vduct;
+	*vductElt = i + 1;
+}
+
+void findInduct(char *protocolName, char *ductName, VInduct **vduct,
+		PsmAddress *vductElt)
+{
+	istrcpy(stubInduct.protocolName, protocolName,
+			sizeof stubInduct.protocolName);
+	istrcpy(stubInduct.ductName, ductName, sizeof stubInduct.ductName);
+	stubInduct.inductElt = 1;
+	stubInduct.cliPid = ERROR;
+	*vduct = &stubInduct;
+	*vductElt = 1;
+}
+
+Object ionStubCreateBundle(void)
+{
+	unsigned char header[128];
+	unsigned char *cursor = header;
+	uvast sequence = __atomic_fetch_add(&stubBundleCount, 1,
+			__ATOMIC_RELAXED);
+	uvast creationMsec = (stubNsec(CLOCK_REALTIME) / 1000000ULL)
+			- (DTN_EPOCH_OFFSET * 1000ULL);
+	unsigned int headerLength, payloadLength, payloadHead;
+	StubZco *zco;
+
+	/* Primary block: version 7, no flags, no CRC, ipn EIDs */
+	cbor_encode_array_open((uvast) -1, &cursor);
+	cbor_encode_array_open(8, &cursor);
+	cbor_encode_integer(7, &cursor);
+	cbor_encode_integer(0, &cursor);
+	cbor_encode_integer(0, &cursor);
+	cbor_encode_array_open(2, &cursor);		/* Destination */
+	cbor_encode_integer(2, &cursor);
+	cbor_encode_array_open(2, &cursor);
+	cbor_encode_integer(2, &cursor);
+	cbor_encode_integer(1, &cursor);
+	cbor_encode_array_open(2, &cursor);		/* Source */
+	cbor_encode_integer(2, &cursor);
+	cbor_encode_array_open(2, &cursor);
+	cbor_encode_integer(ionStub.sourceNode, &cursor);
+	cbor_encode_integer(1, &cursor);
+	cbor_encode_array_open(2, &cursor);		/* Report-to: dtn:none */
+	cbor_encode_integer(1, &cursor);
+	cbor_encode_integer(0, &cursor);
+	cbor_encode_array_open(2, &cursor);		/* Creation timestamp */
+	cbor_encode_integer(creationMsec, &cursor);
+	cbor_encode_integer(sequence, &cursor);
+	cbor_encode_integer(ionStub.lifetimeMsec, &cursor);	/* Lifetime, msec */
+
+	/* Payload block: type 1, number 1, no flags, no CRC */
+	cbor_encode_array_open(5, &cursor);
+	cbor_encode_integer(1, &cursor);
+	cbor_encode_integer(1, &cursor);
+	cbor_encode_integer(0, &cursor);
+	cbor_encode_integer(0, &cursor);
+	headerLength = cursor - header;
+
+	/* Size the payload so the bundle is ionStub.bundleSize bytes */
+	payloadLength = 0;
+	if (ionStub.bundleSize > headerLength + 1) {
+		payloadLength = ionStub.bundleSize - headerLength - 1;
+	}
+
+	for (payloadHead = 1; payloadHead < 9 && payloadLength > 0; ) {
+		unsigned char probe[9];
+		unsigned char *p = probe;
+		unsigned int needed = encodeHead(CborByteString,
+				payloadLength - payloadHead, &p);
+
+		if (needed == payloadHead) break;
+		payloadHead = needed;
+	}
+
+	payloadLength = (payloadLength > payloadHead)
+			? payloadLength - payloadHead : 0;
+	zco = malloc(sizeof(StubZco) + headerLength + 9 + payloadLength + 1);
+	if (zco == NULL) {
+		return 0;
+	}
+
+	memcpy(zco->bytes, header, headerLength);
+	cursor = zco->bytes + headerLength;
+	encodeHead(CborByteString, payloadLength, &cursor);
+	memset(cursor, 0x5a, payloadLength);
+	cursor += payloadLength;
+	if (payloadLength >= STUB_STAMP_LENGTH) {
+		unsigned long long stamp = stubNsec(CLOCK_REALTIME);
+		unsigned char *trailer = cursor - STUB_STAMP_LENGTH;
+
+		memcpy(trailer, "UDSB", 4);
+		for (int i = 0; i < 8; i++) {
+			trailer[4 + i] = (stamp >> (56 - 8 * i)) & 0xff;
+		}
+	}
+
+	cbor_encode_break(&cursor);
+	zco->length = cursor - zco->bytes;
+	count(&ionStub.zcosLive, 1);
+	count(&ionStub.zcoBytesLive, zco->length);
+	return (Object) zco;
+}
+
+int bpDequeue(VOutduct *vduct, Object *outboundZco,
+		BpAncillaryData *ancillaryData, int stewardship)
+{
+	StubOutduct *duct = (StubOutduct *) vduct;
+	struct pollfd ended;
+
+	*outboundZco = 0;
+	memset(ancillaryData, 0, sizeof(BpAncillaryData));
+	if (ionStub.bundlesDequeued == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &stubDequeueStart);
+	}
+
+	/* Out of synthetic traffic: block, without using CPU, until the
+	 * duct is closed or the limit is raised */
+	ended.fd = duct->endPipe[0];
+	ended.events = POLLIN;
+	while (ionStub.bundleLimit > 0
+	&& ionStub.bundlesDequeued >= ionStub.bundleLimit) {
+		if (duct->ended) {
+			return 0;
+		}
+
+		oK(poll(&ended, 1, 1000));
+	}
+
+	/* Pace to the configured rate */
+	if (ionStub.bundleRate > 0.0) {
+		unsigned long long due = ((unsigned long long)
+				stubDequeueStart.tv_sec * 1000000000ULL)
+				+ stubDequeueStart.tv_nsec
+				+ (unsigned long long) (ionStub.bundlesDequeued
+				* (1e9 / ionStub.bundleRate));
+		unsigned long long now;
+
+		while ((now = stubNsec(CLOCK_MONOTONIC)) < due) {
+			if (duct->ended) {
+				return 0;
+			}
+
+			microsnooze((due - now) > 10000000ULL ? 10000
+					: (unsigned int) ((due - now) / 1000));
+		}
+	}
+
+	if (duct->ended) {
+		return 0;
+	}
+
+	*outboundZco = ionStubCreateBundle();
+	if (*outboundZco == 0) {
+		putErrmsg("Stub can't create bundle.", NULL);
+		return -1;
+	}
+
+	count(&ionStub.bundlesDequeued, 1);
+	count(&ionStub.bytesDequeued, ((StubZco *) *outboundZco)->length);
+	if (stewardship) {
+		((StubZco *) *outboundZco)->held = 1;
+		count(&ionStub.bundlesHeld, 1);
+		count(&ionStub.bytesHeld, ((StubZco *) *outboundZco)->length);
+	}
+
+	return 0;
+}
+
+/* A held bundle whose ZCO is destroyed first stays held: ION keeps the
+ * bundle until the convergence layer reports on it. */
+static int releaseHeld(Object zco)
+{
+	StubZco *stubZco = (StubZco *) zco;
+
+	if (stubZco->held) {
+		stubZco->held = 0;
+		count(&ionStub.bundlesHeld, -1);
+		count(&ionStub.bytesHeld, -stubZco->length);
+	}
+
+	return 0;
+}
+
+int bpHandleXmitSuccess(Object zco)
+{
+	return releaseHeld(zco);
+}
+
+int bpHandleXmitFailure(Object zco)
+{
+	return releaseHeld(zco);
+}
+
+AcqWorkArea *bpGetAcqArea(VInduct *vduct)
+{
+	AcqWorkArea *work = MTAKE(sizeof(AcqWorkArea));
+
+	if (work) {
+		memset(work, 0, sizeof(AcqWorkArea));
+		work->vduct = vduct;
+	}
+
+	return work;
+}
+
+void bpReleaseAcqArea(AcqWorkArea *workArea)
+{
+	MRELEASE(workArea);
+}
+
+int bpBeginAcq(AcqWorkArea *workArea, int authentic, void *senderEid)
+{
+	workArea->active = 1;
+	workArea->length = 0;
+	memset(workArea->tail, 0, sizeof workArea->tail);
+	return 0;
+}
+
+int bpContinueAcq(AcqWorkArea *workArea, char *bytes, int length,
+		void *attendant, unsigned char priority)
+{
+	if (!workArea->active) {
+		putErrmsg("Acquisition not begun.", NULL);
+		return -1;
+	}
+
+	workArea->length += length;
+	if (length >= sizeof workArea->tail) {
+		memcpy(workArea->tail, bytes + length - sizeof workArea->tail,
+				sizeof workArea->tail);
+	}
+
+	spin((length * ionStub.zcoNsecPerKb) / 1024);
+	return 0;
+}
+
+void bpCancelAcq(AcqWorkArea *workArea)
+{
+	workArea->active = 0;
+	count(&ionStub.acquisitionsCanceled, 1);
+}
+
+int bpEndAcq(AcqWorkArea *workArea)
+{
+	Sdr sdr = getIonsdr();
+
+	if (!workArea->active) {
+		putErrmsg("Acquisition not begun.", NULL);
+		return -1;
+	}
+
+	/* Bundle parsing runs in parallel; recording the bundle in the
+	 * SDR is serialized with every other transaction */
+	spin(ionStub.acqNsec);
+	sdr_begin_xn(sdr);
+	sdr_exit_xn(sdr);
+	workArea->active = 0;
+	count(&ionStub.bundlesAcquired, 1);
+	count(&ionStub.bytesAcquired, workArea->length);
+	if (ionStub.acquired) {
+		ionStub.acquired(workArea);
+	}
+
+	return 0;
+}
+
+static int readStamp(unsigned char *trailer, unsigned long long *nsec)
+{
+	if (memcmp(trailer, "UDSB", 4) != 0) {
+		return -1;
+	}
+
+	*nsec = 0;
+	for (int i = 0; i < 8; i++) {
+		*nsec = (*nsec << 8) | trailer[4 + i];
+	}
+
+	return 0;
+}
+
+int ionStubBundleTime(AcqWorkArea *workArea, unsigned long long *nsec)
+{
+	/* Trailer is followed by the bundle's closing break (0xff) */
+	return readStamp(workArea->tail, nsec);
+}
+
+int ionStubStampTime(unsigned char *bundle, int length,
+		unsigned long long *nsec)
+{
+	if (length < STUB_STAMP_LENGTH + 1) {
+		return -1;
+	}
+
+	return readStamp(bundle + length - STUB_STAMP_LENGTH - 1, nsec);
+}
+
+int receiveBytesByUDP(int bundleSocket, struct sockaddr_in *fromAddr,
+		char *into, int length)
+{
+	socklen_t fromSize = sizeof(struct sockaddr_in);
+	int bytesRead = recvfrom(bundleSocket, into, length, 0,
+			(struct sockaddr *) fromAddr, &fromSize);
+
+	if (bytesRead < 0) {
+		if (errno == EINTR) {	/* Shutdown */
+			return 0;
+		}
+
+		putSysErrmsg("Can't receive bundle", NULL);
+	}
+
+	return bytesRead;
+}
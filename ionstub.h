@@ -0,0 +1,313 @@
+/*
+	ionstub.h:	minimal stand-in for the ION APIs used by the UDP delay
+			convergence-layer engine, so that the delay core can
+			be built, benchmarked and exercised without an ION
+			installation or a running ION node.
+
+	Only the types, macros and functions that the delay engine and
+	the daemon wrappers actually use are provided.  BP and SDR
+	operations are simulated in process memory with configurable
+	synthetic costs (busy-waited, so they consume CPU like the real
+	operations); socket operations are real.
+
+	Synthetic costs and bundle generation are configured from the
+	environment when bpAttach() is first called, or directly through
+	the ionStub structure:
+
+	STUB_SDR_XN_NS		cost of each sdr_begin_xn (default 2000)
+	STUB_ZCO_NS_PER_KB	cost of zco_transmit per KB (default 250)
+	STUB_ACQ_NS		cost of each bpEndAcq, plus one SDR
+				transaction (default 20000)
+	STUB_MEMO_NS		cost of each writeMemo (default 0)
+	STUB_QUIET		1 = don't print memos to stderr
+	STUB_BUNDLE_SIZE	size of generated bundles (default 1024)
+	STUB_RATE		bpDequeue bundles/sec (0 = unlimited)
+	STUB_BUNDLES		bundles bpDequeue produces (0 = unlimited)
+	STUB_LIFETIME_MS	lifetime of generated bundles (default
+				86400000, one day)
+
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#ifndef _IONSTUB_H_
+#define _IONSTUB_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*	*	*	Platform	*	*	*	*	*	*/
+
+typedef unsigned long long	uvast;
+typedef long long		vast;
+typedef unsigned long		uaddr;
+typedef long			saddr;
+typedef uaddr			Object;
+typedef uaddr			PsmAddress;
+typedef int			sm_SemId;
+typedef struct IonStubSdr	*Sdr;
+
+#define	ERROR			(-1)
+#define	MAXHOSTNAMELEN		256
+#define	MAX_CL_PROTOCOL_NAME_LEN 15
+#define	MAX_CL_DUCT_NAME_LEN	255
+
+#define	CHKERR(e)	if (!(e)) return -1
+#define	CHKZERO(e)	if (!(e)) return 0
+#define	CHKNULL(e)	if (!(e)) return NULL
+#define	CHKVOID(e)	if (!(e)) return
+
+#define	oK(x)		((void) (x))
+#define	PUTS(s)		puts(s)
+#define	closesocket(fd)	close(fd)
+
+#define MTAKE(size)	allocFromIonMemory(__FILE__, __LINE__, size)
+#define MRELEASE(addr)	releaseToIonMemory(__FILE__, __LINE__, addr)
+
+extern void	*allocFromIonMemory(const char *, int, size_t);
+extern void	releaseToIonMemory(const char *, int, void *);
+
+extern void	writeMemo(char *msg);
+extern void	writeMemoNote(char *msg, char *note);
+extern void	writeErrmsgMemos(void);
+#define	putErrmsg(text, arg)	_putErrmsg(__FILE__, __LINE__, text, arg)
+#define	putSysErrmsg(text, arg)	_putSysErrmsg(__FILE__, __LINE__, text, arg)
+extern void	_putErrmsg(const char *, int, const char *, const char *);
+extern void	_putSysErrmsg(const char *, int, const char *, const char *);
+
+extern int	isprintf(char *buffer, int bufSize, char *format, ...);
+extern char	*istrcpy(char *buffer, const char *from, size_t bufSize);
+extern char	*itoa(int value);
+extern void	isignal(int signbr, void (*handler)(int));
+extern void	microsnooze(unsigned int usec);
+extern int	isendto(int fd, char *buf, int len, int flags,
+			const struct sockaddr *to, int tolen);
+extern void	parseSocketSpec(char *socketSpec, unsigned short *portNbr,
+			unsigned int *ipAddress);
+extern unsigned int getInternetAddress(char *hostName);
+extern void	printDottedString(unsigned int hostNbr, char *buffer);
+
+extern int	sm_TaskIdSelf(void);
+extern int	sm_TaskExists(int task);
+extern void	sm_SemEnd(sm_SemId semId);
+extern void	sm_SemUnend(sm_SemId semId);
+extern int	sm_SemEnded(sm_SemId semId);
+
+/*	*	*	ION, SDR and ZCO	*	*	*	*	*/
+
+extern Sdr	getIonsdr(void);
+extern void	ionDetach(void);
+extern void	ionNoteMainThread(char *procName);
+extern void	ionKillMainThread(char *procName);
+
+extern int	sdr_begin_xn(Sdr sdr);
+extern void	sdr_exit_xn(Sdr sdr);
+extern int	sdr_end_xn(Sdr sdr);
+
+typedef struct {
+	Object	zco;
+	vast	offset;
+} ZcoReader;
+
+extern vast	zco_length(Sdr sdr, Object zco);
+extern void	zco_destroy(Sdr sdr, Object zco);
+extern void	zco_start_transmitting(Object zco, ZcoReader *reader);
+extern vast	zco_transmit(Sdr sdr, ZcoReader *reader, vast length,
+			char *buffer);
+
+/*	*	*	CBOR	*	*	*	*	*	*	*/
+
+#define	CborAny			-1
+#define	CborTiny		0
+#define	CborChar		1
+#define	CborShort		2
+#define	CborInt			4
+#define	CborVast		8
+
+#define	CborUnsignedInteger	0
+#define	CborByteString		2
+#define	CborTextString		3
+#define	CborArray		4
+#define	CborSimpleValue		7
+
+extern int	cbor_encode_integer(uvast value, unsigned char **cursor);
+extern int	cbor_encode_byte_string(unsigned char *value, uvast size,
+			unsigned char **cursor);
+extern int	cbor_encode_text_string(char *value, uvast size,
+			unsigned char **cursor);
+extern int	cbor_encode_array_open(uvast size, unsigned char **cursor);
+extern int	cbor_encode_break(unsigned char **cursor);
+extern int	cbor_decode_integer(uvast *value, int class,
+			unsigned char **cursor, unsigned int *bytesBuffered);
+extern int	cbor_decode_text_string(char *value, uvast *size,
+			unsigned char **cursor, unsigned int *bytesBuffered);
+extern int	cbor_decode_array_open(uvast *size, unsigned char **cursor,
+			unsigned int *bytesBuffered);
+
+/*	*	*	BP	*	*	*	*	*	*	*/
+
+#define	BpUdpDefaultPortNbr	4556
+#define	UDPCLA_BUFSZ		((256 * 256) - 1)
+
+/*	Extended class-of-service flags, as in bp.h			*/
+#define	BP_MINIMUM_LATENCY	(1)
+#define	BP_BEST_EFFORT		(2)
+#define	BP_DATA_LABEL_PRESENT	(4)
+#define	BP_RELIABLE		(8)
+
+typedef struct {
+	unsigned int	dataLabel;
+	unsigned char	flags;
+	unsigned char	ordinal;
+	unsigned char	imdr;
+} BpAncillaryData;
+
+typedef struct {
+	Object		inductElt;
+	char		protocolName[MAX_CL_PROTOCOL_NAME_LEN + 1];
+	char		ductName[MAX_CL_DUCT_NAME_LEN + 1];
+	int		cliPid;
+} VInduct;
+
+typedef struct {
+	Object		outductElt;
+	char		protocolName[MAX_CL_PROTOCOL_NAME_LEN + 1];
+	char		ductName[MAX_CL_DUCT_NAME_LEN + 1];
+	int		cloPid;
+	sm_SemId	semaphore;
+} VOutduct;
+
+#define	STUB_STAMP_LENGTH	12	/* "UDSB" + 64-bit creation nsec */
+
+typedef struct {
+	VInduct		*vduct;
+	int		active;		/* Between bpBeginAcq and bpEndAcq */
+	vast		length;
+	unsigned char	tail[STUB_STAMP_LENGTH + 1];	/* Last bytes seen */
+} AcqWorkArea;
+
+extern int	bpAttach(void);
+
+/* Each new duct name adds an outduct (up to 64); sm_SemEnd on its
+ * semaphore closes it until it is looked up again.  All outducts share
+ * the synthetic traffic. */
+extern void	findOutduct(char *protocolName, char *ductName,
+			VOutduct **vduct, PsmAddress *vductElt);
+extern void	findInduct(char *protocolName, char *ductName,
+			VInduct **vduct, PsmAddress *vductElt);
+extern int	bpDequeue(VOutduct *vduct, Object *outboundZco,
+			BpAncillaryData *ancillaryData, int stewardship);
+extern int	bpHandleXmitSuccess(Object zco);
+extern int	bpHandleXmitFailure(Object zco);
+extern AcqWorkArea *bpGetAcqArea(VInduct *vduct);
+extern void	bpReleaseAcqArea(AcqWorkArea *workArea);
+extern int	bpBeginAcq(AcqWorkArea *workArea, int authentic,
+			void *senderEid);
+extern int	bpContinueAcq(AcqWorkArea *workArea, char *bytes, int length,
+			void *attendant, unsigned char priority);
+extern void	bpCancelAcq(AcqWorkArea *workArea);
+extern int	bpEndAcq(AcqWorkArea *workArea);
+extern int	receiveBytesByUDP(int bundleSocket,
+			struct sockaddr_in *fromAddr, char *into, int length);
+
+/*	*	*	Stub configuration and statistics	*	*	*/
+
+typedef struct {
+	/*	Synthetic costs, nanoseconds.				*/
+	unsigned long	sdrXnNsec;
+	unsigned long	zcoNsecPerKb;
+	unsigned long	acqNsec;
+	unsigned long	memoNsec;
+	int		quiet;
+
+	/*	Synthetic outbound traffic.				*/
+	unsigned int	bundleSize;
+	double		bundleRate;
+	uvast		bundleLimit;
+	uvast		sourceNode;
+	uvast		lifetimeMsec;
+
+	/*	Statistics.						*/
+	uvast		bundlesDequeued;
+	uvast		bytesDequeued;
+	uvast		zcosLive;
+	uvast		zcoBytesLive;
+	uvast		bundlesAcquired;
+	uvast		bytesAcquired;
+	uvast		acquisitionsCanceled;
+	uvast		memos;
+	uvast		errmsgs;
+	uvast		memAllocs;
+	uvast		memBytesLive;
+
+	/*	Bundles dequeued with stewardship and not yet reported
+	 *	by bpHandleXmitSuccess/Failure stay in the SDR.		*/
+	uvast		bundlesHeld;
+	uvast		bytesHeld;
+
+	/*	zco_destroy calls outside a transaction, which ION
+	 *	rejects, leaking the ZCO.				*/
+	uvast		xnViolations;
+
+	/*	zco_destroy calls rolled back by sdr_exit_xn, which
+	 *	abandons the transaction's updates, leaking the ZCO.	*/
+	uvast		xnAbandoned;
+
+	/*	Fault injection: the next this many zco_transmit calls
+	 *	read nothing, as on an SDR read error.			*/
+	uvast		transmitFailures;
+
+	/*	Called by bpEndAcq for every acquired bundle.		*/
+	void		(*acquired)(AcqWorkArea *workArea);
+} IonStub;
+
+extern IonStub	ionStub;
+
+/* Apply STUB_* environment settings; called by the first bpAttach */
+extern void	ionStubConfigure(void);
+
+/* Build one synthetic BPv7 bundle of ionStub.bundleSize bytes into a
+ * new ZCO, as bpDequeue does. */
+extern Object	ionStubCreateBundle(void);
+
+/* Generated bundles end their payload with a creation timestamp
+ * (CLOCK_REALTIME).  Gets it from an acquired bundle; returns 0, or -1
+ * if the bundle carries none. */
+extern int	ionStubBundleTime(AcqWorkArea *workArea,
+			unsigned long long *nsec);
+
+/* Same, from a whole bundle as sent in one datagram */
+extern int	ionStubStampTime(unsigned char *bundle, int length,
+			unsigned long long *nsec);
+
+/* Simulated SDR heap occupancy: live ZCOs plus held bundles */
+#define	ionStubSdrBytes()	(ionStub.zcoBytesLive + ionStub.bytesHeld)
+
+/* Write stub statistics to stderr */
+extern void	ionStubReport(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _IONSTUB_H_ */
@@ -0,0 +1,2769 @@
+/*
+	libudpdelay.c:	common functions for the UDP delay convergence-layer
+			adapter daemons.
+
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE		/* pthread_setaffinity_np */
+#endif
+#include "udpdelay.h"
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* BPv7 primary block processing control flag: bundle is a fragment */
+#define BPV7_IS_FRAGMENT	0x01
+
+/* EID scheme code numbers on the wire (RFC 9171) */
+#define BPV7_SCHEME_DTN		1
+#define BPV7_SCHEME_IPN		2
+
+/* Creation times count milliseconds from 2000-01-01 00:00:00 UTC */
+#define BPV7_EPOCH_SEC		946684800
+
+/* FNV-1a, used to reduce dtn-scheme SSPs to a fixed-size identity */
+static uint64_t hashBytes(unsigned char *bytes, uvast length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (length-- > 0) {
+		hash ^= *bytes++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/* Decode one EID, advancing the cursor past it */
+static int decodeEid(unsigned char **cursor, unsigned int *bytesBuffered,
+		uint32_t *scheme, uint64_t *node, uint64_t *service)
+{
+	uvast size = 2;
+	uvast value;
+
+	if (cbor_decode_array_open(&size, cursor, bytesBuffered) < 1
+	|| cbor_decode_integer(&value, CborAny, cursor, bytesBuffered) < 1) {
+		return -1;
+	}
+
+	if (value == BPV7_SCHEME_IPN) {
+		uvast items = 0;
+		uvast ssp[3];
+
+		/* Two-element [node, service] or three-element
+		 * [allocator, node, service] SSP. */
+		if (cbor_decode_array_open(&items, cursor, bytesBuffered) < 1
+		|| items < 2 || items > 3) {
+			return -1;
+		}
+
+		for (uvast i = 0; i < items; i++) {
+			if (cbor_decode_integer(&ssp[i], CborAny, cursor,
+					bytesBuffered) < 1) {
+				return -1;
+			}
+		}
+
+		*scheme = DTR_SCHEME_IPN;
+		*node = ssp[items - 2];
+		*service = ssp[items - 1];
+		return 0;
+	}
+
+	if (value == BPV7_SCHEME_DTN) {
+		*scheme = DTR_SCHEME_DTN;
+		*service = 0;
+		if (*bytesBuffered < 1) {
+			return -1;
+		}
+
+		/* dtn:none is encoded as the unsigned integer 0 */
+		if (((**cursor) >> 5) == CborUnsignedInteger) {
+			*node = 0;
+			return (cbor_decode_integer(&value, CborAny, cursor,
+					bytesBuffered) < 1) ? -1 : 0;
+		}
+
+		uvast length = *bytesBuffered;
+		if (cbor_decode_text_string(NULL, &length, cursor,
+				bytesBuffered) < 1 || length > *bytesBuffered) {
+			return -1;
+		}
+
+		*node = hashBytes(*cursor, length);
+		*cursor += length;
+		*bytesBuffered -= length;
+		return 0;
+	}
+
+	return -1;
+}
+
+int decodeBundleId(unsigned char *bundle, unsigned int length,
+		DelayBundleId *id, struct timeval *expiryTime)
+{
+	unsigned char *cursor = bundle;
+	unsigned int bytesBuffered = length;
+	DelayBundleId decoded;
+	uvast size;
+	uvast version, flags, crcType, lifetime;
+	uvast creationMsec, creationCount, offset;
+	uint32_t scheme;
+	uint64_t node, service;
+
+	memset(id, 0, sizeof(DelayBundleId));
+	memset(&decoded, 0, sizeof decoded);
+	if (expiryTime) {
+		timerclear(expiryTime);
+	}
+
+	/* Bundle is an indefinite-length array; primary block comes first */
+	size = (uvast) -1;
+	if (cbor_decode_array_open(&size, &cursor, &bytesBuffered) < 1) {
+		return -1;
+	}
+
+	size = 0;
+	if (cbor_decode_array_open(&size, &cursor, &bytesBuffered) < 1
+	|| size < 8 || size > 11) {
+		return -1;
+	}
+
+	if (cbor_decode_integer(&version, CborAny, &cursor, &bytesBuffered) < 1
+	|| version != 7
+	|| cbor_decode_integer(&flags, CborAny, &cursor, &bytesBuffered) < 1
+	|| cbor_decode_integer(&crcType, CborAny, &cursor, &bytesBuffered) < 1) {
+		return -1;
+	}
+
+	/* Destination, source and report-to EIDs */
+	if (decodeEid(&cursor, &bytesBuffered, &scheme, &node, &service) < 0
+	|| decodeEid(&cursor, &bytesBuffered, &decoded.scheme,
+			&decoded.sourceNode, &decoded.sourceService) < 0
+	|| decodeEid(&cursor, &bytesBuffered, &scheme, &node, &service) < 0) {
+		return -1;
+	}
+
+	size = 2;
+	if (cbor_decode_array_open(&size, &cursor, &bytesBuffered) < 1
+	|| cbor_decode_integer(&creationMsec, CborAny, &cursor,
+			&bytesBuffered) < 1
+	|| cbor_decode_integer(&creationCount, CborAny, &cursor,
+			&bytesBuffered) < 1
+	|| cbor_decode_integer(&lifetime, CborAny, &cursor,
+			&bytesBuffered) < 1) {
+		return -1;
+	}
+
+	decoded.creationMsec = creationMsec;
+	decoded.creationCount = creationCount;
+	if (flags & BPV7_IS_FRAGMENT) {
+		if (cbor_decode_integer(&offset, CborAny, &cursor,
+				&bytesBuffered) < 1) {
+			return -1;
+		}
+
+		decoded.fragmentOffset = offset;
+	}
+
+	*id = decoded;
+
+	/* Without a creation time (no clock at the source) the age block
+	 * would be needed; such bundles are never expired here */
+	if (expiryTime && creationMsec > 0) {
+		uvast expiryMsec = creationMsec + lifetime;
+
+		expiryTime->tv_sec = BPV7_EPOCH_SEC + expiryMsec / 1000;
+		expiryTime->tv_usec = (expiryMsec % 1000) * 1000;
+	}
+
+	return 0;
+}
+
+int decodeZcoBundleId(Sdr sdr, Object zco, unsigned int length,
+		DelayBundleId *id, struct timeval *expiryTime)
+{
+	unsigned char header[DELAY_ID_PEEK_BYTES];
+	unsigned int peek = (length < sizeof header) ? length : sizeof header;
+	ZcoReader reader;
+
+	zco_start_transmitting(zco, &reader);
+	if (zco_transmit(sdr, &reader, peek, (char *) header) != peek) {
+		memset(id, 0, sizeof(DelayBundleId));
+		if (expiryTime) {
+			timerclear(expiryTime);
+		}
+
+		return -1;
+	}
+
+	return decodeBundleId(header, peek, id, expiryTime);
+}
+
+/* Trace file state, shared by all threads of the daemon */
+static FILE *traceFile = NULL;
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+int openDelayTrace(char *daemonName)
+{
+	char fileName[256];
+	DelayTraceHeader header;
+
+	if (!DELAY_TRACE) {
+		return 0;
+	}
+
+	isprintf(fileName, sizeof fileName, "%s.%d.dtr", daemonName,
+			(int) getpid());
+	traceFile = fopen(fileName, "wb");
+	if (traceFile == NULL) {
+		putSysErrmsg("Can't open bundle trace file", fileName);
+		return -1;
+	}
+
+	/* Records are small; let stdio batch them into large writes */
+	setvbuf(traceFile, NULL, _IOFBF, 1 << 16);
+	memset(&header, 0, sizeof header);
+	header.magic = DTR_MAGIC;
+	header.version = DTR_VERSION;
+	header.recordSize = sizeof(DelayTraceRecord);
+	header.pid = (uint32_t) getpid();
+	istrcpy(header.daemon, daemonName, sizeof header.daemon);
+	fwrite(&header, sizeof header, 1, traceFile);
+	writeMemoNote("[i] Bundle tracing enabled", fileName);
+	return 0;
+}
+
+void traceBundle(DelayBundleId *id, int event, unsigned int length,
+		struct timeval *when)
+{
+	DelayTraceRecord record;
+	struct timeval now;
+
+	if (!DELAY_TRACE || traceFile == NULL) {
+		return;
+	}
+
+	if (when == NULL) {
+		gettimeofday(&now, NULL);
+		when = &now;
+	}
+
+	memset(&record, 0, sizeof record);
+	record.id = *id;
+	record.usec = ((uint64_t) when->tv_sec * 1000000) + when->tv_usec;
+	record.length = length;
+	record.event = event;
+	pthread_mutex_lock(&traceMutex);
+	fwrite(&record, sizeof record, 1, traceFile);
+	pthread_mutex_unlock(&traceMutex);
+}
+
+void closeDelayTrace(void)
+{
+	pthread_mutex_lock(&traceMutex);
+	if (traceFile) {
+		fclose(traceFile);
+		traceFile = NULL;
+	}
+
+	pthread_mutex_unlock(&traceMutex);
+}
+
+/* Stage profiling state.  Counters are updated with relaxed atomics so
+ * any thread may record without taking a lock. */
+DelayProfCounter delayProfile[PROF_STAGES];
+
+static const char *profStageNames[PROF_STAGES] = {
+	"bpDequeue",
+	"zco_length",
+	"queue lock",
+	"enqueue",
+	"stage wait",
+	"release pass",
+	"release late",
+	"sdr_begin_xn",
+	"zco_transmit",
+	"isendto",
+	"zco_destroy",
+	"receive",
+	"receive turn",
+	"bpBeginAcq",
+	"bpContinueAcq",
+	"bpEndAcq"
+};
+
+static char profDaemonName[32] = "udpdelay";
+static volatile sig_atomic_t profReportRequested = 0;
+
+#if DELAY_PROFILE_TSC && defined(__x86_64__)
+#include <x86intrin.h>
+
+static double tscNsecPerTick = 0.0;
+
+/* Calibrate the TSC against CLOCK_MONOTONIC over ~10 ms */
+static void calibrateTsc(void)
+{
+	struct timespec t0, t1;
+	unsigned long long c0, c1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = __rdtsc();
+	microsnooze(10000);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	c1 = __rdtsc();
+	tscNsecPerTick = ((t1.tv_sec - t0.tv_sec) * 1e9
+			+ (t1.tv_nsec - t0.tv_nsec)) / (double) (c1 - c0);
+}
+
+unsigned long long profileClock(void)
+{
+	return (unsigned long long) (__rdtsc() * tscNsecPerTick);
+}
+#else
+unsigned long long profileClock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+#endif
+
+static int profBucket(unsigned long long nsec)
+{
+	int exponent;
+
+	if (nsec < 4) {
+		return (int) nsec;
+	}
+
+	exponent = 63 - __builtin_clzll(nsec);
+	return ((exponent - 1) * 4) + (int) ((nsec >> (exponent - 2)) & 3);
+}
+
+/* Midpoint of a bucket's range, used as its reported value */
+static unsigned long long profBucketValue(int bucket)
+{
+	int exponent;
+	unsigned long long low;
+
+	if (bucket < 4) {
+		return bucket;
+	}
+
+	exponent = (bucket / 4) + 1;
+	low = (unsigned long long) (4 + (bucket % 4)) << (exponent - 2);
+	return low + ((1ULL << (exponent - 2)) / 2);
+}
+
+void profileRecord(DelayProfStage stage, unsigned long long nsec)
+{
+	DelayProfCounter *counter = &delayProfile[stage];
+	unsigned long long max;
+
+	__atomic_fetch_add(&counter->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counter->totalNsec, nsec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&counter->buckets[profBucket(nsec)], 1,
+			__ATOMIC_RELAXED);
+	max = __atomic_load_n(&counter->maxNsec, __ATOMIC_RELAXED);
+	while (nsec > max && !__atomic_compare_exchange_n(&counter->maxNsec,
+			&max, nsec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		/* max was reloaded by the failed exchange */
+	}
+}
+
+static unsigned long long profPercentile(unsigned long long *buckets,
+		unsigned long long count, int percent)
+{
+	unsigned long long rank = ((count * percent) + 99) / 100;
+	unsigned long long seen = 0;
+
+	for (int i = 0; i < PROF_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			return profBucketValue(i);
+		}
+	}
+
+	return 0;
+}
+
+static void requestProfileReport(int signum)
+{
+	isignal(SIGUSR1, requestProfileReport);
+	profReportRequested = 1;
+}
+
+void initProfile(char *daemonName)
+{
+	if (!DELAY_PROFILE) {
+		return;
+	}
+
+	istrcpy(profDaemonName, daemonName, sizeof profDaemonName);
+#if DELAY_PROFILE_TSC && defined(__x86_64__)
+	calibrateTsc();
+#endif
+	isignal(SIGUSR1, requestProfileReport);
+}
+
+void checkProfileReport(void)
+{
+	if (profReportRequested) {
+		profReportRequested = 0;
+		writeProfileReport();
+	}
+}
+
+void writeProfileReport(void)
+{
+	char memoBuf[256];
+
+	if (!DELAY_PROFILE) {
+		return;
+	}
+
+	isprintf(memoBuf, sizeof memoBuf,
+			"[i] %s stage profile (usec): count mean p50 p90 p99 max",
+			profDaemonName);
+	writeMemo(memoBuf);
+	for (int i = 0; i < PROF_STAGES; i++) {
+		DelayProfCounter *counter = &delayProfile[i];
+		unsigned long long buckets[PROF_BUCKETS];
+		unsigned long long count = 0;
+
+		/* Snapshot so that percentiles are self-consistent */
+		for (int j = 0; j < PROF_BUCKETS; j++) {
+			buckets[j] = __atomic_load_n(&counter->buckets[j],
+					__ATOMIC_RELAXED);
+			count += buckets[j];
+		}
+
+		if (count == 0) {
+			continue;
+		}
+
+		isprintf(memoBuf, sizeof memoBuf,
+				"[i]   %-14s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f",
+				profStageNames[i], count,
+				(__atomic_load_n(&counter->totalNsec, __ATOMIC_RELAXED)
+					/ (double) count) / 1000.0,
+				profPercentile(buckets, count, 50) / 1000.0,
+				profPercentile(buckets, count, 90) / 1000.0,
+				profPercentile(buckets, count, 99) / 1000.0,
+				__atomic_load_n(&counter->maxNsec, __ATOMIC_RELAXED)
+					/ 1000.0);
+		writeMemo(memoBuf);
+	}
+}
+
+/* Simulate link loss - returns 1 if bundle should be dropped */
+int simulateLinkLoss(double lossPercentage)
+{
+	if (lossPercentage <= 0.0) {
+		return 0;  /* No loss */
+	}
+	
+	/* Generate random number between 0.0 and 100.0 */
+	double random = ((double)rand() / RAND_MAX) * 100.0;
+	return (random < lossPercentage) ? 1 : 0;
+}
+
+static DelayClockFn delayClock = NULL;
+
+void setDelayClock(DelayClockFn clock)
+{
+	delayClock = clock;
+}
+
+void delayNow(struct timeval *now)
+{
+	if (delayClock) {
+		delayClock(now);
+	} else {
+		gettimeofday(now, NULL);
+	}
+}
+
+void computeReleaseTime(struct timeval *from, double delaySeconds,
+		struct timeval *releaseTime)
+{
+	long long delayMicroseconds = (long long)(delaySeconds * 1000000.0);
+
+	*releaseTime = *from;
+	releaseTime->tv_sec += delayMicroseconds / 1000000;
+	releaseTime->tv_usec += delayMicroseconds % 1000000;
+	
+	/* Handle overflow */
+	if (releaseTime->tv_usec >= 1000000) {
+		releaseTime->tv_sec++;
+		releaseTime->tv_usec -= 1000000;
+	}
+}
+
+int delayBundleExpires(DelayedBundle *bundle)
+{
+	return timerisset(&bundle->expiryTime)
+			&& !timercmp(&bundle->expiryTime, &bundle->releaseTime, >);
+}
+
+const char *delayReleaseModeNames[] = { "poll", "timerfd", "txtime" };
+
+void initDelayRealtime(DelayRealtime *rt)
+{
+	memset(rt, 0, sizeof(DelayRealtime));
+#if DELAY_RELEASE_CPU >= 0
+	rt->releaseCpus = 1UL << DELAY_RELEASE_CPU;
+#endif
+#if DELAY_RECEIVE_CPU >= 0
+	rt->receiveCpus = 1UL << DELAY_RECEIVE_CPU;
+#endif
+
+	rt->priority = DELAY_RT_PRIORITY;
+	rt->lockMemory = DELAY_MLOCK;
+	rt->spinUsec = DELAY_SPIN_USEC;
+}
+
+int applyDelayRealtime(DelayRealtime *rt, unsigned long cpus,
+		char *daemonName, char *threadName)
+{
+	char memoBuf[160];
+	int result = 0;
+
+	if (cpus) {
+#ifdef __linux__
+		cpu_set_t cpuSet;
+
+		CPU_ZERO(&cpuSet);
+		for (int cpu = 0; cpu < (int) (8 * sizeof cpus); cpu++) {
+			if (cpus & (1UL << cpu)) {
+				CPU_SET(cpu, &cpuSet);
+			}
+		}
+
+		if (pthread_setaffinity_np(pthread_self(), sizeof cpuSet,
+				&cpuSet)) {
+			isprintf(memoBuf, sizeof memoBuf, "[w] %s: can't pin %s thread to cores 0x%lx.", daemonName, threadName, cpus);
+			writeMemo(memoBuf);
+			result = -1;
+		}
+#else
+		isprintf(memoBuf, sizeof memoBuf, "[w] %s: can't pin %s thread on this platform.", daemonName, threadName);
+		writeMemo(memoBuf);
+		result = -1;
+#endif
+	}
+
+	if (rt->priority > 0) {
+		struct sched_param param;
+
+		memset(&param, 0, sizeof param);
+		param.sched_priority = rt->priority;
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+			isprintf(memoBuf, sizeof memoBuf, "[w] %s: can't run %s thread SCHED_FIFO at priority %d (needs CAP_SYS_NICE).", daemonName, threadName, rt->priority);
+			writeMemo(memoBuf);
+			result = -1;
+		}
+	}
+
+	return result;
+}
+
+int lockDelayMemory(DelayRealtime *rt, char *daemonName)
+{
+	char memoBuf[160];
+
+	if (!rt->lockMemory) {
+		return 0;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		isprintf(memoBuf, sizeof memoBuf, "[w] %s: can't lock memory (needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK).", daemonName);
+		writeMemo(memoBuf);
+		return -1;
+	}
+
+	return 0;
+}
+
+void unlockDelayMemory(DelayRealtime *rt)
+{
+	if (rt->lockMemory) {
+		oK(munlockall());
+	}
+}
+
+void reportDelayRealtime(DelayRealtime *rt, char *daemonName)
+{
+	char memoBuf[256];
+
+	if (rt->releaseCpus == 0 && rt->receiveCpus == 0 && rt->priority == 0
+	&& rt->lockMemory == 0 && rt->spinUsec == 0) {
+		return;
+	}
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: real-time settings: "
+			"release cores 0x%lx, receive cores 0x%lx, SCHED_FIFO "
+			"priority %d, memory %s, spin %ld usec.", daemonName,
+			rt->releaseCpus, rt->receiveCpus, rt->priority,
+			rt->lockMemory ? "locked" : "not locked", rt->spinUsec);
+	writeMemo(memoBuf);
+}
+
+long long usecToDeadline(DelayQueue *queue)
+{
+	struct timeval deadline, now;
+
+	if (nextDelayedDeadline(queue, &deadline) < 0) {
+		return LLONG_MAX;
+	}
+
+	delayNow(&now);
+	return (deadline.tv_sec - now.tv_sec) * 1000000LL
+			+ (deadline.tv_usec - now.tv_usec) - queue->leadUsec;
+}
+
+int spinToDeadline(DelayQueue *queue, long spinUsec)
+{
+	long long untilUsec = usecToDeadline(queue);
+	struct timeval start, now;
+
+	if (spinUsec <= 0 || untilUsec > spinUsec) {
+		return 0;
+	}
+
+	delayNow(&start);
+	do {
+		delayNow(&now);
+	} while ((now.tv_sec - start.tv_sec) * 1000000LL
+			+ (now.tv_usec - start.tv_usec) < untilUsec);
+
+	return 1;
+}
+
+/* Bundle queue: binary min-heap of release times over bundle slots */
+const char delayQueueKind[] = "binary-heap";
+
+const char *delayClassNames[DELAY_CLASSES] = { "bulk", "standard",
+		"expedited" };
+
+int delayBundleClass(BpAncillaryData *ancillaryData)
+{
+	if (ancillaryData->ordinal > 0
+	|| (ancillaryData->flags & BP_MINIMUM_LATENCY)) {
+		return DELAY_CLASS_EXPEDITED;
+	}
+
+	if (ancillaryData->flags & BP_BEST_EFFORT) {
+		return DELAY_CLASS_BULK;
+	}
+
+	return DELAY_CLASS_STANDARD;
+}
+
+int initDelayQueue(DelayQueue *queue, int capacity)
+{
+	memset(queue, 0, sizeof(DelayQueue));
+	queue->bundles = MTAKE(capacity * sizeof(DelayedBundle));
+	queue->heap = MTAKE(capacity * sizeof(DelayHeapEntry));
+	queue->ready = MTAKE(capacity * sizeof(DelayHeapEntry));
+	queue->freeSlots = MTAKE(capacity * sizeof(int));
+	if (queue->bundles == NULL || queue->heap == NULL
+	|| queue->ready == NULL || queue->freeSlots == NULL) {
+		putErrmsg("Can't allocate delay queue.", itoa(capacity));
+		destroyDelayQueue(queue);
+		return -1;
+	}
+
+	for (int i = 0; i < capacity; i++) {
+		queue->freeSlots[i] = capacity - 1 - i;
+	}
+
+	queue->capacity = capacity;
+	pthread_mutex_init(&queue->mutex, NULL);
+	return 0;
+}
+
+void destroyDelayQueue(DelayQueue *queue)
+{
+	int wasInitialized = queue->capacity > 0;
+
+	if (queue->bundles) {
+		MRELEASE(queue->bundles);
+		queue->bundles = NULL;
+	}
+
+	if (queue->heap) {
+		MRELEASE(queue->heap);
+		queue->heap = NULL;
+	}
+
+	if (queue->ready) {
+		MRELEASE(queue->ready);
+		queue->ready = NULL;
+	}
+
+	if (queue->freeSlots) {
+		MRELEASE(queue->freeSlots);
+		queue->freeSlots = NULL;
+	}
+
+	queue->count = 0;
+	queue->capacity = 0;
+	if (wasInitialized) {
+		pthread_mutex_destroy(&queue->mutex);
+	}
+}
+
+static int heapBefore(DelayHeapEntry *a, DelayHeapEntry *b)
+{
+	if (a->releaseTime.tv_sec != b->releaseTime.tv_sec) {
+		return a->releaseTime.tv_sec < b->releaseTime.tv_sec;
+	}
+
+	if (a->releaseTime.tv_usec != b->releaseTime.tv_usec) {
+		return a->releaseTime.tv_usec < b->releaseTime.tv_usec;
+	}
+
+	return a->sequence < b->sequence;
+}
+
+static void siftUp(DelayHeapEntry *heap, int i)
+{
+	DelayHeapEntry entry = heap[i];
+
+	while (i > 0 && heapBefore(&entry, &heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	heap[i] = entry;
+}
+
+static void siftDown(DelayHeapEntry *heap, int count, int i)
+{
+	DelayHeapEntry entry = heap[i];
+	int child;
+
+	while ((child = 2 * i + 1) < count) {
+		if (child + 1 < count && heapBefore(&heap[child + 1],
+				&heap[child])) {
+			child++;
+		}
+
+		if (!heapBefore(&heap[child], &entry)) {
+			break;
+		}
+
+		heap[i] = heap[child];
+		i = child;
+	}
+
+	heap[i] = entry;
+}
+
+/* Removes the root, the earliest release time.  Its slot goes back on
+ * the free stack at once: it is not reused before the bundle is
+ * released, since both happen with the queue locked. */
+static DelayHeapEntry popHeap(DelayQueue *queue)
+{
+	DelayHeapEntry root = queue->heap[0];
+
+	queue->count--;
+	queue->freeSlots[queue->capacity - 1 - queue->count] = root.slot;
+	if (queue->count > 0) {
+		queue->heap[0] = queue->heap[queue->count];
+		siftDown(queue->heap, queue->count, 0);
+	}
+
+	return root;
+}
+
+int insertDelayed(DelayQueue *queue, DelayedBundle *bundle)
+{
+	DelayClassStats *stats;
+	DelayHeapEntry *entry;
+	int depth;
+
+	unsigned long long lockStart = profileStart();
+	pthread_mutex_lock(&queue->mutex);
+	profileStop(PROF_QUEUE_LOCK, lockStart);
+	unsigned long long enqueueStart = profileStart();
+	if (queue->count >= queue->capacity) {
+		pthread_mutex_unlock(&queue->mutex);
+		return -1;  /* Queue full */
+	}
+
+	/* Free slots are the top capacity - count of the stack */
+	entry = &queue->heap[queue->count];
+	entry->slot = queue->freeSlots[queue->capacity - 1 - queue->count];
+	entry->releaseTime = bundle->releaseTime;
+	entry->sequence = queue->sequence++;
+	queue->bundles[entry->slot] = *bundle;
+	depth = ++queue->count;
+	siftUp(queue->heap, depth - 1);
+	stats = &queue->classes[bundle->releaseClass % DELAY_CLASSES];
+	if (++stats->depth > stats->highWater) {
+		stats->highWater = stats->depth;
+	}
+
+	profileStop(PROF_ENQUEUE, enqueueStart);
+	pthread_mutex_unlock(&queue->mutex);
+	return depth;
+}
+
+int nextDelayedDeadline(DelayQueue *queue, struct timeval *deadline)
+{
+	int found = -1;
+
+	pthread_mutex_lock(&queue->mutex);
+	if (queue->count > 0) {
+		*deadline = queue->heap[0].releaseTime;
+		found = 0;
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+	return found;
+}
+
+/* Higher class first, then higher ordinal, then earlier release time */
+static int compareReady(const void *a, const void *b, void *arg)
+{
+	DelayedBundle *bundles = arg;
+	const DelayHeapEntry *entryA = a, *entryB = b;
+	DelayedBundle *bundleA = &bundles[entryA->slot];
+	DelayedBundle *bundleB = &bundles[entryB->slot];
+
+	if (bundleA->releaseClass != bundleB->releaseClass) {
+		return bundleB->releaseClass - bundleA->releaseClass;
+	}
+
+	if (bundleA->ordinal != bundleB->ordinal) {
+		return bundleB->ordinal - bundleA->ordinal;
+	}
+
+	return heapBefore((DelayHeapEntry *) entryA, (DelayHeapEntry *) entryB)
+			? -1 : 1;
+}
+
+/* Releases a popped slot's bundle */
+static void releaseSlot(DelayQueue *queue, DelayHeapEntry *entry,
+		struct timeval *now, DelayReleaseFn release, void *arg)
+{
+	DelayedBundle *bundle = &queue->bundles[entry->slot];
+	DelayClassStats *stats = &queue->classes[bundle->releaseClass
+			% DELAY_CLASSES];
+	long long lateUsec = (now->tv_sec - entry->releaseTime.tv_sec)
+			* 1000000LL + now->tv_usec - entry->releaseTime.tv_usec;
+
+	if (lateUsec < 0) {
+		lateUsec = 0;
+	}
+
+	stats->depth--;
+	stats->released++;
+	stats->latenessUsec += lateUsec;
+	if (lateUsec > stats->maxLatenessUsec) {
+		stats->maxLatenessUsec = lateUsec;
+	}
+
+	release(bundle, arg);
+}
+
+int releaseDelayed(DelayQueue *queue, struct timeval *now,
+		DelayReleaseFn release, void *arg)
+{
+	int processed = 0;
+	int batch;
+	struct timeval due;
+
+	unsigned long long lockStart = profileStart();
+	pthread_mutex_lock(&queue->mutex);
+	profileStop(PROF_QUEUE_LOCK, lockStart);
+	unsigned long long passStart = profileStart();
+	while (queue->count > 0) {
+		/* Take everything due, then release it in class order */
+		computeReleaseTime(now, queue->leadUsec / 1e6, &due);
+		batch = 0;
+		while (queue->count > 0
+		&& !timercmp(&queue->heap[0].releaseTime, &due, >)) {
+			queue->ready[batch++] = popHeap(queue);
+		}
+
+		if (batch == 0) {
+			break;
+		}
+
+		if (batch > 1) {
+			qsort_r(queue->ready, batch, sizeof(DelayHeapEntry),
+					compareReady, queue->bundles);
+		}
+
+		for (int i = 0; i < batch; i++) {
+			releaseSlot(queue, &queue->ready[i], now, release, arg);
+			delayNow(now);
+		}
+
+		processed += batch;
+	}
+
+	profileStop(PROF_RELEASE_PASS, passStart);
+	pthread_mutex_unlock(&queue->mutex);
+	return processed;
+}
+
+void drainDelayed(DelayQueue *queue, DelayReleaseFn release, void *arg)
+{
+	DelayHeapEntry entry;
+	struct timeval now;
+
+	pthread_mutex_lock(&queue->mutex);
+	delayNow(&now);
+	while (queue->count > 0) {
+		entry = popHeap(queue);
+		releaseSlot(queue, &entry, &now, release, arg);
+	}
+
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+void reportDelayClasses(DelayQueue *queue, char *daemonName)
+{
+	char memoBuf[256];
+
+	for (int i = DELAY_CLASSES - 1; i >= 0; i--) {
+		DelayClassStats *stats = &queue->classes[i];
+
+		if (stats->released == 0 && stats->depth == 0) {
+			continue;
+		}
+
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: %s class: released "
+				"%llu, late %.1f usec mean, %llu max, depth %d "
+				"(high water %d).", daemonName,
+				delayClassNames[i], stats->released,
+				stats->released ? (double) stats->latenessUsec
+				/ stats->released : 0.0,
+				stats->maxLatenessUsec, stats->depth,
+				stats->highWater);
+		writeMemo(memoBuf);
+	}
+}
+
+int initDelayStage(DelayStage *stage, int capacity)
+{
+	memset(stage, 0, sizeof(DelayStage));
+	stage->slots = MTAKE(capacity * sizeof(DelayedBundle));
+	if (stage->slots == NULL) {
+		putErrmsg("Can't allocate pipeline stage.", itoa(capacity));
+		return -1;
+	}
+
+	stage->capacity = capacity;
+	pthread_mutex_init(&stage->mutex, NULL);
+	pthread_cond_init(&stage->notEmpty, NULL);
+	pthread_cond_init(&stage->notFull, NULL);
+	return 0;
+}
+
+void destroyDelayStage(DelayStage *stage)
+{
+	if (stage->slots == NULL) {
+		return;
+	}
+
+	MRELEASE(stage->slots);
+	stage->slots = NULL;
+	stage->count = 0;
+	pthread_mutex_destroy(&stage->mutex);
+	pthread_cond_destroy(&stage->notEmpty);
+	pthread_cond_destroy(&stage->notFull);
+}
+
+int pushDelayStage(DelayStage *stage, DelayedBundle *bundle, int wait)
+{
+	pthread_mutex_lock(&stage->mutex);
+	stage->pushes++;
+	stage->depthSum += stage->count;
+	if (stage->count >= stage->capacity) {
+		stage->fullWaits++;
+		if (!wait) {
+			pthread_mutex_unlock(&stage->mutex);
+			return -1;
+		}
+	}
+
+	while (stage->count >= stage->capacity && !stage->closed) {
+		pthread_cond_wait(&stage->notFull, &stage->mutex);
+	}
+
+	if (stage->closed) {
+		pthread_mutex_unlock(&stage->mutex);
+		return -1;
+	}
+
+	stage->slots[(stage->head + stage->count) % stage->capacity] = *bundle;
+	if (++stage->count > stage->highWater) {
+		stage->highWater = stage->count;
+	}
+
+	pthread_cond_signal(&stage->notEmpty);
+	pthread_mutex_unlock(&stage->mutex);
+	return 0;
+}
+
+int popDelayStage(DelayStage *stage, DelayedBundle *bundle, int wait)
+{
+	pthread_mutex_lock(&stage->mutex);
+	while (wait && stage->count == 0 && !stage->closed) {
+		pthread_cond_wait(&stage->notEmpty, &stage->mutex);
+	}
+
+	if (stage->count == 0) {
+		pthread_mutex_unlock(&stage->mutex);
+		return 0;
+	}
+
+	*bundle = stage->slots[stage->head];
+	stage->head = (stage->head + 1) % stage->capacity;
+	stage->count--;
+	pthread_cond_signal(&stage->notFull);
+	pthread_mutex_unlock(&stage->mutex);
+	return 1;
+}
+
+void waitDelayStage(DelayStage *stage, long usec)
+{
+	struct timespec until;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += usec / 1000000;
+	until.tv_nsec += (usec % 1000000) * 1000;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&stage->mutex);
+	if (stage->count == 0 && !stage->closed) {
+		pthread_cond_timedwait(&stage->notEmpty, &stage->mutex, &until);
+	}
+
+	pthread_mutex_unlock(&stage->mutex);
+}
+
+void closeDelayStage(DelayStage *stage)
+{
+	pthread_mutex_lock(&stage->mutex);
+	stage->closed = 1;
+	pthread_cond_broadcast(&stage->notEmpty);
+	pthread_cond_broadcast(&stage->notFull);
+	pthread_mutex_unlock(&stage->mutex);
+}
+
+void reportDelayStage(DelayStage *stage, char *daemonName, char *name)
+{
+	char memoBuf[256];
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: %s stage: %llu bundles, "
+			"mean depth %.1f, high water %d of %d, %llu found it "
+			"full.", daemonName, name, stage->pushes,
+			stage->pushes ? (double) stage->depthSum / stage->pushes
+			: 0.0, stage->highWater, stage->capacity,
+			stage->fullWaits);
+	writeMemo(memoBuf);
+}
+
+/*	*	*	Socket addresses	*	*	*	*	*/
+
+int parseDelaySocketSpec(char *spec, struct sockaddr_storage *name)
+{
+	char host[MAXHOSTNAMELEN + 1];
+	char *portText = NULL;
+	char *end;
+	long portNbr = 0;
+	struct addrinfo hints, *result, *chosen;
+	int error;
+
+	if (spec[0] == '[') {
+		/* [IPv6 address]:port */
+		end = strchr(spec, ']');
+		if (end == NULL || end - spec - 1 > MAXHOSTNAMELEN) {
+			putErrmsg("Bad IPv6 socket spec.", spec);
+			return -1;
+		}
+
+		memcpy(host, spec + 1, end - spec - 1);
+		host[end - spec - 1] = '\0';
+		if (end[1] == ':') {
+			portText = end + 2;
+		} else if (end[1] != '\0') {
+			putErrmsg("Bad IPv6 socket spec.", spec);
+			return -1;
+		}
+	} else {
+		/* One colon separates the port; more make a bare IPv6 address */
+		end = strchr(spec, ':');
+		if (end && strchr(end + 1, ':') == NULL) {
+			portText = end + 1;
+		} else {
+			end = spec + strlen(spec);
+		}
+
+		if (end - spec > MAXHOSTNAMELEN) {
+			putErrmsg("Socket spec host name too long.", spec);
+			return -1;
+		}
+
+		memcpy(host, spec, end - spec);
+		host[end - spec] = '\0';
+	}
+
+	if (portText && *portText) {
+		portNbr = strtol(portText, &end, 10);
+		if (*end != '\0' || portNbr < 0 || portNbr > 65535) {
+			putErrmsg("Bad port number in socket spec.", spec);
+			return -1;
+		}
+	}
+
+	if (portNbr == 0) {
+		portNbr = BpUdpDefaultPortNbr;
+	}
+
+	if (host[0] == '\0' && gethostname(host, sizeof host) < 0) {
+		putSysErrmsg("Can't get local host name", NULL);
+		return -1;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	error = getaddrinfo(host, NULL, &hints, &result);
+	if (error != 0) {
+		putErrmsg("Can't resolve socket spec host.", spec);
+		writeMemoNote("[?] getaddrinfo", (char *) gai_strerror(error));
+		return -1;
+	}
+
+	/* A name with both kinds of address keeps its IPv4 one, as before */
+	for (chosen = result; chosen; chosen = chosen->ai_next) {
+		if (chosen->ai_family == AF_INET) {
+			break;
+		}
+	}
+
+	if (chosen == NULL) {
+		chosen = result;
+	}
+
+	memset(name, 0, sizeof(struct sockaddr_storage));
+	memcpy(name, chosen->ai_addr, chosen->ai_addrlen);
+	freeaddrinfo(result);
+	if (name->ss_family == AF_INET6) {
+		((struct sockaddr_in6 *) name)->sin6_port = htons(portNbr);
+	} else {
+		((struct sockaddr_in *) name)->sin_port = htons(portNbr);
+	}
+
+	return 0;
+}
+
+socklen_t delayAddressLength(struct sockaddr_storage *name)
+{
+	return name->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+			: sizeof(struct sockaddr_in);
+}
+
+int openDelaySocket(int family)
+{
+	int fd = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	int off = 0;
+
+	if (fd >= 0 && family == AF_INET6
+	&& setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off) < 0) {
+		writeMemo("[w] Can't make IPv6 socket dual-stack; IPv6 only.");
+	}
+
+	return fd;
+}
+
+void mapDelayAddress(struct sockaddr_storage *name)
+{
+	struct sockaddr_in inet = *((struct sockaddr_in *) name);
+	struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *) name;
+
+	if (name->ss_family != AF_INET) {
+		return;
+	}
+
+	memset(inet6, 0, sizeof(struct sockaddr_in6));
+	inet6->sin6_family = AF_INET6;
+	inet6->sin6_port = inet.sin_port;
+	inet6->sin6_addr.s6_addr[10] = 0xff;
+	inet6->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&inet6->sin6_addr.s6_addr[12], &inet.sin_addr, 4);
+}
+
+int sameDelayAddress(struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family) {
+		return 0;
+	}
+
+	if (a->ss_family == AF_INET6) {
+		struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a;
+		struct sockaddr_in6 *b6 = (struct sockaddr_in6 *) b;
+
+		return a6->sin6_port == b6->sin6_port
+			&& memcmp(&a6->sin6_addr, &b6->sin6_addr, 16) == 0;
+	}
+
+	return ((struct sockaddr_in *) a)->sin_port
+			== ((struct sockaddr_in *) b)->sin_port
+		&& ((struct sockaddr_in *) a)->sin_addr.s_addr
+			== ((struct sockaddr_in *) b)->sin_addr.s_addr;
+}
+
+unsigned int hashDelayAddress(struct sockaddr_storage *name)
+{
+	unsigned int key;
+
+	if (name->ss_family == AF_INET6) {
+		struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *) name;
+		unsigned int words[4];
+
+		memcpy(words, &inet6->sin6_addr, 16);
+		key = words[0] ^ words[1] ^ words[2] ^ words[3]
+				^ (inet6->sin6_port * 0x9e3779b1U);
+	} else {
+		struct sockaddr_in *inet = (struct sockaddr_in *) name;
+
+		key = inet->sin_addr.s_addr ^ (inet->sin_port * 0x9e3779b1U);
+	}
+
+	key = (key ^ (key >> 16)) * 0x85ebca6bU;
+	key = (key ^ (key >> 13)) * 0xc2b2ae35U;
+	return key ^ (key >> 16);
+}
+
+char *delayAddressString(struct sockaddr_storage *name, char *buffer,
+		int length)
+{
+	char host[INET6_ADDRSTRLEN];
+
+	if (name->ss_family == AF_INET6) {
+		struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *) name;
+
+		inet_ntop(AF_INET6, &inet6->sin6_addr, host, sizeof host);
+		isprintf(buffer, length, "[%s]:%hu", host,
+				ntohs(inet6->sin6_port));
+	} else {
+		struct sockaddr_in *inet = (struct sockaddr_in *) name;
+
+		inet_ntop(AF_INET, &inet->sin_addr, host, sizeof host);
+		isprintf(buffer, length, "%s:%hu", host,
+				ntohs(inet->sin_port));
+	}
+
+	return buffer;
+}
+
+/*	*	*	Delay CLA frames	*	*	*	*	*/
+
+static void putFrameWord(unsigned char **cursor, unsigned int value)
+{
+	unsigned int word = htonl(value);
+
+	memcpy(*cursor, &word, 4);
+	*cursor += 4;
+}
+
+static unsigned int getFrameWord(unsigned char *from)
+{
+	unsigned int word;
+
+	memcpy(&word, from, 4);
+	return ntohl(word);
+}
+
+int encodeDelayFrame(DelayFrame *frame, unsigned char *into)
+{
+	unsigned char *cursor = into;
+
+	frame->headerLength = frame->kind == DELAY_FRAME_AGGREGATE
+			? DELAY_AGGREGATE_HEADER_BYTES : DELAY_SEGMENT_HEADER_BYTES;
+	putFrameWord(&cursor, DELAY_FRAME_MAGIC);
+	*cursor++ = DELAY_FRAME_VERSION;
+	*cursor++ = frame->kind;
+	*cursor++ = (frame->headerLength >> 8) & 0xff;
+	*cursor++ = frame->headerLength & 0xff;
+	if (frame->kind == DELAY_FRAME_AGGREGATE) {
+		*cursor++ = (frame->count >> 8) & 0xff;
+		*cursor++ = frame->count & 0xff;
+		*cursor++ = 0;
+		*cursor++ = 0;
+		return cursor - into;
+	}
+
+	putFrameWord(&cursor, frame->bundleTag);
+	putFrameWord(&cursor, frame->bundleLength);
+	putFrameWord(&cursor, frame->index);
+	putFrameWord(&cursor, frame->count);
+	putFrameWord(&cursor, frame->offset);
+	return cursor - into;
+}
+
+int decodeDelayFrame(unsigned char *datagram, int length,
+		DelayFrame *frame)
+{
+	unsigned int payloadLength;
+
+	memset(frame, 0, sizeof(DelayFrame));
+	if (length < DELAY_FRAME_BASE_BYTES
+	|| getFrameWord(datagram) != DELAY_FRAME_MAGIC) {
+		return 0;
+	}
+
+	frame->kind = datagram[5];
+	frame->headerLength = (datagram[6] << 8) | datagram[7];
+	if (datagram[4] < 1 || frame->headerLength < DELAY_FRAME_BASE_BYTES
+	|| frame->headerLength > length) {
+		return -1;
+	}
+
+	switch (frame->kind) {
+	case DELAY_FRAME_SEGMENT:
+		if (frame->headerLength < DELAY_SEGMENT_HEADER_BYTES) {
+			return -1;
+		}
+
+		frame->bundleTag = getFrameWord(datagram + 8);
+		frame->bundleLength = getFrameWord(datagram + 12);
+		frame->index = getFrameWord(datagram + 16);
+		frame->count = getFrameWord(datagram + 20);
+		frame->offset = getFrameWord(datagram + 24);
+		if (frame->bundleLength == 0 || frame->count == 0
+		|| frame->index >= frame->count) {
+			return -1;
+		}
+
+		/* All segments but the last carry segmentBytes, at index
+		 * times that; the count follows from it */
+		payloadLength = length - frame->headerLength;
+		if (frame->count == 1) {
+			frame->segmentBytes = frame->bundleLength;
+		} else if (frame->index == 0) {
+			frame->segmentBytes = payloadLength;
+		} else if (frame->offset % frame->index == 0) {
+			frame->segmentBytes = frame->offset / frame->index;
+		} else {
+			return -1;
+		}
+
+		if ((frame->count > 1 && frame->segmentBytes
+				< DELAY_SEGMENT_MIN_PAYLOAD)
+		|| frame->segmentBytes > frame->bundleLength
+		|| frame->count != ((uint64_t) frame->bundleLength
+				+ frame->segmentBytes - 1) / frame->segmentBytes
+		|| frame->offset != (uint64_t) frame->index
+				* frame->segmentBytes
+		|| payloadLength != (frame->index == frame->count - 1
+				? frame->bundleLength - frame->offset
+				: frame->segmentBytes)) {
+			return -1;
+		}
+
+		break;
+
+	case DELAY_FRAME_AGGREGATE:
+		if (frame->headerLength < DELAY_AGGREGATE_HEADER_BYTES) {
+			return -1;
+		}
+
+		frame->count = (datagram[8] << 8) | datagram[9];
+		if (frame->count == 0) {
+			return -1;
+		}
+
+		break;
+	}
+
+	return 1;
+}
+
+void sizeDelayReceiveBuffer(int fd, char *daemonName)
+{
+	int size = DELAY_RECEIVE_BUFFER_BYTES;
+	socklen_t length = sizeof size;
+	char memoBuf[256];
+
+	if (!DELAY_SEGMENTS || fd < 0) {
+		return;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size) < 0
+	|| getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &length) < 0) {
+		size = 0;
+	}
+
+	/* Linux reports twice the size it was asked for */
+	if (size < DELAY_RECEIVE_BUFFER_BYTES) {
+		isprintf(memoBuf, sizeof memoBuf, "[w] %s: receive buffer %d "
+				"bytes, segmented bundles may be lost; raise "
+				"net.core.rmem_max.", daemonName, size);
+		writeMemo(memoBuf);
+	}
+}
+
+/*	*	*	Payload compression	*	*	*	*	*/
+
+/* LZ4 block format: sequences of a token (literal length, match length
+ * - 4), literals, a 2-byte little-endian offset and extra length bytes.
+ * The last match starts at least 12 bytes before the end and the last
+ * 5 bytes are always literals. */
+#define LZ_MIN_MATCH		4
+#define LZ_MATCH_LIMIT		12
+#define LZ_LAST_LITERALS	5
+#define LZ_MAX_OFFSET		65535
+
+static unsigned int readWord(unsigned char *from)
+{
+	unsigned int word;
+
+	memcpy(&word, from, 4);
+	return word;
+}
+
+/* Writes the extra bytes of a length that didn't fit in its nibble */
+static unsigned char *putLzLength(unsigned char *cursor, int length)
+{
+	for (; length >= 255; length -= 255) {
+		*cursor++ = 255;
+	}
+
+	*cursor++ = length;
+	return cursor;
+}
+
+/* Emits one sequence; returns the new cursor, or NULL if out of room */
+static unsigned char *putLzSequence(unsigned char *cursor,
+		unsigned char *limit, unsigned char *literals, int literalLength,
+		int offset, int matchLength)
+{
+	unsigned char *token = cursor++;
+
+	if (limit - cursor < literalLength + literalLength / 255 + 1
+			+ (matchLength ? 2 + matchLength / 255 + 1 : 0)) {
+		return NULL;
+	}
+
+	*token = (literalLength < 15 ? literalLength : 15) << 4;
+	if (literalLength >= 15) {
+		cursor = putLzLength(cursor, literalLength - 15);
+	}
+
+	memcpy(cursor, literals, literalLength);
+	cursor += literalLength;
+	if (matchLength == 0) {
+		return cursor;		/* Last literals */
+	}
+
+	*cursor++ = offset & 0xff;
+	*cursor++ = offset >> 8;
+	matchLength -= LZ_MIN_MATCH;
+	*token |= matchLength < 15 ? matchLength : 15;
+	if (matchLength >= 15) {
+		cursor = putLzLength(cursor, matchLength - 15);
+	}
+
+	return cursor;
+}
+
+int delayCompress(unsigned char *from, int length, unsigned char *into,
+		int capacity, unsigned int *table)
+{
+	unsigned char *cursor = from + 1;
+	unsigned char *anchor = from;
+	unsigned char *end = from + length;
+	unsigned char *out = into;
+	unsigned char *limit = into + capacity;
+	unsigned char *match;
+	int bits = DELAY_COMPRESS_HASH_BITS;
+	unsigned int hash;
+	int matchLength;
+
+	if (length < LZ_MATCH_LIMIT + 1) {
+		return 0;
+	}
+
+	/* Small inputs clear a smaller table */
+	while (bits > 8 && (1 << (bits + 2)) > length) {
+		bits--;
+	}
+
+	memset(table, 0, sizeof(unsigned int) << bits);
+	while (cursor < end - LZ_MATCH_LIMIT) {
+		hash = (readWord(cursor) * 2654435761U) >> (32 - bits);
+		match = from + table[hash];
+		table[hash] = cursor - from;
+		if (match >= cursor || cursor - match > LZ_MAX_OFFSET
+		|| readWord(match) != readWord(cursor)) {
+			/* Step faster through data that isn't matching */
+			cursor += 1 + ((cursor - anchor) >> 6);
+			continue;
+		}
+
+		while (cursor > anchor && match > from
+		&& cursor[-1] == match[-1]) {
+			cursor--;
+			match--;
+		}
+
+		matchLength = LZ_MIN_MATCH;
+		while (cursor + matchLength < end - LZ_LAST_LITERALS
+		&& cursor[matchLength] == match[matchLength]) {
+			matchLength++;
+		}
+
+		out = putLzSequence(out, limit, anchor, cursor - anchor,
+				cursor - match, matchLength);
+		if (out == NULL) {
+			return 0;
+		}
+
+		cursor += matchLength;
+		anchor = cursor;
+	}
+
+	out = putLzSequence(out, limit, anchor, end - anchor, 0, 0);
+	return out ? out - into : 0;
+}
+
+/* Reads the extra bytes of a length; -1 if the block ends first */
+static int getLzLength(unsigned char **cursor, unsigned char *end)
+{
+	int length = 0;
+	unsigned char byte;
+
+	do {
+		if (*cursor >= end || length > INT_MAX - 255) {
+			return -1;
+		}
+
+		byte = *(*cursor)++;
+		length += byte;
+	} while (byte == 255);
+
+	return length;
+}
+
+int delayExpand(unsigned char *from, int length, unsigned char *into,
+		int capacity)
+{
+	unsigned char *cursor = from;
+	unsigned char *end = from + length;
+	unsigned char *out = into;
+	unsigned char *limit = into + capacity;
+	unsigned char *match;
+	int token, literalLength, matchLength, offset, extra;
+
+	while (cursor < end) {
+		token = *cursor++;
+		literalLength = token >> 4;
+		if (literalLength == 15) {
+			if ((extra = getLzLength(&cursor, end)) < 0) {
+				return -1;
+			}
+
+			literalLength += extra;
+		}
+
+		if (literalLength > end - cursor
+		|| literalLength > limit - out) {
+			return -1;
+		}
+
+		memcpy(out, cursor, literalLength);
+		cursor += literalLength;
+		out += literalLength;
+		if (cursor == end) {
+			break;		/* Last literals */
+		}
+
+		if (end - cursor < 2) {
+			return -1;
+		}
+
+		offset = cursor[0] | (cursor[1] << 8);
+		cursor += 2;
+		matchLength = token & 15;
+		if (matchLength == 15) {
+			if ((extra = getLzLength(&cursor, end)) < 0) {
+				return -1;
+			}
+
+			matchLength += extra;
+		}
+
+		matchLength += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out - into
+		|| matchLength > limit - out) {
+			return -1;
+		}
+
+		/* An overlapping match repeats the bytes just written: copy
+		 * them in ever larger pieces */
+		match = out - offset;
+		while (matchLength > 0) {
+			int piece = out - match < matchLength ? out - match
+					: matchLength;
+
+			memcpy(out, match, piece);
+			out += piece;
+			matchLength -= piece;
+		}
+	}
+
+	return out - into;
+}
+
+/*	*	*	Shared-memory ring	*	*	*	*	*/
+
+#define SHM_RING_MAGIC		0x55445352	/* "UDSR" */
+#define SHM_RECORD_DATA		1
+#define SHM_RECORD_PAD		2		/* Skip to the ring's start */
+
+/* Record header, then the bundle, padded to 8 bytes */
+#define SHM_RECORD_BYTES(length)	(8 + (((uint64_t) (length) + 7) & ~7ULL))
+
+/* Writers and the reader work on separate cache lines.  An all-zero
+ * header is an empty ring, so whichever side creates it needn't
+ * initialize it. */
+typedef struct {
+	uint32_t	magic;
+	uint32_t	capacity;	/* Data bytes after the header */
+	unsigned char	pad0[56];
+	uint64_t	head;		/* Bytes written */
+	uint32_t	lock;		/* Writers' spin lock: owner's pid */
+	unsigned char	pad1[52];
+	uint64_t	tail;		/* Bytes read */
+	uint32_t	waiting;	/* Reader asleep on the doorbell */
+	unsigned char	pad2[52];
+} DelayShmHeader;
+
+typedef struct {
+	uint32_t	length;
+	uint32_t	kind;
+} DelayShmRecord;
+
+struct delay_shm_ring_str {
+	DelayShmHeader	*header;
+	unsigned char	*data;
+	size_t		mapLength;
+	int		reader;
+	int		doorbell;	/* Reader: bound; writer: unbound */
+	struct sockaddr_un bellName;
+	uint64_t	writeHead;	/* Under the lock, between begin and end */
+	uint64_t	writeBytes;
+};
+
+/* Whether the process holding the writers' lock has died; the lock
+ * lives in the ring and outlasts it */
+static int shmWriterGone(uint32_t owner)
+{
+	return owner != 0 && owner != (uint32_t) getpid()
+			&& kill((pid_t) owner, 0) < 0 && errno == ESRCH;
+}
+
+/* Takes the writers' lock.  A writer killed while holding it leaves it
+ * held; since nothing done under the lock shows until the head is
+ * published, the lock is simply taken over from a dead owner. */
+static void lockShmRing(DelayShmHeader *header)
+{
+	uint32_t	self = getpid();
+	uint32_t	owner = 0;
+	unsigned int	spins = 0;
+
+	while (!__atomic_compare_exchange_n(&header->lock, &owner, self, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		if (++spins % 256 == 0 && shmWriterGone(owner)
+		&& __atomic_compare_exchange_n(&header->lock, &owner, self,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return;
+		}
+
+		owner = 0;
+		sched_yield();
+	}
+}
+
+/* Names the ring's doorbell, in a directory of this user's that no one
+ * else can write: a doorbell in a shared directory could be taken by
+ * another user first.  Returns 0, or -1 if the directory isn't private. */
+static int shmBellName(char *name, struct sockaddr_un *bellName)
+{
+	char		bellDir[80];
+	struct stat	status;
+
+	isprintf(bellDir, sizeof bellDir, "%s/udpdelay-%d",
+			DELAY_SHM_BELL_DIR, (int) geteuid());
+	if (mkdir(bellDir, 0700) < 0 && errno != EEXIST) {
+		putSysErrmsg("Can't create ring doorbell directory", bellDir);
+		return -1;
+	}
+
+	if (lstat(bellDir, &status) < 0 || !S_ISDIR(status.st_mode)
+	|| status.st_uid != geteuid()
+	|| (status.st_mode & (S_IWGRP | S_IWOTH))) {
+		putErrmsg("Ring doorbell directory isn't private.", bellDir);
+		return -1;
+	}
+
+	bellName->sun_family = AF_UNIX;
+	isprintf(bellName->sun_path, sizeof bellName->sun_path,
+			"%s/udpdelay.%s.bell", bellDir, name);
+	return 0;
+}
+
+DelayShmRing *openDelayShmRing(char *name, int reader)
+{
+	DelayShmRing	*ring;
+	char		shmName[64];
+	size_t		mapLength = sizeof(DelayShmHeader) + DELAY_SHM_RING_BYTES;
+	struct stat	status;
+	uint32_t	expected = 0;
+	int		fd;
+
+	if (strlen(name) == 0 || strlen(name) > 40 || strchr(name, '/')) {
+		putErrmsg("Bad shared-memory ring name.", name);
+		return NULL;
+	}
+
+	ring = MTAKE(sizeof(DelayShmRing));
+	if (ring == NULL) {
+		putErrmsg("Can't allocate shared-memory ring.", name);
+		return NULL;
+	}
+
+	memset(ring, 0, sizeof(DelayShmRing));
+	ring->reader = reader;
+	ring->doorbell = -1;
+	if (shmBellName(name, &ring->bellName) < 0) {
+		MRELEASE(ring);
+		return NULL;
+	}
+
+	/* Either side may create the ring; only this user may use it */
+	isprintf(shmName, sizeof shmName, "/udpdelay.%s", name);
+	fd = shm_open(shmName, O_RDWR | O_CREAT, 0600);
+	if (fd < 0 || fstat(fd, &status) < 0
+	|| (status.st_size == 0 && ftruncate(fd, mapLength) < 0)) {
+		putSysErrmsg("Can't create shared-memory ring", shmName);
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		MRELEASE(ring);
+		return NULL;
+	}
+
+	if (status.st_uid != geteuid()) {
+		putErrmsg("Shared-memory ring belongs to another user.",
+				shmName);
+		close(fd);
+		MRELEASE(ring);
+		return NULL;
+	}
+
+	/* A ring made by an older build may still be open to all */
+	if (fchmod(fd, 0600) < 0) {
+		putSysErrmsg("Can't restrict shared-memory ring", shmName);
+		close(fd);
+		MRELEASE(ring);
+		return NULL;
+	}
+
+	if (status.st_size != 0 && (size_t) status.st_size != mapLength) {
+		putErrmsg("Shared-memory ring has a different size.", shmName);
+		close(fd);
+		MRELEASE(ring);
+		return NULL;
+	}
+
+	ring->header = mmap(NULL, mapLength, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring->header == MAP_FAILED) {
+		putSysErrmsg("Can't map shared-memory ring", shmName);
+		MRELEASE(ring);
+		return NULL;
+	}
+
+	ring->mapLength = mapLength;
+	ring->data = (unsigned char *) (ring->header + 1);
+	if (!__atomic_compare_exchange_n(&ring->header->magic, &expected,
+			SHM_RING_MAGIC, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+	&& expected != SHM_RING_MAGIC) {
+		putErrmsg("Not a delay shared-memory ring.", shmName);
+		closeDelayShmRing(ring);
+		return NULL;
+	}
+
+	ring->header->capacity = DELAY_SHM_RING_BYTES;
+
+	/* Clear a lock left by a writer killed mid-write */
+	expected = __atomic_load_n(&ring->header->lock, __ATOMIC_ACQUIRE);
+	if (shmWriterGone(expected)) {
+		__atomic_compare_exchange_n(&ring->header->lock, &expected, 0,
+				0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+
+	ring->doorbell = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (ring->doorbell < 0) {
+		putSysErrmsg("Can't open ring doorbell", shmName);
+		closeDelayShmRing(ring);
+		return NULL;
+	}
+
+	fcntl(ring->doorbell, F_SETFL, O_NONBLOCK);
+	if (reader) {
+		/* Bundles left by an earlier reader are discarded */
+		oK(unlink(ring->bellName.sun_path));
+		if (bind(ring->doorbell, (struct sockaddr *) &ring->bellName,
+				sizeof ring->bellName) < 0) {
+			putSysErrmsg("Can't bind ring doorbell",
+					ring->bellName.sun_path);
+			closeDelayShmRing(ring);
+			return NULL;
+		}
+
+		__atomic_store_n(&ring->header->tail, __atomic_load_n(
+				&ring->header->head, __ATOMIC_ACQUIRE),
+				__ATOMIC_RELEASE);
+	}
+
+	return ring;
+}
+
+void closeDelayShmRing(DelayShmRing *ring)
+{
+	if (ring->doorbell >= 0) {
+		close(ring->doorbell);
+		if (ring->reader) {
+			__atomic_store_n(&ring->header->waiting, 0,
+					__ATOMIC_SEQ_CST);
+			oK(unlink(ring->bellName.sun_path));
+		}
+	}
+
+	if (ring->header) {
+		munmap(ring->header, ring->mapLength);
+	}
+
+	MRELEASE(ring);
+}
+
+unsigned char *beginShmWrite(DelayShmRing *ring, unsigned int length)
+{
+	DelayShmHeader	*header = ring->header;
+	uint64_t	need = SHM_RECORD_BYTES(length);
+	uint64_t	head, tail, toEnd;
+
+	if (need > DELAY_SHM_RING_BYTES / 2) {
+		return NULL;
+	}
+
+	lockShmRing(header);
+	head = header->head;
+	tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+	toEnd = DELAY_SHM_RING_BYTES - head % DELAY_SHM_RING_BYTES;
+
+	/* Records never wrap: pad out the end of the ring if need be */
+	if (toEnd < need) {
+		if (head + toEnd + need - tail > DELAY_SHM_RING_BYTES) {
+			__atomic_store_n(&header->lock, 0, __ATOMIC_RELEASE);
+			return NULL;
+		}
+
+		((DelayShmRecord *) (ring->data + head % DELAY_SHM_RING_BYTES))
+				->kind = SHM_RECORD_PAD;
+		head += toEnd;
+	} else if (head + need - tail > DELAY_SHM_RING_BYTES) {
+		__atomic_store_n(&header->lock, 0, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	ring->writeHead = head;
+	ring->writeBytes = need;
+	return ring->data + head % DELAY_SHM_RING_BYTES + sizeof(DelayShmRecord);
+}
+
+/* Publishes everything up to newHead and wakes a waiting reader */
+static void publishShmWrite(DelayShmRing *ring, uint64_t newHead)
+{
+	DelayShmHeader	*header = ring->header;
+
+	__atomic_store_n(&header->head, newHead, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&header->lock, 0, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&header->waiting, __ATOMIC_SEQ_CST)) {
+		oK(sendto(ring->doorbell, "", 1, MSG_DONTWAIT,
+				(struct sockaddr *) &ring->bellName,
+				sizeof ring->bellName));
+	}
+}
+
+void endShmWrite(DelayShmRing *ring, unsigned int length)
+{
+	DelayShmRecord	*record = (DelayShmRecord *) (ring->data
+			+ ring->writeHead % DELAY_SHM_RING_BYTES);
+
+	record->length = length;
+	record->kind = SHM_RECORD_DATA;
+	publishShmWrite(ring, ring->writeHead + ring->writeBytes);
+}
+
+void cancelShmWrite(DelayShmRing *ring)
+{
+	/* Keeps any padding, which the reader skips */
+	publishShmWrite(ring, ring->writeHead);
+}
+
+unsigned char *peekShmRecord(DelayShmRing *ring, unsigned int *length)
+{
+	DelayShmHeader	*header = ring->header;
+	DelayShmRecord	*record;
+	uint64_t	tail = header->tail;
+	uint64_t	head, toEnd;
+
+	while (tail != (head = __atomic_load_n(&header->head,
+			__ATOMIC_ACQUIRE))) {
+		record = (DelayShmRecord *) (ring->data
+				+ tail % DELAY_SHM_RING_BYTES);
+		toEnd = DELAY_SHM_RING_BYTES - tail % DELAY_SHM_RING_BYTES;
+
+		/* The record must lie within what was written, and not run
+		 * past the ring's end */
+		if (record->kind == SHM_RECORD_DATA
+		&& SHM_RECORD_BYTES(record->length) <= head - tail
+		&& SHM_RECORD_BYTES(record->length) <= toEnd) {
+			*length = record->length;
+			return (unsigned char *) (record + 1);
+		}
+
+		if (record->kind != SHM_RECORD_PAD || toEnd > head - tail) {
+			putErrmsg("Corrupt shared-memory ring record; "
+					"discarding what is queued.",
+					itoa((int) record->length));
+			__atomic_store_n(&header->tail, head, __ATOMIC_RELEASE);
+			return NULL;
+		}
+
+		tail += toEnd;
+		__atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+void consumeShmRecord(DelayShmRing *ring, unsigned int length)
+{
+	__atomic_store_n(&ring->header->tail, ring->header->tail
+			+ SHM_RECORD_BYTES(length), __ATOMIC_RELEASE);
+}
+
+int shmRingDoorbell(DelayShmRing *ring)
+{
+	return ring->doorbell;
+}
+
+int armShmRing(DelayShmRing *ring)
+{
+	DelayShmHeader	*header = ring->header;
+
+	__atomic_store_n(&header->waiting, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&header->head, __ATOMIC_SEQ_CST) != header->tail;
+}
+
+void quietShmRing(DelayShmRing *ring, int rung)
+{
+	char	bell[16];
+
+	__atomic_store_n(&ring->header->waiting, 0, __ATOMIC_SEQ_CST);
+	while (rung && recv(ring->doorbell, bell, sizeof bell, 0) > 0) {
+		/* drain */
+	}
+}
+
+int shmRingPending(DelayShmRing *ring)
+{
+	return __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE)
+			!= ring->header->tail;
+}
+
+/*	*	*	Live handoff	*	*	*	*	*	*/
+
+/* Sent by the new process once it is ready for the sockets */
+typedef struct {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	recordSize;
+} DelayHandoffRequest;
+
+static void handoffName(char *daemonName, struct sockaddr_un *name)
+{
+	memset(name, 0, sizeof(struct sockaddr_un));
+	name->sun_family = AF_UNIX;
+	isprintf(name->sun_path, sizeof name->sun_path, "%s/%s.handoff",
+			DELAY_HANDOFF_DIR, daemonName);
+}
+
+/* The pid of the process at the other end, if it runs as this user;
+ * else -1 */
+static int handoffPeer(int fd)
+{
+#ifdef SO_PEERCRED
+	struct ucred	credentials;
+	socklen_t	length = sizeof credentials;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0
+	|| credentials.uid != geteuid()) {
+		return -1;
+	}
+
+	return credentials.pid;
+#else
+	return -1;
+#endif
+}
+
+static int readFully(int fd, void *into, size_t length)
+{
+	unsigned char	*cursor = into;
+	ssize_t		bytesRead;
+
+	while (length > 0) {
+		bytesRead = read(fd, cursor, length);
+		if (bytesRead < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (bytesRead <= 0) {
+			return -1;
+		}
+
+		cursor += bytesRead;
+		length -= bytesRead;
+	}
+
+	return 0;
+}
+
+static int writeFully(int fd, void *from, size_t length)
+{
+	unsigned char	*cursor = from;
+	ssize_t		bytesWritten;
+
+	while (length > 0) {
+		bytesWritten = write(fd, cursor, length);
+		if (bytesWritten < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (bytesWritten <= 0) {
+			return -1;
+		}
+
+		cursor += bytesWritten;
+		length -= bytesWritten;
+	}
+
+	return 0;
+}
+
+int listenDelayHandoff(char *daemonName)
+{
+	struct sockaddr_un	name;
+	int			fd;
+
+	handoffName(daemonName, &name);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		putSysErrmsg("Can't open handoff socket", name.sun_path);
+		return -1;
+	}
+
+	/* A name left by a process that didn't exit cleanly */
+	oK(unlink(name.sun_path));
+	if (bind(fd, (struct sockaddr *) &name, sizeof name) < 0
+	|| listen(fd, 1) < 0) {
+		putSysErrmsg("Can't listen on handoff socket", name.sun_path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int acceptDelayHandoff(int listener, char *daemonName, int *peerPid)
+{
+	struct sockaddr_un	name;
+	DelayHandoffRequest	request;
+	char			memoBuf[256];
+	int			fd;
+
+	while (1) {
+		fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+
+			return -1;	/* Shut down */
+		}
+
+		*peerPid = handoffPeer(fd);
+		if (*peerPid < 0 || readFully(fd, &request, sizeof request) < 0
+		|| request.magic != DELAY_HANDOFF_MAGIC
+		|| request.version != DELAY_HANDOFF_VERSION
+		|| request.recordSize != sizeof(DelayHandoffRecord)) {
+			isprintf(memoBuf, sizeof memoBuf, "[w] %s: refused a "
+					"handoff request (other user, or "
+					"another version).", daemonName);
+			writeMemo(memoBuf);
+			close(fd);
+			continue;
+		}
+
+		handoffName(daemonName, &name);
+		oK(unlink(name.sun_path));
+		return fd;
+	}
+}
+
+void closeDelayHandoff(DelayHandoff *handoff, char *daemonName)
+{
+	struct sockaddr_un	name;
+
+	if (!handoff->listening) {
+		return;
+	}
+
+	/* Wakes the handoff thread if it is still waiting */
+	oK(shutdown(handoff->listener, SHUT_RDWR));
+	if (handoff->threadStarted) {
+		pthread_join(handoff->thread, NULL);
+		handoff->threadStarted = 0;
+	}
+
+	close(handoff->listener);
+	handoff->listening = 0;
+	if (!handoff->requested) {
+		handoffName(daemonName, &name);
+		oK(unlink(name.sun_path));
+	}
+}
+
+int connectDelayHandoff(char *daemonName, int *peerPid)
+{
+	struct sockaddr_un	name;
+	int			fd;
+
+	handoffName(daemonName, &name);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		putSysErrmsg("Can't open handoff socket", name.sun_path);
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *) &name, sizeof name) < 0) {
+		putSysErrmsg("No daemon to take over from", name.sun_path);
+		close(fd);
+		return -1;
+	}
+
+	*peerPid = handoffPeer(fd);
+	if (*peerPid < 0) {
+		putErrmsg("Daemon to take over runs as another user.",
+				name.sun_path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int requestDelayHandoff(int fd)
+{
+	DelayHandoffRequest	request;
+
+	request.magic = DELAY_HANDOFF_MAGIC;
+	request.version = DELAY_HANDOFF_VERSION;
+	request.recordSize = sizeof(DelayHandoffRecord);
+	if (writeFully(fd, &request, sizeof request) < 0) {
+		putSysErrmsg("Can't request handoff", NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+int sendHandoffHeader(int fd, DelayHandoffHeader *header, int *fds,
+		int fdCount)
+{
+	char		control[CMSG_SPACE(DELAY_HANDOFF_MAX_FDS
+					* sizeof(int))];
+	struct msghdr	message;
+	struct iovec	iov;
+	struct cmsghdr	*cmsg;
+
+	if (fdCount > DELAY_HANDOFF_MAX_FDS) {
+		putErrmsg("Too many descriptors to hand off.",
+				itoa(fdCount));
+		return -1;
+	}
+
+	header->magic = DELAY_HANDOFF_MAGIC;
+	header->version = DELAY_HANDOFF_VERSION;
+	header->recordSize = sizeof(DelayHandoffRecord);
+	memset(&message, 0, sizeof message);
+	iov.iov_base = header;
+	iov.iov_len = sizeof(DelayHandoffHeader);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	if (fdCount > 0) {
+		memset(control, 0, sizeof control);
+		message.msg_control = control;
+		message.msg_controllen = CMSG_SPACE(fdCount * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fdCount * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fdCount * sizeof(int));
+	}
+
+	if (sendmsg(fd, &message, 0) != sizeof(DelayHandoffHeader)) {
+		putSysErrmsg("Can't send handoff header", NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+int receiveHandoffHeader(int fd, DelayHandoffHeader *header, int *fds)
+{
+	char		control[CMSG_SPACE(DELAY_HANDOFF_MAX_FDS
+					* sizeof(int))];
+	struct msghdr	message;
+	struct iovec	iov;
+	struct cmsghdr	*cmsg;
+	ssize_t		length;
+	int		fdCount = 0;
+
+	memset(&message, 0, sizeof message);
+	iov.iov_base = header;
+	iov.iov_len = sizeof(DelayHandoffHeader);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof control;
+	do {
+		length = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+	} while (length < 0 && errno == EINTR);
+
+	for (cmsg = CMSG_FIRSTHDR(&message); cmsg;
+			cmsg = CMSG_NXTHDR(&message, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET
+		&& cmsg->cmsg_type == SCM_RIGHTS) {
+			fdCount = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), fdCount * sizeof(int));
+		}
+	}
+
+	if (length != sizeof(DelayHandoffHeader)
+	|| (message.msg_flags & MSG_CTRUNC)
+	|| header->magic != DELAY_HANDOFF_MAGIC
+	|| header->version != DELAY_HANDOFF_VERSION
+	|| header->recordSize != sizeof(DelayHandoffRecord)
+	|| (int) (header->sockets + header->segments) != fdCount) {
+		putErrmsg("Bad handoff header.", itoa((int) length));
+		while (fdCount > 0) {
+			close(fds[--fdCount]);
+		}
+
+		return -1;
+	}
+
+	return fdCount;
+}
+
+int writeHandoff(DelayHandoffStream *stream, void *from, unsigned int length)
+{
+	unsigned char	*cursor = from;
+	unsigned int	room;
+
+	while (length > 0) {
+		if (stream->length == DELAY_HANDOFF_BUFFER_BYTES
+		&& flushHandoff(stream) < 0) {
+			return -1;
+		}
+
+		room = DELAY_HANDOFF_BUFFER_BYTES - stream->length;
+		if (room > length) {
+			room = length;
+		}
+
+		memcpy(stream->buffer + stream->length, cursor, room);
+		stream->length += room;
+		cursor += room;
+		length -= room;
+	}
+
+	return 0;
+}
+
+int flushHandoff(DelayHandoffStream *stream)
+{
+	if (writeFully(stream->fd, stream->buffer, stream->length) < 0) {
+		return -1;
+	}
+
+	stream->length = 0;
+	return 0;
+}
+
+int readHandoff(DelayHandoffStream *stream, void *into, unsigned int length)
+{
+	unsigned char	*cursor = into;
+	unsigned int	available;
+	ssize_t		bytesRead;
+
+	while (length > 0) {
+		if (stream->offset == stream->length) {
+			do {
+				bytesRead = read(stream->fd, stream->buffer,
+						DELAY_HANDOFF_BUFFER_BYTES);
+			} while (bytesRead < 0 && errno == EINTR);
+
+			if (bytesRead <= 0) {
+				return -1;
+			}
+
+			stream->offset = 0;
+			stream->length = bytesRead;
+		}
+
+		available = stream->length - stream->offset;
+		if (available > length) {
+			available = length;
+		}
+
+		memcpy(cursor, stream->buffer + stream->offset, available);
+		stream->offset += available;
+		cursor += available;
+		length -= available;
+	}
+
+	return 0;
+}
+
+void packHandoffRecord(DelayedBundle *bundle, DelayHandoffRecord *record)
+{
+	memset(record, 0, sizeof(DelayHandoffRecord));
+	record->releaseUsec = bundle->releaseTime.tv_sec * 1000000ULL
+			+ bundle->releaseTime.tv_usec;
+	record->expiryUsec = bundle->expiryTime.tv_sec * 1000000ULL
+			+ bundle->expiryTime.tv_usec;
+	record->bundleZco = bundle->bundleZco;
+	record->id = bundle->id;
+	record->ancillaryData = bundle->ancillaryData;
+	record->fromAddr = bundle->fromAddr;
+	record->length = bundle->length;
+	record->packedLength = bundle->packedLength;
+	record->coldSegment = -1;
+	record->duct = -1;
+	record->releaseClass = bundle->releaseClass;
+	record->ordinal = bundle->ordinal;
+}
+
+void unpackHandoffRecord(DelayHandoffRecord *record, DelayedBundle *bundle)
+{
+	memset(bundle, 0, sizeof(DelayedBundle));
+	bundle->releaseTime.tv_sec = record->releaseUsec / 1000000;
+	bundle->releaseTime.tv_usec = record->releaseUsec % 1000000;
+	bundle->expiryTime.tv_sec = record->expiryUsec / 1000000;
+	bundle->expiryTime.tv_usec = record->expiryUsec % 1000000;
+	bundle->bundleZco = (Object) record->bundleZco;
+	bundle->id = record->id;
+	bundle->ancillaryData = record->ancillaryData;
+	bundle->fromAddr = record->fromAddr;
+	bundle->length = record->length;
+	bundle->packedLength = record->packedLength;
+	bundle->coldSegment = -1;
+	bundle->releaseClass = record->releaseClass;
+	bundle->ordinal = record->ordinal;
+}
+
+/*	*	*	Kernel netem offload	*	*	*	*	*/
+
+#ifdef __linux__
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+
+#define NETEM_ATTRIBUTE_BYTES	256
+#define NETEM_REPLY_BYTES	16384
+
+typedef struct {
+	struct nlmsghdr	header;
+	struct tcmsg	tc;
+	unsigned char	attributes[NETEM_ATTRIBUTE_BYTES];
+} NetemRequest;
+
+/* A request about the interface's root qdisc */
+static void startNetemRequest(NetemRequest *request, DelayNetem *netem,
+		int type, int flags)
+{
+	memset(request, 0, sizeof(NetemRequest));
+	request->header.nlmsg_len = NLMSG_LENGTH(sizeof(struct tcmsg));
+	request->header.nlmsg_type = type;
+	request->header.nlmsg_flags = NLM_F_REQUEST | flags;
+	request->tc.tcm_family = AF_UNSPEC;
+	request->tc.tcm_ifindex = netem->ifIndex;
+	request->tc.tcm_parent = TC_H_ROOT;
+}
+
+/* Appends an attribute; returns it, so that attributes added after it
+ * can be nested in it */
+static struct rtattr *addNetemAttribute(struct nlmsghdr *header, int type,
+		void *data, int length)
+{
+	struct rtattr *attribute = (struct rtattr *) ((char *) header
+			+ NLMSG_ALIGN(header->nlmsg_len));
+
+	attribute->rta_type = type;
+	attribute->rta_len = RTA_LENGTH(length);
+	memcpy(RTA_DATA(attribute), data, length);
+	header->nlmsg_len = NLMSG_ALIGN(header->nlmsg_len)
+			+ RTA_ALIGN(attribute->rta_len);
+	return attribute;
+}
+
+static int sendNetemRequest(DelayNetem *netem, NetemRequest *request)
+{
+	struct sockaddr_nl kernel;
+
+	memset(&kernel, 0, sizeof kernel);
+	kernel.nl_family = AF_NETLINK;
+	return sendto(netem->fd, request, request->header.nlmsg_len, 0,
+			(struct sockaddr *) &kernel, sizeof kernel) < 0 ? -1 : 0;
+}
+
+/* The kernel's explanation of an error, when it gives one */
+static void netemErrorReason(struct nlmsghdr *header, char *reason,
+		int reasonSize)
+{
+	reason[0] = '\0';
+#ifdef NLM_F_ACK_TLVS
+	struct nlmsgerr *error = NLMSG_DATA(header);
+	struct rtattr *attribute;
+	int offset, length;
+
+	if (!(header->nlmsg_flags & NLM_F_ACK_TLVS)) {
+		return;
+	}
+
+	offset = NLMSG_HDRLEN + sizeof(struct nlmsgerr);
+	if (!(header->nlmsg_flags & NLM_F_CAPPED)) {
+		offset += error->msg.nlmsg_len - NLMSG_HDRLEN;
+	}
+
+	offset = NLMSG_ALIGN(offset);
+	length = header->nlmsg_len - offset;
+	attribute = (struct rtattr *) ((char *) header + offset);
+	for (; RTA_OK(attribute, length);
+			attribute = RTA_NEXT(attribute, length)) {
+		if (attribute->rta_type == NLMSGERR_ATTR_MSG) {
+			istrcpy(reason, RTA_DATA(attribute), reasonSize);
+			return;
+		}
+	}
+#endif
+}
+
+/* Sends a request and waits for the kernel's acknowledgment.  Returns
+ * 0, or -1 with errno set and the kernel's reason, if any, in reason. */
+static int changeNetem(DelayNetem *netem, NetemRequest *request,
+		char *reason, int reasonSize)
+{
+	unsigned char reply[NETEM_REPLY_BYTES];
+	struct nlmsghdr *header = (struct nlmsghdr *) reply;
+	struct nlmsgerr *error;
+	ssize_t length;
+
+	reason[0] = '\0';
+	if (sendNetemRequest(netem, request) < 0) {
+		return -1;
+	}
+
+	do {
+		length = recv(netem->fd, reply, sizeof reply, 0);
+	} while (length < 0 && errno == EINTR);
+
+	if (length < 0) {
+		return -1;
+	}
+
+	if (!NLMSG_OK(header, length) || header->nlmsg_type != NLMSG_ERROR) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	error = NLMSG_DATA(header);
+	if (error->error == 0) {
+		return 0;
+	}
+
+	errno = -error->error;
+	netemErrorReason(header, reason, reasonSize);
+	return -1;
+}
+
+int openDelayNetem(DelayNetem *netem, char *ifName, double delaySeconds,
+		double lossPercentage, unsigned int limit,
+		unsigned long long rateBytes)
+{
+	struct tc_netem_qopt options;
+	struct tc_netem_rate rate;
+	NetemRequest request;
+	struct rtattr *nest;
+	int64_t latencyNsec = (int64_t) (delaySeconds * 1e9);
+	char reason[128];
+	char errmsg[192];
+	int one = 1;
+
+	memset(netem, 0, sizeof(DelayNetem));
+	netem->ifName = ifName;
+	netem->fd = -1;
+	netem->ifIndex = if_nametoindex(ifName);
+	if (netem->ifIndex == 0) {
+		putSysErrmsg("No such netem interface", ifName);
+		return -1;
+	}
+
+	netem->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (netem->fd < 0) {
+		putSysErrmsg("Can't open netlink socket", ifName);
+		return -1;
+	}
+
+#ifdef NETLINK_EXT_ACK
+	oK(setsockopt(netem->fd, SOL_NETLINK, NETLINK_EXT_ACK, &one,
+			sizeof one));
+#endif
+
+	/* The legacy latency is in 64 ns ticks and tops out near 275 s;
+	 * TCA_NETEM_LATENCY64, where the kernel has it, overrides it */
+	memset(&options, 0, sizeof options);
+	options.latency = (latencyNsec >> 6) > UINT32_MAX ? UINT32_MAX
+			: (uint32_t) (latencyNsec >> 6);
+	options.limit = limit;
+	options.loss = lossPercentage >= 100.0 ? UINT32_MAX
+			: (uint32_t) (lossPercentage / 100.0 * UINT32_MAX);
+
+	/* Same as "tc qdisc replace dev <ifName> root netem ..." */
+	startNetemRequest(&request, netem, RTM_NEWQDISC,
+			NLM_F_CREATE | NLM_F_REPLACE | NLM_F_ACK);
+	addNetemAttribute(&request.header, TCA_KIND, "netem", sizeof "netem");
+	nest = addNetemAttribute(&request.header, TCA_OPTIONS, &options,
+			sizeof options);
+	addNetemAttribute(&request.header, TCA_NETEM_LATENCY64, &latencyNsec,
+			sizeof latencyNsec);
+	if (rateBytes > 0) {
+		memset(&rate, 0, sizeof rate);
+		rate.rate = rateBytes >= UINT32_MAX ? UINT32_MAX
+				: (uint32_t) rateBytes;
+		addNetemAttribute(&request.header, TCA_NETEM_RATE, &rate,
+				sizeof rate);
+		if (rateBytes >= UINT32_MAX) {
+			addNetemAttribute(&request.header, TCA_NETEM_RATE64,
+					&rateBytes, sizeof rateBytes);
+		}
+	}
+
+	nest->rta_len = (char *) &request.header + request.header.nlmsg_len
+			- (char *) nest;
+	if (changeNetem(netem, &request, reason, sizeof reason) < 0) {
+		isprintf(errmsg, sizeof errmsg, "Can't install netem qdisc%s%s",
+				reason[0] ? ": " : "", reason);
+		putSysErrmsg(errmsg, ifName);
+		close(netem->fd);
+		netem->fd = -1;
+		return -1;
+	}
+
+	netem->delayUsec = latencyNsec / 1000;
+	netem->limit = limit;
+	netem->offloaded = 1;
+	return 0;
+}
+
+int bindDelayNetem(DelayNetem *netem, int fd)
+{
+	if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, netem->ifName,
+			strlen(netem->ifName) + 1) < 0) {
+		putSysErrmsg("Can't bind socket to netem interface",
+				netem->ifName);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Fills stats from one qdisc's attributes; returns 0, or -1 if it
+ * isn't netem */
+static int readNetemAttributes(struct nlmsghdr *header,
+		DelayNetemStats *stats)
+{
+	struct tcmsg *tc = NLMSG_DATA(header);
+	struct rtattr *attribute = (struct rtattr *) ((char *) tc
+			+ NLMSG_ALIGN(sizeof(struct tcmsg)));
+	int length = header->nlmsg_len - NLMSG_LENGTH(sizeof(struct tcmsg));
+	struct tc_stats counters;
+	int isNetem = 0;
+
+	for (; RTA_OK(attribute, length);
+			attribute = RTA_NEXT(attribute, length)) {
+		if (attribute->rta_type == TCA_KIND) {
+			isNetem = strcmp(RTA_DATA(attribute), "netem") == 0;
+		} else if (attribute->rta_type == TCA_STATS
+		&& RTA_PAYLOAD(attribute) >= sizeof counters) {
+			memcpy(&counters, RTA_DATA(attribute), sizeof counters);
+			stats->sent = counters.packets;
+			stats->bytesSent = counters.bytes;
+			stats->held = counters.qlen;
+			stats->heldBytes = counters.backlog;
+			stats->dropped = counters.drops;
+		}
+	}
+
+	return isNetem ? 0 : -1;
+}
+
+int readDelayNetem(DelayNetem *netem, DelayNetemStats *stats)
+{
+	unsigned char reply[NETEM_REPLY_BYTES];
+	struct nlmsghdr *header;
+	struct tcmsg *tc;
+	NetemRequest request;
+	ssize_t length;
+	int found = -1;
+
+	memset(stats, 0, sizeof(DelayNetemStats));
+	if (!netem->offloaded) {
+		return -1;
+	}
+
+	startNetemRequest(&request, netem, RTM_GETQDISC, NLM_F_DUMP);
+	request.tc.tcm_parent = 0;
+	if (sendNetemRequest(netem, &request) < 0) {
+		return -1;
+	}
+
+	/* Every interface's qdiscs may be listed, ending with NLMSG_DONE */
+	for (;;) {
+		length = recv(netem->fd, reply, sizeof reply, 0);
+		if (length < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (length <= 0) {
+			return -1;
+		}
+
+		header = (struct nlmsghdr *) reply;
+		for (; NLMSG_OK(header, length);
+				header = NLMSG_NEXT(header, length)) {
+			if (header->nlmsg_type == NLMSG_DONE) {
+				return found;
+			}
+
+			if (header->nlmsg_type == NLMSG_ERROR) {
+				return -1;
+			}
+
+			tc = NLMSG_DATA(header);
+			if (header->nlmsg_type == RTM_NEWQDISC
+			&& tc->tcm_ifindex == netem->ifIndex
+			&& tc->tcm_parent == TC_H_ROOT) {
+				found = readNetemAttributes(header, stats);
+			}
+		}
+	}
+}
+
+void closeDelayNetem(DelayNetem *netem, int keepQdisc)
+{
+	NetemRequest request;
+	char reason[128];
+	char memoBuf[256];
+
+	if (!netem->offloaded) {
+		return;
+	}
+
+	if (!keepQdisc) {
+		startNetemRequest(&request, netem, RTM_DELQDISC, NLM_F_ACK);
+		if (changeNetem(netem, &request, reason, sizeof reason) < 0) {
+			isprintf(memoBuf, sizeof memoBuf, "[w] Can't remove "
+					"netem qdisc from %s: %s", netem->ifName,
+					reason[0] ? reason : strerror(errno));
+			writeMemo(memoBuf);
+		}
+	}
+
+	close(netem->fd);
+	netem->fd = -1;
+	netem->offloaded = 0;
+}
+#else
+int openDelayNetem(DelayNetem *netem, char *ifName, double delaySeconds,
+		double lossPercentage, unsigned int limit,
+		unsigned long long rateBytes)
+{
+	memset(netem, 0, sizeof(DelayNetem));
+	netem->fd = -1;
+	putErrmsg("netem offload needs Linux.", ifName);
+	return -1;
+}
+
+int bindDelayNetem(DelayNetem *netem, int fd)
+{
+	return -1;
+}
+
+int readDelayNetem(DelayNetem *netem, DelayNetemStats *stats)
+{
+	memset(stats, 0, sizeof(DelayNetemStats));
+	return -1;
+}
+
+void closeDelayNetem(DelayNetem *netem, int keepQdisc)
+{
+}
+#endif
@@ -0,0 +1,1365 @@
+/*
+	udpdelay.h:	common definitions for the UDP delay convergence-layer
+			adapter daemons (Mars, Moon and preset variants).
+
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#ifndef _UDPDELAY_H_
+#define _UDPDELAY_H_
+
+#ifdef UDPDELAY_STUB
+#include "ionstub.h"		/* Benchmarks: no ION installation */
+#else
+#include "udpcla.h"
+#endif
+#include "udpdelaytrace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Capacity of each daemon's delay queue, per duct served */
+#ifndef MAX_QUEUED_BUNDLES
+#define MAX_QUEUED_BUNDLES 100
+#endif
+
+/* Bundle tracing - enabled at compile time with TRACE=1 */
+#ifndef DELAY_TRACE
+#define DELAY_TRACE 0
+#endif
+
+/* Number of leading bundle bytes needed to decode the primary block */
+#define DELAY_ID_PEEK_BYTES	256
+
+/* Decode the primary-block identity (source EID, creation timestamp,
+ * fragment offset) from the first bytes of a serialized BPv7 bundle,
+ * and, if expiryTime is not NULL, the time its lifetime ends (zeroed
+ * when the bundle has no creation time).  Returns 0 on success, -1 if
+ * the bytes are not a decodable BPv7 primary block, in which case *id
+ * and *expiryTime are zeroed. */
+extern int	decodeBundleId(unsigned char *bundle, unsigned int length,
+			DelayBundleId *id, struct timeval *expiryTime);
+
+/* Same as decodeBundleId, reading the leading bytes from a ZCO.  Must
+ * be called inside an SDR transaction. */
+extern int	decodeZcoBundleId(Sdr sdr, Object zco, unsigned int length,
+			DelayBundleId *id, struct timeval *expiryTime);
+
+/* Open <daemon>.<pid>.dtr in the working directory.  Returns 0 on
+ * success (or when tracing is compiled out), -1 on failure. */
+extern int	openDelayTrace(char *daemonName);
+
+/* Append one record.  Thread safe; no-op when the trace is not open. */
+extern void	traceBundle(DelayBundleId *id, int event, unsigned int length,
+			struct timeval *when);
+
+extern void	closeDelayTrace(void);
+
+/* Per-stage self-profiling - enabled by default, PROFILE=0 compiles
+ * it out.  Timestamps come from CLOCK_MONOTONIC (vDSO, no syscall) or,
+ * with PROFILE_TSC=1 on x86-64, from the calibrated TSC. */
+#ifndef DELAY_PROFILE
+#define DELAY_PROFILE 1
+#endif
+
+#ifndef DELAY_PROFILE_TSC
+#define DELAY_PROFILE_TSC 0
+#endif
+
+typedef enum {
+	PROF_DEQUEUE = 0,	/* CLO: blocked in bpDequeue */
+	PROF_ZCO_LENGTH,	/* CLO: zco_length (and identity peek) xn */
+	PROF_QUEUE_LOCK,	/* Waiting for the delay queue mutex */
+	PROF_ENQUEUE,		/* Inserting into the delay queue */
+	PROF_STAGE_WAIT,	/* CLO: waiting for room in the schedule stage */
+	PROF_RELEASE_PASS,	/* One pass over the delay queue */
+	PROF_RELEASE_LATE,	/* Release time to actual release */
+	PROF_SDR_BEGIN,		/* CLO: sdr_begin_xn before zco_transmit */
+	PROF_ZCO_TRANSMIT,	/* CLO: copying the bundle out of the ZCO */
+	PROF_SENDTO,		/* CLO: isendto */
+	PROF_ZCO_DESTROY,	/* CLO: zco_destroy transaction */
+	PROF_RECEIVE,		/* CLI: receiveBytesByUDP */
+	PROF_RECEIVE_TURN,	/* CLI: receive thread, datagram to handoff */
+	PROF_BEGIN_ACQ,		/* CLI: bpBeginAcq */
+	PROF_CONTINUE_ACQ,	/* CLI: bpContinueAcq */
+	PROF_END_ACQ,		/* CLI: bpEndAcq */
+	PROF_STAGES
+} DelayProfStage;
+
+/* 4 sub-buckets per power of two: percentiles within 25% */
+#define PROF_BUCKETS	256
+
+typedef struct {
+	unsigned long long count;
+	unsigned long long totalNsec;
+	unsigned long long maxNsec;
+	unsigned long long buckets[PROF_BUCKETS];
+} DelayProfCounter;
+
+extern DelayProfCounter	delayProfile[PROF_STAGES];
+
+extern unsigned long long	profileClock(void);
+extern void	profileRecord(DelayProfStage stage, unsigned long long nsec);
+
+static inline unsigned long long profileStart(void)
+{
+	return DELAY_PROFILE ? profileClock() : 0;
+}
+
+static inline void profileStop(DelayProfStage stage, unsigned long long start)
+{
+	if (DELAY_PROFILE) {
+		profileRecord(stage, profileClock() - start);
+	}
+}
+
+/* Install the SIGUSR1 handler that requests a report.  The report
+ * itself is written from thread context by checkProfileReport, which
+ * daemons call from their polling loops. */
+extern void	initProfile(char *daemonName);
+extern void	checkProfileReport(void);
+extern void	writeProfileReport(void);
+
+/* Delay model supplied by each daemon variant */
+typedef struct {
+	char	*daemonName;		/* e.g. "udpmarsdelayclo" */
+	char	*modelName;		/* e.g. "Mars", for log messages */
+	double	(*delay)(void);		/* Current one-way delay, seconds */
+	double	lossPercentage;		/* 0.0 = no loss, 5.0 = 5% loss */
+	int	constantDelay;		/* delay() never changes, so the CLO
+					   may offload it to netem */
+} DelayModel;
+
+typedef struct delayclo_duct_str	DelayCloDuct;
+typedef struct delaycli_duct_str	DelayCliDuct;
+typedef struct delay_source_str		DelaySource;
+
+/* A bundle held back until its release time.  The CLO holds a
+ * reference to the outbound ZCO; the CLI holds a copy of the received
+ * bytes. */
+typedef struct {
+	struct timeval	releaseTime;
+	Object		bundleZco;	/* CLO only */
+	char		*data;		/* CLI only */
+	unsigned int	packedLength;	/* CLI only: data compressed, or 0 */
+	unsigned int	coldOffset;	/* CLI cold tier: data's place in */
+	int		coldSegment;	/* ... this segment file */
+	unsigned int	length;
+	BpAncillaryData	ancillaryData;	/* CLO only */
+	DelayCloDuct	*duct;		/* CLO only: outduct, or NULL */
+	DelayCliDuct	*induct;	/* CLI only: induct, or NULL */
+	DelaySource	*source;	/* CLI only: sender's entry, or NULL */
+	struct sockaddr_storage fromAddr; /* CLI only */
+	DelayBundleId	id;		/* Primary-block identity */
+	struct timeval	expiryTime;	/* End of lifetime, or zero */
+	unsigned char	releaseClass;	/* DELAY_CLASS_... */
+	unsigned char	ordinal;	/* Within the expedited class */
+} DelayedBundle;
+
+/* Release classes.  Bundles due in the same release pass go out
+ * expedited first, in decreasing ordinal, then standard, then bulk. */
+#define DELAY_CLASS_BULK	0
+#define DELAY_CLASS_STANDARD	1
+#define DELAY_CLASS_EXPEDITED	2
+#define DELAY_CLASSES		3
+
+extern const char	*delayClassNames[DELAY_CLASSES];
+
+/* Class of a dequeued bundle: expedited if it has an ordinal or asks
+ * for minimum latency, bulk if it asks for best effort only. */
+extern int	delayBundleClass(BpAncillaryData *ancillaryData);
+
+typedef struct {
+	unsigned long long released;
+	unsigned long long latenessUsec; /* Past the deadline, summed */
+	unsigned long long maxLatenessUsec;
+	int		depth;
+	int		highWater;
+} DelayClassStats;
+
+typedef struct {
+	struct timeval	releaseTime;
+	unsigned long long sequence;	/* Orders equal release times */
+	int		slot;		/* In bundles[] */
+} DelayHeapEntry;
+
+/* Binary min-heap of release times over a fixed array of bundle slots:
+ * the next deadline is the root, and insertion and release cost
+ * O(log depth). */
+typedef struct {
+	DelayedBundle	*bundles;	/* Slots */
+	DelayHeapEntry	*heap;
+	DelayHeapEntry	*ready;		/* Due in the current release pass */
+	int		*freeSlots;	/* Stack of unused slots */
+	int		count;
+	int		capacity;
+	unsigned long long sequence;
+	long		leadUsec;	/* Release this early (SO_TXTIME) */
+	DelayClassStats	classes[DELAY_CLASSES];
+	pthread_mutex_t	mutex;
+} DelayQueue;
+
+/* Called for every bundle whose release time has passed, with the
+ * queue locked.  The callback owns the bundle's ZCO or data. */
+typedef void	(*DelayReleaseFn)(DelayedBundle *bundle, void *arg);
+
+/* Queue implementation name, recorded in benchmark results */
+extern const char	delayQueueKind[];
+
+extern int	initDelayQueue(DelayQueue *queue, int capacity);
+extern void	destroyDelayQueue(DelayQueue *queue);
+
+/* Returns the new queue depth, or -1 if the queue is full. */
+extern int	insertDelayed(DelayQueue *queue, DelayedBundle *bundle);
+
+/* Earliest release time in the queue.  Returns 0, or -1 if empty. */
+extern int	nextDelayedDeadline(DelayQueue *queue, struct timeval *deadline);
+
+/* Releases all bundles due at *now (refreshed after each class-ordered
+ * batch), returning the number released. */
+extern int	releaseDelayed(DelayQueue *queue, struct timeval *now,
+			DelayReleaseFn release, void *arg);
+
+/* Hands every queued bundle to release, due or not, emptying the
+ * queue (at shutdown). */
+extern void	drainDelayed(DelayQueue *queue, DelayReleaseFn release,
+			void *arg);
+
+/* Writes each class's depth and release lateness to the log */
+extern void	reportDelayClasses(DelayQueue *queue, char *daemonName);
+
+/* Bounded FIFO handing bundles from one pipeline stage's thread to
+ * the next.  Pushes block while the stage is full and pops while it is
+ * empty, until the stage is closed. */
+typedef struct {
+	DelayedBundle	*slots;
+	int		capacity;
+	int		head;
+	int		count;
+	int		closed;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	notEmpty;
+	pthread_cond_t	notFull;
+
+	/*	Occupancy, sampled by every push.			*/
+	unsigned long long pushes;
+	unsigned long long depthSum;	/* Depth found, summed */
+	unsigned long long fullWaits;	/* Pushes that found it full */
+	int		highWater;
+} DelayStage;
+
+extern int	initDelayStage(DelayStage *stage, int capacity);
+extern void	destroyDelayStage(DelayStage *stage);
+
+/* With wait 0, returns at once if the stage is full.  Returns 0, or
+ * -1 if the stage is full or has been closed (the bundle is not queued
+ * and still belongs to the caller). */
+extern int	pushDelayStage(DelayStage *stage, DelayedBundle *bundle,
+			int wait);
+
+/* Takes the oldest bundle.  With wait 0, returns at once if the stage
+ * is empty.  Returns 1 if a bundle was taken, 0 if none (empty, or
+ * closed and drained). */
+extern int	popDelayStage(DelayStage *stage, DelayedBundle *bundle,
+			int wait);
+
+/* Sleeps until the stage is non-empty or closed, or usec pass */
+extern void	waitDelayStage(DelayStage *stage, long usec);
+
+/* Wakes every waiting thread; later pushes fail, pops drain the rest */
+extern void	closeDelayStage(DelayStage *stage);
+
+/* Writes "<name> stage: ..." occupancy to the log */
+extern void	reportDelayStage(DelayStage *stage, char *daemonName,
+			char *name);
+
+/* Engine clock: gettimeofday, unless a benchmark or soak test has
+ * installed a virtual clock with setDelayClock. */
+typedef void	(*DelayClockFn)(struct timeval *now);
+
+extern void	setDelayClock(DelayClockFn clock);
+extern void	delayNow(struct timeval *now);
+
+/* releaseTime = from + delaySeconds */
+extern void	computeReleaseTime(struct timeval *from, double delaySeconds,
+			struct timeval *releaseTime);
+
+/* Returns 1 if the bundle's lifetime ends by its release time.  The
+ * receiving node would only discard it, so it is dropped at enqueue
+ * rather than held for the whole delay. */
+extern int	delayBundleExpires(DelayedBundle *bundle);
+
+/* Returns 1 if a bundle should be dropped to simulate link loss */
+extern int	simulateLinkLoss(double lossPercentage);
+
+/* Engine counters are updated with relaxed atomics from any thread */
+#define delayCount(counter, amount) \
+		__atomic_fetch_add(&(counter), (amount), __ATOMIC_RELAXED)
+
+/* How the CLO release thread waits for the next release time:
+ * polling every 10 ms, sleeping on a timerfd armed for the earliest
+ * release time, or as timerfd but handing each bundle to the kernel
+ * DELAY_TXTIME_LEAD_USEC early with an SO_TXTIME transmit time (needs
+ * the fq or etf qdisc on the outbound interface to be exact). */
+#define DELAY_RELEASE_POLL	0
+#define DELAY_RELEASE_TIMERFD	1
+#define DELAY_RELEASE_TXTIME	2
+
+#ifndef DELAY_RELEASE_MODE
+#define DELAY_RELEASE_MODE	DELAY_RELEASE_POLL
+#endif
+
+#ifndef DELAY_TXTIME_LEAD_USEC
+#define DELAY_TXTIME_LEAD_USEC	2000
+#endif
+
+extern const char	*delayReleaseModeNames[];
+
+/* Real-time settings for the threads that set release precision: the
+ * release thread of either daemon and the CLI's receive thread.  Each
+ * can be pinned to chosen cores, and all run SCHED_FIFO at the given
+ * priority (the CLO's transmit threads too, unpinned).  Memory can be
+ * locked so that no page fault delays a release, and the release
+ * thread can sleep only until DELAY_SPIN_USEC before each release time
+ * and spin through the rest.  Settings the process may not use are
+ * skipped with a memo. */
+#ifndef DELAY_RELEASE_CPU
+#define DELAY_RELEASE_CPU	-1	/* Core, or -1: not pinned */
+#endif
+
+#ifndef DELAY_RECEIVE_CPU
+#define DELAY_RECEIVE_CPU	-1
+#endif
+
+#ifndef DELAY_RT_PRIORITY
+#define DELAY_RT_PRIORITY	0	/* SCHED_FIFO priority, 0: SCHED_OTHER */
+#endif
+
+#ifndef DELAY_MLOCK
+#define DELAY_MLOCK		0
+#endif
+
+#ifndef DELAY_SPIN_USEC
+#define DELAY_SPIN_USEC		0
+#endif
+
+typedef struct {
+	unsigned long	releaseCpus;	/* Core mask, 0: not pinned */
+	unsigned long	receiveCpus;	/* CLI receive thread */
+	int		priority;	/* SCHED_FIFO priority, 0: SCHED_OTHER */
+	int		lockMemory;	/* mlockall once set up */
+	long		spinUsec;	/* Spin this close to a release time */
+} DelayRealtime;
+
+/* Fills in the compile-time settings */
+extern void	initDelayRealtime(DelayRealtime *rt);
+
+/* Pins the calling thread to cpus (unless 0) and runs it SCHED_FIFO
+ * if rt->priority is set.  Returns 0, or -1 (with a memo) if either
+ * was refused; the thread carries on regardless. */
+extern int	applyDelayRealtime(DelayRealtime *rt, unsigned long cpus,
+			char *daemonName, char *threadName);
+
+/* mlockall(MCL_CURRENT | MCL_FUTURE) if rt->lockMemory is set.
+ * Returns 0, or -1 with a memo. */
+extern int	lockDelayMemory(DelayRealtime *rt, char *daemonName);
+extern void	unlockDelayMemory(DelayRealtime *rt);
+
+/* Writes the settings in use to the log, if there are any */
+extern void	reportDelayRealtime(DelayRealtime *rt, char *daemonName);
+
+/* Microseconds until the earliest release time in the queue, less the
+ * queue's lead; LLONG_MAX if the queue is empty. */
+extern long long usecToDeadline(DelayQueue *queue);
+
+/* Busy-waits until the earliest release time (less the lead) if it is
+ * no more than spinUsec away.  Returns 1 if it waited, else 0. */
+extern int	spinToDeadline(DelayQueue *queue, long spinUsec);
+
+/* Same-host shared-memory transport.  A duct named shm:<name> carries
+ * bundles through a ring in POSIX shared memory (/udpdelay.<name>)
+ * instead of over UDP.  The CLO's transmit threads copy each due bundle
+ * straight from its ZCO into the ring and the CLI's receive thread
+ * reads it from there: no socket, no system call per bundle and no
+ * 64 KB datagram limit.  Delay and loss are applied as on the UDP path.
+ * The reader sleeps on a Unix datagram doorbell, which writers ring
+ * only while it is waiting.  The ring outlives the daemons; a new
+ * reader discards what an earlier one left unread.  The ring is
+ * readable by its owner only and refused if another user created it;
+ * the doorbell is bound in DELAY_SHM_BELL_DIR/udpdelay-<euid>, which
+ * must be a directory of that user's that no one else can write. */
+#define DELAY_SHM_PREFIX	"shm:"
+
+#ifndef DELAY_SHM_RING_BYTES
+#define DELAY_SHM_RING_BYTES	(64 * 1024 * 1024)
+#endif
+
+#ifndef DELAY_SHM_BELL_DIR
+#define DELAY_SHM_BELL_DIR	"/tmp"
+#endif
+
+/* Records the receive thread takes from one ring per turn */
+#define DELAY_SHM_BATCH		64
+
+typedef struct delay_shm_ring_str	DelayShmRing;
+
+/* Maps the ring, creating it if need be.  The one reader binds the
+ * doorbell.  Returns NULL on failure. */
+extern DelayShmRing *openDelayShmRing(char *name, int reader);
+extern void	closeDelayShmRing(DelayShmRing *ring);
+
+/* Writers: reserves room for a record of length bytes and returns
+ * where to put them, holding the writers' lock until endShmWrite or
+ * cancelShmWrite; returns NULL if the ring is full or the record
+ * larger than half of it.  The lock carries the holder's pid and is
+ * taken over if that process has died. */
+extern unsigned char *beginShmWrite(DelayShmRing *ring, unsigned int length);
+extern void	endShmWrite(DelayShmRing *ring, unsigned int length);
+extern void	cancelShmWrite(DelayShmRing *ring);
+
+/* Reader: the oldest record, in place, or NULL if the ring is empty;
+ * consumeShmRecord frees it.  A record that doesn't fit in what was
+ * written discards the ring's contents. */
+extern unsigned char *peekShmRecord(DelayShmRing *ring, unsigned int *length);
+extern void	consumeShmRecord(DelayShmRing *ring, unsigned int length);
+extern int	shmRingPending(DelayShmRing *ring);
+
+/* Reader: the doorbell descriptor to wait on.  armShmRing asks writers
+ * to ring it and returns 1 if records are already waiting (so don't
+ * sleep); quietShmRing stops the ringing and, if it rang, drains it. */
+extern int	shmRingDoorbell(DelayShmRing *ring);
+extern int	armShmRing(DelayShmRing *ring);
+extern void	quietShmRing(DelayShmRing *ring, int rung);
+
+/* Socket addresses, IPv4 or IPv6.  A duct name is parsed once, when
+ * the duct is attached: "host:port", "a.b.c.d:port", "[IPv6]:port" or a
+ * bare IPv6 address, with the port defaulting to BpUdpDefaultPortNbr
+ * and an empty host meaning this host, as in ION.  Host names are
+ * resolved then, by getaddrinfo, keeping the IPv4 address of a name
+ * that has both; the send and receive paths only copy and compare the
+ * stored addresses. */
+extern int	parseDelaySocketSpec(char *spec,
+			struct sockaddr_storage *name);
+extern socklen_t delayAddressLength(struct sockaddr_storage *name);
+
+/* An IPv6 socket is opened dual-stack, so an induct bound to "[::]"
+ * also receives IPv4 and an outduct's socket can send to IPv4
+ * destinations once they are mapped with mapDelayAddress. */
+extern int	openDelaySocket(int family);
+extern void	mapDelayAddress(struct sockaddr_storage *name);
+extern int	sameDelayAddress(struct sockaddr_storage *a,
+			struct sockaddr_storage *b);
+extern unsigned int hashDelayAddress(struct sockaddr_storage *name);
+
+/* Numeric "address:port" (IPv6 bracketed), without the resolver */
+extern char	*delayAddressString(struct sockaddr_storage *name,
+			char *buffer, int length);
+
+/* Delay CLA frames.  A bundle that fits in one datagram is sent bare,
+ * as by udpclo, so a stock udpcli can still receive it.  Anything else
+ * is framed: the datagram starts with DELAY_FRAME_MAGIC (never the
+ * first byte of a BPv6 or BPv7 bundle) and a header of headerLength
+ * bytes, in network byte order, followed by the frame's payload.
+ * Receivers skip header bytes they don't know, so later frame kinds
+ * and versions can extend the header. */
+#define DELAY_FRAME_MAGIC	0x444c5946	/* "DLYF" */
+#define DELAY_FRAME_VERSION	1
+#define DELAY_FRAME_SEGMENT	1	/* One piece of a large bundle */
+#define DELAY_FRAME_AGGREGATE	2	/* Several small bundles */
+
+/* Magic, version, kind, header length */
+#define DELAY_FRAME_BASE_BYTES	8
+
+/* Plus bundle tag, bundle length, segment index, count and offset */
+#define DELAY_SEGMENT_HEADER_BYTES (DELAY_FRAME_BASE_BYTES + 20)
+
+/* Plus bundle count and two reserved bytes; each bundle in the payload
+ * follows its two-byte length */
+#define DELAY_AGGREGATE_HEADER_BYTES (DELAY_FRAME_BASE_BYTES + 4)
+#define DELAY_AGGREGATE_ENTRY_BYTES 2
+
+typedef struct {
+	int		kind;		/* DELAY_FRAME_... */
+	int		headerLength;	/* Payload starts here */
+	unsigned int	bundleTag;	/* Segment: sender's bundle number */
+	unsigned int	bundleLength;
+	unsigned int	index;		/* Segment index, 0 .. count - 1 */
+	unsigned int	count;		/* Segments, or aggregated bundles */
+	unsigned int	offset;		/* Of the payload in the bundle */
+	unsigned int	segmentBytes;	/* Segment: payload of all but the
+					   last, derived on decoding */
+} DelayFrame;
+
+/* Writes the header for frame and returns its length */
+extern int	encodeDelayFrame(DelayFrame *frame, unsigned char *into);
+
+/* Returns 1 if the datagram is a frame, with its header decoded into
+ * *frame, 0 if it is a bare bundle, or -1 if it is a malformed frame.
+ * A segment is malformed unless the bundle's segments, at its index,
+ * offset and length, would tile it exactly. */
+extern int	decodeDelayFrame(unsigned char *datagram, int length,
+			DelayFrame *frame);
+
+/* CL-level segmentation - enabled by default, SEGMENT=0 compiles it
+ * out (bundles too large for one datagram are then dropped).  A bundle
+ * larger than the largest UDP payload goes out as segments of
+ * DELAY_SEGMENT_BYTES, small enough for an Ethernet MTU even over IPv6,
+ * so that IP never fragments it.  All segments are sent at the bundle's
+ * release time; the receiving CLI reassembles them and releases the bundle
+ * its delay after the first segment arrived. */
+#ifndef DELAY_SEGMENTS
+#define DELAY_SEGMENTS		1
+#endif
+
+#define DELAY_MAX_DATAGRAM	65507	/* Largest IPv4 UDP payload */
+
+#ifndef DELAY_SEGMENT_BYTES
+#define DELAY_SEGMENT_BYTES	1452	/* Datagram, header included */
+#endif
+
+/* Every segment but a bundle's last carries at least this much of it,
+ * which bounds the segment count a frame may claim */
+#define DELAY_SEGMENT_MIN_PAYLOAD 512
+
+#if DELAY_SEGMENT_BYTES - DELAY_SEGMENT_HEADER_BYTES < DELAY_SEGMENT_MIN_PAYLOAD
+#error "DELAY_SEGMENT_BYTES leaves less than DELAY_SEGMENT_MIN_PAYLOAD"
+#endif
+
+/* A segmented bundle reaches the CLI as one burst, so its sockets ask
+ * for a receive buffer this large (the kernel caps it at
+ * net.core.rmem_max). */
+#ifndef DELAY_RECEIVE_BUFFER_BYTES
+#define DELAY_RECEIVE_BUFFER_BYTES (8 * 1024 * 1024)
+#endif
+
+extern void	sizeDelayReceiveBuffer(int fd, char *daemonName);
+
+/* Reassembly holds at most DELAY_REASSEMBLY_SLOTS bundles and
+ * DELAY_REASSEMBLY_BYTES in all, their segment bitmaps included; segments that find no room are
+ * dropped, and a bundle still incomplete DELAY_REASSEMBLY_TIMEOUT_SEC
+ * after its first segment is discarded. */
+#ifndef DELAY_REASSEMBLY_SLOTS
+#define DELAY_REASSEMBLY_SLOTS	16
+#endif
+
+#ifndef DELAY_REASSEMBLY_BYTES
+#define DELAY_REASSEMBLY_BYTES	(64 * 1024 * 1024)
+#endif
+
+#ifndef DELAY_REASSEMBLY_TIMEOUT_SEC
+#define DELAY_REASSEMBLY_TIMEOUT_SEC 10
+#endif
+
+/* Small-bundle aggregation - off by default; AGGREGATE=1 turns it on,
+ * and both ends must be built with it.  The CLO packs small bundles due
+ * in the same release pass for the same duct into one aggregate frame
+ * of at most DELAY_AGGREGATE_BYTES, and its release timer fires
+ * DELAY_AGGREGATE_WINDOW_USEC after the earliest release time, so that
+ * a pass gathers the bundles due in that window: none leaves early, and
+ * none more than the window late.  A bundle with no company is still
+ * sent bare.  A CLI built without aggregation drops aggregate frames,
+ * counting them and warning once, rather than passing them to ION. */
+#ifndef DELAY_AGGREGATE
+#define DELAY_AGGREGATE		0
+#endif
+
+#ifndef DELAY_AGGREGATE_BYTES
+#define DELAY_AGGREGATE_BYTES	1452	/* Datagram, header included */
+#endif
+
+#ifndef DELAY_AGGREGATE_WINDOW_USEC
+#define DELAY_AGGREGATE_WINDOW_USEC 1000
+#endif
+
+/* Largest bundle worth aggregating, and most bundles in a frame */
+#define DELAY_AGGREGATE_BUNDLE_BYTES (DELAY_AGGREGATE_BYTES \
+		- DELAY_AGGREGATE_HEADER_BYTES - DELAY_AGGREGATE_ENTRY_BYTES)
+#define DELAY_AGGREGATE_MAX_BUNDLES 128
+
+/* Bundles packed by one sending thread, not yet sent */
+typedef struct {
+	DelayCloDuct	*duct;		/* Shared by all the bundles */
+	DelayedBundle	latest;		/* Latest due: txtime, destination */
+	int		count;
+	int		length;		/* Of the frame so far */
+	DelayBundleId	ids[DELAY_AGGREGATE_MAX_BUNDLES]; /* For tracing */
+	unsigned short	lengths[DELAY_AGGREGATE_MAX_BUNDLES];
+	unsigned char	buffer[DELAY_AGGREGATE_BYTES];
+} DelayAggregate;
+
+/* Live handoff - enabled at compile time with HANDOFF=1.  A running
+ * daemon listens on a Unix socket, DELAY_HANDOFF_DIR/<daemon>.handoff;
+ * a new binary started with UDPDELAY_HANDOFF set in its environment
+ * connects, sets up everything but its sockets, and asks for them.  The
+ * old process stops its threads and sends its duct sockets (SCM_RIGHTS)
+ * and cold-tier segments with a header, then streams every bundle it
+ * holds, earliest release first, and exits.  The new one starts its
+ * threads once it has the header, so release resumes while the rest
+ * of the queue is still arriving. */
+#ifndef DELAY_HANDOFF
+#define DELAY_HANDOFF		0
+#endif
+
+#ifndef DELAY_HANDOFF_DIR
+#define DELAY_HANDOFF_DIR	"/tmp"
+#endif
+
+#define DELAY_HANDOFF_ENV	"UDPDELAY_HANDOFF"
+#define DELAY_HANDOFF_MAGIC	0x444c5948	/* "DLYH" */
+#define DELAY_HANDOFF_VERSION	1
+#define DELAY_HANDOFF_MAX_FDS	192	/* Sockets and segments */
+#define DELAY_HANDOFF_BUFFER_BYTES 65536
+
+/* Sent with the descriptors: sockets first, in duct order, then
+ * segments; the segments' descriptions follow in the stream, then
+ * bundles records. */
+typedef struct {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	recordSize;	/* sizeof(DelayHandoffRecord) */
+	int32_t		pid;
+	uint32_t	ductCount;
+	uint32_t	sockets;
+	uint32_t	segments;
+	uint64_t	bundles;
+	uint64_t	lastReleaseUsec; /* Old release thread's last pass */
+} DelayHandoffHeader;
+
+typedef struct {
+	uint32_t	index;		/* In the tier's segment table */
+	uint32_t	length;
+	uint32_t	live;
+	uint32_t	reserved;
+} DelayHandoffSegment;
+
+/* One bundle.  A CLI bundle's data (packedLength bytes if compressed)
+ * follows its record unless it is in a cold-tier segment. */
+typedef struct {
+	uint64_t	releaseUsec;
+	uint64_t	expiryUsec;	/* 0: no expiry time */
+	uint64_t	bundleZco;	/* CLO: in the shared SDR */
+	DelayBundleId	id;
+	BpAncillaryData	ancillaryData;	/* CLO */
+	struct sockaddr_storage fromAddr; /* CLI */
+	uint32_t	length;
+	uint32_t	packedLength;
+	uint32_t	coldOffset;
+	int32_t		coldSegment;	/* -1: data follows */
+	int32_t		duct;		/* Index, -1: none */
+	uint8_t		releaseClass;
+	uint8_t		ordinal;
+	uint8_t		reserved[2];
+} DelayHandoffRecord;
+
+/* A daemon's side of a handoff.  The old process has requested set
+ * once a new one asks; the new one is connected from startup. */
+typedef struct {
+	int		listening;
+	int		listener;
+	volatile int	requested;
+	int		connected;
+	int		fd;		/* Connection, if either is set */
+	int		peerPid;	/* At the other end */
+	pthread_t	thread;
+	int		threadStarted;
+	struct timeval	lastRelease;	/* Release thread's last pass */
+
+	/*	The last handoff, for reports.				*/
+	unsigned int	bundles;	/* Handed, or taken over and queued */
+	unsigned int	lost;		/* Taken over: dropped or unread */
+	unsigned int	late;		/* Taken over past release time */
+	long long	maxLateUsec;
+	long long	gapUsec;	/* Old release thread's last pass to
+					   the new one's start, or (old) to
+					   the end of the stream */
+} DelayHandoff;
+
+/* Buffered, blocking stream over the connection */
+typedef struct {
+	int		fd;
+	int		length;
+	int		offset;
+	unsigned char	buffer[DELAY_HANDOFF_BUFFER_BYTES];
+} DelayHandoffStream;
+
+/* Old process: binds the daemon's handoff socket, replacing a stale
+ * one.  Returns the listening socket, or -1. */
+extern int	listenDelayHandoff(char *daemonName);
+
+/* Waits for a request from a process of the same user; *peerPid gets
+ * its pid.  Returns the connection, or -1 once the listener is shut
+ * down.  Removes the socket name, so the new process can bind it. */
+extern int	acceptDelayHandoff(int listener, char *daemonName,
+			int *peerPid);
+
+/* Shuts down and closes the listener, removing the socket name unless
+ * a handoff was accepted */
+extern void	closeDelayHandoff(DelayHandoff *handoff, char *daemonName);
+
+/* New process: connects to the running daemon; *peerPid gets its pid.
+ * Nothing is handed over until requestDelayHandoff. */
+extern int	connectDelayHandoff(char *daemonName, int *peerPid);
+extern int	requestDelayHandoff(int fd);
+
+/* The header and its descriptors travel in one message.  Receiving
+ * checks magic, version and record size, and returns the number of
+ * descriptors (into fds, DELAY_HANDOFF_MAX_FDS), or -1. */
+extern int	sendHandoffHeader(int fd, DelayHandoffHeader *header,
+			int *fds, int fdCount);
+extern int	receiveHandoffHeader(int fd, DelayHandoffHeader *header,
+			int *fds);
+
+/* Each returns 0, or -1 if the connection failed */
+extern int	writeHandoff(DelayHandoffStream *stream, void *from,
+			unsigned int length);
+extern int	flushHandoff(DelayHandoffStream *stream);
+extern int	readHandoff(DelayHandoffStream *stream, void *into,
+			unsigned int length);
+
+/* Fields common to both engines; the caller sets duct, data and the
+ * tier fields */
+extern void	packHandoffRecord(DelayedBundle *bundle,
+			DelayHandoffRecord *record);
+extern void	unpackHandoffRecord(DelayHandoffRecord *record,
+			DelayedBundle *bundle);
+
+/* Kernel netem offload - enabled at compile time with NETEM=1, for
+ * models whose delay never changes.  With UDPDELAY_NETEM naming a
+ * network interface that carries only the delayed link (one end of a
+ * veth pair, or an interface in the daemon's own network namespace),
+ * the CLO makes a netem qdisc that interface's root over rtnetlink,
+ * with the model's delay and loss, binds its socket to the interface
+ * and sends each bundle as soon as it is dequeued.  The kernel holds
+ * the datagrams for the delay, so the CLO needs no release or transmit
+ * thread.  Needs CAP_NET_ADMIN (and CAP_NET_RAW to bind the socket). */
+#ifndef DELAY_NETEM
+#define DELAY_NETEM		0
+#endif
+
+#define DELAY_NETEM_ENV		"UDPDELAY_NETEM"
+
+/* Link rate emulated by netem, kbit/s; 0: unlimited */
+#ifndef DELAY_NETEM_RATE_KBPS
+#define DELAY_NETEM_RATE_KBPS	0
+#endif
+
+/* Datagrams netem holds before dropping; 0: the delay queue's capacity */
+#ifndef DELAY_NETEM_LIMIT
+#define DELAY_NETEM_LIMIT	0
+#endif
+
+typedef struct {
+	int		offloaded;
+	int		fd;		/* NETLINK_ROUTE */
+	int		ifIndex;
+	char		*ifName;
+	long long	delayUsec;	/* Applied by the qdisc */
+	unsigned int	limit;
+} DelayNetem;
+
+/* The root qdisc's counters */
+typedef struct {
+	unsigned long long sent;	/* Datagrams past the delay */
+	unsigned long long bytesSent;
+	unsigned int	held;		/* Datagrams in the delay now */
+	unsigned int	heldBytes;
+	unsigned int	dropped;	/* Link loss, or over the limit */
+} DelayNetemStats;
+
+/* Makes netem, with the given delay, loss %, limit (datagrams) and rate
+ * (bytes/s, 0: unlimited), the root qdisc of ifName, replacing any
+ * other.  An existing netem root is changed in place, keeping the
+ * datagrams it holds.  Returns 0, or -1 with the kernel's reason. */
+extern int	openDelayNetem(DelayNetem *netem, char *ifName,
+			double delaySeconds, double lossPercentage,
+			unsigned int limit, unsigned long long rateBytes);
+
+/* Sends whatever fd sends through the netem interface */
+extern int	bindDelayNetem(DelayNetem *netem, int fd);
+
+/* Returns 0, or -1 if the qdisc is gone or isn't netem */
+extern int	readDelayNetem(DelayNetem *netem, DelayNetemStats *stats);
+
+/* Removes the qdisc, dropping the datagrams it holds, unless keepQdisc
+ * (a new instance is taking over), and closes the netlink socket */
+extern void	closeDelayNetem(DelayNetem *netem, int keepQdisc);
+
+/* Output (CLO) engine */
+typedef struct {
+	unsigned long long dequeued;
+	unsigned long long queueFull;	/* Dropped: delay queue full */
+	unsigned long long expired;	/* Dropped: lifetime ends in delay */
+	unsigned long long linkLoss;	/* Dropped: simulated link loss */
+	unsigned long long sendFailed;	/* Dropped: ZCO read or sendto error,
+					   or shared-memory ring full */
+	unsigned long long sent;
+	unsigned long long bytesSent;
+	unsigned long long segmented;	/* Sent as segments */
+	unsigned long long segmentsSent;
+	unsigned long long datagramsSent;
+	unsigned long long aggregated;	/* Sent in aggregate frames */
+	unsigned long long aggregates;	/* Aggregate frames sent */
+} DelayCloStats;
+
+/* The CLO is a three-stage pipeline.  The dequeue thread reads each
+ * bundle's length and identity from the SDR and passes it through the
+ * schedule stage to the release thread, which alone owns the deadline
+ * queue.  Due bundles pass through the transmit stage to one or more
+ * transmit threads, which copy them out of the SDR and send them, so
+ * a slow SDR read delays only its own bundle.  With no transmit
+ * threads the release thread sends bundles itself. */
+#ifndef DELAY_TRANSMIT_THREADS
+#define DELAY_TRANSMIT_THREADS	2
+#endif
+
+#define DELAY_MAX_TRANSMIT_THREADS 16
+
+#ifndef DELAY_STAGE_CAPACITY
+#define DELAY_STAGE_CAPACITY	256
+#endif
+
+typedef struct delayclo_str	DelayClo;
+
+typedef struct {
+	DelayClo	*clo;
+	pthread_t	thread;
+	unsigned char	*buffer;	/* UDPCLA_BUFSZ transmit buffer */
+	DelayAggregate	*aggregate;	/* NULL unless DELAY_AGGREGATE */
+} DelayTransmitter;
+
+/* One CLO process can serve many outducts.  Each duct has its own
+ * dequeue thread, blocked in bpDequeue on the duct's semaphore, and its
+ * own destination and counters; the release thread, transmit threads,
+ * delay queue and socket are shared, so adding a duct adds one idle
+ * thread and nothing to the release path. */
+#ifndef DELAY_MAX_CLO_DUCTS
+#define DELAY_MAX_CLO_DUCTS	64
+#endif
+
+struct delayclo_duct_str {
+	DelayClo	*clo;
+	VOutduct	*vduct;
+	char		*ductName;
+	struct sockaddr_storage socketName; /* Destination */
+	DelayShmRing	*ring;		/* shm: duct, else NULL */
+	unsigned char	*buffer;	/* Netem offload: the dequeue thread
+					   sends from it */
+	pthread_t	dequeueThread;
+	int		threadStarted;
+	DelayCloStats	stats;
+};
+
+struct delayclo_str {
+	DelayModel	*model;
+	DelayQueue	queue;		/* Owned by the release thread */
+	int		ductSocket;
+	struct sockaddr_storage socketName; /* Destination of bundles with
+					   no duct */
+	unsigned char	*buffer;	/* Release thread's transmit buffer */
+	DelayAggregate	*aggregate;	/* Release thread's; NULL unless
+					   DELAY_AGGREGATE */
+	volatile int	running;
+	DelayCloStats	stats;
+	int		releaseMode;	/* DELAY_RELEASE_... */
+	int		timerFd;	/* timerfd and txtime modes */
+	int		wakeFd;		/* eventfd: earlier bundle queued */
+	long long	armedUsec;	/* Release time the timer is armed for */
+	DelayRealtime	rt;
+	DelayStage	scheduleStage;	/* Dequeue -> release thread */
+	DelayStage	transmitStage;	/* Release -> transmit threads */
+	int		transmitThreads;
+	DelayTransmitter transmitters[DELAY_MAX_TRANSMIT_THREADS];
+	pthread_t	releaseThread;
+	int		started;	/* Release and transmit threads */
+	DelayCloDuct	*ducts;
+	int		ductCount;
+	unsigned int	segmentTag;	/* Last segmented bundle's tag */
+	DelayHandoff	handoff;
+	DelayNetem	netem;
+};
+
+/* Reads length and identity of a ZCO dequeued from duct (NULL: send to
+ * clo->socketName) and passes it to the release thread, waiting while
+ * the schedule stage is full.  The release thread destroys the ZCO if
+ * the delay queue is full.  Returns 0 on success, or when the CLO is
+ * stopping (the ZCO is destroyed), -1 on system failure. */
+extern int	delayCloEnqueue(DelayClo *clo, DelayCloDuct *duct,
+			Object bundleZco, BpAncillaryData *ancillaryData);
+
+/* Moves newly dequeued bundles into the delay queue, then transmits
+ * (or drops) every bundle that is due, or hands it to the transmit
+ * threads.  Called by the release thread only. */
+extern void	delayCloRelease(DelayClo *clo);
+
+/* Sets up the pipeline stages for the given number of transmit threads
+ * (0 .. DELAY_MAX_TRANSMIT_THREADS).  Returns 0, or -1 on failure. */
+extern int	initDelayCloPipeline(DelayClo *clo, int transmitThreads);
+
+/* Destroys the ZCOs of bundles still in the pipeline stages */
+extern void	closeDelayCloPipeline(DelayClo *clo);
+
+/* Starts the release and transmit threads.  stopDelayClo clears
+ * clo->running and waits for them; transmit threads first send the
+ * bundles already handed to them. */
+extern int	startDelayClo(DelayClo *clo);
+extern void	stopDelayClo(DelayClo *clo);
+
+/* Sets up the release mode once clo->ductSocket is open.  Falls back
+ * to polling, with a memo, where the mode isn't supported.  Returns 0,
+ * or -1 on system failure. */
+extern int	initDelayCloRelease(DelayClo *clo, int releaseMode);
+extern void	closeDelayCloRelease(DelayClo *clo);
+
+/* Release thread: calls delayCloRelease whenever bundles are due, until
+ * clo->running is cleared, then closes the schedule stage.  The
+ * argument is the DelayClo. */
+extern void	*delayCloMonitor(void *clo);
+
+/* Writes the CLO counters to the log, per duct when there are several */
+extern void	delayCloReport(DelayClo *clo);
+
+/* Dequeue loop: takes bundles from the duct's outduct and queues them
+ * until the duct is closed or clo->running is cleared.  Returns 0 on
+ * normal stop, -1 on failure. */
+extern int	delayCloServe(DelayClo *clo, DelayCloDuct *duct);
+
+/* Live handoff (HANDOFF=1).  listenDelayCloHandoff starts a thread
+ * that waits for a new instance, then ends every duct so the daemon
+ * stops as it would at shutdown, with clo->handoff.requested set.
+ * Once stopDelayClo has returned, delayCloHandOff sends the socket and
+ * every queued bundle.  In the new instance, with clo->handoff
+ * connected, delayCloTakeOver replaces startDelayClo: it adopts the
+ * socket, reopens the ducts, starts the threads and queues the bundles
+ * handed over.  Each returns 0, or -1 on failure. */
+extern int	listenDelayCloHandoff(DelayClo *clo);
+extern void	closeDelayCloHandoff(DelayClo *clo);
+extern int	delayCloHandOff(DelayClo *clo);
+extern int	delayCloTakeOver(DelayClo *clo);
+
+/* Netem offload (NETEM=1).  Once clo->ductSocket is open, installs
+ * netem on ifName and binds the socket to it, if the model's delay is
+ * constant and no duct is shared-memory; otherwise, or if the kernel
+ * refuses, the CLO keeps its delay queue, with a memo.  Offloaded,
+ * delayCloEnqueue sends each bundle at once from the caller's thread
+ * (the duct's buffer, or clo->buffer for bundles with no duct) and
+ * startDelayClo isn't needed.  closeDelayCloNetem leaves the qdisc in
+ * place for an instance taking over.  Returns 0, or -1 on system
+ * failure. */
+extern int	initDelayCloNetem(DelayClo *clo, char *ifName);
+extern void	closeDelayCloNetem(DelayClo *clo);
+
+/* Complete outduct daemon: attaches to BP, runs until stopped */
+extern int	udpDelayClo(DelayModel *model, char *ductName);
+
+/* Same, serving ductCount (1 .. DELAY_MAX_CLO_DUCTS) outducts with one
+ * release thread, transmit pool and socket.  Each outduct's CLO command
+ * should then be omitted from the bpadmin configuration. */
+extern int	udpDelayCloDucts(DelayModel *model, int ductCount,
+			char **ductNames);
+
+/* In-queue compression - enabled at compile time with COMPRESS=1.  The
+ * CLI release thread compresses each bundle as it files it, with an
+ * in-tree LZ4-format block codec, keeping it only if it saves at least
+ * an eighth, and the thread that acquires it expands it after its
+ * delay.  The receive thread is left within its budget.  Bundles that
+ * don't compress make the release thread skip the next 1, 2, 4 ..
+ * DELAY_COMPRESS_MAX_BACKOFF bundles before trying again, so
+ * incompressible traffic costs it almost nothing. */
+#ifndef DELAY_COMPRESS
+#define DELAY_COMPRESS		0
+#endif
+
+#define DELAY_COMPRESS_MIN_BYTES 256	/* Smaller bundles are stored raw */
+#ifndef DELAY_COMPRESS_MAX_BYTES
+#define DELAY_COMPRESS_MAX_BYTES 65536	/* And so are larger ones */
+#endif
+#define DELAY_COMPRESS_MAX_BACKOFF 64
+#ifndef DELAY_COMPRESS_MIN_HOLD_MSEC
+#define DELAY_COMPRESS_MIN_HOLD_MSEC 1000 /* Bundles due sooner stay raw */
+#endif
+#define DELAY_COMPRESS_HASH_BITS 12
+
+/* Compresses length bytes into at most capacity bytes of LZ4 block
+ * format, using table (1 << DELAY_COMPRESS_HASH_BITS entries) as
+ * scratch.  Returns the compressed length, or 0 if it doesn't fit. */
+extern int	delayCompress(unsigned char *from, int length,
+			unsigned char *into, int capacity, unsigned int *table);
+
+/* Expands an LZ4 block.  Returns the expanded length, or -1 if the
+ * block is malformed or would overflow capacity. */
+extern int	delayExpand(unsigned char *from, int length,
+			unsigned char *into, int capacity);
+
+typedef struct {
+	unsigned long long tried;
+	unsigned long long compressed;	/* Kept compressed */
+	unsigned long long bypassed;	/* Skipped after a failure */
+	unsigned long long rawBytes;	/* Of bundles kept compressed */
+	unsigned long long packedBytes;
+	unsigned long long compressNsec; /* All tries */
+	unsigned long long expanded;
+	unsigned long long expandNsec;
+	unsigned long long expandFailed; /* Dropped: corrupt block */
+	long long	heldSaving;	/* Bytes saved by queued bundles */
+	long long	maxHeldSaving;
+} DelayCompressStats;
+
+/* Receive thread's compression state */
+typedef struct {
+	unsigned int	*table;		/* NULL: not compressing */
+	unsigned char	*scratch;	/* DELAY_COMPRESS_MAX_BYTES */
+	int		skip;		/* Bundles left to bypass */
+	int		backoff;	/* Skip after the next failure */
+	DelayCompressStats stats;
+} DelayCompressor;
+
+/* Input (CLI) engine.  The receive thread only reads, timestamps and
+ * copies datagrams, and hands them through the schedule stage to the
+ * release thread, which owns the delay queue and acquires due bundles
+ * into ION.  The receive thread never waits for the release thread: a
+ * datagram that finds the stage full is dropped and counted. */
+
+/* Receive thread's budget per datagram, from the end of the receive
+ * to the handoff; longer turns are counted as overruns */
+#ifndef DELAY_RECEIVE_BUDGET_USEC
+#define DELAY_RECEIVE_BUDGET_USEC	50
+#endif
+
+typedef struct {
+	unsigned long long received;
+	unsigned long long bytesReceived;
+	unsigned long long queueFull;	/* Dropped: delay queue full */
+	unsigned long long stageFull;	/* Dropped: schedule stage full */
+	unsigned long long expired;	/* Dropped: lifetime ends in delay */
+	unsigned long long duplicates;	/* Dropped: copy already queued */
+	unsigned long long linkLoss;	/* Dropped: simulated link loss */
+	unsigned long long acqFailed;	/* Dropped: acquisition error */
+	unsigned long long coldUnreadable; /* Dropped: cold tier unreadable */
+	unsigned long long acquired;
+	unsigned long long budgetOverruns; /* Receive turns over budget */
+	unsigned long long maxReceiveNsec; /* Longest receive turn */
+	unsigned long long segments;	/* Segments received */
+	unsigned long long reassembled;	/* Bundles reassembled */
+	unsigned long long segmentsRefused; /* Dropped: no reassembly room */
+	unsigned long long reassemblyTimeouts; /* Dropped: incomplete */
+	unsigned long long badFrames;	/* Dropped: malformed frame */
+	unsigned long long datagrams;	/* Datagrams received */
+	unsigned long long aggregates;	/* Aggregate frames unpacked */
+	unsigned long long aggregatesRefused; /* Dropped: not aggregating */
+} DelayCliStats;
+
+/* Due bundles are acquired by a pool of workers, each with its own
+ * ION acquisition work area, so that acquisition isn't limited to one
+ * core.  With DELAY_ACQ_ORDERED each source's bundles always go to the
+ * same worker and stay in order; otherwise each bundle goes to the
+ * least busy worker.  With no workers the release thread acquires. */
+#ifndef DELAY_ACQ_WORKERS
+#define DELAY_ACQ_WORKERS	1
+#endif
+
+#ifndef DELAY_ACQ_ORDERED
+#define DELAY_ACQ_ORDERED	0
+#endif
+
+#define DELAY_MAX_ACQ_WORKERS	16
+
+typedef struct delaycli_str	DelayCli;
+
+/* A segmented bundle being reassembled; free when data is NULL */
+typedef struct {
+	DelayCliDuct	*induct;
+	struct sockaddr_storage fromAddr;
+	unsigned int	bundleTag;
+	unsigned int	bundleLength;
+	unsigned int	count;		/* Segments */
+	unsigned int	segmentBytes;	/* Payload of all but the last */
+	unsigned int	received;
+	unsigned char	*seen;		/* One bit per segment */
+	char		*data;
+	struct timeval	firstArrival;	/* Sets the release time */
+} DelayReassembly;
+
+/* Per-source delay and loss.  A CLI that hears many emulated
+ * spacecraft can give each sender its own delay and loss, read at
+ * startup from the file named by UDPDELAY_SOURCES or, failing that,
+ * <daemon name>.sources in the working directory.  Each line is
+ *	<address>[:<port>] <delay sec | model[+|-<sec>]> [<loss %>]
+ * where "model" is the daemon's model, optionally offset, and a
+ * source without a port matches every port at that address.  Loss
+ * defaults to the induct's.  The table is an open-addressing hash
+ * (linear probing, at most half full) built once at startup and read
+ * without locks, so looking up each datagram's sender allocates
+ * nothing; each source keeps its own counters. */
+#ifndef DELAY_MAX_SOURCES
+#define DELAY_MAX_SOURCES	65536
+#endif
+
+#define DELAY_SOURCES_ENV	"UDPDELAY_SOURCES"
+#define DELAY_SOURCE_REPORT_LIMIT 32	/* Sources listed at shutdown */
+
+struct delay_source_str {
+	struct sockaddr_in6 addr;	/* IPv4 as v4-mapped; port 0: any */
+	int		inUse;
+	int		useModel;	/* Delay is the model's plus offset */
+	double		delaySeconds;	/* Fixed delay, or the offset */
+	double		lossPercentage;	/* < 0: the induct's */
+	DelayCliStats	stats;
+};
+
+typedef struct {
+	DelaySource	*slots;		/* NULL: no table */
+	unsigned int	mask;		/* Slot count - 1, a power of two */
+	unsigned int	count;
+	int		anyPort;	/* Some source has no port */
+	unsigned long long unlisted;	/* Datagrams from other senders */
+} DelaySourceTable;
+
+/* Reads a source table into an empty table.  Returns the number of
+ * sources, or -1 if the file can't be read or has a bad line. */
+extern int	loadDelaySources(DelaySourceTable *table, char *fileName);
+
+/* The entry for a sender (exact port first, then any port), or NULL.
+ * Safe from any thread once loaded. */
+extern DelaySource *findDelaySource(DelaySourceTable *table,
+			struct sockaddr_storage *fromAddr);
+
+extern void	freeDelaySources(DelaySourceTable *table);
+
+/* Duplicate suppression - enabled at compile time with DEDUP=1.  The
+ * receive thread remembers each bundle it queues, by a 64-bit hash of
+ * its primary-block identity, until the bundle's release time, and
+ * drops copies that arrive in the meantime.  The table is sized from
+ * the delay queue, never grows, and is used by the receive thread
+ * only. */
+#ifndef DELAY_DEDUP
+#define DELAY_DEDUP 0
+#endif
+
+/* Slots checked for expired entries at each insertion */
+#define DELAY_DEDUP_SWEEP	4
+
+typedef struct {
+	uint64_t	key;		/* Identity hash; 0 = empty */
+	unsigned long long releaseUsec;	/* Entry expires then */
+} DelayDedupEntry;
+
+typedef struct {
+	DelayDedupEntry	*slots;		/* NULL: not suppressing */
+	unsigned int	mask;		/* Slot count - 1, a power of two */
+	unsigned int	count;
+	unsigned int	sweep;		/* Next slot checked for expiry */
+	unsigned long long unremembered; /* Queued while table was full */
+} DelayDedupIndex;
+
+/* Tiered delay queue - enabled at compile time with TIER=1.  A bundle
+ * due more than DELAY_TIER_HORIZON_SEC after it reaches the release
+ * thread is handed to the tier thread, which writes its data to a
+ * cold-tier file and frees it, keeping only its descriptor in a cold
+ * index ordered by release time.  DELAY_TIER_LEAD_SEC before the bundle
+ * is due the tier thread reads it back and hands it to the release
+ * thread, so a release never waits on the disk.  The files are
+ * segments of DELAY_TIER_SEGMENT_BYTES, created unlinked in the
+ * directory named by UDPDELAY_TIER_DIR or DELAY_TIER_DIR; a segment's
+ * space is returned once its last bundle is promoted.  Bundles the
+ * tier can't take (index or segments full, write error) stay in RAM. */
+#ifndef DELAY_TIER
+#define DELAY_TIER		0
+#endif
+
+#ifndef DELAY_TIER_HORIZON_SEC
+#define DELAY_TIER_HORIZON_SEC	60
+#endif
+
+#ifndef DELAY_TIER_LEAD_SEC
+#define DELAY_TIER_LEAD_SEC	10
+#endif
+
+#ifndef DELAY_TIER_CAPACITY
+#define DELAY_TIER_CAPACITY	0	/* Cold bundles, 0: the queue's */
+#endif
+
+#ifndef DELAY_TIER_SEGMENT_BYTES
+#define DELAY_TIER_SEGMENT_BYTES (64 * 1024 * 1024)
+#endif
+
+#define DELAY_TIER_SEGMENTS	64
+
+#ifndef DELAY_TIER_DIR
+#define DELAY_TIER_DIR		"/var/tmp"
+#endif
+
+#define DELAY_TIER_DIR_ENV	"UDPDELAY_TIER_DIR"
+
+typedef struct {
+	int		fd;		/* -1: unused */
+	unsigned int	length;		/* Written so far */
+	unsigned int	live;		/* Bundles not yet promoted */
+} DelayTierSegment;
+
+typedef struct {
+	unsigned long long spilled;	/* Moved to the cold tier */
+	unsigned long long spilledBytes;
+	unsigned long long keptHot;	/* Due beyond the horizon, kept in RAM */
+	unsigned long long promoted;
+	unsigned long long readFailed;	/* Dropped: cold data unreadable */
+	unsigned long long writeNsec;
+	unsigned long long readNsec;
+	unsigned long long latenessUsec; /* Promotion past its time, summed */
+	unsigned long long maxLatenessUsec;
+	unsigned long long pastDeadline; /* Promoted after release time */
+	long long	minMarginUsec;	/* Least time to spare at promotion */
+	unsigned long long coldBytes;	/* In the segments, live */
+	unsigned long long maxColdBytes;
+	int		highWater;	/* Cold bundles */
+} DelayTierStats;
+
+typedef struct {
+	long long	horizonUsec;	/* 0: no cold tier */
+	DelayQueue	cold;		/* Tier thread only; data NULL */
+	DelayStage	spillStage;	/* Release -> tier thread */
+	DelayStage	promoteStage;	/* Tier -> release thread */
+	DelayTierSegment segments[DELAY_TIER_SEGMENTS];
+	int		current;	/* Segment being written, or -1 */
+	char		*dirName;
+	pthread_t	thread;
+	int		threadStarted;
+	DelayTierStats	stats;
+} DelayTier;
+
+/* One CLI process can serve many inducts, each with its own socket
+ * and, optionally, its own fixed delay and loss.  One receive thread
+ * waits on all the sockets with epoll (select where there is none) and
+ * reads only those that are ready; the release thread, acquisition
+ * workers and delay queue are shared.  Each induct has a work area for
+ * each thread that acquires its bundles. */
+#ifndef DELAY_MAX_CLI_DUCTS
+#define DELAY_MAX_CLI_DUCTS	64
+#endif
+
+struct delaycli_duct_str {
+	DelayCli	*cli;
+	VInduct		*vduct;
+	char		*ductName;
+	int		ductSocket;	/* -1 for a shm: induct */
+	DelayShmRing	*ring;		/* shm: induct, else NULL */
+	int		closed;		/* Stop datagram received */
+	double		fixedDelay;	/* Seconds; < 0: the daemon's model */
+	double		lossPercentage;
+	AcqWorkArea	*work[DELAY_MAX_ACQ_WORKERS + 1]; /* Release thread,
+					   then each worker */
+	DelayCliStats	stats;
+};
+
+typedef struct {
+	DelayCli	*cli;
+	int		index;
+	pthread_t	thread;
+	AcqWorkArea	*work;		/* For bundles with no induct */
+	DelayStage	stage;		/* Due bundles for this worker */
+	unsigned long long acquired;
+} DelayAcqWorker;
+
+struct delaycli_str {
+	DelayModel	*model;
+	DelayQueue	queue;		/* Owned by the release thread */
+	int		ductSocket;	/* Socket when there are no inducts */
+	AcqWorkArea	*work;		/* Release thread's work area */
+	char		*buffer;	/* UDPCLA_BUFSZ receive buffer */
+	volatile int	running;
+	DelayCliStats	stats;
+	DelayStage	scheduleStage;	/* Receive -> release thread */
+	pthread_t	releaseThread;
+	DelayRealtime	rt;
+	int		acqWorkers;
+	int		acqOrdered;	/* Keep each source's bundles in order */
+	DelayAcqWorker	workers[DELAY_MAX_ACQ_WORKERS];
+	DelayCliDuct	*ducts;
+	int		ductCount;
+	DelayReassembly	reassembly[DELAY_REASSEMBLY_SLOTS]; /* Receive
+					   thread only */
+	unsigned long	reassemblyBytes;
+	DelaySourceTable sources;	/* Per-sender delay and loss */
+	DelayDedupIndex	dedup;		/* Receive thread only */
+	DelayCompressor	compressor;
+	DelayTier	tier;
+	DelayHandoff	handoff;
+};
+
+/* Copies a datagram received on induct (NULL: cli->ductSocket),
+ * timestamps it and passes it to the release thread without waiting.
+ * Returns 0 on success, -1 if the schedule stage is full or out of
+ * memory. */
+extern int	delayCliEnqueue(DelayCli *cli, DelayCliDuct *induct,
+			char *data, int length,
+			struct sockaddr_storage *fromAddr);
+
+/* Moves newly received bundles into the delay queue, then hands every
+ * bundle that is due to ION (or drops it), or to an acquisition
+ * worker.  Called by the release thread only. */
+extern void	delayCliRelease(DelayCli *cli);
+
+/* Sets up the schedule stage, the cold tier (with TIER=1) and the
+ * given number of acquisition workers (0 .. DELAY_MAX_ACQ_WORKERS),
+ * each with a work area for vduct, or none if vduct is NULL.  Returns
+ * 0, or -1 on failure. */
+extern int	initDelayCliPipeline(DelayCli *cli, VInduct *vduct,
+			int acqWorkers);
+
+/* Gets the induct's work areas once the pipeline is set up, and
+ * releases them.  Returns 0, or -1 on failure. */
+extern int	openDelayCliDuct(DelayCli *cli, DelayCliDuct *induct);
+extern void	closeDelayCliDuct(DelayCliDuct *induct);
+
+/* Frees bundles still in the pipeline stages and the workers' work
+ * areas */
+extern void	closeDelayCliPipeline(DelayCli *cli);
+
+/* Release thread: calls delayCliRelease as bundles arrive and fall
+ * due, until cli->running is cleared.  The argument is the DelayCli. */
+extern void	*delayCliMonitor(void *cli);
+
+/* Starts the release, acquisition and tier threads.  stopDelayCli
+ * clears cli->running and waits for them; workers first acquire the
+ * bundles already handed to them. */
+extern int	startDelayCli(DelayCli *cli);
+extern void	stopDelayCli(DelayCli *cli);
+
+/* Receive loop on every induct's socket, or on cli->ductSocket if
+ * there are none: queues datagrams until cli->running is cleared or
+ * every induct has received its stop datagram.  Returns 0 on normal
+ * stop, -1 on socket failure. */
+extern int	delayCliServe(DelayCli *cli);
+
+/* Writes the CLI counters to the log, per induct when there are several */
+extern void	delayCliReport(DelayCli *cli);
+
+/* Live handoff (HANDOFF=1), as for the CLO.  The handoff thread stops
+ * the receive loop; delayCliHandOff sends the induct sockets (or
+ * cli->ductSocket) and cold-tier segments, then every bundle held, and
+ * delayCliTakeOver adopts them in place of startDelayCli.  Datagrams
+ * that reach a socket meanwhile wait in it for the new instance; a
+ * segmented bundle still being reassembled is lost. */
+extern int	listenDelayCliHandoff(DelayCli *cli);
+extern void	closeDelayCliHandoff(DelayCli *cli);
+extern int	delayCliHandOff(DelayCli *cli);
+extern int	delayCliTakeOver(DelayCli *cli);
+
+/* Complete induct daemon: attaches to BP, runs until stopped.  An
+ * endpoint spec may end in @<delay sec>[/<loss %>] to give that induct
+ * a fixed delay and loss instead of the daemon's model. */
+extern int	udpDelayCli(DelayModel *model, char *endpointSpec);
+
+/* Same, serving ductCount (1 .. DELAY_MAX_CLI_DUCTS) inducts with one
+ * receive thread, release thread and worker pool */
+extern int	udpDelayCliDucts(DelayModel *model, int ductCount,
+			char **endpointSpecs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _UDPDELAY_H_ */
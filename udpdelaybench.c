@@ -0,0 +1,4081 @@
+/*
+	udpdelaybench.c:	benchmarks for the UDP delay convergence-layer
+				engine, linked against the ION stub (ionstub.c)
+				so that no ION installation is needed.
+
+	Usage: udpdelaybench [pipeline] [-n <bundles>] [-s <bundle size>]
+	       udpdelaybench queue [-d <max depth>] [-p <pattern>]
+	       udpdelaybench loopback [-n <bundles>] [-s <bundle size>]
+			[-r <bundles/sec>] [-D <CLO delay>] [-C <CLI delay>]
+			[-L <loss %>] [-Q <queue capacity>] [-m <release mode>]
+			[-T <transmit threads>] [-w <acquisition workers>]
+			[-X udp|udp6|shm]
+	       udpdelaybench soak [-t <virtual seconds>[m|h|d]]
+			[-x <acceleration>] [-i <sample interval>]
+			[-r <bundles/sec>] [-D <CLO delay>] [-C <CLI delay>]
+			[-L <loss %>] [-Q <queue capacity>] [-s <bundle size>]
+			[-T <transmit threads>] [-w <acquisition workers>]
+			[-X udp|udp6|shm]
+	       udpdelaybench acquire [-w <max workers>] [-n <bundles>]
+			[-s <bundle size>] [-u <sources>] [-o]
+	       udpdelaybench jitter [-m poll|timerfd|txtime|all]
+			[-n <bundles>] [-r <bundles/sec>] [-D <delay>]
+			[-c <CPU spinners>] [-M <memory hogs>]
+			[-S <SDR storm threads>] [-P <RT priority>]
+			[-A <release core>] [-K] [-W <spin usec>] [-R]
+			[-T <transmit threads>]
+	       udpdelaybench ducts [-k <max ducts>] [-n <bundles>]
+			[-r <bundles/sec>] [-D <delay>] [-Q <queue capacity>]
+			[-m <release mode>] [-T <transmit threads>]
+	       udpdelaybench inducts [-k <max inducts>] [-n <bundles>]
+			[-r <bundles/sec>] [-C <delay>] [-Q <queue capacity>]
+			[-w <acquisition workers>]
+	       udpdelaybench priority [-n <bundles>]
+	       udpdelaybench sources [-u <max sources>] [-n <lookups>]
+	       udpdelaybench expire [-n <bundles>] [-r <bundles/sec>]
+			[-D <CLO delay>] [-C <CLI delay>]
+	       udpdelaybench dedup [-n <bundles>] [-s <bundle size>]
+	       udpdelaybench compress [-n <bundles>] [-s <bundle size>]
+	       udpdelaybench tier [-n <bundles>] [-s <bundle size>]
+			[-r <bundles/sec>] [-D <delay>] [-x <acceleration>]
+	       udpdelaybench handoff [-n <bundles>] [-r <bundles/sec>]
+			[-D <CLO delay>] [-C <CLI delay>] [-m <release mode>]
+			[-T <transmit threads>] [-w <acquisition workers>]
+	       udpdelaybench netem [-I <interface>] [-n <bundles>]
+			[-r <bundles/sec>] [-D <delay>] [-L <loss %>]
+			[-Q <queue capacity>] [-m <release mode>]
+			[-T <transmit threads>]
+	       udpdelaybench sendfail [-n <bundles>]
+
+	pipeline	Drives synthetic bundles through the CLO path
+			(bpDequeue, delayCloEnqueue, delayCloRelease, UDP send
+			to a local socket) and the CLI path (delayCliEnqueue,
+			delayCliRelease, acquisition) with zero delay, and
+			reports throughput and the per-stage profile.
+
+	queue		Measures insert, next-deadline and release-batch costs
+			of the delay queue at depths 10^2 .. max depth
+			(default 10^7) for constant (preset), slowly varying
+			(Mars) and jittered delays, in steady state on a
+			virtual clock.  Results are written to stdout as JSON.
+
+	loopback	Runs a delay CLO and a delay CLI against each other
+			over 127.0.0.1, using the daemons' own release and
+			receive loops, with synthetic bundles offered at the
+			given rate (default 1000/s).  Reports delivered
+			bundles/s and bytes/s, drops by cause, and emulated
+			end-to-end delay against the configured delay.
+			Bundles over 64 KB are sent in segments and
+			reassembled by the CLI.  -X udp6 runs over ::1 with
+			dual-stack sockets, as do the other UDP modes given
+			it; -X shm connects them through a shared-memory ring
+			instead.
+
+	soak		Runs the loopback CLO, fed by the daemon's own dequeue
+			loop, and CLI for a long virtual duration (default 1
+			day) on a clock running <acceleration> times faster
+			than real time (default 1000), with a 750 s delay and
+			5% link loss unless -D or -L is given.  Samples
+			RSS, simulated SDR occupancy, bundles held for
+			stewardship, live ZCOs, ION and malloc allocator use
+			and queue depths, and fails (exit status 1) if any of
+			them keeps growing after warm-up.
+
+	acquire		Measures CLI acquisition throughput with 1 .. max
+			workers (default 8), bundles coming from <sources>
+			source ports in turn, and how evenly the workers
+			share them.  -o keeps each source's bundles on one
+			worker, in order.
+
+	jitter		Runs the CLO release path in each release mode while
+			background threads spin on the CPU, stream memory or
+			hammer SDR transactions, and reports the lateness of
+			each datagram's arrival at a local receiver against
+			its release time.  -P runs the release and transmit
+			threads at the given SCHED_FIFO priority, -A pins the
+			release thread to a core, -K locks memory and -W
+			spins through the last <spin usec> before each
+			release.  -R runs each of these alone (defaults
+			core 0, priority 50, 100 usec) and then all
+			together, one lateness line per setting.
+
+	ducts		Serves 1, 2, 4 .. max (default 16) outducts, each with
+			its own dequeue thread, from one CLO per duct and
+			from one shared CLO, and reports for each the CPU
+			time per bundle sent, then the thread count and CPU
+			use once idle.
+
+	inducts		Serves 1, 2, 4 .. max (default 16) inducts from one CLI
+			per induct and from one shared CLI, whose single
+			receive thread waits on all sockets with epoll,
+			sends bundles to each induct in turn and reports the
+			same figures.
+
+	priority	Queues a backlog of bundles (default 10000) that all
+			fall due at once, as when a contact opens, 10%
+			expedited (random ordinals), 20% standard and 70%
+			bulk, and releases it over an emulated link taking
+			10 usec per bundle.  Reports each class's mean
+			lateness in plain deadline order and in class order,
+			and fails if class order ever releases a bundle
+			ahead of a higher-ranked one.
+
+	sources		Loads per-source tables of 16, 256 .. max (default
+			4096) IPv4 and IPv6 sources, some without a port,
+			times <lookups> (default 10^6) lookups of listed and
+			unlisted senders, then enqueues one bundle from each
+			source and checks its delay and the source's
+			counters.  Fails if a lookup allocates memory or
+			any bundle or counter is wrong.
+
+	expire		Times decoding a bundle's expiration from its primary
+			block, then offers bundles (default 3000) through the
+			loopback CLO and CLI (CLI delay defaults to the CLO
+			delay) with lifetimes ending in turn within the CLO's
+			delay, within the CLI's, and after both.  Fails if
+			any bundle is not dropped by the daemon it expires
+			in, or delivered otherwise, or if a ZCO is left.
+
+	dedup		Needs DEDUP=1.  Sends bundles (default 10^5) to a CLI
+			over 100 virtual seconds with a 10 s delay, two
+			thirds of them again 0.1 s later and a third a
+			third time 1 s later, then the first 1000 again
+			long after their release.  Reports the cost per
+			datagram and fails unless exactly the copies sent
+			while the original was queued are dropped.
+
+	compress	Needs COMPRESS=1.  Queues bundles (default 20000) in
+			a CLI with compression off, then on, for stub fill,
+			CSV telemetry and random payloads, then releases them
+			together.  Reports the cost per bundle of enqueueing,
+			scheduling (where compression runs) and releasing,
+			the enqueues over the receive thread's budget, the
+			compression ratio, bundles compressed and bypassed
+			and the memory the queue held, and fails if any
+			bundle is lost or acquired with the wrong length.
+
+	tier		Needs TIER=1.  Offers bundles (default 30000, 50 a
+			second) to a CLI running its own threads, with a
+			1200 s delay on a clock running <acceleration> times
+			faster than real time (default 100), with the cold
+			tier on, then off.  Reports the peak memory held by
+			bundles and the peak RSS growth, bundles spilled and
+			promoted, promotion lateness and margin and release
+			lateness, and fails if a bundle is lost or promoted
+			after its release time.
+
+	handoff		Runs the loopback CLO and CLI (default 6000 bundles
+			at 1000/s, CLI delay defaulting to the CLO delay);
+			a third of the way in the CLI hands its socket and
+			queue over to a new CLI instance, two thirds in the
+			CLO does, as a new binary would take over.  Reports
+			for each the bundles handed over, the time to stream
+			them, the release gap (old release thread's last
+			pass to the new one's start), the bundles that were
+			due before they arrived and how late, the longest
+			pause in acquisitions and the delay error overall,
+			and fails if any bundle is lost.
+
+	netem		Offers bundles (default 20000 at 2000/s, 5 s delay)
+			to a constant-delay CLO sending to a local receiver,
+			first with netem on <interface> holding the
+			datagrams (skipped without -I; needs CAP_NET_ADMIN
+			and sch_netem), then with the CLO's own delay queue.
+			Reports for each the CPU time, the peak memory held
+			in ZCOs and in the qdisc, the RSS growth and the
+			delay error.  The qdisc delays everything else on the
+			interface too, so give it lo in a network namespace
+			of its own: unshare -rn sh -c 'ip link set lo up &&
+			./udpdelaybench netem -I lo'.
+
+	sendfail	Offers bundles (default 1000 per case) to a CLO whose
+			every send fails: datagrams refused, ZCOs unreadable,
+			for small, large and segmented bundles and over a
+			shared-memory ring.  Fails unless each bundle is
+			counted as a send failure and no ZCO is left.
+
+	-T sets the number of CLO transmit threads (default
+	DELAY_TRANSMIT_THREADS; 0 = the release thread sends), -w the
+	number of CLI acquisition workers (default DELAY_ACQ_WORKERS; 0 =
+	the release thread acquires).
+
+	Synthetic ION costs are set with the STUB_* environment variables
+	described in ionstub.h.  Memos are suppressed unless STUB_QUIET=0.
+
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#include "udpdelay.h"
+#include <limits.h>
+#include <errno.h>
+#include <sched.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static double zeroDelay(void)
+{
+	return 0.0;
+}
+
+static DelayModel benchModel = { "udpdelaybench", "bench", zeroDelay, 0.0 };
+
+static double elapsedSeconds(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)
+			+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void printRate(char *path, unsigned long bundles, double bytes,
+		double seconds)
+{
+	printf("%-4s %10lu bundles in %7.3f s: %10.0f bundles/s, %8.1f MB/s, "
+			"%6.2f usec/bundle\n", path, bundles, seconds,
+			bundles / seconds, bytes / seconds / 1e6,
+			seconds * 1e6 / bundles);
+	fflush(stdout);
+}
+
+/* Address family of the benchmark sockets: IPv4, or IPv6 (-X udp6) */
+static int sinkFamily = AF_INET;
+
+/* Loopback address of sinkFamily with the given port */
+static void loopbackAddress(struct sockaddr_storage *name, int portNbr)
+{
+	memset(name, 0, sizeof(struct sockaddr_storage));
+	if (sinkFamily == AF_INET6) {
+		struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *) name;
+
+		inet6->sin6_family = AF_INET6;
+		inet6->sin6_addr = in6addr_loopback;
+		inet6->sin6_port = htons(portNbr);
+	} else {
+		struct sockaddr_in *inet = (struct sockaddr_in *) name;
+
+		inet->sin_family = AF_INET;
+		inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		inet->sin_port = htons(portNbr);
+	}
+}
+
+/* Local UDP socket that absorbs the CLO's transmissions */
+static int openSink(struct sockaddr_storage *sinkName)
+{
+	socklen_t nameLength;
+	int sink = openDelaySocket(sinkFamily);
+
+	if (sink < 0) {
+		putSysErrmsg("Can't open sink socket", NULL);
+		return -1;
+	}
+
+	loopbackAddress(sinkName, 0);
+	nameLength = delayAddressLength(sinkName);
+	if (bind(sink, (struct sockaddr *) sinkName, nameLength) < 0
+	|| getsockname(sink, (struct sockaddr *) sinkName, &nameLength) < 0) {
+		putSysErrmsg("Can't bind sink socket", NULL);
+		close(sink);
+		return -1;
+	}
+
+	return sink;
+}
+
+static int benchClo(unsigned long bundles)
+{
+	DelayClo clo;
+	VOutduct *vduct;
+	PsmAddress vductElt;
+	Object bundleZco;
+	BpAncillaryData ancillaryData;
+	struct sockaddr_storage sinkName;
+	struct timespec start;
+	double bytes = 0.0;
+	int sink;
+
+	findOutduct("udp", "127.0.0.1", &vduct, &vductElt);
+	sink = openSink(&sinkName);
+	if (sink < 0) {
+		return -1;
+	}
+
+	memset(&clo, 0, sizeof clo);
+	clo.model = &benchModel;
+	clo.running = 1;
+	memcpy(&clo.socketName, &sinkName, sizeof sinkName);
+	clo.ductSocket = openDelaySocket(sinkFamily);
+	clo.buffer = MTAKE(UDPCLA_BUFSZ);
+	if (clo.ductSocket < 0 || clo.buffer == NULL
+	|| initDelayQueue(&clo.queue, MAX_QUEUED_BUNDLES) < 0
+	|| initDelayCloRelease(&clo, DELAY_RELEASE_POLL) < 0
+	|| initDelayCloPipeline(&clo, 0) < 0) {
+		putErrmsg("Can't set up benchmark CLO.", NULL);
+		close(sink);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < bundles; i++) {
+		if (bpDequeue(vduct, &bundleZco, &ancillaryData, 0) < 0
+		|| bundleZco == 0) {
+			putErrmsg("Stub dequeue failed.", NULL);
+			break;
+		}
+
+		bytes += zco_length(getIonsdr(), bundleZco);
+		if (delayCloEnqueue(&clo, NULL, bundleZco, &ancillaryData) < 0) {
+			break;
+		}
+
+		/* Release in batches, as the monitor thread would */
+		if (clo.scheduleStage.count + clo.queue.count
+				>= clo.queue.capacity / 2) {
+			delayCloRelease(&clo);
+		}
+	}
+
+	delayCloRelease(&clo);
+	printRate("clo", bundles, bytes, elapsedSeconds(&start));
+	closeDelayCloPipeline(&clo);
+	destroyDelayQueue(&clo.queue);
+	MRELEASE(clo.buffer);
+	close(clo.ductSocket);
+	close(sink);
+	return 0;
+}
+
+static int benchCli(unsigned long bundles)
+{
+	DelayCli cli;
+	VInduct *vduct;
+	PsmAddress vductElt;
+	ZcoReader reader;
+	struct sockaddr_storage fromAddr;
+	struct timespec start;
+	Object bundleZco;
+	int length;
+
+	findInduct("udp", "127.0.0.1:4556", &vduct, &vductElt);
+	memset(&cli, 0, sizeof cli);
+	cli.model = &benchModel;
+	cli.running = 1;
+	cli.buffer = MTAKE(UDPCLA_BUFSZ);
+	cli.work = bpGetAcqArea(vduct);
+	if (cli.buffer == NULL || cli.work == NULL
+	|| initDelayQueue(&cli.queue, MAX_QUEUED_BUNDLES) < 0
+	|| initDelayCliPipeline(&cli, vduct, 0) < 0) {
+		putErrmsg("Can't set up benchmark CLI.", NULL);
+		return -1;
+	}
+
+	/* One synthetic datagram, received over and over */
+	bundleZco = ionStubCreateBundle();
+	zco_start_transmitting(bundleZco, &reader);
+	length = zco_transmit(getIonsdr(), &reader, zco_length(getIonsdr(),
+			bundleZco), cli.buffer);
+	if (sdr_begin_xn(getIonsdr())) {
+		zco_destroy(getIonsdr(), bundleZco);
+		oK(sdr_end_xn(getIonsdr()));
+	}
+
+	loopbackAddress(&fromAddr, BpUdpDefaultPortNbr);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < bundles; i++) {
+		if (delayCliEnqueue(&cli, NULL, cli.buffer, length,
+				&fromAddr) < 0) {
+			putErrmsg("Can't queue bundle.", NULL);
+			break;
+		}
+
+		if (cli.scheduleStage.count + cli.queue.count
+				>= cli.queue.capacity / 2) {
+			delayCliRelease(&cli);
+		}
+	}
+
+	delayCliRelease(&cli);
+	printRate("cli", bundles, (double) bundles * length,
+			elapsedSeconds(&start));
+	closeDelayCliPipeline(&cli);
+	destroyDelayQueue(&cli.queue);
+	bpReleaseAcqArea(cli.work);
+	MRELEASE(cli.buffer);
+	return 0;
+}
+
+static int benchPipeline(unsigned long bundles)
+{
+	printf("pipeline: %lu bundles of %u bytes, zero delay, queue capacity "
+			"%d\n", bundles, ionStub.bundleSize, MAX_QUEUED_BUNDLES);
+	if (benchClo(bundles) < 0 || benchCli(bundles) < 0) {
+		return -1;
+	}
+
+	ionStub.quiet = 0;
+	writeProfileReport();
+	ionStubReport();
+	return 0;
+}
+
+/*	*	*	Queue microbenchmark	*	*	*	*	*/
+
+#define VIRTUAL_EPOCH	1000000000	/* Virtual clock base, seconds */
+
+typedef struct {
+	char	*name;
+	double	(*delay)(double t);	/* Delay for an arrival at t */
+	double	meanDelay;
+} ArrivalPattern;
+
+static struct timeval virtualNow;
+static unsigned long long randomState = 0x9e3779b97f4a7c15ULL;
+
+static double random01(void)
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 7;
+	randomState ^= randomState << 17;
+	return (randomState >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double presetDelay(double t)
+{
+	return 10.0;
+}
+
+/* One-way light time drifting over the 780-day synodic period */
+static double marsDelay(double t)
+{
+	return 750.0 + 500.0 * sin(2.0 * M_PI * t / (780.0 * 86400.0));
+}
+
+static double jitterDelay(double t)
+{
+	return 10.0 + 5.0 * (2.0 * random01() - 1.0);
+}
+
+static ArrivalPattern patterns[] = {
+	{ "preset", presetDelay, 10.0 },
+	{ "mars", marsDelay, 750.0 },
+	{ "jitter", jitterDelay, 10.0 }
+};
+
+static void virtualTime(double t, struct timeval *tv)
+{
+	tv->tv_sec = VIRTUAL_EPOCH + (time_t) t;
+	tv->tv_usec = (suseconds_t) ((t - floor(t)) * 1e6);
+}
+
+static void virtualClock(struct timeval *now)
+{
+	*now = virtualNow;
+}
+
+static unsigned long long benchNsec(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+static void countRelease(DelayedBundle *bundle, void *arg)
+{
+	(*(unsigned long *) arg)++;
+}
+
+/* Queues an arrival at virtual time t, unless it would already be due
+ * at *due.  Returns the new depth, 0 if skipped, -1 if the queue is full. */
+static int arrive(DelayQueue *queue, ArrivalPattern *pattern, double t,
+		struct timeval *due)
+{
+	DelayedBundle bundle;
+
+	memset(&bundle, 0, sizeof bundle);
+	bundle.length = 1;
+	virtualTime(t + pattern->delay(t), &bundle.releaseTime);
+	if (due && !timercmp(&bundle.releaseTime, due, >)) {
+		return 0;
+	}
+
+	return insertDelayed(queue, &bundle);
+}
+
+static int benchQueueDepth(ArrivalPattern *pattern, int depth, int first)
+{
+	DelayQueue queue;
+	struct timeval deadline;
+	double interval = pattern->meanDelay / depth;
+	double t;
+	unsigned long long start, releaseNsec = 0, reinsertNsec = 0;
+	unsigned long inserted = 0, released = 0, reinserted = 0, peeks = 0;
+	unsigned long passes = 0;
+	int result;
+	unsigned long long insertNsec, peekNsec;
+	int batch = depth < 100 ? 1 : (depth < 100000 ? depth / 100 : 1000);
+	int i;
+
+	if (initDelayQueue(&queue, depth + depth / 4 + 1000) < 0) {
+		return -1;
+	}
+
+	/* Fill with the arrivals of the last 1.5 mean delays that are still
+	 * pending, which is the steady-state content of ~depth bundles */
+	t = 1.5 * depth * interval;
+	virtualTime(t, &virtualNow);
+	start = benchNsec();
+	for (i = 0; i < depth + depth / 2; i++) {
+		result = arrive(&queue, pattern, i * interval, &virtualNow);
+		if (result < 0) {
+			break;
+		}
+
+		if (result > 0) {
+			inserted++;
+		}
+	}
+
+	insertNsec = benchNsec() - start;
+
+	/* Next-deadline lookups */
+	start = benchNsec();
+	do {
+		nextDelayedDeadline(&queue, &deadline);
+		peeks++;
+	} while (peeks < 100000 && (peeks < 3
+			|| benchNsec() - start < 200000000ULL));
+	peekNsec = benchNsec() - start;
+
+	/* Steady state: advance one batch of arrivals, release what is due,
+	 * queue the new arrivals */
+	do {
+
+		t += batch * interval;
+		virtualTime(t, &virtualNow);
+		start = benchNsec();
+		releaseDelayed(&queue, &virtualNow, countRelease, &released);
+		releaseNsec += benchNsec() - start;
+		start = benchNsec();
+		for (i = 0; i < batch; i++) {
+			if (arrive(&queue, pattern, t - (batch - i) * interval,
+					NULL) < 0) {
+				break;
+			}
+
+			reinserted++;
+		}
+
+		reinsertNsec += benchNsec() - start;
+		passes++;
+	} while (passes < 1000 && (passes < 3 || releaseNsec < 500000000ULL));
+
+	printf("%s\n    {\"pattern\": \"%s\", \"target_depth\": %d, "
+			"\"depth\": %d, \"insert_ns\": %.1f, \"peek_ns\": %.1f, "
+			"\"release_batch\": %.1f, \"release_batch_ns\": %.1f, "
+			"\"release_ns_per_bundle\": %.1f, "
+			"\"steady_insert_ns\": %.1f, \"final_depth\": %d}",
+			first ? "" : ",", pattern->name, depth, (int) inserted,
+			inserted ? (double) insertNsec / inserted : 0.0,
+			(double) peekNsec / peeks,
+			(double) released / passes, (double) releaseNsec / passes,
+			released ? (double) releaseNsec / released : 0.0,
+			reinserted ? (double) reinsertNsec / reinserted : 0.0,
+			queue.count);
+	fflush(stdout);
+	destroyDelayQueue(&queue);
+	return 0;
+}
+
+static int benchQueue(int maxDepth, char *patternName)
+{
+	int first = 1;
+
+	setDelayClock(virtualClock);
+	printf("{\n  \"benchmark\": \"queue\",\n  \"queue\": \"%s\",\n"
+			"  \"profile\": %d,\n  \"entry_bytes\": %u,\n"
+			"  \"results\": [", delayQueueKind, DELAY_PROFILE,
+			(unsigned int) sizeof(DelayedBundle));
+	for (int p = 0; p < sizeof patterns / sizeof patterns[0]; p++) {
+		if (patternName && strcmp(patternName, patterns[p].name) != 0) {
+			continue;
+		}
+
+		for (long depth = 100; depth <= maxDepth; depth *= 10) {
+			fprintf(stderr, "queue: %s depth %ld\n",
+					patterns[p].name, depth);
+			if (benchQueueDepth(&patterns[p], depth, first) < 0) {
+				return -1;
+			}
+
+			first = 0;
+		}
+	}
+
+	printf("\n  ]\n}\n");
+	setDelayClock(NULL);
+	return 0;
+}
+
+/*	*	*	Priority release	*	*	*	*	*/
+
+#define PRIORITY_SEND_USEC	10	/* Emulated link time per bundle */
+
+typedef struct {
+	unsigned long long start;
+	unsigned long long latenessNsec[DELAY_CLASSES];
+	unsigned long long maxLatenessNsec[DELAY_CLASSES];
+	unsigned long	released[DELAY_CLASSES];
+	unsigned long	inversions;	/* Released ahead of a higher rank */
+	int		lastRank;
+} PriorityRun;
+
+/* The bundle's offered class is kept in its length, since a flat run
+ * queues every bundle as standard */
+static void priorityRelease(DelayedBundle *bundle, void *arg)
+{
+	PriorityRun *run = arg;
+	int offered = bundle->length;
+	int rank = offered * 256 + bundle->ancillaryData.ordinal;
+	unsigned long long now = benchNsec();
+	unsigned long long lateness = now - run->start;
+
+	run->latenessNsec[offered] += lateness;
+	if (lateness > run->maxLatenessNsec[offered]) {
+		run->maxLatenessNsec[offered] = lateness;
+	}
+
+	run->released[offered]++;
+	if (rank > run->lastRank) {
+		run->inversions++;
+	}
+
+	run->lastRank = rank;
+	while (benchNsec() - now < PRIORITY_SEND_USEC * 1000ULL) {
+		;
+	}
+}
+
+/* Releases a backlog that all fell due at once, as when a contact
+ * opens, with classes honored or (flat) in deadline order */
+static int runPriority(unsigned long bundles, int flat, PriorityRun *run)
+{
+	DelayQueue queue;
+	DelayedBundle bundle;
+	struct timeval now;
+	double pick;
+
+	if (initDelayQueue(&queue, bundles) < 0) {
+		return -1;
+	}
+
+	randomState = 88172645463325252ULL;
+	delayNow(&now);
+	for (unsigned long i = 0; i < bundles; i++) {
+		memset(&bundle, 0, sizeof bundle);
+		pick = random01();
+		if (pick < 0.1) {
+			bundle.ancillaryData.ordinal = 1 + (int) (random01() * 254);
+		} else if (pick >= 0.3) {
+			bundle.ancillaryData.flags = BP_BEST_EFFORT;
+		}
+
+		bundle.length = delayBundleClass(&bundle.ancillaryData);
+		bundle.releaseClass = flat ? DELAY_CLASS_STANDARD
+				: bundle.length;
+		bundle.ordinal = flat ? 0 : bundle.ancillaryData.ordinal;
+
+		/* Deadlines spread over the last second, all now past */
+		computeReleaseTime(&now, -1.0 + (double) i / bundles,
+				&bundle.releaseTime);
+		if (insertDelayed(&queue, &bundle) < 0) {
+			destroyDelayQueue(&queue);
+			return -1;
+		}
+	}
+
+	memset(run, 0, sizeof(PriorityRun));
+	run->lastRank = INT_MAX;
+	run->start = benchNsec();
+	delayNow(&now);
+	releaseDelayed(&queue, &now, priorityRelease, run);
+	destroyDelayQueue(&queue);
+	return 0;
+}
+
+static int benchPriority(unsigned long bundles)
+{
+	PriorityRun flat, ordered;
+
+	if (runPriority(bundles, 1, &flat) < 0
+	|| runPriority(bundles, 0, &ordered) < 0) {
+		putErrmsg("Can't run priority benchmark.", NULL);
+		return -1;
+	}
+
+	printf("priority: %lu bundles due at once, %d usec each to send, "
+			"10%% expedited, 20%% standard, 70%% bulk\n", bundles,
+			PRIORITY_SEND_USEC);
+	printf("%-10s %8s %16s %16s %16s\n", "class", "bundles",
+			"deadline mean ms", "class mean ms", "class max ms");
+	for (int i = DELAY_CLASSES - 1; i >= 0; i--) {
+		if (ordered.released[i] == 0) {
+			continue;
+		}
+
+		printf("%-10s %8lu %16.2f %16.2f %16.2f\n", delayClassNames[i],
+				ordered.released[i], flat.latenessNsec[i] / 1e6
+				/ flat.released[i], ordered.latenessNsec[i] / 1e6
+				/ ordered.released[i],
+				ordered.maxLatenessNsec[i] / 1e6);
+	}
+
+	printf("rank inversions: %lu in deadline order, %lu in class order\n",
+			flat.inversions, ordered.inversions);
+	return ordered.inversions == 0 ? 0 : -1;
+}
+
+/*	*	*	Loopback CLO to CLI	*	*	*	*	*/
+
+/* CLO transmit threads for the loopback, soak and jitter modes (-T) */
+static int benchTransmitThreads = DELAY_TRANSMIT_THREADS;
+
+/* CLI acquisition workers for the loopback and soak modes (-w) */
+static int benchAcqWorkers = DELAY_ACQ_WORKERS;
+
+/* Loopback and soak transport: UDP, or a shared-memory ring (-X shm) */
+static int loopbackShm = 0;
+
+static double loopbackCloDelay = 1.0;
+static double loopbackCliDelay = 0.0;
+static unsigned long long *latencies;	/* Emulated delay, nsec */
+static unsigned long latencyLimit;
+static unsigned long latencyCount;
+static unsigned long long firstAcquired, lastAcquired;
+static unsigned long long maxAcquireGap;
+
+static double cloDelay(void)
+{
+	return loopbackCloDelay;
+}
+
+static double cliDelay(void)
+{
+	return loopbackCliDelay;
+}
+
+static DelayModel loopbackCloModel = { "udpdelaybench-clo", "loopback",
+		cloDelay, 0.0 };
+static DelayModel loopbackCliModel = { "udpdelaybench-cli", "loopback",
+		cliDelay, 0.0 };
+
+/* Called by the stub's bpEndAcq, on the CLI thread */
+static void noteAcquired(AcqWorkArea *workArea)
+{
+	unsigned long long created, now;
+
+	now = benchNsec();
+	if (firstAcquired == 0) {
+		firstAcquired = now;
+	}
+
+	if (lastAcquired != 0 && now > lastAcquired + maxAcquireGap) {
+		maxAcquireGap = now - lastAcquired;
+	}
+
+	lastAcquired = now;
+	if (ionStubBundleTime(workArea, &created) < 0
+	|| latencyCount >= latencyLimit) {
+		return;
+	}
+
+	struct timespec realNow;
+
+	clock_gettime(CLOCK_REALTIME, &realNow);
+	latencies[latencyCount++] = ((unsigned long long) realNow.tv_sec
+			* 1000000000ULL + realNow.tv_nsec) - created;
+}
+
+static int compareLatency(const void *a, const void *b)
+{
+	unsigned long long x = *(unsigned long long *) a;
+	unsigned long long y = *(unsigned long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double latencyPercentile(double fraction)
+{
+	unsigned long index = (unsigned long) (fraction * (latencyCount - 1));
+
+	return latencies[index] / 1e6;
+}
+
+static void *runCli(void *arg)
+{
+	oK(delayCliServe((DelayCli *) arg));
+	return NULL;
+}
+
+/* A delay CLO and a delay CLI connected over 127.0.0.1, or through a
+ * shared-memory ring, each running its daemon's release or receive
+ * loop on its own thread */
+typedef struct {
+	DelayClo	clo;
+	DelayCli	cli;
+	DelayCloDuct	duct;
+	DelayCliDuct	induct;		/* Ring reader, with -X shm */
+	VOutduct	*voutduct;
+	VInduct		*vinduct;
+	pthread_t	cliThread;
+} LoopbackPair;
+
+static int openLoopback(LoopbackPair *pair, int capacity, int releaseMode)
+{
+	DelayClo *clo = &pair->clo;
+	DelayCli *cli = &pair->cli;
+	PsmAddress vductElt;
+	struct sockaddr_storage cliName;
+
+	memset(pair, 0, sizeof(LoopbackPair));
+	clo->model = &loopbackCloModel;
+	cli->model = &loopbackCliModel;
+	clo->running = cli->running = 1;
+	findOutduct("udp", "127.0.0.1", &pair->voutduct, &vductElt);
+	findInduct("udp", "127.0.0.1", &pair->vinduct, &vductElt);
+	cli->ductSocket = openSink(&cliName);
+	sizeDelayReceiveBuffer(cli->ductSocket, cli->model->daemonName);
+	clo->ductSocket = openDelaySocket(sinkFamily);
+	clo->buffer = MTAKE(UDPCLA_BUFSZ);
+	cli->buffer = MTAKE(UDPCLA_BUFSZ);
+	cli->work = bpGetAcqArea(pair->vinduct);
+	pair->duct.clo = clo;
+	pair->duct.vduct = pair->voutduct;
+	pair->duct.ductName = "127.0.0.1";
+	memcpy(&pair->duct.socketName, &cliName, sizeof cliName);
+	if (cli->ductSocket < 0 || clo->ductSocket < 0 || clo->buffer == NULL
+	|| cli->buffer == NULL || cli->work == NULL
+	|| initDelayQueue(&clo->queue, capacity) < 0
+	|| initDelayQueue(&cli->queue, capacity) < 0
+	|| initDelayCloRelease(clo, releaseMode) < 0
+	|| initDelayCloPipeline(clo, benchTransmitThreads) < 0
+	|| initDelayCliPipeline(cli, pair->vinduct, benchAcqWorkers) < 0) {
+		putErrmsg("Can't set up loopback CLO and CLI.", NULL);
+		return -1;
+	}
+
+	if (loopbackShm) {
+		/* The reader opens first, discarding any stale records */
+		pair->induct.cli = cli;
+		pair->induct.vduct = pair->vinduct;
+		pair->induct.ductName = DELAY_SHM_PREFIX "udpdelaybench";
+		pair->induct.ductSocket = -1;
+		pair->induct.fixedDelay = -1.0;
+		pair->induct.lossPercentage = cli->model->lossPercentage;
+		pair->induct.ring = openDelayShmRing("udpdelaybench", 1);
+		pair->duct.ring = openDelayShmRing("udpdelaybench", 0);
+		if (pair->induct.ring == NULL || pair->duct.ring == NULL
+		|| openDelayCliDuct(cli, &pair->induct) < 0) {
+			putErrmsg("Can't set up loopback ring.", NULL);
+			return -1;
+		}
+
+		cli->ducts = &pair->induct;
+		cli->ductCount = 1;
+	}
+
+	return 0;
+}
+
+static int startLoopback(LoopbackPair *pair)
+{
+	if (startDelayClo(&pair->clo) < 0 || startDelayCli(&pair->cli) < 0
+	|| pthread_create(&pair->cliThread, NULL, runCli, &pair->cli)) {
+		putErrmsg("Can't start loopback threads.", NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void stopLoopback(LoopbackPair *pair)
+{
+	stopDelayClo(&pair->clo);
+	pair->cli.running = 0;
+	pthread_join(pair->cliThread, NULL);
+	stopDelayCli(&pair->cli);
+}
+
+static void destroyQueuedZco(DelayedBundle *bundle, void *arg)
+{
+	zco_destroy(getIonsdr(), bundle->bundleZco);
+}
+
+static void freeQueuedData(DelayedBundle *bundle, void *arg)
+{
+	MRELEASE(bundle->data);
+}
+
+/* Frees whatever is still queued, as the daemons do at shutdown */
+static void closeLoopback(LoopbackPair *pair)
+{
+	Sdr sdr = getIonsdr();
+	DelayQueue *queue = &pair->clo.queue;
+
+	if (sdr_begin_xn(sdr)) {
+		drainDelayed(queue, destroyQueuedZco, NULL);
+		if (sdr_end_xn(sdr) < 0) {
+			putErrmsg("Can't destroy queued bundle ZCOs.", NULL);
+		}
+	}
+
+	closeDelayCloPipeline(&pair->clo);
+	closeDelayCliPipeline(&pair->cli);
+	drainDelayed(&pair->cli.queue, freeQueuedData, NULL);
+
+	if (loopbackShm) {
+		closeDelayCliDuct(&pair->induct);
+		closeDelayShmRing(pair->induct.ring);
+		closeDelayShmRing(pair->duct.ring);
+		pair->cli.ductCount = 0;
+	}
+
+	closeDelayCloRelease(&pair->clo);
+	close(pair->clo.ductSocket);
+	close(pair->cli.ductSocket);
+	destroyDelayQueue(&pair->clo.queue);
+	destroyDelayQueue(&pair->cli.queue);
+	bpReleaseAcqArea(pair->cli.work);
+	MRELEASE(pair->clo.buffer);
+	MRELEASE(pair->cli.buffer);
+}
+
+static int benchLoopback(unsigned long bundles, double rate, int capacity,
+		int releaseMode)
+{
+	LoopbackPair pair;
+	DelayClo *clo = &pair.clo;
+	DelayCli *cli = &pair.cli;
+	Object bundleZco;
+	BpAncillaryData ancillaryData;
+	unsigned long long start, offeredNsec, settled;
+	unsigned long long progress, lastProgress = 0;
+	double configured = loopbackCloDelay + loopbackCliDelay;
+	double delivered;
+	unsigned long long socketLoss;
+
+	latencyLimit = bundles;
+	latencies = malloc(bundles * sizeof(unsigned long long));
+	if (latencies == NULL || openLoopback(&pair, capacity, releaseMode) < 0) {
+		return -1;
+	}
+
+	ionStub.acquired = noteAcquired;
+	ionStub.bundleRate = rate;
+	printf("loopback: %lu bundles of %u bytes at %.0f/s, delay %.3f s "
+			"(CLO %.3f + CLI %.3f), loss %.1f%%, queue capacity %d, "
+			"%s release, %s\n", bundles, ionStub.bundleSize, rate,
+			configured, loopbackCloDelay, loopbackCliDelay,
+			loopbackCloModel.lossPercentage, capacity,
+			delayReleaseModeNames[clo->releaseMode],
+			loopbackShm ? "shared-memory ring"
+			: sinkFamily == AF_INET6 ? "UDP over IPv6" : "UDP");
+	fflush(stdout);
+	if (startLoopback(&pair) < 0) {
+		return -1;
+	}
+
+	/* Offer bundles at the stub's paced rate, as the dequeue loop does */
+	start = benchNsec();
+	for (unsigned long i = 0; i < bundles; i++) {
+		if (bpDequeue(pair.voutduct, &bundleZco, &ancillaryData, 0) < 0
+		|| bundleZco == 0) {
+			break;
+		}
+
+		if (delayCloEnqueue(clo, &pair.duct, bundleZco,
+				&ancillaryData) < 0) {
+			break;
+		}
+	}
+
+	offeredNsec = benchNsec() - start;
+
+	/* Drain: wait until both queues are empty and nothing has moved for
+	 * 200 ms, or the configured delay plus 10 s has passed */
+	settled = benchNsec();
+	while (benchNsec() - settled < (unsigned long long)
+			((configured + 10.0) * 1e9)) {
+		progress = cli->stats.received + cli->stats.acquired;
+		if (clo->queue.count + clo->scheduleStage.count
+				+ clo->transmitStage.count == 0
+		&& cli->queue.count + cli->scheduleStage.count == 0
+		&& progress == lastProgress) {
+			microsnooze(200000);
+			if (cli->stats.received + cli->stats.acquired == progress) {
+				break;
+			}
+		}
+
+		lastProgress = progress;
+		microsnooze(10000);
+	}
+
+	stopLoopback(&pair);
+	ionStub.acquired = NULL;
+
+	delivered = (lastAcquired > firstAcquired)
+			? (lastAcquired - firstAcquired) / 1e9 : 0.0;
+	socketLoss = clo->stats.sent > cli->stats.received
+			? clo->stats.sent - cli->stats.received : 0;
+	printf("offered   %10llu bundles in %7.3f s: %10.0f bundles/s\n",
+			clo->stats.dequeued, offeredNsec / 1e9,
+			clo->stats.dequeued / (offeredNsec / 1e9));
+	if (delivered > 0.0) {
+		printf("delivered %10llu bundles in %7.3f s: %10.0f bundles/s, "
+				"%8.3f MB/s\n", cli->stats.acquired, delivered,
+				(cli->stats.acquired - 1) / delivered,
+				ionStub.bytesAcquired / delivered / 1e6);
+	} else {
+		printf("delivered %10llu bundles\n", cli->stats.acquired);
+	}
+
+	printf("dropped   clo queue full %llu, clo link loss %llu, clo send "
+			"failed %llu, socket %llu,\n          cli queue full %llu, "
+			"cli release behind %llu, cli link loss %llu, cli "
+			"acquisition failed %llu,\n          undelivered %d\n",
+			clo->stats.queueFull, clo->stats.linkLoss,
+			clo->stats.sendFailed, socketLoss, cli->stats.queueFull,
+			cli->stats.stageFull, cli->stats.linkLoss,
+			cli->stats.acqFailed, clo->queue.count + cli->queue.count);
+	printf("receive   turn budget %d usec, %llu overruns, longest %.1f "
+			"usec\n", DELAY_RECEIVE_BUDGET_USEC,
+			cli->stats.budgetOverruns,
+			cli->stats.maxReceiveNsec / 1000.0);
+	if (!loopbackShm) {
+		printf("datagrams clo sent %llu (%.0f/s), cli received %llu; "
+				"%llu bundles in %llu aggregate frames, %llu "
+				"refused\n", clo->stats.datagramsSent,
+				clo->stats.datagramsSent / (offeredNsec / 1e9),
+				cli->stats.datagrams, clo->stats.aggregated,
+				clo->stats.aggregates,
+				cli->stats.aggregatesRefused);
+	}
+
+	if (latencyCount > 0) {
+		qsort(latencies, latencyCount, sizeof latencies[0],
+				compareLatency);
+		printf("delay     configured %.3f ms, emulated p50 %.3f ms, p99 "
+				"%.3f ms, max %.3f ms\n          error p50 %+.3f ms, "
+				"p99 %+.3f ms\n", configured * 1e3,
+				latencyPercentile(0.50), latencyPercentile(0.99),
+				latencyPercentile(1.0),
+				latencyPercentile(0.50) - configured * 1e3,
+				latencyPercentile(0.99) - configured * 1e3);
+	}
+
+	fflush(stdout);
+	closeLoopback(&pair);
+	free(latencies);
+	ionStub.quiet = 0;
+	writeProfileReport();
+	ionStubReport();
+	return 0;
+}
+
+/*	*	*	Soak test	*	*	*	*	*	*/
+
+#define SOAK_METRICS		9
+#define SOAK_MAX_SAMPLES	10000
+
+typedef struct {
+	double	t;			/* Virtual seconds since start */
+	double	value[SOAK_METRICS];
+} SoakSample;
+
+static const char *soakMetricNames[SOAK_METRICS] = {
+	"rss_kb", "sdr_bytes", "held", "zcos", "ion_allocs", "ion_bytes",
+	"heap_bytes", "clo_depth", "cli_depth"
+};
+
+static double soakAcceleration = 1000.0;
+static struct timeval soakEpoch;
+static unsigned long long soakRealStart;
+
+static void acceleratedClock(struct timeval *now)
+{
+	double elapsed = (benchNsec() - soakRealStart) / 1e9 * soakAcceleration;
+
+	computeReleaseTime(&soakEpoch, elapsed, now);
+}
+
+static double soakElapsed(void)
+{
+	return (benchNsec() - soakRealStart) / 1e9 * soakAcceleration;
+}
+
+static double residentKb(void)
+{
+	FILE *statm = fopen("/proc/self/statm", "r");
+	unsigned long size, resident = 0;
+
+	if (statm) {
+		if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+			resident = 0;
+		}
+
+		fclose(statm);
+	}
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024.0);
+}
+
+static double heapInUse(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	return mallinfo2().uordblks;
+#else
+	return 0.0;
+#endif
+}
+
+static void takeSoakSample(LoopbackPair *pair, SoakSample *sample)
+{
+	sample->t = soakElapsed();
+	sample->value[0] = residentKb();
+	sample->value[1] = ionStubSdrBytes();
+	sample->value[2] = ionStub.bundlesHeld;
+	sample->value[3] = ionStub.zcosLive;
+	sample->value[4] = ionStub.memAllocs;
+	sample->value[5] = ionStub.memBytesLive;
+	sample->value[6] = heapInUse();
+	sample->value[7] = pair->clo.queue.count;
+	sample->value[8] = pair->cli.queue.count;
+	printf("%10.0f", sample->t);
+	for (int m = 0; m < SOAK_METRICS; m++) {
+		printf(" %12.0f", sample->value[m]);
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+/* Least-squares growth of one metric across the samples after warm-up
+ * (the first third, while the queues fill).  A metric grows without
+ * bound if its trend adds more than 10% of its mean, and more than
+ * its noise floor, over the measured window. */
+static int checkSoakGrowth(SoakSample *samples, int count, int metric,
+		double floor)
+{
+	int first = count / 3;
+	int n = count - first;
+	double sumT = 0, sumV = 0, sumTT = 0, sumTV = 0;
+	double slope, mean, growth;
+
+	if (n < 4) {
+		return 0;
+	}
+
+	for (int i = first; i < count; i++) {
+		double t = samples[i].t, v = samples[i].value[metric];
+
+		sumT += t;
+		sumV += v;
+		sumTT += t * t;
+		sumTV += t * v;
+	}
+
+	slope = (n * sumTV - sumT * sumV) / (n * sumTT - sumT * sumT);
+	mean = sumV / n;
+	growth = slope * (samples[count - 1].t - samples[first].t);
+	if (growth > floor && growth > 0.10 * mean) {
+		printf("soak: FAIL %s grows by %.0f over %.0f virtual seconds "
+				"(mean %.0f)\n", soakMetricNames[metric], growth,
+				samples[count - 1].t - samples[first].t, mean);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *runCloServe(void *arg)
+{
+	LoopbackPair *pair = (LoopbackPair *) arg;
+
+	if (delayCloServe(&pair->clo, &pair->duct) < 0) {
+		putErrmsg("Soak dequeue loop failed.", NULL);
+	}
+
+	/* Stop the release thread too, as the daemon does */
+	pair->clo.running = 0;
+	return NULL;
+}
+
+static int benchSoak(double duration, double interval, double rate,
+		int capacity)
+{
+	LoopbackPair pair;
+	SoakSample *samples;
+	pthread_t dequeueThread;
+	double nextSample = 0.0;
+	int count = 0, failures = 0;
+	double floors[SOAK_METRICS];
+
+	if (interval <= 0.0) {
+		interval = duration / 60;
+	}
+
+	samples = malloc(SOAK_MAX_SAMPLES * sizeof(SoakSample));
+	if (samples == NULL || openLoopback(&pair, capacity,
+			DELAY_RELEASE_POLL) < 0) {
+		return -1;
+	}
+
+	/* Noise floors: a few bundles' worth, or a few MB */
+	floors[0] = 4096;
+	floors[1] = 16.0 * ionStub.bundleSize;
+	floors[2] = 0;
+	floors[3] = 16;
+	floors[4] = 16;
+	floors[5] = 16.0 * ionStub.bundleSize;
+	floors[6] = 4 * 1024 * 1024;
+	floors[7] = floors[8] = capacity / 10.0;
+
+	/* Bundles are stamped with the real clock: they must outlive the
+	 * accelerated run, or the daemons would drop them as expired */
+	ionStub.lifetimeMsec = (uvast) ((duration + loopbackCloDelay
+			+ loopbackCliDelay + 3600.0) * 1000.0);
+	gettimeofday(&soakEpoch, NULL);
+	soakRealStart = benchNsec();
+	setDelayClock(acceleratedClock);
+	ionStub.bundleRate = rate;
+	printf("soak: %.0f virtual seconds at %.0fx (%.0f s real), %.0f "
+			"bundles/s, delay %.1f s (CLO %.1f + CLI %.1f), loss "
+			"%.1f%%, queue capacity %d\n", duration, soakAcceleration,
+			duration / soakAcceleration, rate,
+			loopbackCloDelay + loopbackCliDelay, loopbackCloDelay,
+			loopbackCliDelay, loopbackCloModel.lossPercentage,
+			capacity);
+	printf("%10s", "t");
+	for (int m = 0; m < SOAK_METRICS; m++) {
+		printf(" %12s", soakMetricNames[m]);
+	}
+
+	printf("\n");
+	if (startLoopback(&pair) < 0) {
+		return -1;
+	}
+
+	/* The daemon's own dequeue loop feeds the CLO; sample as virtual
+	 * time passes, then close the duct as bpclm would */
+	if (pthread_create(&dequeueThread, NULL, runCloServe, &pair)) {
+		putErrmsg("Can't start dequeue thread.", NULL);
+		return -1;
+	}
+
+	while (soakElapsed() < duration) {
+		if (soakElapsed() >= nextSample && count < SOAK_MAX_SAMPLES) {
+			takeSoakSample(&pair, &samples[count++]);
+			nextSample += interval;
+		}
+
+		microsnooze(1000);
+	}
+
+	if (count < SOAK_MAX_SAMPLES) {
+		takeSoakSample(&pair, &samples[count++]);
+	}
+
+	pair.clo.running = 0;
+	sm_SemEnd(pair.voutduct->semaphore);
+	pthread_join(dequeueThread, NULL);
+	stopLoopback(&pair);
+	setDelayClock(NULL);
+	delayCloReport(&pair.clo);
+	delayCliReport(&pair.cli);
+	for (int m = 0; m < SOAK_METRICS; m++) {
+		failures += checkSoakGrowth(samples, count, m, floors[m]);
+	}
+
+	/* Leaks show once what is still queued has been destroyed */
+	closeLoopback(&pair);
+	if (ionStub.zcosLive > 0 || ionStub.xnViolations > 0
+	|| ionStub.xnAbandoned > 0) {
+		printf("soak: FAIL %llu ZCOs left, %llu destroyed outside a "
+				"transaction, %llu abandoned by sdr_exit_xn\n",
+				ionStub.zcosLive, ionStub.xnViolations,
+				ionStub.xnAbandoned);
+		failures++;
+	}
+
+	printf("soak: %s\n", failures ? "FAILED" : "passed");
+	fflush(stdout);
+	free(samples);
+	ionStub.quiet = 0;
+	ionStubReport();
+	return failures ? -1 : 0;
+}
+
+/*	*	*	Acquisition worker scaling	*	*	*	*/
+
+static DelayModel acquireModel = { "udpdelaybench-acq", "acquire",
+		zeroDelay, 0.0 };
+
+/* Runs bundles through a CLI with the given number of acquisition
+ * workers at zero delay: the main thread enqueues as the receive thread
+ * would, from <sources> source ports in turn.  Returns bundles/s, and
+ * the fewest and most bundles acquired by one worker. */
+static double benchAcquireWorkers(int workers, unsigned long bundles,
+		int sources, int ordered, unsigned long long *least,
+		unsigned long long *most)
+{
+	DelayCli cli;
+	VInduct *vduct;
+	PsmAddress vductElt;
+	ZcoReader reader;
+	struct sockaddr_storage fromAddr;
+	Object bundleZco;
+	unsigned long long start, elapsed;
+	int length;
+
+	findInduct("udp", "127.0.0.1:4556", &vduct, &vductElt);
+	memset(&cli, 0, sizeof cli);
+	cli.model = &acquireModel;
+	cli.running = 1;
+	cli.buffer = MTAKE(UDPCLA_BUFSZ);
+	cli.work = bpGetAcqArea(vduct);
+	if (cli.buffer == NULL || cli.work == NULL
+	|| initDelayQueue(&cli.queue, 100000) < 0
+	|| initDelayCliPipeline(&cli, vduct, workers) < 0) {
+		putErrmsg("Can't set up acquisition benchmark CLI.", NULL);
+		return -1.0;
+	}
+
+	cli.acqOrdered = ordered;
+	bundleZco = ionStubCreateBundle();
+	zco_start_transmitting(bundleZco, &reader);
+	length = zco_transmit(getIonsdr(), &reader, zco_length(getIonsdr(),
+			bundleZco), cli.buffer);
+	if (sdr_begin_xn(getIonsdr())) {
+		zco_destroy(getIonsdr(), bundleZco);
+		oK(sdr_end_xn(getIonsdr()));
+	}
+
+	if (startDelayCli(&cli) < 0) {
+		return -1.0;
+	}
+
+	start = benchNsec();
+	for (unsigned long i = 0; i < bundles; i++) {
+		loopbackAddress(&fromAddr, BpUdpDefaultPortNbr + (i % sources));
+		while (__atomic_load_n(&cli.scheduleStage.count,
+				__ATOMIC_RELAXED) >= cli.scheduleStage.capacity) {
+			sched_yield();
+		}
+
+		oK(delayCliEnqueue(&cli, NULL, cli.buffer, length, &fromAddr));
+	}
+
+	while (cli.stats.acquired + cli.stats.acqFailed + cli.stats.stageFull
+			+ cli.stats.queueFull < bundles) {
+		microsnooze(100);
+	}
+
+	elapsed = benchNsec() - start;
+	stopDelayCli(&cli);
+	*least = ~0ULL;
+	*most = 0;
+	for (int i = 0; i < cli.acqWorkers; i++) {
+		if (cli.workers[i].acquired < *least) {
+			*least = cli.workers[i].acquired;
+		}
+
+		if (cli.workers[i].acquired > *most) {
+			*most = cli.workers[i].acquired;
+		}
+	}
+
+	closeDelayCliPipeline(&cli);
+	destroyDelayQueue(&cli.queue);
+	bpReleaseAcqArea(cli.work);
+	MRELEASE(cli.buffer);
+	return cli.stats.acquired / (elapsed / 1e9);
+}
+
+static int benchAcquire(int maxWorkers, unsigned long bundles, int sources,
+		int ordered)
+{
+	unsigned long long least, most;
+	double rate, base = 0.0;
+
+	printf("acquire: %lu bundles of %u bytes from %d sources, %s, "
+			"acquisition %lu ns + SDR transaction %lu ns, %ld CPUs\n",
+			bundles, ionStub.bundleSize, sources, ordered
+			? "ordered per source" : "least busy worker",
+			ionStub.acqNsec, ionStub.sdrXnNsec,
+			sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%7s %12s %12s %12s %12s %8s\n", "workers", "bundles/s",
+			"usec/bundle", "least", "most", "speedup");
+	for (int workers = 1; workers <= maxWorkers; workers++) {
+		rate = benchAcquireWorkers(workers, bundles, sources, ordered,
+				&least, &most);
+		if (rate < 0.0) {
+			return -1;
+		}
+
+		if (base == 0.0) {
+			base = rate;
+		}
+
+		printf("%7d %12.0f %12.2f %12llu %12llu %8.2f\n", workers,
+				rate, 1e6 / rate, least, most, rate / base);
+		fflush(stdout);
+	}
+
+	ionStub.quiet = 0;
+	ionStubReport();
+	return 0;
+}
+
+/*	*	*	Per-source delay and loss	*	*	*	*/
+
+static DelayModel sourcesModel = { "udpdelaybench-sources", "sources",
+		zeroDelay, 0.0 };
+
+/* Table entry i and an address it matches: mostly IPv4 with a port
+ * (every fourth seen on a dual-stack socket, v4-mapped), every fourth
+ * IPv6 and every eighth IPv4 without a port, heard from any port */
+static int sourceEntry(int i, char *spec, int size,
+		struct sockaddr_storage *sender)
+{
+	char senderSpec[64];
+
+	if (i % 4 == 1) {
+		isprintf(spec, size, "[fd00::%x:%x]:%d", i >> 16, i & 0xffff,
+				BpUdpDefaultPortNbr + i % 16);
+		istrcpy(senderSpec, spec, sizeof senderSpec);
+	} else if (i % 8 == 7) {
+		isprintf(spec, size, "10.%d.%d.%d", (i >> 16) & 0xff,
+				(i >> 8) & 0xff, i & 0xff);
+		isprintf(senderSpec, sizeof senderSpec, "%s:%d", spec,
+				5000 + i % 1000);
+	} else {
+		isprintf(spec, size, "10.%d.%d.%d:%d", (i >> 16) & 0xff,
+				(i >> 8) & 0xff, i & 0xff,
+				BpUdpDefaultPortNbr + i % 16);
+		istrcpy(senderSpec, spec, sizeof senderSpec);
+	}
+
+	if (parseDelaySocketSpec(senderSpec, sender) < 0) {
+		return -1;
+	}
+
+	if (i % 8 == 2) {
+		mapDelayAddress(sender);
+	}
+
+	return 0;
+}
+
+/* Delay and loss of entry i: 1 .. 2 s, 0 .. 4% */
+static double sourceDelay(int i)
+{
+	return 1.0 + (i % 1000) / 1000.0;
+}
+
+typedef struct {
+	DelaySourceTable *table;
+	unsigned long long start;	/* Enqueueing, on the delay clock */
+	unsigned long long end;
+	unsigned long	checked;
+	unsigned long	wrong;		/* Wrong source or release time */
+} SourceCheck;
+
+/* Each queued bundle must carry its sender's entry and fall due that
+ * entry's delay after it was enqueued */
+static void checkSourceBundle(DelayedBundle *bundle, void *arg)
+{
+	SourceCheck *check = arg;
+	unsigned long long release = bundle->releaseTime.tv_sec * 1000000ULL
+			+ bundle->releaseTime.tv_usec;
+	unsigned long long delay;
+
+	check->checked++;
+	if (bundle->source == NULL
+	|| bundle->source != findDelaySource(check->table, &bundle->fromAddr)) {
+		check->wrong++;
+	} else {
+		delay = bundle->source->delaySeconds * 1e6;
+		if (release + 1 < check->start + delay
+		|| release > check->end + delay + 1) {
+			check->wrong++;
+		}
+	}
+
+	MRELEASE(bundle->data);
+}
+
+static unsigned long long delayClockUsec(void)
+{
+	struct timeval now;
+
+	delayNow(&now);
+	return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+/* Loads a table of n sources, times lookups of listed and unlisted
+ * senders, then passes one bundle per source through a CLI and checks
+ * its delay and the per-source counters */
+static int benchSourceTable(int n, unsigned long lookups)
+{
+	char fileName[64], spec[64];
+	struct sockaddr_storage *senders;
+	struct sockaddr_storage stranger;
+	DelayCli cli;
+	SourceCheck check;
+	FILE *file;
+	unsigned long long start, loadNsec, hitNsec, missNsec, allocs;
+	unsigned long found = 0, counted = 0;
+	int i;
+
+	isprintf(fileName, sizeof fileName, "/tmp/udpdelaybench.%d.sources",
+			(int) getpid());
+	senders = malloc(n * sizeof(struct sockaddr_storage));
+	file = fopen(fileName, "w");
+	if (senders == NULL || file == NULL) {
+		putErrmsg("Can't set up source table benchmark.", fileName);
+		free(senders);
+		return -1;
+	}
+
+	fprintf(file, "# source\tdelay\tloss\n");
+	for (i = 0; i < n; i++) {
+		if (sourceEntry(i, spec, sizeof spec, senders + i) < 0) {
+			fclose(file);
+			free(senders);
+			return -1;
+		}
+
+		fprintf(file, "%s\t%.3f\t%d\n", spec, sourceDelay(i), i % 5);
+	}
+
+	fclose(file);
+	memset(&cli, 0, sizeof cli);
+	cli.model = &sourcesModel;
+	cli.running = 1;
+	start = benchNsec();
+	if (loadDelaySources(&cli.sources, fileName) != n) {
+		unlink(fileName);
+		free(senders);
+		return -1;
+	}
+
+	loadNsec = benchNsec() - start;
+	unlink(fileName);
+
+	/* Lookups must not allocate */
+	allocs = ionStub.memAllocs;
+	start = benchNsec();
+	for (unsigned long k = 0, j = 0; k < lookups; k++) {
+		j = (j + 7919) % n;
+		if (findDelaySource(&cli.sources, senders + j)) {
+			found++;
+		}
+	}
+
+	hitNsec = benchNsec() - start;
+	oK(parseDelaySocketSpec("192.168.77.1:4556", &stranger));
+	start = benchNsec();
+	for (unsigned long k = 0; k < lookups; k++) {
+		((struct sockaddr_in *) &stranger)->sin_port = htons(k);
+		if (findDelaySource(&cli.sources, &stranger)) {
+			found++;
+		}
+	}
+
+	missNsec = benchNsec() - start;
+	allocs = ionStub.memAllocs - allocs;
+
+	/* One bundle per source through the receive and schedule path */
+	if (initDelayQueue(&cli.queue, n) < 0
+	|| initDelayCliPipeline(&cli, NULL, 0) < 0) {
+		freeDelaySources(&cli.sources);
+		free(senders);
+		return -1;
+	}
+
+	memset(&check, 0, sizeof check);
+	check.table = &cli.sources;
+	check.start = delayClockUsec();
+	for (i = 0; i < n; i++) {
+		if (cli.scheduleStage.count >= cli.scheduleStage.capacity / 2) {
+			delayCliRelease(&cli);
+		}
+
+		oK(delayCliEnqueue(&cli, NULL, spec, sizeof spec, senders + i));
+	}
+
+	check.end = delayClockUsec();
+	delayCliRelease(&cli);
+	drainDelayed(&cli.queue, checkSourceBundle, &check);
+	for (unsigned int s = 0; s <= cli.sources.mask; s++) {
+		if (cli.sources.slots[s].inUse
+		&& cli.sources.slots[s].stats.received == 1) {
+			counted++;
+		}
+	}
+
+	printf("%8d %10.2f %10.1f %10.1f %8llu %8lu %8lu %8lu\n", n,
+			loadNsec / 1e6, (double) hitNsec / lookups,
+			(double) missNsec / lookups, allocs, check.checked,
+			check.wrong, n - counted);
+	closeDelayCliPipeline(&cli);
+	destroyDelayQueue(&cli.queue);
+	freeDelaySources(&cli.sources);
+	free(senders);
+	return found == lookups && allocs == 0 && check.checked == (unsigned) n
+			&& check.wrong == 0 && counted == (unsigned) n ? 0 : -1;
+}
+
+static int benchSources(int maxSources, unsigned long lookups)
+{
+	int failures = 0;
+
+	printf("sources: %lu lookups per table, 1/4 IPv6, 1/8 any port, "
+			"1/8 v4-mapped senders\n", lookups);
+	printf("%8s %10s %10s %10s %8s %8s %8s %8s\n", "sources", "load ms",
+			"hit ns", "miss ns", "allocs", "queued", "wrong",
+			"uncounted");
+	for (int n = 16; ; n *= 16) {
+		if (n > maxSources) {
+			n = maxSources;
+		}
+
+		if (benchSourceTable(n, lookups) < 0) {
+			failures++;
+		}
+
+		fflush(stdout);
+		if (n == maxSources) {
+			break;
+		}
+	}
+
+	return failures ? -1 : 0;
+}
+
+/*	*	*	Bundle expiry	*	*	*	*	*	*/
+
+/* Times decoding a generated bundle's primary block, as both daemons
+ * now do for every bundle, and returns nsec per decode */
+static double benchExpiryDecode(unsigned long decodes)
+{
+	Sdr sdr = getIonsdr();
+	unsigned char header[DELAY_ID_PEEK_BYTES];
+	DelayBundleId id;
+	struct timeval expiryTime;
+	Object bundleZco = ionStubCreateBundle();
+	ZcoReader reader;
+	unsigned int length;
+	unsigned long long start;
+
+	if (bundleZco == 0 || !sdr_begin_xn(sdr)) {
+		return -1.0;
+	}
+
+	length = zco_length(sdr, bundleZco);
+	length = length < sizeof header ? length : sizeof header;
+	zco_start_transmitting(bundleZco, &reader);
+	oK(zco_transmit(sdr, &reader, length, (char *) header));
+	zco_destroy(sdr, bundleZco);
+	oK(sdr_end_xn(sdr));
+	start = benchNsec();
+	for (unsigned long i = 0; i < decodes; i++) {
+		if (decodeBundleId(header, length, &id, &expiryTime) < 0) {
+			return -1.0;
+		}
+	}
+
+	return (double) (benchNsec() - start) / decodes;
+}
+
+/* Offers bundles through the loopback with lifetimes cycling through
+ * one that ends in the CLO's delay, one that ends in the CLI's and one
+ * that outlasts both, and checks that each is dropped by the daemon it
+ * expires in, and that nothing is left behind */
+static int benchExpire(unsigned long bundles, double rate, int capacity)
+{
+	LoopbackPair pair;
+	DelayClo *clo = &pair.clo;
+	DelayCli *cli = &pair.cli;
+	Object bundleZco;
+	BpAncillaryData ancillaryData;
+	double configured = loopbackCloDelay + loopbackCliDelay;
+	uvast lifetimes[3];
+	unsigned long expected[3] = { 0, 0, 0 };
+	unsigned long long settled;
+	double decodeNsec;
+	int failures = 0;
+
+	lifetimes[0] = (uvast) (loopbackCloDelay * 500.0);
+	lifetimes[1] = (uvast) ((loopbackCloDelay + loopbackCliDelay / 2.0)
+			* 1000.0);
+	lifetimes[2] = (uvast) ((configured + 10.0) * 1000.0);
+	for (unsigned long i = 0; i < bundles; i++) {
+		expected[i % 3]++;
+	}
+
+	decodeNsec = benchExpiryDecode(1000000);
+	if (decodeNsec < 0.0 || openLoopback(&pair, capacity,
+			DELAY_RELEASE_MODE) < 0) {
+		putErrmsg("Can't set up expiry benchmark.", NULL);
+		return -1;
+	}
+
+	ionStub.bundleRate = rate;
+	printf("expire: %lu bundles at %.0f/s, delay CLO %.3f s + CLI %.3f s, "
+			"lifetimes %llu, %llu and %llu ms in turn\n", bundles,
+			rate, loopbackCloDelay, loopbackCliDelay,
+			(unsigned long long) lifetimes[0],
+			(unsigned long long) lifetimes[1],
+			(unsigned long long) lifetimes[2]);
+	fflush(stdout);
+	if (startLoopback(&pair) < 0) {
+		return -1;
+	}
+
+	for (unsigned long i = 0; i < bundles; i++) {
+		ionStub.lifetimeMsec = lifetimes[i % 3];
+		if (bpDequeue(pair.voutduct, &bundleZco, &ancillaryData, 0) < 0
+		|| bundleZco == 0
+		|| delayCloEnqueue(clo, &pair.duct, bundleZco,
+				&ancillaryData) < 0) {
+			break;
+		}
+	}
+
+	/* Wait for every bundle to be accounted for, or the delay plus
+	 * 10 s */
+	settled = benchNsec();
+	while (clo->stats.expired + cli->stats.expired + cli->stats.acquired
+			< bundles && benchNsec() - settled
+			< (unsigned long long) ((configured + 10.0) * 1e9)) {
+		microsnooze(10000);
+	}
+
+	stopLoopback(&pair);
+	printf("decode    primary block and expiry %.0f ns\n", decodeNsec);
+	printf("expired   clo %llu (expected %lu), cli %llu (expected %lu)\n",
+			clo->stats.expired, expected[0], cli->stats.expired,
+			expected[1]);
+	printf("delivered %llu (expected %lu), clo queue high water %d, cli "
+			"queue high water %d\n", cli->stats.acquired, expected[2],
+			clo->queue.classes[DELAY_CLASS_STANDARD].highWater,
+			cli->queue.classes[DELAY_CLASS_STANDARD].highWater);
+	if (clo->stats.expired != expected[0]
+	|| cli->stats.expired != expected[1]
+	|| cli->stats.acquired != expected[2]) {
+		printf("FAIL: bundles not dropped where their lifetime "
+				"ends\n");
+		failures++;
+	}
+
+	fflush(stdout);
+	closeLoopback(&pair);
+	if (ionStub.zcosLive > 0 || ionStub.xnViolations > 0
+	|| ionStub.xnAbandoned > 0) {
+		printf("FAIL: %llu ZCOs left, %llu destroyed outside a "
+				"transaction, %llu abandoned by sdr_exit_xn\n",
+				(unsigned long long) ionStub.zcosLive,
+				(unsigned long long) ionStub.xnViolations,
+				(unsigned long long) ionStub.xnAbandoned);
+		failures++;
+	}
+
+	ionStub.quiet = 0;
+	ionStubReport();
+	return failures ? -1 : 0;
+}
+
+/*	*	*	Duplicate suppression	*	*	*	*	*/
+
+#define DEDUP_DELAY		10.0	/* Virtual seconds */
+#define DEDUP_DURATION		100.0
+#define DEDUP_RING		1024	/* Recent bundles kept for copies */
+#define DEDUP_RESENT		1000	/* First bundles sent again at the end */
+
+static struct timeval shiftedEpoch;
+static double shiftedOffset;
+
+/* Real time at the start, advanced by the benchmark, so that bundle
+ * lifetimes still hold */
+static void shiftedClock(struct timeval *now)
+{
+	computeReleaseTime(&shiftedEpoch, shiftedOffset, now);
+}
+
+static double dedupDelay(void)
+{
+	return DEDUP_DELAY;
+}
+
+static DelayModel dedupModel = { "udpdelaybench-dedup", "dedup", dedupDelay,
+		0.0 };
+
+/* Reads a new generated bundle into buffer; returns its length */
+static int dedupBundle(char *buffer)
+{
+	Sdr sdr = getIonsdr();
+	Object bundleZco = ionStubCreateBundle();
+	ZcoReader reader;
+	int length;
+
+	if (bundleZco == 0) {
+		return -1;
+	}
+
+	zco_start_transmitting(bundleZco, &reader);
+	length = zco_transmit(sdr, &reader, zco_length(sdr, bundleZco),
+			buffer);
+	if (sdr_begin_xn(sdr)) {
+		zco_destroy(sdr, bundleZco);
+		oK(sdr_end_xn(sdr));
+	}
+
+	return length;
+}
+
+/* Sends bundles over 100 virtual seconds with a 10 s delay, each once,
+ * twice or three times, the copies 0.1 s and 1 s after the original,
+ * so index entries expire all the time.  Then sends the first bundles
+ * again, long after their release.  Fails unless exactly the copies
+ * sent while the original was queued are dropped. */
+static int benchDedup(unsigned long bundles)
+{
+	DelayCli cli;
+	VInduct *vduct;
+	PsmAddress vductElt;
+	struct sockaddr_storage fromAddr;
+	char *ring, *resent;
+	int lengths[DEDUP_RING], resentLengths[DEDUP_RESENT];
+	unsigned long resend = bundles < DEDUP_RESENT ? bundles : DEDUP_RESENT;
+	unsigned long datagrams = 0, copies = 0, i;
+	unsigned long acqNsec = ionStub.acqNsec;
+	unsigned long long start, enqueueNsec = 0;
+	int failures = 0;
+
+	if (!DELAY_DEDUP) {
+		printf("dedup: built without duplicate suppression; rebuild "
+				"with DEDUP=1\n");
+		return -1;
+	}
+
+	findInduct("udp", "127.0.0.1:4556", &vduct, &vductElt);
+	memset(&cli, 0, sizeof cli);
+	cli.model = &dedupModel;
+	cli.running = 1;
+	cli.work = bpGetAcqArea(vduct);
+	ring = malloc((size_t) DEDUP_RING * UDPCLA_BUFSZ);
+	resent = malloc((size_t) resend * ionStub.bundleSize + 1);
+	if (cli.work == NULL || ring == NULL || resent == NULL
+	|| initDelayQueue(&cli.queue, bundles / 5 + 1000) < 0
+	|| initDelayCliPipeline(&cli, vduct, 0) < 0) {
+		putErrmsg("Can't set up duplicate benchmark.", NULL);
+		return -1;
+	}
+
+	loopbackAddress(&fromAddr, BpUdpDefaultPortNbr);
+	gettimeofday(&shiftedEpoch, NULL);
+	shiftedOffset = 0.0;
+	setDelayClock(shiftedClock);
+	ionStub.acqNsec = 0;
+	printf("dedup: %lu bundles of %u bytes over %.0f virtual seconds, "
+			"delay %.0f s, duplicate index of %u slots\n", bundles,
+			ionStub.bundleSize, DEDUP_DURATION, DEDUP_DELAY,
+			cli.dedup.mask + 1);
+	for (i = 0; i < bundles; i++) {
+		char *bundle = ring + (i % DEDUP_RING) * UDPCLA_BUFSZ;
+		unsigned long back[3] = { 0, 100, 1000 };
+
+		shiftedOffset = i * DEDUP_DURATION / bundles;
+		lengths[i % DEDUP_RING] = dedupBundle(bundle);
+		if (lengths[i % DEDUP_RING] < 0) {
+			failures++;
+			break;
+		}
+
+		if (i < resend) {
+			memcpy(resent + i * ionStub.bundleSize, bundle,
+					lengths[i % DEDUP_RING]);
+			resentLengths[i] = lengths[i % DEDUP_RING];
+		}
+
+		/* The original, then copies of earlier bundles */
+		for (int k = 0; k < 3; k++) {
+			unsigned long j = i - back[k];
+
+			if (back[k] > i || (k > 0 && (int) (j % 3) < k)) {
+				continue;
+			}
+
+			start = benchNsec();
+			oK(delayCliEnqueue(&cli, NULL, ring + (j % DEDUP_RING)
+					* UDPCLA_BUFSZ, lengths[j % DEDUP_RING],
+					&fromAddr));
+			enqueueNsec += benchNsec() - start;
+			datagrams++;
+			copies += k > 0;
+		}
+
+		if (cli.scheduleStage.count >= cli.scheduleStage.capacity / 2) {
+			delayCliRelease(&cli);
+		}
+	}
+
+	/* Long after their release, the first bundles are new again */
+	shiftedOffset = DEDUP_DURATION + 2 * DEDUP_DELAY;
+	delayCliRelease(&cli);
+	for (i = 0; i < resend; i++) {
+		oK(delayCliEnqueue(&cli, NULL, resent + i * ionStub.bundleSize,
+				resentLengths[i], &fromAddr));
+		if (cli.scheduleStage.count >= cli.scheduleStage.capacity / 2) {
+			delayCliRelease(&cli);
+		}
+	}
+
+	shiftedOffset += 2 * DEDUP_DELAY;
+	delayCliRelease(&cli);
+	setDelayClock(NULL);
+	ionStub.acqNsec = acqNsec;
+	printf("enqueue   %lu datagrams, %.0f ns each\n", datagrams,
+			(double) enqueueNsec / datagrams);
+	printf("dropped   %llu duplicates (expected %lu), acquired %llu "
+			"(expected %lu), %llu queued unremembered\n",
+			cli.stats.duplicates, copies, cli.stats.acquired,
+			bundles + resend, cli.dedup.unremembered);
+	if (cli.stats.duplicates != copies
+	|| cli.stats.acquired != bundles + resend) {
+		printf("FAIL: wrong bundles dropped as duplicates\n");
+		failures++;
+	}
+
+	closeDelayCliPipeline(&cli);
+	destroyDelayQueue(&cli.queue);
+	bpReleaseAcqArea(cli.work);
+	free(ring);
+	free(resent);
+	return failures ? -1 : 0;
+}
+
+/*	*	*	In-queue compression	*	*	*	*	*/
+
+#define COMPRESS_KINDS		3
+
+static const char *compressKindNames[COMPRESS_KINDS] = {
+	"fill", "telemetry", "random"
+};
+
+/* Rewrites a generated bundle's payload: left as the stub's fill,
+ * CSV telemetry records, or random bytes */
+static void fillPayload(char *bundle, int length, int kind, unsigned long n)
+{
+	char record[128];
+	int at = 64, end = length - 16, size;
+
+	for (unsigned long r = n * 100; kind > 0 && at < end; r++) {
+		if (kind == 2) {
+			bundle[at++] = random();
+			continue;
+		}
+
+		size = snprintf(record, sizeof record, "%lu,%.3f,%.3f,%d,OK\n",
+				r, 20.0 + (r % 97) / 10.0, 3.3 - (r % 13) / 100.0,
+				(int) (r % 1024));
+		if (size > end - at) {
+			size = end - at;
+		}
+
+		memcpy(bundle + at, record, size);
+		at += size;
+	}
+}
+
+static double compressDelay(void)
+{
+	return 1000.0;
+}
+
+static DelayModel compressModel = { "udpdelaybench-compress", "compress",
+		compressDelay, 0.0 };
+
+/* Queues bundles of one payload kind in a CLI, compressing or not, then
+ * releases them all; reports the cost per bundle of enqueueing (receive
+ * thread), scheduling and releasing (release thread), the enqueues over
+ * the receive thread's budget and the memory the bundles held */
+static int benchCompressKind(int kind, int compress, unsigned long bundles,
+		char *buffer, int length)
+{
+	DelayCli cli;
+	VInduct *vduct;
+	PsmAddress vductElt;
+	struct sockaddr_storage fromAddr;
+	DelayCompressStats *stats = &cli.compressor.stats;
+	unsigned int *table;
+	unsigned long long start, nsec, enqueueNsec, scheduleNsec, releaseNsec;
+	unsigned long long heldBytes, overruns, sentBytes = 0;
+	unsigned long long baseBytes = ionStub.memBytesLive;
+	unsigned long long acquiredBytes = ionStub.bytesAcquired;
+
+	findInduct("udp", "127.0.0.1:4556", &vduct, &vductElt);
+	memset(&cli, 0, sizeof cli);
+	cli.model = &compressModel;
+	cli.running = 1;
+	cli.work = bpGetAcqArea(vduct);
+	if (cli.work == NULL || initDelayQueue(&cli.queue, bundles + 1000) < 0
+	|| initDelayCliPipeline(&cli, vduct, 0) < 0) {
+		putErrmsg("Can't set up compression benchmark.", NULL);
+		return -1;
+	}
+
+	table = cli.compressor.table;
+	if (!compress) {
+		cli.compressor.table = NULL;
+	}
+
+	baseBytes = ionStub.memBytesLive;
+	loopbackAddress(&fromAddr, BpUdpDefaultPortNbr);
+	shiftedOffset = 0.0;
+	enqueueNsec = scheduleNsec = overruns = 0;
+	for (unsigned long i = 0; i < bundles; i++) {
+		/* A new bundle each time, or DEDUP=1 would drop the rest */
+		if ((length = dedupBundle(buffer)) < 0) {
+			putErrmsg("Can't generate bundle.", NULL);
+			break;
+		}
+
+		sentBytes += length;
+		if (kind > 0) {
+			fillPayload(buffer, length, kind, i);
+		}
+
+		start = benchNsec();
+		oK(delayCliEnqueue(&cli, NULL, buffer, length, &fromAddr));
+		nsec = benchNsec() - start;
+		enqueueNsec += nsec;
+		if (nsec > DELAY_RECEIVE_BUDGET_USEC * 1000ULL) {
+			overruns++;
+		}
+
+		if (cli.scheduleStage.count >= cli.scheduleStage.capacity / 2) {
+			start = benchNsec();
+			delayCliRelease(&cli);
+			scheduleNsec += benchNsec() - start;
+		}
+	}
+
+	start = benchNsec();
+	delayCliRelease(&cli);
+	scheduleNsec += benchNsec() - start;
+	heldBytes = ionStub.memBytesLive - baseBytes;
+
+	/* All due at once */
+	shiftedOffset = compressDelay() + 1.0;
+	start = benchNsec();
+	delayCliRelease(&cli);
+	releaseNsec = benchNsec() - start;
+	printf("%-10s %-4s %9.2f %9llu %9.2f %9.2f %7.2f %9llu %9llu %9.1f "
+			"%9llu\n", compressKindNames[kind],
+			compress ? "on" : "off",
+			(double) enqueueNsec / bundles / 1000.0, overruns,
+			(double) scheduleNsec / bundles / 1000.0,
+			(double) releaseNsec / bundles / 1000.0,
+			stats->packedBytes ? (double) stats->rawBytes
+			/ stats->packedBytes : 1.0, stats->compressed,
+			stats->bypassed, heldBytes / 1e6,
+			cli.stats.acquired);
+	cli.compressor.table = table;
+	closeDelayCliPipeline(&cli);
+	destroyDelayQueue(&cli.queue);
+	bpReleaseAcqArea(cli.work);
+	return cli.stats.acquired == bundles && stats->expandFailed == 0
+			&& ionStub.bytesAcquired - acquiredBytes
+			== sentBytes ? 0 : -1;
+}
+
+static int benchCompress(unsigned long bundles)
+{
+	char *buffer = malloc(UDPCLA_BUFSZ);
+	unsigned long acqNsec = ionStub.acqNsec;
+	int length, failures = 0;
+
+	if (!DELAY_COMPRESS) {
+		printf("compress: built without in-queue compression; rebuild "
+				"with COMPRESS=1\n");
+		free(buffer);
+		return -1;
+	}
+
+	if (buffer == NULL || (length = dedupBundle(buffer)) < 0) {
+		putErrmsg("Can't set up compression benchmark.", NULL);
+		free(buffer);
+		return -1;
+	}
+
+	gettimeofday(&shiftedEpoch, NULL);
+	setDelayClock(shiftedClock);
+	ionStub.acqNsec = 0;
+	printf("compress: %lu bundles of %d bytes per payload kind, queued "
+			"then released together, acquisition cost 0\n", bundles,
+			length);
+	printf("receive budget %d usec\n", DELAY_RECEIVE_BUDGET_USEC);
+	printf("%-10s %-4s %9s %9s %9s %9s %7s %9s %9s %9s %9s\n", "payload",
+			"cmp", "enq usec", "overruns", "sch usec", "rel usec",
+			"ratio", "packed", "bypassed", "held MB", "acquired");
+	for (int kind = 0; kind < COMPRESS_KINDS; kind++) {
+		for (int compress = 0; compress <= 1; compress++) {
+			if (benchCompressKind(kind, compress, bundles, buffer,
+					length) < 0) {
+				failures++;
+			}
+		}
+	}
+
+	setDelayClock(NULL);
+	ionStub.acqNsec = acqNsec;
+	free(buffer);
+	if (failures) {
+		printf("FAIL: bundles lost or altered\n");
+	}
+
+	return failures ? -1 : 0;
+}
+
+/*	*	*	Tiered delay queue	*	*	*	*	*/
+
+static double tierDelaySeconds = 1200.0;
+
+static double tierDelay(void)
+{
+	return tierDelaySeconds;
+}
+
+static DelayModel tierModel = { "udpdelaybench-tier", "tier", tierDelay,
+		0.0 };
+
+/* Largest RSS (KB) and bundle memory (bytes) seen so far */
+static void sampleTier(double *peakRss, unsigned long long *peakBytes)
+{
+	double rss = residentKb();
+
+	if (rss > *peakRss) {
+		*peakRss = rss;
+	}
+
+	if (ionStub.memBytesLive > *peakBytes) {
+		*peakBytes = ionStub.memBytesLive;
+	}
+}
+
+/* Offers bundles at rate per virtual second to a CLI running its own
+ * threads, on the accelerated clock, with the cold tier on or off, and
+ * samples RSS and the memory the bundles hold until all are acquired */
+static int benchTierRun(int tiered, unsigned long bundles, double rate,
+		char *buffer)
+{
+	DelayCli cli;
+	VInduct *vduct;
+	PsmAddress vductElt;
+	struct sockaddr_storage fromAddr;
+	DelayTierStats *stats = &cli.tier.stats;
+	DelayProfCounter *late = &delayProfile[PROF_RELEASE_LATE];
+	double baseRss, peakRss;
+	unsigned long long baseBytes, peakBytes;
+	int length;
+
+	findInduct("udp", "127.0.0.1:4556", &vduct, &vductElt);
+	memset(&cli, 0, sizeof cli);
+	cli.model = &tierModel;
+	cli.running = 1;
+	cli.work = bpGetAcqArea(vduct);
+	if (cli.work == NULL || initDelayQueue(&cli.queue, bundles
+			+ DELAY_STAGE_CAPACITY) < 0
+	|| initDelayCliPipeline(&cli, vduct, 1) < 0) {
+		putErrmsg("Can't set up tier benchmark CLI.", NULL);
+		return -1;
+	}
+
+	if (!tiered) {
+		cli.tier.horizonUsec = 0;
+	}
+
+	loopbackAddress(&fromAddr, BpUdpDefaultPortNbr);
+	memset(late, 0, sizeof(DelayProfCounter));
+	baseRss = peakRss = residentKb();
+	baseBytes = peakBytes = ionStub.memBytesLive;
+	gettimeofday(&soakEpoch, NULL);
+	soakRealStart = benchNsec();
+	setDelayClock(acceleratedClock);
+	if (startDelayCli(&cli) < 0) {
+		setDelayClock(NULL);
+		return -1;
+	}
+
+	for (unsigned long i = 0; i < bundles; i++) {
+		while (soakElapsed() < i / rate) {
+			sampleTier(&peakRss, &peakBytes);
+			microsnooze(1000);
+		}
+
+		/* A new bundle each time, or DEDUP=1 would drop the rest */
+		length = dedupBundle(buffer);
+		oK(delayCliEnqueue(&cli, NULL, buffer, length, &fromAddr));
+	}
+
+	while (cli.stats.acquired + cli.stats.acqFailed + cli.stats.stageFull
+			+ cli.stats.queueFull + cli.stats.duplicates
+			+ cli.stats.expired + cli.stats.linkLoss
+			+ cli.stats.coldUnreadable < bundles) {
+		sampleTier(&peakRss, &peakBytes);
+		microsnooze(10000);
+	}
+
+	stopDelayCli(&cli);
+	setDelayClock(NULL);
+	printf("%-4s %9.1f %9.1f %8llu %8llu %6llu %9.1f %9.1f %6llu "
+			"%9.1f %8llu\n", tiered ? "on" : "off",
+			(peakBytes - baseBytes) / 1e6, (peakRss - baseRss) / 1024.0,
+			stats->spilled, stats->promoted, stats->keptHot,
+			stats->maxLatenessUsec / 1000.0, stats->promoted
+			? stats->minMarginUsec / 1000.0 : 0.0,
+			stats->pastDeadline, late->maxNsec / 1e6,
+			cli.stats.acquired);
+	closeDelayCliPipeline(&cli);
+	destroyDelayQueue(&cli.queue);
+	bpReleaseAcqArea(cli.work);
+	return cli.stats.acquired == bundles && stats->pastDeadline == 0
+			&& (!tiered || stats->promoted == bundles) ? 0 : -1;
+}
+
+static int benchTier(unsigned long bundles, double rate)
+{
+	char *buffer = malloc(UDPCLA_BUFSZ);
+	unsigned long acqNsec = ionStub.acqNsec;
+	int length, failures = 0;
+
+	if (!DELAY_TIER) {
+		printf("tier: built without the cold tier; rebuild with "
+				"TIER=1\n");
+		free(buffer);
+		return -1;
+	}
+
+	if (buffer == NULL || (length = dedupBundle(buffer)) < 0) {
+		putErrmsg("Can't set up tier benchmark.", NULL);
+		free(buffer);
+		return -1;
+	}
+
+	ionStub.acqNsec = 0;
+	printf("tier: %lu bundles of %d bytes at %.0f/s, %.0f s delay, "
+			"horizon %d s, lead %d s, clock %.0fx real time "
+			"(times below are virtual)\n", bundles, length, rate,
+			tierDelaySeconds, DELAY_TIER_HORIZON_SEC,
+			DELAY_TIER_LEAD_SEC, soakAcceleration);
+	printf("%-4s %9s %9s %8s %8s %6s %9s %9s %6s %9s %8s\n", "tier",
+			"held MB", "RSS MB", "spilled", "promoted", "hot",
+			"late ms", "margin ms", "past", "rel ms", "acquired");
+
+	/* Tiered first: RAM freed by the other run may stay resident */
+	for (int tiered = 1; tiered >= 0; tiered--) {
+		if (benchTierRun(tiered, bundles, rate, buffer) < 0) {
+			failures++;
+		}
+	}
+
+	ionStub.acqNsec = acqNsec;
+	free(buffer);
+	if (failures) {
+		printf("FAIL: bundles lost, or promoted after their release "
+				"time\n");
+	}
+
+	return failures ? -1 : 0;
+}
+
+/*	*	*	Live handoff	*	*	*	*	*	*/
+
+/* The loopback CLI, then the CLO, hands over to a fresh instance part
+ * way through the run, as a new binary would take over; every bundle
+ * must still arrive, and the release gap and lateness are reported */
+
+/* The old CLI's main thread once its receive loop has ended */
+static void *retireCli(void *arg)
+{
+	LoopbackPair *pair = (LoopbackPair *) arg;
+
+	pthread_join(pair->cliThread, NULL);
+	stopDelayCli(&pair->cli);
+	closeDelayCliHandoff(&pair->cli);
+	if (pair->cli.handoff.requested) {
+		oK(delayCliHandOff(&pair->cli));
+	}
+
+	return NULL;
+}
+
+/* The old CLO's main thread.  The benchmark offers bundles itself, so
+ * there is no dequeue loop to end: it waits for the handoff thread. */
+static void *retireClo(void *arg)
+{
+	LoopbackPair *pair = (LoopbackPair *) arg;
+	DelayHandoff *handoff = &pair->clo.handoff;
+
+	pthread_join(handoff->thread, NULL);
+	handoff->threadStarted = 0;
+	stopDelayClo(&pair->clo);
+	closeDelayCloHandoff(&pair->clo);
+	if (handoff->requested) {
+		oK(delayCloHandOff(&pair->clo));
+	}
+
+	return NULL;
+}
+
+/* Connects a new instance to the old one's handoff socket */
+static int connectHandoff(DelayHandoff *handoff, char *daemonName)
+{
+	handoff->fd = connectDelayHandoff(daemonName, &handoff->peerPid);
+	if (handoff->fd < 0) {
+		return -1;
+	}
+
+	handoff->connected = 1;
+	return 0;
+}
+
+/* Sets up a CLI as openLoopback does, but with no socket of its own,
+ * takes over the pair's and starts its receive thread */
+static int handOffCli(LoopbackPair *pair, DelayCli *next, int capacity,
+		pthread_t *nextThread)
+{
+	pthread_t retirer;
+	int result;
+
+	memset(next, 0, sizeof(DelayCli));
+	next->model = &loopbackCliModel;
+	next->running = 1;
+	next->ductSocket = -1;
+	next->buffer = MTAKE(UDPCLA_BUFSZ);
+	next->work = bpGetAcqArea(pair->vinduct);
+	if (next->buffer == NULL || next->work == NULL
+	|| initDelayQueue(&next->queue, capacity) < 0
+	|| initDelayCliPipeline(next, pair->vinduct, benchAcqWorkers) < 0
+	|| connectHandoff(&next->handoff, next->model->daemonName) < 0
+	|| pthread_create(&retirer, NULL, retireCli, pair)) {
+		putErrmsg("Can't set up new CLI.", NULL);
+		return -1;
+	}
+
+	result = delayCliTakeOver(next);
+	if (result == 0 && pthread_create(nextThread, NULL, runCli, next)) {
+		result = -1;
+	}
+
+	pthread_join(retirer, NULL);
+	return result;
+}
+
+static int handOffClo(LoopbackPair *pair, DelayClo *next,
+		DelayCloDuct *nextDuct, int capacity, int releaseMode)
+{
+	pthread_t retirer;
+	int result;
+
+	memset(next, 0, sizeof(DelayClo));
+	next->model = &loopbackCloModel;
+	next->running = 1;
+	next->ductSocket = openDelaySocket(sinkFamily);
+	next->buffer = MTAKE(UDPCLA_BUFSZ);
+	*nextDuct = pair->duct;
+	memset(&nextDuct->stats, 0, sizeof(DelayCloStats));
+	nextDuct->clo = next;
+	next->ducts = nextDuct;
+	next->ductCount = 1;
+	if (next->ductSocket < 0 || next->buffer == NULL
+	|| initDelayQueue(&next->queue, capacity) < 0
+	|| initDelayCloRelease(next, releaseMode) < 0
+	|| initDelayCloPipeline(next, benchTransmitThreads) < 0
+	|| connectHandoff(&next->handoff, next->model->daemonName) < 0
+	|| pthread_create(&retirer, NULL, retireClo, pair)) {
+		putErrmsg("Can't set up new CLO.", NULL);
+		return -1;
+	}
+
+	result = delayCloTakeOver(next);
+	pthread_join(retirer, NULL);
+	return result;
+}
+
+static void printHandoff(char *name, DelayHandoff *old, DelayHandoff *next)
+{
+	printf("%-4s %8u %8u %10.2f %10.2f %6u %10.2f\n", name, old->bundles,
+			next->bundles, old->gapUsec / 1000.0,
+			next->gapUsec / 1000.0, next->late,
+			next->maxLateUsec / 1000.0);
+}
+
+static int benchHandoff(unsigned long bundles, double rate, int capacity,
+		int releaseMode)
+{
+	LoopbackPair pair;
+	DelayClo *nextClo = MTAKE(sizeof(DelayClo));
+	DelayCli *nextCli = MTAKE(sizeof(DelayCli));
+	DelayCloDuct nextDuct;
+	DelayClo *clo = &pair.clo;
+	DelayCloDuct *duct = &pair.duct;
+	pthread_t nextCliThread;
+	Object bundleZco;
+	BpAncillaryData ancillaryData;
+	unsigned long long settled, offered, acquired;
+	double configured = loopbackCloDelay + loopbackCliDelay;
+
+	if (loopbackShm) {
+		printf("handoff: shared-memory inducts can't be handed over\n");
+		return -1;
+	}
+
+	latencyLimit = bundles;
+	latencies = malloc(bundles * sizeof(unsigned long long));
+	if (nextClo == NULL || nextCli == NULL || latencies == NULL
+	|| openLoopback(&pair, capacity, releaseMode) < 0) {
+		return -1;
+	}
+
+	/* The CLO's handoff thread ends the duct's semaphore */
+	pair.clo.ducts = &pair.duct;
+	pair.clo.ductCount = 1;
+	if (listenDelayCloHandoff(&pair.clo) < 0
+	|| listenDelayCliHandoff(&pair.cli) < 0) {
+		return -1;
+	}
+
+	ionStub.acquired = noteAcquired;
+	ionStub.bundleRate = rate;
+	printf("handoff: %lu bundles of %u bytes at %.0f/s, delay %.3f s "
+			"(CLO %.3f + CLI %.3f), %s release; the CLI hands over "
+			"after %lu, the CLO after %lu\n", bundles,
+			ionStub.bundleSize, rate, configured, loopbackCloDelay,
+			loopbackCliDelay, delayReleaseModeNames[clo->releaseMode],
+			bundles / 3, 2 * bundles / 3);
+	fflush(stdout);
+	if (startLoopback(&pair) < 0) {
+		return -1;
+	}
+
+	for (unsigned long i = 0; i < bundles; i++) {
+		if (i == bundles / 3 && handOffCli(&pair, nextCli, capacity,
+				&nextCliThread) < 0) {
+			return -1;
+		}
+
+		if (i == 2 * bundles / 3) {
+			if (handOffClo(&pair, nextClo, &nextDuct, capacity,
+					releaseMode) < 0) {
+				return -1;
+			}
+
+			clo = nextClo;
+			duct = &nextDuct;
+		}
+
+		if (bpDequeue(pair.voutduct, &bundleZco, &ancillaryData, 0) < 0
+		|| bundleZco == 0) {
+			break;
+		}
+
+		if (delayCloEnqueue(clo, duct, bundleZco, &ancillaryData) < 0) {
+			break;
+		}
+	}
+
+	/* Drain, as the loopback does */
+	offered = pair.clo.stats.dequeued + nextClo->stats.dequeued;
+	settled = benchNsec();
+	do {
+		microsnooze(10000);
+		acquired = pair.cli.stats.acquired + nextCli->stats.acquired;
+	} while (acquired < offered && benchNsec() - settled
+			< (unsigned long long) ((configured + 10.0) * 1e9));
+
+	stopDelayClo(nextClo);
+	nextCli->running = 0;
+	pthread_join(nextCliThread, NULL);
+	stopDelayCli(nextCli);
+	ionStub.acquired = NULL;
+
+	printf("%-4s %8s %8s %10s %10s %6s %10s\n", "", "handed", "taken",
+			"stream ms", "gap ms", "late", "max late ms");
+	printHandoff("cli", &pair.cli.handoff, &nextCli->handoff);
+	printHandoff("clo", &pair.clo.handoff, &nextClo->handoff);
+	printf("offered %llu, acquired %llu (old CLI %llu, new CLI %llu), "
+			"lost %lld; longest pause between acquisitions %.2f "
+			"ms\n", offered, acquired, pair.cli.stats.acquired,
+			nextCli->stats.acquired, (long long) (offered - acquired),
+			maxAcquireGap / 1e6);
+	if (latencyCount > 0) {
+		qsort(latencies, latencyCount, sizeof latencies[0],
+				compareLatency);
+		printf("delay   configured %.3f ms, error p50 %+.3f ms, p99 "
+				"%+.3f ms, max %+.3f ms\n", configured * 1e3,
+				latencyPercentile(0.50) - configured * 1e3,
+				latencyPercentile(0.99) - configured * 1e3,
+				latencyPercentile(1.0) - configured * 1e3);
+	}
+
+	fflush(stdout);
+
+	/* The old pair is stopped and empty; close the new instances */
+	closeLoopback(&pair);
+	closeDelayCloPipeline(nextClo);
+	closeDelayCloRelease(nextClo);
+	close(nextClo->ductSocket);
+	destroyDelayQueue(&nextClo->queue);
+	MRELEASE(nextClo->buffer);
+	closeDelayCliPipeline(nextCli);
+	drainDelayed(&nextCli->queue, freeQueuedData, NULL);
+	close(nextCli->ductSocket);
+	destroyDelayQueue(&nextCli->queue);
+	bpReleaseAcqArea(nextCli->work);
+	MRELEASE(nextCli->buffer);
+	MRELEASE(nextClo);
+	MRELEASE(nextCli);
+	free(latencies);
+	if (acquired < offered) {
+		printf("FAIL: bundles lost in the handoff\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*	*	*	Outducts per process	*	*	*	*	*/
+
+static DelayModel ductsModel = { "udpdelaybench-ducts", "ducts", cloDelay,
+		0.0 };
+static volatile int sinkRunning;
+static unsigned long long sinkReceived;
+
+/* Counts datagrams arriving at the sink until sinkRunning is cleared */
+static void *countingSink(void *arg)
+{
+	int sink = *(int *) arg;
+	struct timeval timeout = { 0, 100000 };
+	char buffer[UDPCLA_BUFSZ];
+
+	setsockopt(sink, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	while (sinkRunning) {
+		if (recv(sink, buffer, sizeof buffer, 0) >= 0) {
+			sinkReceived++;
+		}
+	}
+
+	return NULL;
+}
+
+static void *runDuct(void *arg)
+{
+	DelayCloDuct *duct = (DelayCloDuct *) arg;
+
+	if (delayCloServe(duct->clo, duct) < 0) {
+		putErrmsg("Duct dequeue loop failed.", duct->ductName);
+	}
+
+	return NULL;
+}
+
+static int threadCount(void)
+{
+	FILE *status = fopen("/proc/self/status", "r");
+	char line[256];
+	int threads = -1;
+
+	if (status == NULL) {
+		return -1;
+	}
+
+	while (fgets(line, sizeof line, status)) {
+		if (sscanf(line, "Threads: %d", &threads) == 1) {
+			break;
+		}
+	}
+
+	fclose(status);
+	return threads;
+}
+
+static double processCpuSeconds(void)
+{
+	struct timespec cpu;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+	return cpu.tv_sec + cpu.tv_nsec / 1e9;
+}
+
+/* Serves ductCount outducts, each with its own dequeue thread, from one
+ * shared CLO or from one CLO per duct (as one daemon per duct would),
+ * offers bundles to all of them and measures CPU per bundle; then,
+ * with every thread blocked, the thread count and idle CPU. */
+static int benchDuctLayout(int ductCount, int shared, unsigned long bundles,
+		double rate, int capacity, int releaseMode)
+{
+	int cloCount = shared ? 1 : ductCount;
+	DelayClo *clos = calloc(cloCount, sizeof(DelayClo));
+	DelayCloDuct *ducts = calloc(ductCount, sizeof(DelayCloDuct));
+	struct sockaddr_storage sinkName;
+	PsmAddress vductElt;
+	pthread_t sinkThread;
+	unsigned long long start, dequeued, pending;
+	double busyCpu, idleCpu;
+	char ductName[32];
+	int sink, threads, started = 0;
+
+	sink = openSink(&sinkName);
+	if (clos == NULL || ducts == NULL || sink < 0) {
+		putErrmsg("Can't set up outduct benchmark.", NULL);
+		return -1;
+	}
+
+	for (int i = 0; i < cloCount; i++) {
+		DelayClo *clo = &clos[i];
+
+		clo->model = &ductsModel;
+		clo->running = 1;
+		clo->ductSocket = openDelaySocket(sinkFamily);
+		clo->buffer = MTAKE(UDPCLA_BUFSZ);
+		clo->ducts = shared ? ducts : &ducts[i];
+		clo->ductCount = shared ? ductCount : 1;
+		if (clo->ductSocket < 0 || clo->buffer == NULL
+		|| initDelayQueue(&clo->queue, capacity * clo->ductCount) < 0
+		|| initDelayCloRelease(clo, releaseMode) < 0
+		|| initDelayCloPipeline(clo, benchTransmitThreads) < 0) {
+			putErrmsg("Can't set up outduct benchmark CLO.", NULL);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < ductCount; i++) {
+		isprintf(ductName, sizeof ductName, "127.0.0.1:%d", 5000 + i);
+		findOutduct("udp", ductName, &ducts[i].vduct, &vductElt);
+		if (vductElt == 0) {
+			putErrmsg("Can't find stub outduct.", ductName);
+			return -1;
+		}
+
+		ducts[i].clo = shared ? &clos[0] : &clos[i];
+		ducts[i].ductName = ducts[i].vduct->ductName;
+		memcpy(&ducts[i].socketName, &sinkName, sizeof sinkName);
+	}
+
+	/* Fresh synthetic traffic, paced from the first dequeue */
+	ionStub.bundlesDequeued = 0;
+	ionStub.bundleLimit = bundles;
+	ionStub.bundleRate = rate;
+	sinkReceived = 0;
+	sinkRunning = 1;
+	if (pthread_create(&sinkThread, NULL, countingSink, &sink)) {
+		putSysErrmsg("Can't start sink thread", NULL);
+		return -1;
+	}
+
+	busyCpu = processCpuSeconds();
+	for (int i = 0; i < cloCount; i++) {
+		if (startDelayClo(&clos[i]) < 0) {
+			return -1;
+		}
+	}
+
+	for (started = 0; started < ductCount; started++) {
+		if (pthread_create(&ducts[started].dequeueThread, NULL, runDuct,
+				&ducts[started])) {
+			putSysErrmsg("Can't start dequeue thread", NULL);
+			break;
+		}
+	}
+
+	/* Wait for every bundle to be sent, then for the CLOs to idle */
+	start = benchNsec();
+	do {
+		microsnooze(10000);
+		dequeued = pending = 0;
+		for (int i = 0; i < cloCount; i++) {
+			DelayCloStats *stats = &clos[i].stats;
+
+			dequeued += stats->dequeued;
+			pending += stats->dequeued - stats->sent
+					- stats->sendFailed - stats->queueFull
+					- stats->linkLoss;
+		}
+	} while ((dequeued < bundles || pending > 0) && benchNsec() - start
+			< (unsigned long long) ((bundles / rate
+			+ loopbackCloDelay + 10.0) * 1e9));
+
+	busyCpu = processCpuSeconds() - busyCpu;
+	microsnooze(200000);
+	threads = threadCount() - 2;	/* Not the main and sink threads */
+	idleCpu = processCpuSeconds();
+	microsnooze(1000000);
+	idleCpu = processCpuSeconds() - idleCpu;
+	for (int i = 0; i < cloCount; i++) {
+		clos[i].running = 0;
+	}
+
+	for (int i = 0; i < ductCount; i++) {
+		sm_SemEnd(ducts[i].vduct->semaphore);
+	}
+
+	while (started > 0) {
+		pthread_join(ducts[--started].dequeueThread, NULL);
+	}
+
+	for (int i = 0; i < cloCount; i++) {
+		stopDelayClo(&clos[i]);
+	}
+
+	sinkRunning = 0;
+	pthread_join(sinkThread, NULL);
+	printf("%5d %9s %6d %8d %10.2f %14.1f %10llu\n", ductCount,
+			shared ? "shared" : "per-duct", cloCount, threads,
+			idleCpu * 100.0, busyCpu * 1e6 / bundles, sinkReceived);
+	fflush(stdout);
+	for (int i = 0; i < cloCount; i++) {
+		closeDelayCloPipeline(&clos[i]);
+		closeDelayCloRelease(&clos[i]);
+		destroyDelayQueue(&clos[i].queue);
+		MRELEASE(clos[i].buffer);
+		close(clos[i].ductSocket);
+	}
+
+	close(sink);
+	free(clos);
+	free(ducts);
+	return 0;
+}
+
+static int benchDucts(int maxDucts, unsigned long bundles, double rate,
+		int capacity, int releaseMode)
+{
+	printf("ducts: %lu bundles of %u bytes at %.0f/s over all ducts, "
+			"delay %.3f s, queue capacity %d per duct, %s release, "
+			"%d transmit threads per CLO, %ld CPUs\n", bundles,
+			ionStub.bundleSize, rate, loopbackCloDelay, capacity,
+			delayReleaseModeNames[releaseMode], benchTransmitThreads,
+			sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%5s %9s %6s %8s %10s %14s %10s\n", "ducts", "layout", "CLOs",
+			"threads", "idle CPU%", "CPU us/bundle", "delivered");
+	for (int ducts = 1; ducts <= maxDucts; ducts *= 2) {
+		if (benchDuctLayout(ducts, 0, bundles, rate, capacity,
+				releaseMode) < 0
+		|| benchDuctLayout(ducts, 1, bundles, rate, capacity,
+				releaseMode) < 0) {
+			return -1;
+		}
+	}
+
+	ionStub.bundleLimit = 0;
+	ionStub.quiet = 0;
+	ionStubReport();
+	return 0;
+}
+
+/*	*	*	Inducts per process	*	*	*	*	*/
+
+static DelayModel inductsModel = { "udpdelaybench-inducts", "inducts",
+		cliDelay, 0.0 };
+
+/* Serves ductCount inducts from one shared CLI, with one receive thread
+ * for all sockets, or from one CLI per induct (as one daemon per induct
+ * would), sends bundles to all of them in turn and measures CPU per
+ * bundle; then, with every thread blocked, the thread count and idle
+ * CPU. */
+static int benchInductLayout(int ductCount, int shared, unsigned long bundles,
+		double rate, int capacity)
+{
+	int cliCount = shared ? 1 : ductCount;
+	DelayCli *clis = calloc(cliCount, sizeof(DelayCli));
+	DelayCliDuct *ducts = calloc(ductCount, sizeof(DelayCliDuct));
+	pthread_t *receivers = calloc(cliCount, sizeof(pthread_t));
+	struct sockaddr_storage *names = calloc(ductCount,
+			sizeof(struct sockaddr_storage));
+	VInduct *vduct;
+	PsmAddress vductElt;
+	ZcoReader reader;
+	Object bundleZco;
+	char *datagram = MTAKE(UDPCLA_BUFSZ);
+	unsigned long long start, done, acquired;
+	double busyCpu, idleCpu;
+	int sender, length, threads;
+
+	findInduct("udp", "127.0.0.1", &vduct, &vductElt);
+	sender = openDelaySocket(sinkFamily);
+	if (clis == NULL || ducts == NULL || receivers == NULL || names == NULL
+	|| datagram == NULL || sender < 0) {
+		putErrmsg("Can't set up induct benchmark.", NULL);
+		return -1;
+	}
+
+	for (int i = 0; i < cliCount; i++) {
+		DelayCli *cli = &clis[i];
+
+		cli->model = &inductsModel;
+		cli->running = 1;
+		cli->ductSocket = -1;
+		cli->buffer = MTAKE(UDPCLA_BUFSZ);
+		cli->ducts = shared ? ducts : &ducts[i];
+		cli->ductCount = shared ? ductCount : 1;
+		if (cli->buffer == NULL
+		|| initDelayQueue(&cli->queue, capacity * cli->ductCount) < 0
+		|| initDelayCliPipeline(cli, NULL, benchAcqWorkers) < 0) {
+			putErrmsg("Can't set up induct benchmark CLI.", NULL);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < ductCount; i++) {
+		ducts[i].vduct = vduct;
+		ducts[i].ductName = vduct->ductName;
+		ducts[i].fixedDelay = -1.0;
+		ducts[i].ductSocket = openSink(&names[i]);
+		if (ducts[i].ductSocket < 0
+		|| openDelayCliDuct(shared ? &clis[0] : &clis[i],
+				&ducts[i]) < 0) {
+			return -1;
+		}
+	}
+
+	/* One synthetic bundle, sent to each induct in turn */
+	bundleZco = ionStubCreateBundle();
+	zco_start_transmitting(bundleZco, &reader);
+	length = zco_transmit(getIonsdr(), &reader, zco_length(getIonsdr(),
+			bundleZco), datagram);
+	if (sdr_begin_xn(getIonsdr())) {
+		zco_destroy(getIonsdr(), bundleZco);
+		oK(sdr_end_xn(getIonsdr()));
+	}
+
+	busyCpu = processCpuSeconds();
+	for (int i = 0; i < cliCount; i++) {
+		if (startDelayCli(&clis[i]) < 0
+		|| pthread_create(&receivers[i], NULL, runCli, &clis[i])) {
+			putErrmsg("Can't start induct benchmark CLI.", NULL);
+			return -1;
+		}
+	}
+
+	start = benchNsec();
+	for (unsigned long i = 0; i < bundles; i++) {
+		unsigned long long due = start + (unsigned long long)
+				(i * (1e9 / rate));
+		unsigned long long now = benchNsec();
+
+		if (now < due) {
+			microsnooze((due - now) / 1000);
+		}
+
+		oK(sendto(sender, datagram, length, 0, (struct sockaddr *)
+				&names[i % ductCount],
+				delayAddressLength(&names[0])));
+	}
+
+	/* Wait until every received bundle has been handled */
+	start = benchNsec();
+	do {
+		microsnooze(10000);
+		done = acquired = 0;
+		for (int i = 0; i < cliCount; i++) {
+			DelayCliStats *stats = &clis[i].stats;
+
+			acquired += stats->acquired;
+			done += stats->acquired + stats->queueFull
+					+ stats->stageFull + stats->linkLoss
+					+ stats->acqFailed;
+		}
+	} while (done < bundles && benchNsec() - start < (unsigned long long)
+			((loopbackCliDelay + 2.0) * 1e9));
+
+	busyCpu = processCpuSeconds() - busyCpu;
+	microsnooze(200000);
+	threads = threadCount() - 1;	/* Not the main thread */
+	idleCpu = processCpuSeconds();
+	microsnooze(1000000);
+	idleCpu = processCpuSeconds() - idleCpu;
+	for (int i = 0; i < cliCount; i++) {
+		clis[i].running = 0;
+	}
+
+	for (int i = 0; i < cliCount; i++) {
+		pthread_join(receivers[i], NULL);
+		stopDelayCli(&clis[i]);
+	}
+
+	printf("%7d %9s %6d %8d %10.2f %14.1f %10llu\n", ductCount,
+			shared ? "shared" : "per-duct", cliCount, threads,
+			idleCpu * 100.0, busyCpu * 1e6 / bundles, acquired);
+	fflush(stdout);
+	for (int i = 0; i < cliCount; i++) {
+		DelayQueue *queue = &clis[i].queue;
+
+		drainDelayed(queue, freeQueuedData, NULL);
+		closeDelayCliPipeline(&clis[i]);
+		destroyDelayQueue(queue);
+		MRELEASE(clis[i].buffer);
+	}
+
+	for (int i = 0; i < ductCount; i++) {
+		closeDelayCliDuct(&ducts[i]);
+		close(ducts[i].ductSocket);
+	}
+
+	close(sender);
+	MRELEASE(datagram);
+	free(clis);
+	free(ducts);
+	free(receivers);
+	free(names);
+	return 0;
+}
+
+static int benchInducts(int maxDucts, unsigned long bundles, double rate,
+		int capacity)
+{
+	printf("inducts: %lu bundles of %u bytes at %.0f/s over all inducts, "
+			"delay %.3f s, queue capacity %d per induct, %d "
+			"acquisition workers per CLI, %ld CPUs\n", bundles,
+			ionStub.bundleSize, rate, loopbackCliDelay, capacity,
+			benchAcqWorkers, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%7s %9s %6s %8s %10s %14s %10s\n", "inducts", "layout", "CLIs",
+			"threads", "idle CPU%", "CPU us/bundle", "acquired");
+	for (int ducts = 1; ducts <= maxDucts; ducts *= 2) {
+		if (benchInductLayout(ducts, 0, bundles, rate, capacity) < 0
+		|| benchInductLayout(ducts, 1, bundles, rate, capacity) < 0) {
+			return -1;
+		}
+	}
+
+	ionStub.quiet = 0;
+	ionStubReport();
+	return 0;
+}
+
+/*	*	*	Release jitter under contention	*	*	*	*/
+
+#define MEMORY_HOG_BYTES	(64 * 1024 * 1024)
+
+static volatile int loadRunning;
+static volatile int receiverRunning;
+static double jitterDelaySeconds = 0.1;
+static long long *lateness;		/* Arrival - release time, nsec */
+static unsigned long latenessLimit;
+static unsigned long latenessCount;
+
+static void *cpuSpinner(void *arg)
+{
+	while (loadRunning) {
+		/* spin */
+	}
+
+	return NULL;
+}
+
+static void *memoryHog(void *arg)
+{
+	char *from = malloc(MEMORY_HOG_BYTES);
+	char *to = malloc(MEMORY_HOG_BYTES);
+
+	if (from && to) {
+		memset(from, 1, MEMORY_HOG_BYTES);
+		while (loadRunning) {
+			memcpy(to, from, MEMORY_HOG_BYTES);
+		}
+	}
+
+	free(from);
+	free(to);
+	return NULL;
+}
+
+static void *sdrStorm(void *arg)
+{
+	Sdr sdr = getIonsdr();
+
+	while (loadRunning) {
+		if (sdr_begin_xn(sdr)) {
+			oK(sdr_end_xn(sdr));
+		}
+	}
+
+	return NULL;
+}
+
+/* Timestamps each datagram as it arrives; the release time is the
+ * stub's creation stamp plus the configured delay */
+static void *jitterReceiver(void *arg)
+{
+	int sink = *(int *) arg;
+	unsigned char buffer[UDPCLA_BUFSZ];
+	struct timeval timeout = { 0, 100000 };
+	struct timespec now;
+	unsigned long long created;
+	int length;
+
+	setsockopt(sink, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	while (receiverRunning) {
+		length = recv(sink, buffer, sizeof buffer, 0);
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (length < STUB_STAMP_LENGTH + 1 || latenessCount >= latenessLimit) {
+			continue;
+		}
+
+		unsigned char *trailer = buffer + length - STUB_STAMP_LENGTH - 1;
+		if (memcmp(trailer, "UDSB", 4) != 0) {
+			continue;
+		}
+
+		created = 0;
+		for (int i = 0; i < 8; i++) {
+			created = (created << 8) | trailer[4 + i];
+		}
+
+		lateness[latenessCount++] = ((long long) now.tv_sec
+				* 1000000000LL + now.tv_nsec) - (long long) created
+				- (long long) (jitterDelaySeconds * 1e9);
+	}
+
+	return NULL;
+}
+
+static int compareLateness(const void *a, const void *b)
+{
+	long long x = *(long long *) a;
+	long long y = *(long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double latenessPercentile(double fraction)
+{
+	return lateness[(unsigned long) (fraction * (latenessCount - 1))] / 1e3;
+}
+
+static double fixedDelay(void)
+{
+	return jitterDelaySeconds;
+}
+
+static DelayModel jitterModel = { "udpdelaybench", "jitter", fixedDelay, 0.0 };
+
+/* Short name of a set of real-time settings, e.g. "pin0+fifo50" */
+static void nameRealtime(DelayRealtime *rt, char *name, int size)
+{
+	int length = 0;
+
+	name[0] = '\0';
+	for (int cpu = 0; cpu < (int) (8 * sizeof rt->releaseCpus); cpu++) {
+		if (rt->releaseCpus & (1UL << cpu)) {
+			length += snprintf(name + length, size - length,
+					"%spin%d", length ? "+" : "", cpu);
+			break;
+		}
+	}
+
+	if (rt->priority > 0 && length < size) {
+		length += snprintf(name + length, size - length, "%sfifo%d",
+				length ? "+" : "", rt->priority);
+	}
+
+	if (rt->lockMemory && length < size) {
+		length += snprintf(name + length, size - length, "%smlock",
+				length ? "+" : "");
+	}
+
+	if (rt->spinUsec > 0 && length < size) {
+		length += snprintf(name + length, size - length, "%sspin%ld",
+				length ? "+" : "", rt->spinUsec);
+	}
+
+	if (length == 0) {
+		snprintf(name, size, "none");
+	}
+}
+
+static int benchJitterMode(int releaseMode, unsigned long bundles,
+		double rate, int loads[3], DelayRealtime *rt)
+{
+	DelayClo clo;
+	VOutduct *vduct;
+	PsmAddress vductElt;
+	Object bundleZco;
+	BpAncillaryData ancillaryData;
+	struct sockaddr_storage sinkName;
+	struct timespec due;
+	pthread_t receiverThread;
+	pthread_t loadThreads[64];
+	void *(*loadFunctions[3])(void *) = { cpuSpinner, memoryHog, sdrStorm };
+	int loadCount = 0, early = 0;
+	int sink;
+	char *modeName;
+	char setting[48];
+
+	findOutduct("udp", "127.0.0.1", &vduct, &vductElt);
+	memset(&clo, 0, sizeof clo);
+	clo.model = &jitterModel;
+	clo.running = 1;
+	clo.rt = *rt;
+	sink = openSink(&sinkName);
+	memcpy(&clo.socketName, &sinkName, sizeof sinkName);
+	clo.ductSocket = openDelaySocket(sinkFamily);
+	clo.buffer = MTAKE(UDPCLA_BUFSZ);
+	if (sink < 0 || clo.ductSocket < 0 || clo.buffer == NULL
+	|| initDelayQueue(&clo.queue, (int) (rate * jitterDelaySeconds * 2)
+			+ 100) < 0
+	|| initDelayCloRelease(&clo, releaseMode) < 0
+	|| initDelayCloPipeline(&clo, benchTransmitThreads) < 0) {
+		putErrmsg("Can't set up jitter benchmark CLO.", NULL);
+		return -1;
+	}
+
+	modeName = (char *) delayReleaseModeNames[clo.releaseMode];
+	latenessCount = 0;
+	loadRunning = receiverRunning = 1;
+	for (int kind = 0; kind < 3; kind++) {
+		for (int i = 0; i < loads[kind] && loadCount < 64; i++) {
+			if (pthread_create(&loadThreads[loadCount], NULL,
+					loadFunctions[kind], NULL) == 0) {
+				loadCount++;
+			}
+		}
+	}
+
+	if (pthread_create(&receiverThread, NULL, jitterReceiver, &sink)
+	|| startDelayClo(&clo) < 0) {
+		putErrmsg("Can't start jitter benchmark threads.", NULL);
+		return -1;
+	}
+
+	/* The release thread applies the settings itself; report any
+	 * the process wasn't allowed */
+	if (lockDelayMemory(&clo.rt, jitterModel.daemonName) < 0) {
+		fprintf(stderr, "jitter: can't lock memory (needs "
+				"CAP_IPC_LOCK), running without\n");
+		clo.rt.lockMemory = 0;
+	}
+
+	if (clo.rt.priority > 0) {
+		struct sched_param param;
+		int policy = SCHED_OTHER;
+
+		microsnooze(10000);
+		pthread_getschedparam(clo.releaseThread, &policy, &param);
+		if (policy != SCHED_FIFO) {
+			fprintf(stderr, "jitter: can't set SCHED_FIFO priority "
+					"%d (needs CAP_SYS_NICE), running without\n",
+					clo.rt.priority);
+			clo.rt.priority = 0;
+		}
+	}
+
+	nameRealtime(&clo.rt, setting, sizeof setting);
+
+	/* Offer bundles at a fixed rate */
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	for (unsigned long i = 0; i < bundles; i++) {
+		long long step = (long long) (1e9 / rate);
+
+		due.tv_nsec += step % 1000000000LL;
+		due.tv_sec += step / 1000000000LL + due.tv_nsec / 1000000000L;
+		due.tv_nsec %= 1000000000L;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		if (bpDequeue(vduct, &bundleZco, &ancillaryData, 0) < 0
+		|| bundleZco == 0
+		|| delayCloEnqueue(&clo, NULL, bundleZco, &ancillaryData) < 0) {
+			break;
+		}
+	}
+
+	/* Let the last releases arrive */
+	microsnooze((unsigned int) (jitterDelaySeconds * 1e6) + 200000);
+	for (int i = 0; i < 50 && clo.queue.count > 0; i++) {
+		microsnooze(100000);
+	}
+
+	stopDelayClo(&clo);
+	microsnooze(50000);
+	receiverRunning = 0;
+	pthread_join(receiverThread, NULL);
+	loadRunning = 0;
+	for (int i = 0; i < loadCount; i++) {
+		pthread_join(loadThreads[i], NULL);
+	}
+
+	if (latenessCount > 0) {
+		qsort(lateness, latenessCount, sizeof lateness[0],
+				compareLateness);
+		for (unsigned long i = 0; i < latenessCount && lateness[i] < 0; i++) {
+			early++;
+		}
+
+		printf("%-8s %3d %-26s %4d %4d %4d %8lu %8d %9.1f %9.1f %9.1f "
+				"%9.1f %9.1f\n", modeName, clo.transmitThreads,
+				setting, loads[0], loads[1], loads[2],
+				latenessCount, early,
+				latenessPercentile(0.5), latenessPercentile(0.9),
+				latenessPercentile(0.99), latenessPercentile(0.999),
+				latenessPercentile(1.0));
+	} else {
+		printf("%-8s %3d %-26s %4d %4d %4d %8d   (nothing received)\n",
+				modeName, clo.transmitThreads, setting,
+				loads[0], loads[1], loads[2], 0);
+	}
+
+	fflush(stdout);
+	unlockDelayMemory(&clo.rt);
+	closeDelayCloPipeline(&clo);
+	closeDelayCloRelease(&clo);
+	close(clo.ductSocket);
+	close(sink);
+	destroyDelayQueue(&clo.queue);
+	MRELEASE(clo.buffer);
+	return 0;
+}
+
+static int benchJitter(char *modeName, unsigned long bundles, double rate,
+		int loads[3], DelayRealtime *rt, int sweep)
+{
+	DelayRealtime settings[6];
+	int settingCount = 1;
+	int result = 0;
+
+	/* -R: no settings, each alone, then all together */
+	settings[0] = *rt;
+	if (sweep) {
+		memset(settings, 0, sizeof settings);
+		settings[1].releaseCpus = rt->releaseCpus ? rt->releaseCpus : 1;
+		settings[2].priority = rt->priority > 0 ? rt->priority : 50;
+		settings[3].lockMemory = 1;
+		settings[4].spinUsec = rt->spinUsec > 0 ? rt->spinUsec : 100;
+		settings[5].releaseCpus = settings[1].releaseCpus;
+		settings[5].priority = settings[2].priority;
+		settings[5].lockMemory = 1;
+		settings[5].spinUsec = settings[4].spinUsec;
+		settingCount = 6;
+	}
+
+	latenessLimit = bundles;
+	lateness = malloc(bundles * sizeof(long long));
+	if (lateness == NULL) {
+		putErrmsg("Can't allocate lateness samples.", NULL);
+		return -1;
+	}
+
+	printf("jitter: %lu bundles at %.0f/s, delay %.3f s, lateness of "
+			"arrival vs release time (usec)\n", bundles, rate,
+			jitterDelaySeconds);
+	printf("%-8s %3s %-26s %4s %4s %4s %8s %8s %9s %9s %9s %9s %9s\n",
+			"mode", "tx", "setting", "cpu", "mem", "sdr", "count",
+			"early", "p50", "p90", "p99", "p99.9", "max");
+	for (int mode = DELAY_RELEASE_POLL; mode <= DELAY_RELEASE_TXTIME;
+			mode++) {
+		if (strcmp(modeName, "all") != 0
+		&& strcmp(modeName, delayReleaseModeNames[mode]) != 0) {
+			continue;
+		}
+
+		for (int i = 0; i < settingCount && result == 0; i++) {
+			result = benchJitterMode(mode, bundles, rate, loads,
+					&settings[i]);
+		}
+
+		if (result < 0) {
+			break;
+		}
+	}
+
+	free(lateness);
+	return result;
+}
+
+/*	*	*	Kernel netem offload	*	*	*	*	*/
+
+/* A constant-delay CLO with netem on the bench interface (-I) holding
+ * the datagrams, then with its own delay queue, sending to a local
+ * receiver; CPU, memory and delay are compared */
+
+static char *netemInterface = NULL;
+static DelayModel netemModel = { "udpdelaybench-netem", "preset", cloDelay,
+		0.0, 1 };
+static volatile int netemSampling;
+
+typedef struct {
+	DelayClo	*clo;
+	double		peakRss;
+	unsigned long long peakSdrBytes;	/* ZCOs held */
+	unsigned int	peakNetemBytes;		/* Datagrams netem holds */
+	pthread_t	thread;
+} NetemSampler;
+
+/* Takes the peaks every 10 ms until netemSampling is cleared */
+static void *sampleNetem(void *arg)
+{
+	NetemSampler *sampler = (NetemSampler *) arg;
+	DelayNetemStats stats;
+	double rss;
+
+	while (netemSampling) {
+		rss = residentKb();
+		if (rss > sampler->peakRss) {
+			sampler->peakRss = rss;
+		}
+
+		if (ionStubSdrBytes() > sampler->peakSdrBytes) {
+			sampler->peakSdrBytes = ionStubSdrBytes();
+		}
+
+		if (readDelayNetem(&sampler->clo->netem, &stats) == 0
+		&& stats.heldBytes > sampler->peakNetemBytes) {
+			sampler->peakNetemBytes = stats.heldBytes;
+		}
+
+		microsnooze(10000);
+	}
+
+	return NULL;
+}
+
+/* Records each datagram's delay from the stub bundle's creation stamp
+ * until sinkRunning is cleared */
+static void *stampingSink(void *arg)
+{
+	int sink = *(int *) arg;
+	struct timeval timeout = { 0, 100000 };
+	unsigned char buffer[UDPCLA_BUFSZ];
+	unsigned long long created;
+	struct timespec now;
+	int length;
+
+	setsockopt(sink, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	while (sinkRunning) {
+		length = recv(sink, buffer, sizeof buffer, 0);
+		if (length < 0) {
+			continue;
+		}
+
+		sinkReceived++;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (ionStubStampTime(buffer, length, &created) == 0
+		&& latencyCount < latencyLimit) {
+			latencies[latencyCount++] = ((unsigned long long)
+					now.tv_sec * 1000000000ULL
+					+ now.tv_nsec) - created;
+		}
+	}
+
+	return NULL;
+}
+
+static void closeNetemRun(DelayClo *clo, int sink)
+{
+	Sdr sdr = getIonsdr();
+
+	closeDelayCloNetem(clo);
+	if (sdr_begin_xn(sdr)) {
+		drainDelayed(&clo->queue, destroyQueuedZco, NULL);
+		if (sdr_end_xn(sdr) < 0) {
+			putErrmsg("Can't destroy queued bundle ZCOs.", NULL);
+		}
+	}
+
+	closeDelayCloPipeline(clo);
+	closeDelayCloRelease(clo);
+	destroyDelayQueue(&clo->queue);
+	close(clo->ductSocket);
+	close(sink);
+	MRELEASE(clo->buffer);
+}
+
+/* Offers the bundles to the CLO, offloaded or not, and reports once
+ * all have arrived or been dropped.  Returns 0, 1 if netem isn't
+ * available, or -1 on failure or loss. */
+static int benchNetemRun(int offload, unsigned long bundles, double rate,
+		int capacity, int releaseMode)
+{
+	DelayClo clo;
+	DelayCloDuct duct;
+	NetemSampler sampler;
+	DelayNetemStats stats;
+	VOutduct *vduct;
+	PsmAddress vductElt;
+	struct sockaddr_storage sinkName;
+	pthread_t sinkThread;
+	Object bundleZco;
+	BpAncillaryData ancillaryData;
+	double cpuStart, cpuSeconds, baseRss;
+	unsigned long long baseSdrBytes, settled, lastReceived = 0;
+	unsigned long long dropped;
+	int sink, held;
+
+	memset(&clo, 0, sizeof clo);
+	memset(&duct, 0, sizeof duct);
+	memset(&sampler, 0, sizeof sampler);
+	clo.model = &netemModel;
+	clo.running = 1;
+	findOutduct("udp", "127.0.0.1", &vduct, &vductElt);
+	sink = openSink(&sinkName);
+	clo.ductSocket = openDelaySocket(sinkFamily);
+	clo.buffer = MTAKE(UDPCLA_BUFSZ);
+	duct.clo = &clo;
+	duct.vduct = vduct;
+	duct.ductName = "127.0.0.1";
+	memcpy(&duct.socketName, &sinkName, sizeof sinkName);
+	if (sink < 0 || clo.ductSocket < 0 || clo.buffer == NULL
+	|| initDelayQueue(&clo.queue, capacity) < 0
+	|| initDelayCloRelease(&clo, releaseMode) < 0
+	|| initDelayCloPipeline(&clo, benchTransmitThreads) < 0) {
+		putErrmsg("Can't set up netem benchmark CLO.", NULL);
+		return -1;
+	}
+
+	sizeDelayReceiveBuffer(sink, netemModel.daemonName);
+	if (offload && netemInterface == NULL) {
+		printf("%-6s skipped: no interface given (-I)\n", "netem");
+		closeNetemRun(&clo, sink);
+		return 1;
+	}
+
+	if (offload && (initDelayCloNetem(&clo, netemInterface) < 0
+			|| !clo.netem.offloaded)) {
+		printf("%-6s can't install netem on %s: needs CAP_NET_ADMIN "
+				"and sch_netem (STUB_QUIET=0 shows why)\n",
+				"netem", netemInterface);
+		closeNetemRun(&clo, sink);
+		return 1;
+	}
+
+	latencyCount = 0;
+	sinkReceived = 0;
+	sinkRunning = 1;
+	netemSampling = 1;
+	sampler.clo = &clo;
+	baseRss = sampler.peakRss = residentKb();
+	baseSdrBytes = sampler.peakSdrBytes = ionStubSdrBytes();
+	if (pthread_create(&sinkThread, NULL, stampingSink, &sink)
+	|| pthread_create(&sampler.thread, NULL, sampleNetem, &sampler)) {
+		putSysErrmsg("Can't start netem benchmark threads", NULL);
+		return -1;
+	}
+
+	cpuStart = processCpuSeconds();
+	if (!clo.netem.offloaded && startDelayClo(&clo) < 0) {
+		return -1;
+	}
+
+	for (unsigned long i = 0; i < bundles; i++) {
+		if (bpDequeue(vduct, &bundleZco, &ancillaryData, 0) < 0
+		|| bundleZco == 0
+		|| delayCloEnqueue(&clo, &duct, bundleZco,
+				&ancillaryData) < 0) {
+			break;
+		}
+	}
+
+	/* Drain: nothing queued or held by netem, and nothing arriving
+	 * for 200 ms, or the delay plus 10 s has passed */
+	settled = benchNsec();
+	while (benchNsec() - settled < (unsigned long long)
+			((loopbackCloDelay + 10.0) * 1e9)) {
+		held = clo.queue.count + clo.scheduleStage.count
+				+ clo.transmitStage.count;
+		if (clo.netem.offloaded && readDelayNetem(&clo.netem,
+				&stats) == 0) {
+			held += stats.held;
+		}
+
+		if (held == 0 && sinkReceived == lastReceived) {
+			microsnooze(200000);
+			if (sinkReceived == lastReceived) {
+				break;
+			}
+		}
+
+		lastReceived = sinkReceived;
+		microsnooze(10000);
+	}
+
+	stopDelayClo(&clo);
+	cpuSeconds = processCpuSeconds() - cpuStart;
+	netemSampling = 0;
+	pthread_join(sampler.thread, NULL);
+	sinkRunning = 0;
+	pthread_join(sinkThread, NULL);
+
+	dropped = clo.stats.queueFull + clo.stats.expired
+			+ clo.stats.linkLoss + clo.stats.sendFailed;
+	if (clo.netem.offloaded && readDelayNetem(&clo.netem, &stats) == 0) {
+		dropped += stats.dropped;
+	}
+
+	qsort(latencies, latencyCount, sizeof latencies[0], compareLatency);
+	printf("%-6s %8llu %8llu %8llu %9.0f %8.2f %8.2f %8.2f %8.2f "
+			"%+8.3f %+8.3f\n", offload ? "netem" : "queue",
+			clo.stats.sent, sinkReceived, dropped, cpuSeconds * 1e3,
+			cpuSeconds * 1e6 / bundles,
+			(sampler.peakSdrBytes - baseSdrBytes) / 1e6,
+			sampler.peakNetemBytes / 1e6,
+			(sampler.peakRss - baseRss) / 1024.0,
+			latencyCount ? latencyPercentile(0.50)
+			- loopbackCloDelay * 1e3 : 0.0,
+			latencyCount ? latencyPercentile(0.99)
+			- loopbackCloDelay * 1e3 : 0.0);
+	fflush(stdout);
+	closeNetemRun(&clo, sink);
+	return sinkReceived + dropped < bundles ? -1 : 0;
+}
+
+static int benchNetem(unsigned long bundles, double rate, int capacity,
+		int releaseMode)
+{
+	int failures = 0;
+	int result;
+
+	latencyLimit = bundles;
+	latencies = malloc(bundles * sizeof(unsigned long long));
+	if (latencies == NULL) {
+		putErrmsg("Can't allocate latency samples.", NULL);
+		return -1;
+	}
+
+	ionStub.bundleRate = rate;
+	netemModel.lossPercentage = loopbackCloModel.lossPercentage;
+	printf("netem: %lu bundles of %u bytes at %.0f/s, delay %.3f s, "
+			"loss %.1f%%, queue capacity %d, %s release, netem on "
+			"%s\n", bundles, ionStub.bundleSize, rate,
+			loopbackCloDelay, netemModel.lossPercentage, capacity,
+			delayReleaseModeNames[releaseMode],
+			netemInterface ? netemInterface : "no interface");
+	printf("%-6s %8s %8s %8s %9s %8s %8s %8s %8s %8s %8s\n", "mode",
+			"sent", "arrived", "dropped", "cpu ms", "us/bndl",
+			"SDR MB", "qdisc MB", "RSS MB", "err p50", "err p99");
+
+	/* Netem first: RAM freed by the other run may stay resident */
+	for (int offload = 1; offload >= 0; offload--) {
+		result = benchNetemRun(offload, bundles, rate, capacity,
+				releaseMode);
+		if (result < 0) {
+			failures++;
+		}
+	}
+
+	free(latencies);
+	if (failures) {
+		printf("FAIL: bundles neither delivered nor dropped\n");
+	}
+
+	return failures ? -1 : 0;
+}
+
+/*	*	*	Send failures	*	*	*	*	*	*/
+
+/* Each way a due bundle can fail to leave the CLO.  Datagrams go to
+ * port 0, which Linux refuses; unreadable bundles go to a sink, with
+ * the stub failing the first read of each as it is released.  With
+ * AGGREGATE=1 the small bundles take the aggregate path; without
+ * SEGMENT=1 the large ones are refused as too long. */
+typedef struct {
+	char		*name;
+	unsigned int	bundleSize;
+	int		unreadable;	/* zco_transmit reads nothing */
+	int		ring;		/* Sent over a shm: duct */
+} SendFailCase;
+
+static SendFailCase sendFailCases[] = {
+	{ "send", 4096, 0, 0 },
+	{ "read", 4096, 1, 0 },
+	{ "small send", 1024, 0, 0 },
+	{ "small read", 1024, 1, 0 },
+	{ "segment send", 70000, 0, 0 },
+	{ "segment read", 70000, 1, 0 },
+	{ "ring read", 1024, 1, 1 }
+};
+
+/* Offers bundles to a zero-delay CLO whose every send fails; returns
+ * 1 unless all are counted as send failures and no ZCO is left */
+static int benchSendFailCase(SendFailCase *sendCase, unsigned long bundles)
+{
+	DelayClo clo;
+	DelayCloDuct duct;
+	PsmAddress vductElt;
+	Object bundleZco;
+	BpAncillaryData ancillaryData;
+	unsigned long offered = 0;
+	unsigned long staged = 0;
+	int sink = -1;
+	int failed;
+
+	memset(&clo, 0, sizeof clo);
+	memset(&duct, 0, sizeof duct);
+	clo.model = &benchModel;
+	clo.running = 1;
+	clo.ductSocket = openDelaySocket(sinkFamily);
+	clo.buffer = MTAKE(UDPCLA_BUFSZ);
+	findOutduct("udp", "127.0.0.1", &duct.vduct, &vductElt);
+	duct.clo = &clo;
+	duct.ductName = "127.0.0.1";
+	if (sendCase->unreadable) {
+		sink = openSink(&duct.socketName);
+	} else {
+		loopbackAddress(&duct.socketName, 0);
+	}
+
+	if (sendCase->ring) {
+		duct.ring = openDelayShmRing("udpdelaybench", 0);
+	}
+
+	if (clo.ductSocket < 0 || clo.buffer == NULL
+	|| (sendCase->unreadable && sink < 0)
+	|| (sendCase->ring && duct.ring == NULL)
+	|| initDelayQueue(&clo.queue, MAX_QUEUED_BUNDLES) < 0
+	|| initDelayCloRelease(&clo, DELAY_RELEASE_POLL) < 0
+	|| initDelayCloPipeline(&clo, 0) < 0) {
+		putErrmsg("Can't set up benchmark CLO.", NULL);
+		return -1;
+	}
+
+	ionStub.bundleSize = sendCase->bundleSize;
+	for (; offered < bundles; offered++) {
+		if (bpDequeue(duct.vduct, &bundleZco, &ancillaryData, 0) < 0
+		|| bundleZco == 0) {
+			putErrmsg("Stub dequeue failed.", NULL);
+			break;
+		}
+
+		if (delayCloEnqueue(&clo, &duct, bundleZco, &ancillaryData) < 0) {
+			break;
+		}
+
+		if (++staged >= clo.queue.capacity / 2) {
+			ionStub.transmitFailures = sendCase->unreadable
+					? staged : 0;
+			delayCloRelease(&clo);
+			staged = 0;
+		}
+	}
+
+	ionStub.transmitFailures = sendCase->unreadable ? staged : 0;
+	delayCloRelease(&clo);
+	ionStub.transmitFailures = 0;
+	failed = clo.stats.sendFailed != offered || clo.stats.sent != 0
+			|| ionStub.zcosLive != 0 || ionStub.xnViolations != 0
+			|| ionStub.xnAbandoned != 0;
+	printf("%-13s %8lu %8llu %8llu %10llu  %s\n", sendCase->name, offered,
+			clo.stats.sendFailed, clo.stats.sent, ionStub.zcosLive,
+			failed ? "FAIL" : "ok");
+
+	closeDelayCloPipeline(&clo);
+	closeDelayCloRelease(&clo);
+	destroyDelayQueue(&clo.queue);
+	if (duct.ring) {
+		closeDelayShmRing(duct.ring);
+	}
+
+	MRELEASE(clo.buffer);
+	close(clo.ductSocket);
+	if (sink >= 0) {
+		close(sink);
+	}
+
+	return failed;
+}
+
+static int benchSendFail(unsigned long bundles)
+{
+	unsigned int bundleSize = ionStub.bundleSize;
+	int failures = 0;
+	int result;
+
+	printf("sendfail: %lu bundles per case, every send failing\n",
+			bundles);
+	printf("%-13s %8s %8s %8s %10s\n", "case", "offered", "failed",
+			"sent", "ZCOs live");
+	for (int i = 0; i < sizeof sendFailCases / sizeof sendFailCases[0];
+			i++) {
+		result = benchSendFailCase(&sendFailCases[i], bundles);
+		if (result < 0) {
+			return -1;
+		}
+
+		failures += result;
+	}
+
+	ionStub.bundleSize = bundleSize;
+	if (failures) {
+		printf("FAIL: %d cases left ZCOs or miscounted bundles\n",
+				failures);
+	}
+
+	return failures ? -1 : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: udpdelaybench [pipeline] [-n <bundles>] "
+			"[-s <bundle size>]\n"
+			"       udpdelaybench queue [-d <max depth>] "
+			"[-p preset|mars|jitter]\n"
+			"       udpdelaybench loopback [-n <bundles>] "
+			"[-s <bundle size>] [-r <bundles/sec>]\n"
+			"\t\t[-D <CLO delay>] [-C <CLI delay>] [-L <loss %%>] "
+			"[-Q <queue capacity>] [-m <release mode>]\n"
+			"\t\t[-T <transmit threads>] [-w <acquisition workers>] "
+			"[-X udp|udp6|shm]\n"
+			"       udpdelaybench soak [-t <virtual seconds>[m|h|d]] "
+			"[-x <acceleration>] [-i <sample interval>]\n"
+			"\t\t[-r <bundles/sec>] [-D <CLO delay>] [-C <CLI delay>] "
+			"[-L <loss %%>]\n\t\t[-Q <queue capacity>] "
+			"[-s <bundle size>] [-T <transmit threads>]\n"
+			"\t\t[-w <acquisition workers>] [-X udp|udp6|shm]\n"
+			"       udpdelaybench acquire [-w <max workers>] "
+			"[-n <bundles>] [-s <bundle size>]\n"
+			"\t\t[-u <sources>] [-o]\n"
+			"       udpdelaybench jitter [-m poll|timerfd|txtime|all] "
+			"[-n <bundles>] [-r <bundles/sec>]\n\t\t[-D <delay>] "
+			"[-c <CPU spinners>] [-M <memory hogs>] "
+			"[-S <SDR storm threads>]\n\t\t[-P <RT priority>] "
+			"[-A <release core>] [-K] [-W <spin usec>] [-R]\n"
+			"\t\t[-T <transmit threads>]\n"
+			"       udpdelaybench ducts [-k <max ducts>] [-n <bundles>] "
+			"[-r <bundles/sec>]\n\t\t[-D <delay>] [-Q <queue capacity>] "
+			"[-m <release mode>]\n\t\t[-T <transmit threads>]\n"
+			"       udpdelaybench inducts [-k <max inducts>] "
+			"[-n <bundles>] [-r <bundles/sec>]\n\t\t[-C <delay>] "
+			"[-Q <queue capacity>] [-w <acquisition workers>]\n"
+			"       udpdelaybench priority [-n <bundles>]\n"
+			"       udpdelaybench sources [-u <max sources>] "
+			"[-n <lookups>]\n"
+			"       udpdelaybench expire [-n <bundles>] "
+			"[-r <bundles/sec>] [-D <CLO delay>] [-C <CLI delay>]\n"
+			"       udpdelaybench dedup [-n <bundles>] "
+			"[-s <bundle size>]\n"
+			"       udpdelaybench compress [-n <bundles>] "
+			"[-s <bundle size>]\n"
+			"       udpdelaybench tier [-n <bundles>] "
+			"[-s <bundle size>] [-r <bundles/sec>] [-D <delay>] "
+			"[-x <acceleration>]\n"
+			"       udpdelaybench handoff [-n <bundles>] "
+			"[-r <bundles/sec>] [-D <CLO delay>] [-C <CLI delay>]\n"
+			"\t\t[-m <release mode>] [-T <transmit threads>] "
+			"[-w <acquisition workers>]\n"
+			"       udpdelaybench netem [-I <interface>] "
+			"[-n <bundles>] [-r <bundles/sec>] [-D <delay>]\n"
+			"\t\t[-L <loss %%>] [-Q <queue capacity>] "
+			"[-m <release mode>] [-T <transmit threads>]\n"
+			"       udpdelaybench sendfail [-n <bundles>]\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *mode = "pipeline";
+	char *patternName = NULL;
+	unsigned long bundles = 0;
+	long maxDepth = 10000000;
+	double rate = 0.0;
+	int capacity = 0;
+	char *releaseModeName = "all";
+	int loads[3] = { 0, 0, 0 };
+	DelayRealtime rt;
+	int sweep = 0;
+	int largeBundles;
+	double delay = -1.0;
+	double loss = -1.0;
+	int workers = -1;
+	int sources = 0;
+	int ordered = 0;
+	int maxDucts = 16;
+	double duration = 86400.0;
+	double interval = 0.0;
+	double acceleration = 0.0;
+	int i = 1;
+
+	if (i < argc && argv[i][0] != '-') {
+		mode = argv[i++];
+	}
+
+	if (getenv("STUB_QUIET") == NULL) {
+		setenv("STUB_QUIET", "1", 0);
+	}
+
+	bpAttach();
+	initProfile(benchModel.daemonName);
+	memset(&rt, 0, sizeof rt);
+	for (; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			bundles = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			ionStub.bundleSize = strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			maxDepth = strtol(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			patternName = argv[++i];
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rate = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-D") == 0 && i + 1 < argc) {
+			delay = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+			loopbackCliDelay = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+			loss = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-Q") == 0 && i + 1 < argc) {
+			capacity = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			char *unit;
+
+			duration = strtod(argv[++i], &unit);
+			duration *= *unit == 'm' ? 60 : *unit == 'h' ? 3600
+					: *unit == 'd' ? 86400 : 1;
+		} else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc) {
+			acceleration = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			interval = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc) {
+			netemInterface = argv[++i];
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			releaseModeName = argv[++i];
+		} else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+			benchTransmitThreads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			workers = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+			sources = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0) {
+			ordered = 1;
+		} else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+			maxDucts = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			loads[0] = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+			loads[1] = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+			loads[2] = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+			rt.priority = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+			int cpu = atoi(argv[++i]);
+
+			rt.releaseCpus = cpu >= 0 && cpu < 64 ? 1UL << cpu : 0;
+		} else if (strcmp(argv[i], "-K") == 0) {
+			rt.lockMemory = 1;
+		} else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc) {
+			rt.spinUsec = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-R") == 0) {
+			sweep = 1;
+		} else if (strcmp(argv[i], "-X") == 0 && i + 1 < argc) {
+			i++;
+			loopbackShm = strcmp(argv[i], "shm") == 0;
+			sinkFamily = strcmp(argv[i], "udp6") == 0 ? AF_INET6
+					: AF_INET;
+		} else {
+			usage();
+			return 1;
+		}
+	}
+
+	if (bundles == 0) {
+		bundles = strcmp(mode, "loopback") == 0 ? 10000
+				: strcmp(mode, "jitter") == 0 ? 2000
+				: strcmp(mode, "ducts") == 0 ? 2000
+				: strcmp(mode, "inducts") == 0 ? 10000
+				: strcmp(mode, "priority") == 0 ? 10000
+				: strcmp(mode, "expire") == 0 ? 3000
+				: strcmp(mode, "dedup") == 0 ? 100000
+				: strcmp(mode, "compress") == 0 ? 20000
+				: strcmp(mode, "tier") == 0 ? 30000
+				: strcmp(mode, "handoff") == 0 ? 6000
+				: strcmp(mode, "netem") == 0 ? 20000
+				: strcmp(mode, "sendfail") == 0 ? 1000
+				: strcmp(mode, "acquire") == 0 ? 100000 : 1000000;
+	}
+
+	if (sources == 0) {
+		sources = strcmp(mode, "sources") == 0 ? 4096 : 1;
+	}
+
+	if (workers >= 0) {
+		benchAcqWorkers = workers;
+	} else if (strcmp(mode, "acquire") == 0) {
+		benchAcqWorkers = 8;
+	}
+
+	if (rate == 0.0) {
+		rate = strcmp(mode, "jitter") == 0 ? 500.0
+				: strcmp(mode, "soak") == 0 ? 200.0
+				: strcmp(mode, "inducts") == 0 ? 5000.0
+				: strcmp(mode, "netem") == 0 ? 2000.0
+				: strcmp(mode, "tier") == 0 ? 50.0 : 1000.0;
+	}
+
+	if (capacity == 0) {
+		capacity = strcmp(mode, "soak") == 0 ? 10000
+				: strcmp(mode, "ducts") == 0 ? (int) bundles
+				: strcmp(mode, "inducts") == 0 ? (int) bundles
+				: strcmp(mode, "expire") == 0 ? (int) bundles
+				: strcmp(mode, "handoff") == 0 ? (int) bundles
+				: strcmp(mode, "netem") == 0 ? (int) bundles
+				: MAX_QUEUED_BUNDLES;
+	}
+
+	if (acceleration == 0.0) {
+		acceleration = strcmp(mode, "tier") == 0 ? 100.0 : 1000.0;
+	}
+
+	soakAcceleration = acceleration;
+	if (strcmp(mode, "soak") == 0) {
+		if (delay < 0.0) {
+			delay = 750.0;		/* Mean Mars light time */
+		}
+
+		if (loss < 0.0) {
+			loss = 5.0;
+		}
+	}
+
+	if (strcmp(mode, "netem") == 0 && delay < 0.0) {
+		delay = 5.0;
+	}
+
+	if (delay >= 0.0) {
+		loopbackCloDelay = jitterDelaySeconds = delay;
+	}
+
+	if (loss >= 0.0) {
+		loopbackCloModel.lossPercentage = loss;
+	}
+
+	/* Loopback and soak segment large bundles over UDP */
+	largeBundles = loopbackShm || (DELAY_SEGMENTS
+			&& (strcmp(mode, "loopback") == 0
+			|| strcmp(mode, "soak") == 0));
+	if ((ionStub.bundleSize > UDPCLA_BUFSZ && !largeBundles)
+	|| ionStub.bundleSize > DELAY_SHM_RING_BYTES / 4 || maxDepth < 100
+	|| maxDepth > 100000000 || rate <= 0.0 || capacity < 1
+	|| duration <= 0.0 || soakAcceleration < 1.0
+	|| benchTransmitThreads < 0
+	|| benchTransmitThreads > DELAY_MAX_TRANSMIT_THREADS
+	|| benchAcqWorkers < 0 || benchAcqWorkers > DELAY_MAX_ACQ_WORKERS
+	|| sources < 1 || sources >= DELAY_MAX_SOURCES
+	|| maxDucts < 1 || maxDucts > DELAY_MAX_CLO_DUCTS) {
+		usage();
+		return 1;
+	}
+
+	if (strcmp(mode, "pipeline") == 0) {
+		return benchPipeline(bundles) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "loopback") == 0 || strcmp(mode, "ducts") == 0
+	|| strcmp(mode, "handoff") == 0 || strcmp(mode, "netem") == 0) {
+		int releaseMode = DELAY_RELEASE_MODE;
+
+		for (int m = DELAY_RELEASE_POLL; m <= DELAY_RELEASE_TXTIME; m++) {
+			if (strcmp(releaseModeName, delayReleaseModeNames[m]) == 0) {
+				releaseMode = m;
+			}
+		}
+
+		if (strcmp(mode, "handoff") == 0) {
+			if (loopbackCliDelay == 0.0) {
+				loopbackCliDelay = loopbackCloDelay;
+			}
+
+			return benchHandoff(bundles, rate, capacity,
+					releaseMode) < 0 ? 1 : 0;
+		}
+
+		if (strcmp(mode, "netem") == 0) {
+			return benchNetem(bundles, rate, capacity,
+					releaseMode) < 0 ? 1 : 0;
+		}
+
+		if (strcmp(mode, "ducts") == 0) {
+			return benchDucts(maxDucts, bundles, rate, capacity,
+					releaseMode) < 0 ? 1 : 0;
+		}
+
+		return benchLoopback(bundles, rate, capacity, releaseMode) < 0
+				? 1 : 0;
+	}
+
+	if (strcmp(mode, "inducts") == 0) {
+		return benchInducts(maxDucts, bundles, rate, capacity) < 0
+				? 1 : 0;
+	}
+
+	if (strcmp(mode, "soak") == 0) {
+		return benchSoak(duration, interval, rate, capacity) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "acquire") == 0) {
+		return benchAcquire(benchAcqWorkers < 1 ? 1 : benchAcqWorkers,
+				bundles, sources, ordered) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "jitter") == 0) {
+		return benchJitter(releaseModeName, bundles, rate, loads, &rt,
+				sweep) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "queue") == 0) {
+		return benchQueue(maxDepth, patternName) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "priority") == 0) {
+		return benchPriority(bundles) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "sources") == 0) {
+		return benchSources(sources, bundles) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "expire") == 0) {
+		if (loopbackCliDelay == 0.0) {
+			loopbackCliDelay = loopbackCloDelay;
+		}
+
+		return benchExpire(bundles, rate, capacity) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "dedup") == 0) {
+		return benchDedup(bundles) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "compress") == 0) {
+		return benchCompress(bundles) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "sendfail") == 0) {
+		return benchSendFail(bundles) < 0 ? 1 : 0;
+	}
+
+	if (strcmp(mode, "tier") == 0) {
+		if (delay >= 0.0) {
+			tierDelaySeconds = delay;
+		}
+
+		return benchTier(bundles, rate) < 0 ? 1 : 0;
+	}
+
+	usage();
+	return 1;
+}
@@ -0,0 +1,3080 @@
+/*
+	udpdelaycli.c:	UDP delay convergence-layer input engine shared by
+			the Mars, Moon and preset delay input daemons.
+
+	Based on original ION UDP convergence layer (udpcli.c)
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#include "udpdelay.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+static DelayCli cli;
+
+/* Counts against the CLI and, for bundles from an induct or a listed
+ * source, the induct and the source */
+#define cliCount(cli, bundle, counter, amount) do { \
+	delayCount((cli)->stats.counter, amount); \
+	if ((bundle)->induct) { \
+		delayCount((bundle)->induct->stats.counter, amount); \
+	} \
+	if ((bundle)->source) { \
+		delayCount((bundle)->source->stats.counter, amount); \
+	} \
+} while (0)
+
+static unsigned long long receiveClock(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((unsigned long long) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/*	*	*	Per-source delay and loss	*	*	*	*/
+
+/* Table key: IPv4 senders as v4-mapped IPv6, so that an entry matches
+ * whichever kind of socket the datagram came in on.  -1 for a sender
+ * with no address (a shm: ring). */
+static int sourceKey(struct sockaddr_storage *name, struct sockaddr_in6 *key)
+{
+	memset(key, 0, sizeof(struct sockaddr_in6));
+	key->sin6_family = AF_INET6;
+	if (name->ss_family == AF_INET6) {
+		struct sockaddr_in6 *inet6 = (struct sockaddr_in6 *) name;
+
+		key->sin6_port = inet6->sin6_port;
+		key->sin6_addr = inet6->sin6_addr;
+		return 0;
+	}
+
+	if (name->ss_family == AF_INET) {
+		struct sockaddr_in *inet = (struct sockaddr_in *) name;
+
+		key->sin6_port = inet->sin_port;
+		key->sin6_addr.s6_addr[10] = 0xff;
+		key->sin6_addr.s6_addr[11] = 0xff;
+		memcpy(&key->sin6_addr.s6_addr[12], &inet->sin_addr, 4);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* The key's slot, or the free slot that ends its probe sequence */
+static DelaySource *probeSource(DelaySourceTable *table,
+		struct sockaddr_in6 *key)
+{
+	unsigned int i = hashDelayAddress((struct sockaddr_storage *) key)
+			& table->mask;
+	DelaySource *slot;
+
+	for (;; i = (i + 1) & table->mask) {
+		slot = table->slots + i;
+		if (!slot->inUse || (slot->addr.sin6_port == key->sin6_port
+		&& memcmp(&slot->addr.sin6_addr, &key->sin6_addr, 16) == 0)) {
+			return slot;
+		}
+	}
+}
+
+DelaySource *findDelaySource(DelaySourceTable *table,
+		struct sockaddr_storage *fromAddr)
+{
+	struct sockaddr_in6 key;
+	DelaySource *slot;
+
+	if (table->count == 0 || sourceKey(fromAddr, &key) < 0) {
+		return NULL;
+	}
+
+	slot = probeSource(table, &key);
+	if (!slot->inUse && table->anyPort) {
+		key.sin6_port = 0;
+		slot = probeSource(table, &key);
+	}
+
+	if (!slot->inUse) {
+		delayCount(table->unlisted, 1);
+		return NULL;
+	}
+
+	return slot;
+}
+
+/* Whether a socket spec gives a port: [<IPv6 address>]:<port> or
+ * <host>:<port> */
+static int specHasPort(char *spec)
+{
+	char *colon;
+
+	if (spec[0] == '[') {
+		return strstr(spec, "]:") != NULL;
+	}
+
+	colon = strchr(spec, ':');
+	return colon != NULL && strchr(colon + 1, ':') == NULL;
+}
+
+/* Parses one source line into its slot; -1 if it is bad */
+static int parseSource(DelaySourceTable *table, char *spec, char *delay,
+		char *loss)
+{
+	struct sockaddr_storage name;
+	struct sockaddr_in6 key;
+	DelaySource *slot;
+	double seconds = 0.0;
+	int useModel = 0;
+	char *end = "";
+
+	if (parseDelaySocketSpec(spec, &name) < 0
+	|| sourceKey(&name, &key) < 0) {
+		return -1;
+	}
+
+	if (!specHasPort(spec)) {
+		key.sin6_port = 0;
+		table->anyPort = 1;
+	}
+
+	if (strncmp(delay, "model", 5) == 0) {
+		useModel = 1;
+		if (delay[5] == '+' || delay[5] == '-') {
+			seconds = strtod(delay + 5, &end);
+		} else if (delay[5] != '\0') {
+			end = delay;
+		}
+	} else {
+		seconds = strtod(delay, &end);
+		if (seconds < 0.0) {
+			end = delay;
+		}
+	}
+
+	if (*end != '\0') {
+		putErrmsg("Bad delay in source table.", delay);
+		return -1;
+	}
+
+	slot = probeSource(table, &key);
+	if (slot->inUse) {
+		putErrmsg("Source listed twice in source table.", spec);
+		return -1;
+	}
+
+	slot->addr = key;
+	slot->useModel = useModel;
+	slot->delaySeconds = seconds;
+	slot->lossPercentage = -1.0;
+	if (loss) {
+		slot->lossPercentage = strtod(loss, &end);
+		if (*end != '\0' || slot->lossPercentage < 0.0
+		|| slot->lossPercentage > 100.0) {
+			putErrmsg("Bad loss in source table.", loss);
+			return -1;
+		}
+	}
+
+	slot->inUse = 1;
+	table->count++;
+	return 0;
+}
+
+int loadDelaySources(DelaySourceTable *table, char *fileName)
+{
+	char line[256], spec[128], delay[64], loss[64], where[300];
+	unsigned int lines = 0, slots = 16;
+	int lineNbr = 0, fields;
+	FILE *file;
+
+	file = fopen(fileName, "r");
+	if (file == NULL) {
+		putSysErrmsg("Can't open source table", fileName);
+		return -1;
+	}
+
+	/* Size the table so that it is at most half full */
+	while (fgets(line, sizeof line, file)) {
+		lines++;
+	}
+
+	if (lines > DELAY_MAX_SOURCES) {
+		putErrmsg("Source table too long.", fileName);
+		fclose(file);
+		return -1;
+	}
+
+	while (slots < lines * 2) {
+		slots <<= 1;
+	}
+
+	table->slots = MTAKE(slots * sizeof(DelaySource));
+	if (table->slots == NULL) {
+		putErrmsg("Can't allocate source table.", fileName);
+		fclose(file);
+		return -1;
+	}
+
+	memset(table->slots, 0, slots * sizeof(DelaySource));
+	table->mask = slots - 1;
+	rewind(file);
+	while (fgets(line, sizeof line, file)) {
+		lineNbr++;
+		fields = sscanf(line, "%127s %63s %63s", spec, delay, loss);
+		if (fields < 1 || spec[0] == '#') {
+			continue;	/* Blank line or comment */
+		}
+
+		if (fields < 2 || parseSource(table, spec, delay,
+				fields > 2 ? loss : NULL) < 0) {
+			isprintf(where, sizeof where, "%s line %d", fileName,
+					lineNbr);
+			putErrmsg("Bad source table line.", where);
+			fclose(file);
+			freeDelaySources(table);
+			return -1;
+		}
+	}
+
+	fclose(file);
+	return table->count;
+}
+
+void freeDelaySources(DelaySourceTable *table)
+{
+	if (table->slots) {
+		MRELEASE(table->slots);
+	}
+
+	memset(table, 0, sizeof(DelaySourceTable));
+}
+
+/*	*	*	Duplicate suppression (receive thread)	*	*	*/
+
+static int initDedupIndex(DelayDedupIndex *index, int capacity)
+{
+	unsigned int size = 16;
+
+	memset(index, 0, sizeof(DelayDedupIndex));
+	if (!DELAY_DEDUP) {
+		return 0;
+	}
+
+	/* Every queued or staged bundle may have an entry; keep the table
+	 * at most half full with them */
+	while (size < 2 * (unsigned int) (capacity + DELAY_STAGE_CAPACITY)) {
+		size <<= 1;
+	}
+
+	index->slots = MTAKE(size * sizeof(DelayDedupEntry));
+	if (index->slots == NULL) {
+		putErrmsg("Can't allocate duplicate index.", itoa(size));
+		return -1;
+	}
+
+	memset(index->slots, 0, size * sizeof(DelayDedupEntry));
+	index->mask = size - 1;
+	return 0;
+}
+
+static void freeDedupIndex(DelayDedupIndex *index)
+{
+	if (index->slots) {
+		MRELEASE(index->slots);
+	}
+
+	memset(index, 0, sizeof(DelayDedupIndex));
+}
+
+/* Hash of a primary-block identity, or 0 if it was not decoded */
+static uint64_t bundleKey(DelayBundleId *id)
+{
+	uint64_t words[4] = { id->sourceNode, id->sourceService,
+			id->creationMsec, id->creationCount };
+	uint64_t key = ((uint64_t) id->scheme << 32) ^ id->fragmentOffset;
+
+	if (id->scheme == DTR_SCHEME_UNKNOWN) {
+		return 0;
+	}
+
+	for (int i = 0; i < 4; i++) {
+		key = (key ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+		key ^= key >> 29;
+	}
+
+	key = (key ^ (key >> 32)) * 0xd6e8feb86659fd93ULL;
+	key ^= key >> 32;
+	return key ? key : 1;
+}
+
+/* Empties slot i, moving later entries of its probe run back so that
+ * none is left behind a gap */
+static void deleteDedupSlot(DelayDedupIndex *index, unsigned int i)
+{
+	DelayDedupEntry *slots = index->slots;
+	unsigned int j = i, home;
+
+	for (;;) {
+		j = (j + 1) & index->mask;
+		if (slots[j].key == 0) {
+			break;
+		}
+
+		/* Entry j may fill the gap unless its home lies between
+		 * the gap and j */
+		home = slots[j].key & index->mask;
+		if (((j - home) & index->mask) >= ((j - i) & index->mask)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+
+	slots[i].key = 0;
+	index->count--;
+}
+
+/* Frees the entries of released bundles, a few slots per call */
+static void sweepDedupIndex(DelayDedupIndex *index,
+		unsigned long long nowUsec)
+{
+	DelayDedupEntry *slot;
+
+	for (int n = 0; n < DELAY_DEDUP_SWEEP; n++) {
+		slot = index->slots + index->sweep;
+		if (slot->key != 0 && slot->releaseUsec <= nowUsec) {
+			deleteDedupSlot(index, index->sweep);
+			continue;	/* Slot may hold a moved entry */
+		}
+
+		index->sweep = (index->sweep + 1) & index->mask;
+	}
+}
+
+/* Looks a bundle up.  Sets *duplicate if a copy is still queued;
+ * otherwise returns the slot to remember this bundle in, or NULL if
+ * the table is full. */
+static DelayDedupEntry *findDedupSlot(DelayDedupIndex *index, uint64_t key,
+		unsigned long long nowUsec, int *duplicate)
+{
+	unsigned int i = key & index->mask;
+	DelayDedupEntry *slot;
+
+	*duplicate = 0;
+	sweepDedupIndex(index, nowUsec);
+	for (unsigned int n = 0; n <= index->mask; n++) {
+		slot = index->slots + ((i + n) & index->mask);
+		if (slot->key == 0) {
+			return slot;
+		}
+
+		if (slot->key == key) {
+			*duplicate = slot->releaseUsec > nowUsec;
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/* Copies of a queued bundle arriving before its release are now
+ * duplicates.  slot is from findDedupSlot, key the bundle's (0: not
+ * decoded, nothing to remember). */
+static void rememberBundle(DelayDedupIndex *index, DelayDedupEntry *slot,
+		uint64_t key, DelayedBundle *bundle)
+{
+	if (slot) {
+		if (slot->key == 0) {
+			index->count++;
+		}
+
+		slot->key = key;
+		slot->releaseUsec = bundle->releaseTime.tv_sec * 1000000ULL
+				+ bundle->releaseTime.tv_usec;
+	} else if (key != 0) {
+		index->unremembered++;
+	}
+}
+
+/*	*	*	In-queue compression	*	*	*	*	*/
+
+static void freeCompressor(DelayCompressor *compressor)
+{
+	if (compressor->table) {
+		MRELEASE(compressor->table);
+		compressor->table = NULL;
+	}
+
+	if (compressor->scratch) {
+		MRELEASE(compressor->scratch);
+		compressor->scratch = NULL;
+	}
+}
+
+static int initCompressor(DelayCompressor *compressor)
+{
+	memset(compressor, 0, sizeof(DelayCompressor));
+	if (!DELAY_COMPRESS) {
+		return 0;
+	}
+
+	compressor->table = MTAKE(sizeof(unsigned int)
+			<< DELAY_COMPRESS_HASH_BITS);
+	compressor->scratch = MTAKE(DELAY_COMPRESS_MAX_BYTES);
+	if (compressor->table == NULL || compressor->scratch == NULL) {
+		putErrmsg("Can't allocate compression buffers.", NULL);
+		freeCompressor(compressor);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Release thread: stores a newly arrived bundle compressed if that
+ * saves at least an eighth, and bypasses the next bundles, more of them
+ * each time, after one that doesn't.  Bundles due within
+ * DELAY_COMPRESS_MIN_HOLD_MSEC aren't worth it. */
+static void packBundle(DelayCli *cli, DelayedBundle *bundle,
+		struct timeval *now)
+{
+	DelayCompressor *compressor = &cli->compressor;
+	DelayCompressStats *stats = &compressor->stats;
+	unsigned long long start;
+	long long saving;
+	char *packed;
+	int length;
+
+	if (compressor->table == NULL
+	|| bundle->length < DELAY_COMPRESS_MIN_BYTES
+	|| bundle->length > DELAY_COMPRESS_MAX_BYTES
+	|| (bundle->releaseTime.tv_sec - now->tv_sec) * 1000000LL
+			+ bundle->releaseTime.tv_usec - now->tv_usec
+			< DELAY_COMPRESS_MIN_HOLD_MSEC * 1000LL) {
+		return;
+	}
+
+	if (compressor->skip > 0) {
+		compressor->skip--;
+		stats->bypassed++;
+		return;
+	}
+
+	start = receiveClock();
+	length = delayCompress((unsigned char *) bundle->data, bundle->length,
+			compressor->scratch, bundle->length - bundle->length / 8,
+			compressor->table);
+	stats->tried++;
+	if (length == 0) {
+		compressor->backoff = compressor->backoff == 0 ? 1
+				: compressor->backoff < DELAY_COMPRESS_MAX_BACKOFF
+				? compressor->backoff * 2 : compressor->backoff;
+		compressor->skip = compressor->backoff;
+		stats->compressNsec += receiveClock() - start;
+		return;
+	}
+
+	compressor->backoff = 0;
+	packed = MTAKE(length);
+	if (packed == NULL) {
+		stats->compressNsec += receiveClock() - start;
+		return;			/* Keep it as it is */
+	}
+
+	memcpy(packed, compressor->scratch, length);
+	MRELEASE(bundle->data);
+	bundle->data = packed;
+	bundle->packedLength = length;
+	stats->compressNsec += receiveClock() - start;
+	stats->compressed++;
+	stats->rawBytes += bundle->length;
+	stats->packedBytes += length;
+	saving = __atomic_add_fetch(&stats->heldSaving,
+			bundle->length - length, __ATOMIC_RELAXED);
+	if (saving > stats->maxHeldSaving) {
+		stats->maxHeldSaving = saving;
+	}
+}
+
+/* Acquiring thread: restores a compressed bundle's data */
+static int expandBundle(DelayCli *cli, DelayedBundle *bundle)
+{
+	DelayCompressStats *stats = &cli->compressor.stats;
+	unsigned long long start = receiveClock();
+	char *raw;
+
+	raw = MTAKE(bundle->length);
+	if (raw == NULL) {
+		return -1;
+	}
+
+	if (delayExpand((unsigned char *) bundle->data, bundle->packedLength,
+			(unsigned char *) raw, bundle->length)
+			!= (int) bundle->length) {
+		MRELEASE(raw);
+		delayCount(stats->expandFailed, 1);
+		return -1;
+	}
+
+	__atomic_sub_fetch(&stats->heldSaving,
+			bundle->length - bundle->packedLength, __ATOMIC_RELAXED);
+	MRELEASE(bundle->data);
+	bundle->data = raw;
+	bundle->packedLength = 0;
+	delayCount(stats->expanded, 1);
+	delayCount(stats->expandNsec, receiveClock() - start);
+	return 0;
+}
+
+/* Frees a bundle's data, compressed or not, if it has any */
+static void freeBundleData(DelayCli *cli, DelayedBundle *bundle)
+{
+	if (bundle->packedLength > 0) {
+		__atomic_sub_fetch(&cli->compressor.stats.heldSaving,
+				bundle->length - bundle->packedLength,
+				__ATOMIC_RELAXED);
+		bundle->packedLength = 0;
+	}
+
+	if (bundle->data) {
+		MRELEASE(bundle->data);
+		bundle->data = NULL;
+	}
+}
+
+/*	*	*	Receive thread	*	*	*	*	*	*/
+
+/* Queues a received bundle, taking ownership of data (MTAKEn), to be
+ * released its delay after arrival */
+static int queueReceived(DelayCli *cli, DelayCliDuct *induct,
+		DelaySource *source, char *data, int length,
+		struct sockaddr_storage *fromAddr, struct timeval *arrival)
+{
+	DelayedBundle bundle;
+	double delaySeconds;
+	DelayDedupEntry *remembered = NULL;
+	uint64_t key = 0;
+	int duplicate = 0;
+
+	memset(&bundle, 0, sizeof bundle);
+	bundle.induct = induct;
+	bundle.source = source;
+	bundle.data = data;
+	bundle.length = length;
+	bundle.fromAddr = *fromAddr;
+	bundle.releaseClass = DELAY_CLASS_STANDARD;
+
+	/* Calculate process time = arrival time + delay */
+	decodeBundleId((unsigned char *) data, length, &bundle.id,
+			&bundle.expiryTime);
+	if (DELAY_TRACE) {
+		traceBundle(&bundle.id, DTR_CLI_RECEIVE, length, arrival);
+	}
+
+	if (source && !source->useModel) {
+		delaySeconds = source->delaySeconds;
+	} else if (source) {
+		delaySeconds = cli->model->delay() + source->delaySeconds;
+		if (delaySeconds < 0.0) {
+			delaySeconds = 0.0;
+		}
+	} else if (induct && induct->fixedDelay >= 0.0) {
+		delaySeconds = induct->fixedDelay;
+	} else {
+		delaySeconds = cli->model->delay();
+	}
+
+	computeReleaseTime(arrival, delaySeconds, &bundle.releaseTime);
+	if (delayBundleExpires(&bundle)) {
+		cliCount(cli, &bundle, expired, 1);
+		traceBundle(&bundle.id, DTR_CLI_DROP, length, NULL);
+		MRELEASE(bundle.data);
+		return 0;
+	}
+
+	if (cli->dedup.slots && (key = bundleKey(&bundle.id)) != 0) {
+		remembered = findDedupSlot(&cli->dedup, key, arrival->tv_sec
+				* 1000000ULL + arrival->tv_usec, &duplicate);
+	}
+
+	if (duplicate) {
+		cliCount(cli, &bundle, duplicates, 1);
+		traceBundle(&bundle.id, DTR_CLI_DROP, length, NULL);
+		MRELEASE(bundle.data);
+		return 0;
+	}
+
+	/* The release thread puts it in the delay queue */
+	if (pushDelayStage(&cli->scheduleStage, &bundle, 0) < 0) {
+		cliCount(cli, &bundle, stageFull, 1);
+		traceBundle(&bundle.id, DTR_CLI_DROP, length, NULL);
+		freeBundleData(cli, &bundle);
+		return -1;  /* Release thread behind */
+	}
+
+	rememberBundle(&cli->dedup, remembered, key, &bundle);
+	return 0;
+}
+
+int delayCliEnqueue(DelayCli *cli, DelayCliDuct *induct, char *data,
+		int length, struct sockaddr_storage *fromAddr)
+{
+	DelayedBundle bundle;
+	struct timeval now;
+	char *copy;
+
+	memset(&bundle, 0, sizeof bundle);
+	bundle.induct = induct;
+	bundle.source = findDelaySource(&cli->sources, fromAddr);
+	cliCount(cli, &bundle, received, 1);
+	cliCount(cli, &bundle, bytesReceived, length);
+
+	/* Allocate and copy data */
+	copy = MTAKE(length);
+	if (copy == NULL) {
+		cliCount(cli, &bundle, queueFull, 1);
+		return -1;
+	}
+
+	memcpy(copy, data, length);
+	delayNow(&now);
+	return queueReceived(cli, induct, bundle.source, copy, length,
+			fromAddr, &now);
+}
+
+/*	*	*	Segment reassembly (receive thread)	*	*	*/
+
+/* Memory a bundle's reassembly takes: its bytes and segment bitmap */
+#define REASSEMBLY_BYTES(bundleLength, count) \
+	((unsigned long) (bundleLength) + ((count) + 7) / 8)
+
+static void freeReassembly(DelayCli *cli, DelayReassembly *slot)
+{
+	cli->reassemblyBytes -= REASSEMBLY_BYTES(slot->bundleLength,
+			slot->count);
+	MRELEASE(slot->seen);
+	if (slot->data) {
+		MRELEASE(slot->data);
+	}
+
+	memset(slot, 0, sizeof(DelayReassembly));
+}
+
+/* Discards bundles whose segments stopped arriving */
+static void expireReassembly(DelayCli *cli)
+{
+	struct timeval now;
+
+	delayNow(&now);
+	for (int i = 0; i < DELAY_REASSEMBLY_SLOTS; i++) {
+		DelayReassembly *slot = &cli->reassembly[i];
+
+		if (slot->seen == NULL || now.tv_sec - slot->firstArrival.tv_sec
+				< DELAY_REASSEMBLY_TIMEOUT_SEC) {
+			continue;
+		}
+
+		delayCount(cli->stats.reassemblyTimeouts, 1);
+		if (slot->induct) {
+			delayCount(slot->induct->stats.reassemblyTimeouts, 1);
+		}
+
+		freeReassembly(cli, slot);
+	}
+}
+
+static void discardReassembly(DelayCli *cli)
+{
+	for (int i = 0; i < DELAY_REASSEMBLY_SLOTS; i++) {
+		if (cli->reassembly[i].seen) {
+			freeReassembly(cli, &cli->reassembly[i]);
+		}
+	}
+}
+
+/* Finds the bundle a segment belongs to, or starts reassembling it */
+static DelayReassembly *findReassembly(DelayCli *cli, DelayCliDuct *induct,
+		DelayFrame *frame, struct sockaddr_storage *fromAddr)
+{
+	DelayReassembly *slot, *unused = NULL;
+
+	for (int i = 0; i < DELAY_REASSEMBLY_SLOTS; i++) {
+		slot = &cli->reassembly[i];
+		if (slot->seen == NULL) {
+			if (unused == NULL) {
+				unused = slot;
+			}
+
+			continue;
+		}
+
+		if (slot->induct == induct && slot->bundleTag == frame->bundleTag
+		&& slot->bundleLength == frame->bundleLength
+		&& slot->count == frame->count
+		&& slot->segmentBytes == frame->segmentBytes
+		&& sameDelayAddress(&slot->fromAddr, fromAddr)) {
+			return slot;
+		}
+	}
+
+	if (unused == NULL || cli->reassemblyBytes + REASSEMBLY_BYTES(
+			frame->bundleLength, frame->count)
+			> DELAY_REASSEMBLY_BYTES) {
+		return NULL;
+	}
+
+	unused->seen = MTAKE((frame->count + 7) / 8);
+	if (unused->seen == NULL) {
+		return NULL;
+	}
+
+	unused->data = MTAKE(frame->bundleLength);
+	if (unused->data == NULL) {
+		MRELEASE(unused->seen);
+		unused->seen = NULL;
+		return NULL;
+	}
+
+	memset(unused->seen, 0, (frame->count + 7) / 8);
+	unused->induct = induct;
+	unused->fromAddr = *fromAddr;
+	unused->bundleTag = frame->bundleTag;
+	unused->bundleLength = frame->bundleLength;
+	unused->count = frame->count;
+	unused->segmentBytes = frame->segmentBytes;
+	unused->received = 0;
+	delayNow(&unused->firstArrival);
+	cli->reassemblyBytes += REASSEMBLY_BYTES(frame->bundleLength,
+			frame->count);
+	return unused;
+}
+
+/* Copies a segment into its bundle, queueing the bundle once complete */
+static int receiveSegment(DelayCli *cli, DelayCliDuct *induct,
+		DelayFrame *frame, char *datagram, int length,
+		struct sockaddr_storage *fromAddr)
+{
+	DelayedBundle bundle;
+	DelayReassembly *slot;
+	unsigned int bit = 1 << (frame->index % 8);
+	struct timeval arrival;
+	char *data;
+	int bundleLength;
+
+	memset(&bundle, 0, sizeof bundle);
+	bundle.induct = induct;
+	bundle.source = findDelaySource(&cli->sources, fromAddr);
+	cliCount(cli, &bundle, segments, 1);
+	slot = findReassembly(cli, induct, frame, fromAddr);
+	if (slot == NULL) {
+		cliCount(cli, &bundle, segmentsRefused, 1);
+		return -1;
+	}
+
+	if (slot->seen[frame->index / 8] & bit) {
+		return 0;	/* Duplicate segment */
+	}
+
+	memcpy(slot->data + frame->offset, datagram + frame->headerLength,
+			length - frame->headerLength);
+	slot->seen[frame->index / 8] |= bit;
+	if (++slot->received < slot->count) {
+		return 0;
+	}
+
+	/* Complete: the queue takes the reassembled bundle as it is */
+	cliCount(cli, &bundle, reassembled, 1);
+	cliCount(cli, &bundle, received, 1);
+	cliCount(cli, &bundle, bytesReceived, slot->bundleLength);
+	data = slot->data;
+	bundleLength = slot->bundleLength;
+	arrival = slot->firstArrival;
+	slot->data = NULL;
+	freeReassembly(cli, slot);
+	return queueReceived(cli, induct, bundle.source, data, bundleLength,
+			fromAddr, &arrival);
+}
+
+/*	*	*	Aggregate frames (receive thread)	*	*	*/
+
+/* Queues each bundle packed in an aggregate frame.  The whole frame is
+ * checked first, so a malformed one queues nothing; returns -1 then. */
+static int receiveAggregate(DelayCli *cli, DelayCliDuct *induct,
+		DelayFrame *frame, char *datagram, int length,
+		struct sockaddr_storage *fromAddr)
+{
+	unsigned char *start = (unsigned char *) datagram + frame->headerLength;
+	unsigned char *end = (unsigned char *) datagram + length;
+	unsigned char *cursor = start;
+	unsigned int bundleLength;
+
+	for (unsigned int i = 0; i < frame->count; i++) {
+		if (end - cursor < DELAY_AGGREGATE_ENTRY_BYTES) {
+			return -1;
+		}
+
+		bundleLength = (cursor[0] << 8) | cursor[1];
+		cursor += DELAY_AGGREGATE_ENTRY_BYTES;
+		if (bundleLength == 0 || bundleLength > end - cursor) {
+			return -1;
+		}
+
+		cursor += bundleLength;
+	}
+
+	if (cursor != end) {
+		return -1;
+	}
+
+	delayCount(cli->stats.aggregates, 1);
+	if (induct) {
+		delayCount(induct->stats.aggregates, 1);
+	}
+
+	for (cursor = start; cursor < end; cursor += bundleLength) {
+		bundleLength = (cursor[0] << 8) | cursor[1];
+		cursor += DELAY_AGGREGATE_ENTRY_BYTES;
+		if (delayCliEnqueue(cli, induct, (char *) cursor, bundleLength,
+				fromAddr) < 0) {
+			putErrmsg("Can't queue bundle - release thread behind.", NULL);
+		}
+	}
+
+	return 0;
+}
+
+/* An aggregating CLO is sending to a CLI built without aggregation */
+static void refuseAggregate(DelayCli *cli, DelayCliDuct *induct)
+{
+	char memoBuf[256];
+
+	if (induct) {
+		delayCount(induct->stats.aggregatesRefused, 1);
+	}
+
+	if (__atomic_add_fetch(&cli->stats.aggregatesRefused, 1,
+			__ATOMIC_RELAXED) == 1) {
+		isprintf(memoBuf, sizeof memoBuf, "[?] %s: peer sends "
+				"aggregated bundles; dropping them.  Build both "
+				"ends with AGGREGATE=1, or neither.",
+				cli->model->daemonName);
+		writeMemo(memoBuf);
+	}
+}
+
+/*	*	*	Cold tier (tier thread)	*	*	*	*	*/
+
+static int initTier(DelayCli *cli, int capacity)
+{
+	DelayTier *tier = &cli->tier;
+
+	memset(tier, 0, sizeof(DelayTier));
+	tier->current = -1;
+	for (int i = 0; i < DELAY_TIER_SEGMENTS; i++) {
+		tier->segments[i].fd = -1;
+	}
+
+	if (!DELAY_TIER) {
+		return 0;
+	}
+
+	tier->dirName = getenv(DELAY_TIER_DIR_ENV);
+	if (tier->dirName == NULL || *tier->dirName == '\0') {
+		tier->dirName = DELAY_TIER_DIR;
+	}
+
+	if (access(tier->dirName, W_OK) < 0) {
+		putSysErrmsg("Can't use cold-tier directory", tier->dirName);
+		return -1;
+	}
+
+	if (initDelayQueue(&tier->cold, DELAY_TIER_CAPACITY > 0
+			? DELAY_TIER_CAPACITY : capacity) < 0
+	|| initDelayStage(&tier->spillStage, DELAY_STAGE_CAPACITY) < 0
+	|| initDelayStage(&tier->promoteStage, DELAY_STAGE_CAPACITY) < 0) {
+		putErrmsg("Can't set up cold tier.", tier->dirName);
+		return -1;
+	}
+
+	tier->cold.leadUsec = DELAY_TIER_LEAD_SEC * 1000000L;
+	tier->horizonUsec = DELAY_TIER_HORIZON_SEC * 1000000LL;
+	tier->stats.minMarginUsec = LLONG_MAX;
+	return 0;
+}
+
+/* The file is unlinked, so closing it returns its space */
+static void closeSegment(DelayTier *tier, int i)
+{
+	close(tier->segments[i].fd);
+	tier->segments[i].fd = -1;
+	tier->segments[i].length = 0;
+	tier->segments[i].live = 0;
+	if (tier->current == i) {
+		tier->current = -1;
+	}
+}
+
+/* Bundles still cold at shutdown are simply forgotten */
+static void closeTier(DelayTier *tier)
+{
+	if (tier->dirName == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < DELAY_TIER_SEGMENTS; i++) {
+		if (tier->segments[i].fd >= 0) {
+			closeSegment(tier, i);
+		}
+	}
+
+	destroyDelayQueue(&tier->cold);
+	tier->horizonUsec = 0;
+	tier->dirName = NULL;
+}
+
+static int openSegment(DelayCli *cli)
+{
+	DelayTier *tier = &cli->tier;
+	char fileName[256];
+	int i, fd;
+
+	for (i = 0; i < DELAY_TIER_SEGMENTS; i++) {
+		if (tier->segments[i].fd < 0) {
+			break;
+		}
+	}
+
+	if (i == DELAY_TIER_SEGMENTS) {
+		return -1;		/* Cold tier full */
+	}
+
+	isprintf(fileName, sizeof fileName, "%s/%s.cold.XXXXXX",
+			tier->dirName, cli->model->daemonName);
+	fd = mkstemp(fileName);
+	if (fd < 0) {
+		putSysErrmsg("Can't create cold-tier file", fileName);
+		return -1;
+	}
+
+	oK(unlink(fileName));
+	tier->segments[i].fd = fd;
+	tier->segments[i].length = 0;
+	tier->segments[i].live = 0;
+	tier->current = i;
+	return 0;
+}
+
+/* Stops writing the current segment.  Its pages are flushed and
+ * dropped from the page cache, since nothing reads them until they are
+ * nearly due. */
+static void retireSegment(DelayTier *tier)
+{
+	int i = tier->current;
+
+	tier->current = -1;
+	if (tier->segments[i].live == 0) {
+		closeSegment(tier, i);
+		return;
+	}
+
+	oK(fdatasync(tier->segments[i].fd));
+	oK(posix_fadvise(tier->segments[i].fd, 0, 0, POSIX_FADV_DONTNEED));
+}
+
+/* Hands a bundle the tier didn't take back to the release thread */
+static void keepHot(DelayCli *cli, DelayedBundle *bundle)
+{
+	delayCount(cli->tier.stats.keptHot, 1);
+	if (pushDelayStage(&cli->tier.promoteStage, bundle, 1) < 0) {
+		freeBundleData(cli, bundle);	/* CLI stopping */
+	}
+}
+
+/* Called by releaseDelayed for each bundle DELAY_TIER_LEAD_SEC before
+ * its release time: reads its data back and hands it to the release
+ * thread */
+static void promoteBundle(DelayedBundle *bundle, void *arg)
+{
+	DelayCli *cli = (DelayCli *) arg;
+	DelayTier *tier = &cli->tier;
+	DelayTierStats *stats = &tier->stats;
+	DelayTierSegment *segment = &tier->segments[bundle->coldSegment];
+	unsigned int length = bundle->packedLength > 0 ? bundle->packedLength
+			: bundle->length;
+	unsigned long long start = receiveClock();
+	struct timeval now;
+	long long marginUsec, lateUsec;
+	ssize_t bytesRead = -1;
+
+	bundle->data = MTAKE(length);
+	if (bundle->data == NULL) {
+		putErrmsg("Can't allocate cold-tier bundle.", itoa(length));
+	} else if ((bytesRead = pread(segment->fd, bundle->data, length,
+			bundle->coldOffset)) < 0) {
+		putSysErrmsg("Can't read from cold tier", itoa(length));
+	} else if (bytesRead != (ssize_t) length) {
+		putErrmsg("Cold-tier bundle cut short.", itoa(bytesRead));
+	}
+
+	if (bytesRead != (ssize_t) length) {
+		stats->readFailed++;
+		cliCount(cli, bundle, coldUnreadable, 1);
+		traceBundle(&bundle->id, DTR_CLI_DROP, bundle->length, NULL);
+		freeBundleData(cli, bundle);
+	} else {
+		stats->readNsec += receiveClock() - start;
+		stats->promoted++;
+		delayNow(&now);
+		marginUsec = (bundle->releaseTime.tv_sec - now.tv_sec) * 1000000LL
+				+ bundle->releaseTime.tv_usec - now.tv_usec;
+		lateUsec = tier->cold.leadUsec - marginUsec;
+		if (lateUsec > 0) {
+			stats->latenessUsec += lateUsec;
+			if (lateUsec > (long long) stats->maxLatenessUsec) {
+				stats->maxLatenessUsec = lateUsec;
+			}
+		}
+
+		if (marginUsec < stats->minMarginUsec) {
+			stats->minMarginUsec = marginUsec;
+		}
+
+		if (marginUsec < 0) {
+			stats->pastDeadline++;
+		}
+
+		if (pushDelayStage(&tier->promoteStage, bundle, 1) < 0) {
+			freeBundleData(cli, bundle);	/* CLI stopping */
+		}
+	}
+
+	stats->coldBytes -= length;
+	if (--segment->live == 0) {
+		if (bundle->coldSegment != tier->current) {
+			closeSegment(tier, bundle->coldSegment);
+		} else if (ftruncate(segment->fd, 0) == 0) {
+			segment->length = 0;	/* Start it over */
+		}
+	}
+
+	bundle->data = NULL;
+}
+
+/* Writes a bundle's data (compressed, if it is) to the current segment
+ * and files the bundle in the cold index */
+static void spillBundle(DelayCli *cli, DelayedBundle *bundle)
+{
+	DelayTier *tier = &cli->tier;
+	DelayTierStats *stats = &tier->stats;
+	DelayTierSegment *segment;
+	unsigned int length = bundle->packedLength > 0 ? bundle->packedLength
+			: bundle->length;
+	unsigned long long start = receiveClock();
+
+	/* Handed over by another process, already in a segment */
+	if (bundle->data == NULL) {
+		stats->coldBytes += length;
+		if (insertDelayed(&tier->cold, bundle) < 0) {
+			promoteBundle(bundle, cli);
+		}
+
+		return;
+	}
+
+	if (tier->cold.count == tier->cold.capacity
+	|| length > DELAY_TIER_SEGMENT_BYTES) {
+		keepHot(cli, bundle);
+		return;
+	}
+
+	if (tier->current >= 0 && tier->segments[tier->current].length
+			> DELAY_TIER_SEGMENT_BYTES - length) {
+		retireSegment(tier);
+	}
+
+	if (tier->current < 0 && openSegment(cli) < 0) {
+		keepHot(cli, bundle);
+		return;
+	}
+
+	segment = &tier->segments[tier->current];
+	if (pwrite(segment->fd, bundle->data, length, segment->length)
+			!= (ssize_t) length) {
+		putSysErrmsg("Can't write to cold tier", itoa(length));
+		keepHot(cli, bundle);
+		return;
+	}
+
+	bundle->coldSegment = tier->current;
+	bundle->coldOffset = segment->length;
+	segment->length += length;
+	segment->live++;
+	MRELEASE(bundle->data);
+	bundle->data = NULL;
+	oK(insertDelayed(&tier->cold, bundle));
+	stats->spilled++;
+	stats->spilledBytes += length;
+	stats->coldBytes += length;
+	if (stats->coldBytes > stats->maxColdBytes) {
+		stats->maxColdBytes = stats->coldBytes;
+	}
+
+	if (tier->cold.count > stats->highWater) {
+		stats->highWater = tier->cold.count;
+	}
+
+	stats->writeNsec += receiveClock() - start;
+}
+
+/* Tier thread: spills the bundles it is handed and promotes those
+ * nearly due, until the spill stage is closed */
+static void *delayCliTier(void *arg)
+{
+	DelayCli *cli = (DelayCli *) arg;
+	DelayTier *tier = &cli->tier;
+	DelayedBundle bundle;
+	struct timeval now;
+	long long usec;
+
+	while (!__atomic_load_n(&tier->spillStage.closed, __ATOMIC_RELAXED)) {
+		while (popDelayStage(&tier->spillStage, &bundle, 0)) {
+			spillBundle(cli, &bundle);
+		}
+
+		delayNow(&now);
+		oK(releaseDelayed(&tier->cold, &now, promoteBundle, cli));
+
+		/* At most 10 ms: the engine clock may be virtual */
+		usec = usecToDeadline(&tier->cold);
+		if (usec > 0) {
+			waitDelayStage(&tier->spillStage, usec < 10000 ? usec
+					: 10000);
+		}
+	}
+
+	return NULL;
+}
+
+static void stopTier(DelayTier *tier)
+{
+	if (!tier->threadStarted) {
+		return;
+	}
+
+	closeDelayStage(&tier->spillStage);
+	closeDelayStage(&tier->promoteStage);
+	pthread_join(tier->thread, NULL);
+	tier->threadStarted = 0;
+}
+
+/* Release thread: whether a newly arrived bundle is due beyond the
+ * horizon, and so belongs in the cold tier */
+static int beyondHorizon(DelayTier *tier, DelayedBundle *bundle,
+		struct timeval *now)
+{
+	return tier->horizonUsec > 0
+		&& (bundle->releaseTime.tv_sec - now->tv_sec) * 1000000LL
+		+ bundle->releaseTime.tv_usec - now->tv_usec
+		> tier->horizonUsec;
+}
+
+/* Release thread: a bundle joins the delay queue.  A newly received
+ * one (now given) is compressed first, and goes to the cold tier
+ * instead if it is due beyond the horizon and the tier thread has room
+ * for it. */
+static void scheduleBundle(DelayCli *cli, DelayedBundle *bundle,
+		struct timeval *now)
+{
+	if (now) {
+		packBundle(cli, bundle, now);
+	}
+
+	if (now && beyondHorizon(&cli->tier, bundle, now)) {
+		if (pushDelayStage(&cli->tier.spillStage, bundle, 0) == 0) {
+			traceBundle(&bundle->id, DTR_CLI_DEADLINE,
+					bundle->length, &bundle->releaseTime);
+			return;
+		}
+
+		delayCount(cli->tier.stats.keptHot, 1);
+	}
+
+	if (insertDelayed(&cli->queue, bundle) < 0) {
+		putErrmsg("Can't queue bundle - queue full.", NULL);
+		cliCount(cli, bundle, queueFull, 1);
+		traceBundle(&bundle->id, DTR_CLI_DROP, bundle->length, NULL);
+		freeBundleData(cli, bundle);
+		return;
+	}
+
+	if (now) {
+		traceBundle(&bundle->id, DTR_CLI_DEADLINE, bundle->length,
+				&bundle->releaseTime);
+	}
+}
+
+/* Numeric source address, for error reporting */
+static char *sourceName(DelayedBundle *bundle, char *hostName)
+{
+	return delayAddressString(&bundle->fromAddr, hostName,
+			MAXHOSTNAMELEN + 1);
+}
+
+/* Process a bundle (after delay has elapsed), using the caller's work
+ * area */
+static int processBundle(DelayCli *cli, AcqWorkArea *work,
+		DelayedBundle *bundle)
+{
+	char hostName[MAXHOSTNAMELEN + 1];
+	struct timeval now;
+	double lossPercentage = cli->model->lossPercentage;
+
+	delayNow(&now);
+	if (timercmp(&now, &bundle->releaseTime, >)) {
+		profileRecord(PROF_RELEASE_LATE,
+				((now.tv_sec - bundle->releaseTime.tv_sec) * 1000000LL
+				+ now.tv_usec - bundle->releaseTime.tv_usec) * 1000);
+	}
+
+	traceBundle(&bundle->id, DTR_CLI_RELEASE, bundle->length, NULL);
+
+	/* Check for link loss: the source's, else the induct's */
+	if (bundle->source && bundle->source->lossPercentage >= 0.0) {
+		lossPercentage = bundle->source->lossPercentage;
+	} else if (bundle->induct) {
+		lossPercentage = bundle->induct->lossPercentage;
+	}
+
+	if (simulateLinkLoss(lossPercentage)) {
+		/* Simulate bundle loss - just drop it */
+		cliCount(cli, bundle, linkLoss, 1);
+		traceBundle(&bundle->id, DTR_CLI_DROP, bundle->length, NULL);
+		return 0;
+	}
+
+	if (bundle->packedLength > 0 && expandBundle(cli, bundle) < 0) {
+		putErrmsg("Can't expand bundle.", sourceName(bundle, hostName));
+		cliCount(cli, bundle, acqFailed, 1);
+		traceBundle(&bundle->id, DTR_CLI_DROP, bundle->length, NULL);
+		return -1;
+	}
+
+	unsigned long long stageStart = profileStart();
+	if (bpBeginAcq(work, 0, NULL) < 0)
+	{
+		putErrmsg("Can't begin bundle acquisition.", sourceName(bundle, hostName));
+		cliCount(cli, bundle, acqFailed, 1);
+		return -1;
+	}
+	profileStop(PROF_BEGIN_ACQ, stageStart);
+
+	stageStart = profileStart();
+	if (bpContinueAcq(work, bundle->data, bundle->length, 0, 0) < 0)
+	{
+		putErrmsg("Can't continue bundle acquisition.", sourceName(bundle, hostName));
+		bpCancelAcq(work);
+		cliCount(cli, bundle, acqFailed, 1);
+		return -1;
+	}
+	profileStop(PROF_CONTINUE_ACQ, stageStart);
+
+	stageStart = profileStart();
+	if (bpEndAcq(work) < 0)
+	{
+		putErrmsg("Can't end bundle acquisition.", sourceName(bundle, hostName));
+		cliCount(cli, bundle, acqFailed, 1);
+		traceBundle(&bundle->id, DTR_CLI_DROP, bundle->length, NULL);
+		return -1;
+	}
+	profileStop(PROF_END_ACQ, stageStart);
+
+	traceBundle(&bundle->id, DTR_CLI_ACQUIRE, bundle->length, NULL);
+	cliCount(cli, bundle, acquired, 1);
+	return 0;
+}
+
+static void acquireBundle(DelayCli *cli, AcqWorkArea *work,
+		DelayedBundle *bundle)
+{
+	if (processBundle(cli, work, bundle) < 0) {
+		putErrmsg("Can't process bundle.", NULL);
+	}
+
+	/* Free the data */
+	if (bundle->data) {
+		freeBundleData(cli, bundle);
+	}
+}
+
+/* Each source's bundles go to one worker (ordered), or each bundle to
+ * the worker with the fewest waiting */
+static DelayAcqWorker *chooseWorker(DelayCli *cli, DelayedBundle *bundle)
+{
+	int chosen = 0;
+
+	if (cli->acqOrdered) {
+		return &cli->workers[hashDelayAddress(&bundle->fromAddr)
+				% cli->acqWorkers];
+	}
+
+	for (int i = 1; i < cli->acqWorkers; i++) {
+		if (__atomic_load_n(&cli->workers[i].stage.count, __ATOMIC_RELAXED)
+				< __atomic_load_n(&cli->workers[chosen].stage.count,
+				__ATOMIC_RELAXED)) {
+			chosen = i;
+		}
+	}
+
+	return &cli->workers[chosen];
+}
+
+static void releaseBundle(DelayedBundle *bundle, void *arg)
+{
+	DelayCli *cli = (DelayCli *) arg;
+
+	if (cli->acqWorkers == 0) {
+		acquireBundle(cli, bundle->induct ? bundle->induct->work[0]
+				: cli->work, bundle);
+		return;
+	}
+
+	if (pushDelayStage(&chooseWorker(cli, bundle)->stage, bundle, 1) < 0) {
+		freeBundleData(cli, bundle);	/* CLI stopping */
+	}
+
+	bundle->data = NULL;
+}
+
+/* Acquisition worker: acquires due bundles until its stage is closed
+ * and drained */
+static void *delayCliWorker(void *arg)
+{
+	DelayAcqWorker *worker = (DelayAcqWorker *) arg;
+	DelayedBundle bundle;
+
+	while (popDelayStage(&worker->stage, &bundle, 1)) {
+		acquireBundle(worker->cli, bundle.induct
+				? bundle.induct->work[1 + worker->index]
+				: worker->work, &bundle);
+		worker->acquired++;
+	}
+
+	return NULL;
+}
+
+void delayCliRelease(DelayCli *cli)
+{
+	DelayedBundle bundle;
+	struct timeval now;
+
+	delayNow(&now);
+
+	/* What is due goes first: compressing arrivals mustn't delay it */
+	if (cli->compressor.table) {
+		releaseDelayed(&cli->queue, &now, releaseBundle, cli);
+	}
+
+	while (popDelayStage(&cli->scheduleStage, &bundle, 0)) {
+		scheduleBundle(cli, &bundle, &now);
+	}
+
+	while (cli->tier.horizonUsec > 0
+	&& popDelayStage(&cli->tier.promoteStage, &bundle, 0)) {
+		scheduleBundle(cli, &bundle, NULL);
+	}
+
+	delayNow(&now);
+	releaseDelayed(&cli->queue, &now, releaseBundle, cli);
+}
+
+int initDelayCliPipeline(DelayCli *cli, VInduct *vduct, int acqWorkers)
+{
+	cli->acqWorkers = 0;
+	cli->acqOrdered = DELAY_ACQ_ORDERED;
+	if (acqWorkers < 0 || acqWorkers > DELAY_MAX_ACQ_WORKERS) {
+		putErrmsg("Bad acquisition worker count.", itoa(acqWorkers));
+		return -1;
+	}
+
+	if (initDelayStage(&cli->scheduleStage, DELAY_STAGE_CAPACITY) < 0) {
+		return -1;
+	}
+
+	if (initDedupIndex(&cli->dedup, cli->queue.capacity) < 0
+	|| initCompressor(&cli->compressor) < 0
+	|| initTier(cli, cli->queue.capacity) < 0) {
+		closeDelayCliPipeline(cli);
+		return -1;
+	}
+
+	for (int i = 0; i < acqWorkers; i++) {
+		DelayAcqWorker *worker = &cli->workers[i];
+
+		memset(worker, 0, sizeof(DelayAcqWorker));
+		worker->cli = cli;
+		worker->index = i;
+		worker->work = vduct ? bpGetAcqArea(vduct) : NULL;
+		if ((vduct && worker->work == NULL)
+		|| initDelayStage(&worker->stage, DELAY_STAGE_CAPACITY) < 0) {
+			putErrmsg("Can't set up acquisition worker.", itoa(i));
+			if (worker->work) {
+				bpReleaseAcqArea(worker->work);
+			}
+
+			closeDelayCliPipeline(cli);
+			return -1;
+		}
+
+		cli->acqWorkers++;
+	}
+
+	return 0;
+}
+
+static void freeStagedData(DelayStage *stage)
+{
+	DelayedBundle bundle;
+
+	if (stage->slots == NULL) {
+		return;
+	}
+
+	while (popDelayStage(stage, &bundle, 0)) {
+		MRELEASE(bundle.data);
+	}
+
+	destroyDelayStage(stage);
+}
+
+void closeDelayCliPipeline(DelayCli *cli)
+{
+	freeStagedData(&cli->scheduleStage);
+	for (int i = 0; i < cli->acqWorkers; i++) {
+		freeStagedData(&cli->workers[i].stage);
+		if (cli->workers[i].work) {
+			bpReleaseAcqArea(cli->workers[i].work);
+			cli->workers[i].work = NULL;
+		}
+	}
+
+	cli->acqWorkers = 0;
+	freeStagedData(&cli->tier.spillStage);
+	freeStagedData(&cli->tier.promoteStage);
+	closeTier(&cli->tier);
+	freeDedupIndex(&cli->dedup);
+	freeCompressor(&cli->compressor);
+}
+
+int openDelayCliDuct(DelayCli *cli, DelayCliDuct *induct)
+{
+	induct->cli = cli;
+	for (int i = 0; i <= cli->acqWorkers; i++) {
+		induct->work[i] = bpGetAcqArea(induct->vduct);
+		if (induct->work[i] == NULL) {
+			putErrmsg("Can't get acquisition work area.",
+					induct->ductName);
+			closeDelayCliDuct(induct);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void closeDelayCliDuct(DelayCliDuct *induct)
+{
+	for (int i = 0; i <= DELAY_MAX_ACQ_WORKERS; i++) {
+		if (induct->work[i]) {
+			bpReleaseAcqArea(induct->work[i]);
+			induct->work[i] = NULL;
+		}
+	}
+}
+
+/* Sleep until a datagram is received or the next release time, at
+ * most 1 ms (the engine clock may be virtual) */
+static void waitForRelease(DelayCli *cli)
+{
+	struct timeval deadline, now;
+	long usec = 1000;
+
+	if (nextDelayedDeadline(&cli->queue, &deadline) == 0) {
+		delayNow(&now);
+		usec = (deadline.tv_sec - now.tv_sec) * 1000000L
+				+ deadline.tv_usec - now.tv_usec;
+		if (usec <= 0) {
+			return;
+		}
+
+		/* Spin through the last stretch instead of sleeping */
+		usec -= cli->rt.spinUsec;
+		if (usec <= 0) {
+			oK(spinToDeadline(&cli->queue, cli->rt.spinUsec));
+			return;
+		}
+
+		if (usec > 1000) {
+			usec = 1000;
+		}
+	}
+
+	waitDelayStage(&cli->scheduleStage, usec);
+}
+
+void *delayCliMonitor(void *arg)
+{
+	DelayCli *cli = (DelayCli *) arg;
+
+	oK(applyDelayRealtime(&cli->rt, cli->rt.releaseCpus,
+			cli->model->daemonName, "release"));
+	while (cli->running) {
+		delayCliRelease(cli);
+		checkProfileReport();
+		waitForRelease(cli);
+	}
+
+	delayNow(&cli->handoff.lastRelease);
+	closeDelayStage(&cli->scheduleStage);
+	return NULL;
+}
+
+int startDelayCli(DelayCli *cli)
+{
+	int started;
+
+	if (cli->tier.horizonUsec > 0) {
+		if (pthread_create(&cli->tier.thread, NULL, delayCliTier, cli)) {
+			putSysErrmsg("Can't create cold-tier thread", NULL);
+			return -1;
+		}
+
+		cli->tier.threadStarted = 1;
+	}
+
+	for (started = 0; started < cli->acqWorkers; started++) {
+		if (pthread_create(&cli->workers[started].thread, NULL,
+				delayCliWorker, &cli->workers[started])) {
+			break;
+		}
+	}
+
+	if (started < cli->acqWorkers
+	|| pthread_create(&cli->releaseThread, NULL, delayCliMonitor, cli)) {
+		putSysErrmsg("Can't create CLI thread", NULL);
+		while (started > 0) {
+			closeDelayStage(&cli->workers[--started].stage);
+			pthread_join(cli->workers[started].thread, NULL);
+		}
+
+		stopTier(&cli->tier);
+		return -1;
+	}
+
+	return 0;
+}
+
+void stopDelayCli(DelayCli *cli)
+{
+	cli->running = 0;
+	pthread_join(cli->releaseThread, NULL);
+	stopTier(&cli->tier);
+	for (int i = 0; i < cli->acqWorkers; i++) {
+		closeDelayStage(&cli->workers[i].stage);
+	}
+
+	for (int i = 0; i < cli->acqWorkers; i++) {
+		pthread_join(cli->workers[i].thread, NULL);
+	}
+}
+
+/* The receive thread's turn: from a datagram's arrival in user space
+ * to the handoff to the release thread */
+static void noteReceiveTurn(DelayCli *cli, unsigned long long start)
+{
+	unsigned long long nsec = receiveClock() - start;
+
+	profileRecord(PROF_RECEIVE_TURN, nsec);
+	if (nsec > DELAY_RECEIVE_BUDGET_USEC * 1000ULL) {
+		delayCount(cli->stats.budgetOverruns, 1);
+	}
+
+	if (nsec > cli->stats.maxReceiveNsec) {
+		cli->stats.maxReceiveNsec = nsec;
+	}
+}
+
+/* The descriptor that wakes the receive thread for an induct: its
+ * socket, or its ring's doorbell */
+static int inductFd(DelayCliDuct *induct)
+{
+	return induct->ring ? shmRingDoorbell(induct->ring) : induct->ductSocket;
+}
+
+/* Asks the writers of every open ring to ring its doorbell.  Returns
+ * 1 if any ring already has records, so the wait mustn't sleep. */
+static int armRings(DelayCli *cli)
+{
+	int pending = 0;
+
+	for (int i = 0; i < cli->ductCount; i++) {
+		if (cli->ducts[i].ring && !cli->ducts[i].closed) {
+			pending |= armShmRing(cli->ducts[i].ring);
+		}
+	}
+
+	return pending;
+}
+
+/* Stops the doorbells and lists the inducts whose rings have records,
+ * after the count already in ready */
+static int listRings(DelayCli *cli, DelayCliDuct **ready, int count)
+{
+	DelayCliDuct *induct;
+
+	for (int i = 0; i < cli->ductCount; i++) {
+		induct = &cli->ducts[i];
+		if (induct->ring && !induct->closed) {
+			quietShmRing(induct->ring, 0);
+			if (shmRingPending(induct->ring)) {
+				ready[count++] = induct;
+			}
+		}
+	}
+
+	return count;
+}
+
+/* Starts watching every induct's socket or ring doorbell, or
+ * cli->ductSocket if there are none.  Returns the epoll descriptor (-1
+ * where select is used), or -2 on failure. */
+static int watchSockets(DelayCli *cli)
+{
+#ifdef __linux__
+	struct epoll_event event;
+	int epollFd = epoll_create1(0);
+
+	if (epollFd < 0) {
+		putSysErrmsg("Can't create epoll instance", NULL);
+		return -2;
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (cli->ductCount == 0
+	&& epoll_ctl(epollFd, EPOLL_CTL_ADD, cli->ductSocket, &event) < 0) {
+		putSysErrmsg("Can't watch UDP socket", NULL);
+		close(epollFd);
+		return -2;
+	}
+
+	for (int i = 0; i < cli->ductCount; i++) {
+		event.data.ptr = &cli->ducts[i];
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, inductFd(&cli->ducts[i]),
+				&event) < 0) {
+			putSysErrmsg("Can't watch UDP socket",
+					cli->ducts[i].ductName);
+			close(epollFd);
+			return -2;
+		}
+	}
+
+	return epollFd;
+#else
+	return -1;
+#endif
+}
+
+/* Waits up to 100 ms (bounding the shutdown check) for datagrams and
+ * lists the inducts that have one, NULL standing for cli->ductSocket.
+ * Returns the number listed, or -1 on failure. */
+static int waitForDatagrams(DelayCli *cli, int epollFd, DelayCliDuct **ready)
+{
+#ifdef __linux__
+	struct epoll_event events[DELAY_MAX_CLI_DUCTS];
+	int count, sockets = 0;
+
+	count = epoll_wait(epollFd, events, DELAY_MAX_CLI_DUCTS,
+			armRings(cli) ? 0 : 100);
+	if (count < 0) {
+		/* Interrupted by signal during shutdown - this is normal */
+		return errno == EINTR ? 0 : -1;
+	}
+
+	/* A rung doorbell is drained; its ring is listed below */
+	for (int i = 0; i < count; i++) {
+		DelayCliDuct *induct = (DelayCliDuct *) events[i].data.ptr;
+
+		if (induct && induct->ring) {
+			quietShmRing(induct->ring, 1);
+		} else {
+			ready[sockets++] = induct;
+		}
+	}
+
+	return listRings(cli, ready, sockets);
+#else
+	fd_set readfds;
+	struct timeval timeout;
+	int maxFd = cli->ductSocket;
+	int count = 0;
+
+	FD_ZERO(&readfds);
+	if (cli->ductCount == 0) {
+		FD_SET(cli->ductSocket, &readfds);
+	}
+
+	for (int i = 0; i < cli->ductCount; i++) {
+		if (!cli->ducts[i].closed) {
+			FD_SET(inductFd(&cli->ducts[i]), &readfds);
+			if (inductFd(&cli->ducts[i]) > maxFd) {
+				maxFd = inductFd(&cli->ducts[i]);
+			}
+		}
+	}
+
+	timeout.tv_sec = 0;
+	timeout.tv_usec = armRings(cli) ? 0 : 100000;
+	if (select(maxFd + 1, &readfds, NULL, NULL, &timeout) < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (cli->ductCount == 0 && FD_ISSET(cli->ductSocket, &readfds)) {
+		ready[count++] = NULL;
+	}
+
+	for (int i = 0; i < cli->ductCount; i++) {
+		if (!cli->ducts[i].closed
+		&& FD_ISSET(inductFd(&cli->ducts[i]), &readfds)) {
+			if (cli->ducts[i].ring) {
+				quietShmRing(cli->ducts[i].ring, 1);
+			} else {
+				ready[count++] = &cli->ducts[i];
+			}
+		}
+	}
+
+	return listRings(cli, ready, count);
+#endif
+}
+
+/* Takes up to DELAY_SHM_BATCH records from an induct's ring, in place.
+ * Returns 0, or 1 for the stop record. */
+static int receiveRecords(DelayCli *cli, DelayCliDuct *induct)
+{
+	struct sockaddr_storage fromAddr;
+	unsigned char *record;
+	unsigned int length;
+
+	memset(&fromAddr, 0, sizeof fromAddr);
+	for (int i = 0; i < DELAY_SHM_BATCH; i++) {
+		unsigned long long receiveStart = profileStart();
+
+		record = peekShmRecord(induct->ring, &length);
+		profileStop(PROF_RECEIVE, receiveStart);
+		if (record == NULL) {
+			break;
+		}
+
+		if (length == 1) {
+			consumeShmRecord(induct->ring, length);
+			return 1;	/* Normal stop signal */
+		}
+
+		unsigned long long turnStart = receiveClock();
+
+		if (delayCliEnqueue(cli, induct, (char *) record, length,
+				&fromAddr) < 0) {
+			putErrmsg("Can't queue bundle - release thread behind.", NULL);
+		}
+
+		consumeShmRecord(induct->ring, length);
+		noteReceiveTurn(cli, turnStart);
+	}
+
+	return 0;
+}
+
+/* receiveBytesByUDP for a socket of either address family */
+static int receiveFrom(int fd, struct sockaddr_storage *fromAddr,
+		char *into, int length)
+{
+	socklen_t fromSize = sizeof(struct sockaddr_storage);
+	int bytesRead = recvfrom(fd, into, length, 0,
+			(struct sockaddr *) fromAddr, &fromSize);
+
+	if (bytesRead < 0) {
+		if (errno == EINTR) {	/* Shutdown */
+			return 0;
+		}
+
+		putSysErrmsg("Can't receive bundle", NULL);
+	}
+
+	return bytesRead;
+}
+
+/* Reads one datagram from a ready socket, or records from a ring.
+ * Returns 0, 1 for the stop datagram, or -1 on failure. */
+static int receiveDatagram(DelayCli *cli, DelayCliDuct *induct)
+{
+	struct sockaddr_storage fromAddr;
+	int bundleLength;
+
+	if (induct && induct->ring) {
+		return receiveRecords(cli, induct);
+	}
+
+	unsigned long long receiveStart = profileStart();
+	bundleLength = receiveFrom(induct ? induct->ductSocket
+			: cli->ductSocket, &fromAddr, cli->buffer, UDPCLA_BUFSZ);
+	profileStop(PROF_RECEIVE, receiveStart);
+	if (bundleLength > 1) {
+		/* Hand bundle to the release thread for delayed processing */
+		unsigned long long turnStart = receiveClock();
+		DelayFrame frame;
+
+		delayCount(cli->stats.datagrams, 1);
+		if (induct) {
+			delayCount(induct->stats.datagrams, 1);
+		}
+
+		switch (decodeDelayFrame((unsigned char *) cli->buffer,
+				bundleLength, &frame)) {
+		case 0:
+			if (delayCliEnqueue(cli, induct, cli->buffer,
+					bundleLength, &fromAddr) < 0) {
+				putErrmsg("Can't queue bundle - release thread behind.", NULL);
+			}
+
+			break;
+
+		case 1:
+			if (frame.kind == DELAY_FRAME_SEGMENT && DELAY_SEGMENTS) {
+				oK(receiveSegment(cli, induct, &frame,
+						cli->buffer, bundleLength,
+						&fromAddr));
+				break;
+			}
+
+			if (frame.kind == DELAY_FRAME_AGGREGATE
+			&& !DELAY_AGGREGATE) {
+				refuseAggregate(cli, induct);
+				break;
+			}
+
+			if (frame.kind == DELAY_FRAME_AGGREGATE
+			&& receiveAggregate(cli, induct, &frame, cli->buffer,
+					bundleLength, &fromAddr) == 0) {
+				break;
+			}
+
+			/* Intentional fall-through: can't use this frame */
+
+		default:
+			delayCount(cli->stats.badFrames, 1);
+			if (induct) {
+				delayCount(induct->stats.badFrames, 1);
+			}
+		}
+
+		noteReceiveTurn(cli, turnStart);
+		return 0;
+	}
+
+	if (bundleLength == 1) {
+		return 1;	/* Normal stop signal */
+	}
+
+	if (bundleLength < 0) {
+		putErrmsg("Can't receive bundle.",
+				induct ? induct->ductName : NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+int delayCliServe(DelayCli *cli)
+{
+	DelayCliDuct	*ready[DELAY_MAX_CLI_DUCTS];
+	int		open = cli->ductCount > 0 ? cli->ductCount : 1;
+	int		epollFd, count;
+	int		result = 0;
+
+	epollFd = watchSockets(cli);
+	if (epollFd < -1) {
+		return -1;
+	}
+
+	oK(applyDelayRealtime(&cli->rt, cli->rt.receiveCpus,
+			cli->model->daemonName, "receive"));
+
+	/* On a handoff request the release thread runs on until
+	 * stopDelayCli, so waiting here for the last datagrams adds
+	 * nothing to the release gap */
+	while (cli->running && !cli->handoff.requested)
+	{
+		/* Wait for data on any socket; only ready ones are read */
+		count = waitForDatagrams(cli, epollFd, ready);
+		if (count < 0) {
+			putSysErrmsg("Can't wait on UDP sockets", NULL);
+			cli->running = 0;
+			result = -1;
+			break;
+		}
+
+		for (int i = 0; i < count && cli->running; i++) {
+			switch (receiveDatagram(cli, ready[i])) {
+			case 1:
+				/* This induct is stopping */
+				if (ready[i]) {
+					ready[i]->closed = 1;
+#ifdef __linux__
+					epoll_ctl(epollFd, EPOLL_CTL_DEL,
+						inductFd(ready[i]), NULL);
+#endif
+				}
+
+				if (--open == 0) {
+					cli->running = 0;
+				}
+
+				break;
+
+			case -1:
+				cli->running = 0;
+				result = -1;
+				break;
+			}
+		}
+
+		if (cli->reassemblyBytes > 0) {
+			expireReassembly(cli);
+		}
+	}
+
+	discardReassembly(cli);
+
+	if (epollFd >= 0) {
+		close(epollFd);
+	}
+
+	return result;
+}
+
+/* A source as it is written in the table */
+static char *sourceEntryName(DelaySource *source, char *buffer, int length)
+{
+	struct sockaddr_storage name;
+	struct sockaddr_in *inet = (struct sockaddr_in *) &name;
+
+	memset(&name, 0, sizeof name);
+	if (IN6_IS_ADDR_V4MAPPED(&source->addr.sin6_addr)) {
+		inet->sin_family = AF_INET;
+		inet->sin_port = source->addr.sin6_port;
+		memcpy(&inet->sin_addr, &source->addr.sin6_addr.s6_addr[12], 4);
+	} else {
+		memcpy(&name, &source->addr, sizeof source->addr);
+	}
+
+	delayAddressString(&name, buffer, length);
+	if (source->addr.sin6_port == 0) {
+		*strrchr(buffer, ':') = '\0';	/* Any port */
+	}
+
+	return buffer;
+}
+
+/* Counters of the first sources heard from; the rest are summed */
+static void reportSources(DelayCli *cli)
+{
+	DelaySourceTable *table = &cli->sources;
+	char memoBuf[256];
+	char sourceName[INET6_ADDRSTRLEN + 16];
+	unsigned int heard = 0;
+
+	for (unsigned int i = 0; i <= table->mask; i++) {
+		DelaySource *source = table->slots + i;
+		DelayCliStats *stats = &source->stats;
+
+		if (!source->inUse || stats->received == 0) {
+			continue;
+		}
+
+		if (++heard > DELAY_SOURCE_REPORT_LIMIT) {
+			continue;
+		}
+
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: source %s: "
+				"received %llu (%llu bytes), acquired %llu, "
+				"dropped: queue full %llu, expired %llu, "
+				"duplicate %llu, release thread behind %llu, link "
+				"loss %llu, acquisition failed %llu, cold tier "
+				"unreadable %llu.", cli->model->daemonName,
+				sourceEntryName(source, sourceName,
+				sizeof sourceName), stats->received,
+				stats->bytesReceived, stats->acquired,
+				stats->queueFull, stats->expired,
+				stats->duplicates, stats->stageFull,
+				stats->linkLoss, stats->acqFailed,
+				stats->coldUnreadable);
+		writeMemo(memoBuf);
+	}
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: %u sources listed, %u "
+			"heard from (%u not shown), %llu datagrams from "
+			"unlisted senders.", cli->model->daemonName,
+			table->count, heard,
+			heard > DELAY_SOURCE_REPORT_LIMIT
+			? heard - DELAY_SOURCE_REPORT_LIMIT : 0,
+			table->unlisted);
+	writeMemo(memoBuf);
+}
+
+/* Resident set size of the process and its peak, in KB; 0 where
+ * /proc/self/status can't be read */
+static void residentSetKb(unsigned long *rss, unsigned long *peak)
+{
+	FILE *status = fopen("/proc/self/status", "r");
+	char line[128];
+
+	*rss = *peak = 0;
+	if (status == NULL) {
+		return;
+	}
+
+	while (fgets(line, sizeof line, status)) {
+		oK(sscanf(line, "VmRSS: %lu", rss));
+		oK(sscanf(line, "VmHWM: %lu", peak));
+	}
+
+	fclose(status);
+}
+
+static void reportTier(DelayCli *cli)
+{
+	DelayTierStats *stats = &cli->tier.stats;
+	char memoBuf[256];
+	unsigned long rss, peak;
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: cold tier: spilled %llu "
+			"(%.1f MB), promoted %llu, kept in RAM %llu, dropped: "
+			"unreadable %llu, %d still cold (high water %d, %.1f "
+			"MB peak), %.1f usec per write, %.1f per read.",
+			cli->model->daemonName, stats->spilled,
+			stats->spilledBytes / 1e6, stats->promoted,
+			stats->keptHot, stats->readFailed, cli->tier.cold.count,
+			stats->highWater, stats->maxColdBytes / 1e6,
+			stats->spilled ? stats->writeNsec / 1000.0
+			/ stats->spilled : 0.0,
+			stats->promoted ? stats->readNsec / 1000.0
+			/ stats->promoted : 0.0);
+	writeMemo(memoBuf);
+	residentSetKb(&rss, &peak);
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: promotion late %.1f msec "
+			"mean, %.1f max, %llu after release time, least margin "
+			"%.1f msec; RSS %lu KB, peak %lu KB.",
+			cli->model->daemonName, stats->promoted
+			? stats->latenessUsec / 1000.0 / stats->promoted : 0.0,
+			stats->maxLatenessUsec / 1000.0, stats->pastDeadline,
+			stats->promoted ? stats->minMarginUsec / 1000.0 : 0.0,
+			rss, peak);
+	writeMemo(memoBuf);
+}
+
+void delayCliReport(DelayCli *cli)
+{
+	char memoBuf[256];
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: received %llu (%llu "
+			"bytes), acquired %llu, dropped: queue full %llu, "
+			"expired %llu, duplicate %llu, release thread behind "
+			"%llu, link loss %llu, acquisition failed %llu, cold "
+			"tier unreadable %llu, %d still queued.",
+			cli->model->daemonName,
+			cli->stats.received, cli->stats.bytesReceived,
+			cli->stats.acquired, cli->stats.queueFull,
+			cli->stats.expired, cli->stats.duplicates,
+			cli->stats.stageFull,
+			cli->stats.linkLoss, cli->stats.acqFailed,
+			cli->stats.coldUnreadable, cli->queue.count);
+	writeMemo(memoBuf);
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: receive turn budget %d "
+			"usec, %llu overruns, longest %.1f usec.",
+			cli->model->daemonName, DELAY_RECEIVE_BUDGET_USEC,
+			cli->stats.budgetOverruns,
+			cli->stats.maxReceiveNsec / 1000.0);
+	writeMemo(memoBuf);
+	if (cli->stats.aggregates > 0 || cli->stats.aggregatesRefused > 0) {
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: %llu datagrams, "
+				"%llu aggregate frames unpacked, dropped: "
+				"aggregation off %llu.", cli->model->daemonName,
+				cli->stats.datagrams, cli->stats.aggregates,
+				cli->stats.aggregatesRefused);
+		writeMemo(memoBuf);
+	}
+
+	if (cli->dedup.slots) {
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: duplicate index "
+				"holds %u bundles in %u slots, %llu queued "
+				"unremembered (index full).", cli->model->daemonName,
+				cli->dedup.count, cli->dedup.mask + 1,
+				cli->dedup.unremembered);
+		writeMemo(memoBuf);
+	}
+
+	if (cli->compressor.table) {
+		DelayCompressStats *stats = &cli->compressor.stats;
+
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: compression: "
+				"%llu of %llu bundles tried kept compressed, %llu "
+				"bypassed, ratio %.2f, %.1f usec per try, %.1f "
+				"usec per expansion, %lld bytes saved in the "
+				"queue (peak %lld), corrupt %llu.",
+				cli->model->daemonName, stats->compressed,
+				stats->tried, stats->bypassed,
+				stats->packedBytes ? (double) stats->rawBytes
+				/ stats->packedBytes : 1.0,
+				stats->tried ? stats->compressNsec / 1000.0
+				/ stats->tried : 0.0,
+				stats->expanded ? stats->expandNsec / 1000.0
+				/ stats->expanded : 0.0,
+				stats->heldSaving, stats->maxHeldSaving,
+				stats->expandFailed);
+		writeMemo(memoBuf);
+	}
+
+	if (cli->tier.horizonUsec > 0) {
+		reportTier(cli);
+	}
+
+	if (cli->stats.segments > 0 || cli->stats.badFrames > 0) {
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: %llu segments, "
+				"%llu bundles reassembled, dropped: no "
+				"reassembly room %llu segments, reassembly "
+				"timed out %llu, bad frame %llu.",
+				cli->model->daemonName, cli->stats.segments,
+				cli->stats.reassembled,
+				cli->stats.segmentsRefused,
+				cli->stats.reassemblyTimeouts,
+				cli->stats.badFrames);
+		writeMemo(memoBuf);
+	}
+
+	for (int i = 0; cli->ductCount > 1 && i < cli->ductCount; i++) {
+		DelayCliStats *stats = &cli->ducts[i].stats;
+
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: induct %s: "
+				"received %llu (%llu bytes), acquired %llu, "
+				"dropped: queue full %llu, expired %llu, "
+				"duplicate %llu, release thread behind %llu, link "
+				"loss %llu, acquisition failed %llu, cold tier "
+				"unreadable %llu.", cli->model->daemonName,
+				cli->ducts[i].ductName,
+				stats->received, stats->bytesReceived,
+				stats->acquired, stats->queueFull,
+				stats->expired, stats->duplicates,
+				stats->stageFull, stats->linkLoss,
+				stats->acqFailed, stats->coldUnreadable);
+		writeMemo(memoBuf);
+	}
+
+	if (cli->sources.count > 0) {
+		reportSources(cli);
+	}
+
+	reportDelayClasses(&cli->queue, cli->model->daemonName);
+	reportDelayStage(&cli->scheduleStage, cli->model->daemonName,
+			"schedule");
+	for (int i = 0; i < cli->acqWorkers; i++) {
+		char stageName[32];
+
+		isprintf(stageName, sizeof stageName, "acquisition worker %d", i);
+		reportDelayStage(&cli->workers[i].stage, cli->model->daemonName,
+				stageName);
+	}
+}
+
+/*	*	*	Live handoff	*	*	*	*	*	*/
+
+/* Bundles streamed to the new instance */
+typedef struct {
+	DelayCli		*cli;
+	DelayHandoffStream	*stream;
+	int			failed;
+	unsigned int		handed;
+	unsigned long long	bytes;		/* Data streamed */
+} DelayCliSender;
+
+/* Handoff thread: waits for a new instance, then ends the receive
+ * loop so that the daemon hands over */
+static void *awaitCliHandoff(void *arg)
+{
+	DelayCli *cli = (DelayCli *) arg;
+	DelayHandoff *handoff = &cli->handoff;
+	char memoBuf[256];
+
+	handoff->fd = acceptDelayHandoff(handoff->listener,
+			cli->model->daemonName, &handoff->peerPid);
+	if (handoff->fd < 0) {
+		return NULL;
+	}
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: handing over to pid %d.",
+			cli->model->daemonName, handoff->peerPid);
+	writeMemo(memoBuf);
+	handoff->requested = 1;
+	return NULL;
+}
+
+int listenDelayCliHandoff(DelayCli *cli)
+{
+	DelayHandoff *handoff = &cli->handoff;
+
+	/* A new reader would discard a ring's unread records */
+	for (int i = 0; i < cli->ductCount; i++) {
+		if (cli->ducts[i].ring) {
+			putErrmsg("Can't hand off a shared-memory induct.",
+					cli->ducts[i].ductName);
+			return -1;
+		}
+	}
+
+	handoff->listener = listenDelayHandoff(cli->model->daemonName);
+	if (handoff->listener < 0) {
+		return -1;
+	}
+
+	handoff->listening = 1;
+	if (pthread_create(&handoff->thread, NULL, awaitCliHandoff, cli)) {
+		putSysErrmsg("Can't create handoff thread", NULL);
+		closeDelayCliHandoff(cli);
+		return -1;
+	}
+
+	handoff->threadStarted = 1;
+	return 0;
+}
+
+void closeDelayCliHandoff(DelayCli *cli)
+{
+	closeDelayHandoff(&cli->handoff, cli->model->daemonName);
+}
+
+/* Streams a bundle's record and, unless it is cold, its data, which
+ * is then freed */
+static void handOffBundle(DelayedBundle *bundle, void *arg)
+{
+	DelayCliSender *sender = (DelayCliSender *) arg;
+	DelayCli *cli = sender->cli;
+	DelayHandoffRecord record;
+	unsigned int length = bundle->packedLength > 0 ? bundle->packedLength
+			: bundle->length;
+
+	packHandoffRecord(bundle, &record);
+	if (bundle->induct) {
+		record.duct = bundle->induct - cli->ducts;
+	}
+
+	if (bundle->data == NULL) {
+		record.coldSegment = bundle->coldSegment;
+		record.coldOffset = bundle->coldOffset;
+	}
+
+	if (!sender->failed
+	&& writeHandoff(sender->stream, &record, sizeof record) == 0
+	&& (bundle->data == NULL
+		|| writeHandoff(sender->stream, bundle->data, length) == 0)) {
+		sender->handed++;
+		sender->bytes += bundle->data ? length : 0;
+	} else {
+		sender->failed = 1;	/* The bundle is lost */
+	}
+
+	freeBundleData(cli, bundle);
+}
+
+static void handOffStage(DelayStage *stage, DelayCliSender *sender)
+{
+	DelayedBundle bundle;
+
+	while (popDelayStage(stage, &bundle, 0)) {
+		handOffBundle(&bundle, sender);
+	}
+}
+
+int delayCliHandOff(DelayCli *cli)
+{
+	DelayHandoff *handoff = &cli->handoff;
+	DelayTier *tier = &cli->tier;
+	DelayHandoffHeader header;
+	DelayHandoffSegment segments[DELAY_TIER_SEGMENTS];
+	DelayCliSender sender;
+	int fds[DELAY_HANDOFF_MAX_FDS];
+	int fdCount = 0;
+	struct timeval now;
+	char memoBuf[256];
+
+	memset(&header, 0, sizeof header);
+	header.pid = sm_TaskIdSelf();
+	header.ductCount = cli->ductCount;
+	if (cli->ductCount == 0) {
+		fds[fdCount++] = cli->ductSocket;
+	}
+
+	for (int i = 0; i < cli->ductCount; i++) {
+		fds[fdCount++] = cli->ducts[i].ductSocket;
+	}
+
+	header.sockets = fdCount;
+	header.bundles = cli->queue.count + cli->scheduleStage.count;
+	if (tier->horizonUsec > 0) {
+		for (int i = 0; i < DELAY_TIER_SEGMENTS; i++) {
+			if (tier->segments[i].fd < 0) {
+				continue;
+			}
+
+			memset(&segments[header.segments], 0,
+					sizeof(DelayHandoffSegment));
+			segments[header.segments].index = i;
+			segments[header.segments].length =
+					tier->segments[i].length;
+			segments[header.segments].live = tier->segments[i].live;
+			header.segments++;
+			fds[fdCount++] = tier->segments[i].fd;
+		}
+
+		header.bundles += tier->cold.count + tier->spillStage.count
+				+ tier->promoteStage.count;
+	}
+
+	header.lastReleaseUsec = handoff->lastRelease.tv_sec * 1000000ULL
+			+ handoff->lastRelease.tv_usec;
+	memset(&sender, 0, sizeof sender);
+	sender.cli = cli;
+	sender.stream = MTAKE(sizeof(DelayHandoffStream));
+	if (sender.stream == NULL) {
+		putErrmsg("Can't allocate handoff stream.", NULL);
+		sender.failed = 1;
+	} else {
+		sender.stream->fd = handoff->fd;
+		sender.stream->length = 0;
+		if (sendHandoffHeader(handoff->fd, &header, fds, fdCount) < 0
+		|| writeHandoff(sender.stream, segments, header.segments
+				* sizeof(DelayHandoffSegment)) < 0) {
+			sender.failed = 1;
+		}
+	}
+
+	/* Earliest release first: the hot queue, bundles being promoted,
+	 * then those not yet scheduled or spilled, then the cold index */
+	drainDelayed(&cli->queue, handOffBundle, &sender);
+	if (tier->horizonUsec > 0) {
+		handOffStage(&tier->promoteStage, &sender);
+	}
+
+	handOffStage(&cli->scheduleStage, &sender);
+	if (tier->horizonUsec > 0) {
+		handOffStage(&tier->spillStage, &sender);
+		drainDelayed(&tier->cold, handOffBundle, &sender);
+	}
+
+	if (!sender.failed && flushHandoff(sender.stream) < 0) {
+		sender.failed = 1;
+	}
+
+	if (sender.stream) {
+		MRELEASE(sender.stream);
+	}
+
+	close(handoff->fd);
+	handoff->fd = -1;
+	if (sender.failed) {
+		putSysErrmsg("Handoff failed", itoa(handoff->peerPid));
+		return -1;
+	}
+
+	delayNow(&now);
+	handoff->bundles = sender.handed;
+	handoff->gapUsec = (now.tv_sec - handoff->lastRelease.tv_sec)
+			* 1000000LL + now.tv_usec - handoff->lastRelease.tv_usec;
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: handed %d sockets, %u "
+			"cold-tier segments and %u bundles (%llu bytes streamed) "
+			"to pid %d, %.1f ms after the last release pass.",
+			cli->model->daemonName, header.sockets, header.segments,
+			sender.handed, sender.bytes, handoff->peerPid,
+			handoff->gapUsec / 1000.0);
+	writeMemo(memoBuf);
+	return 0;
+}
+
+/* Reads a handed-over bundle's data from the stream or, if it was
+ * cold and this CLI has no tier, from its segment.  Returns 0, or -1
+ * if it couldn't; the stream is then unusable. */
+static int takeBundleData(DelayCli *cli, DelayHandoffStream *stream,
+		DelayHandoffRecord *record, int *segmentFds,
+		DelayedBundle *bundle)
+{
+	unsigned int length = record->packedLength > 0 ? record->packedLength
+			: record->length;
+
+	if (record->coldSegment >= 0 && cli->tier.horizonUsec > 0) {
+		bundle->coldSegment = record->coldSegment;
+		bundle->coldOffset = record->coldOffset;
+		return 0;
+	}
+
+	bundle->data = MTAKE(length);
+	if (bundle->data == NULL) {
+		putErrmsg("Can't allocate handed-over bundle.", itoa(length));
+		return -1;
+	}
+
+	if (record->coldSegment < 0) {
+		return readHandoff(stream, bundle->data, length);
+	}
+
+	if (segmentFds[record->coldSegment] < 0
+	|| pread(segmentFds[record->coldSegment], bundle->data, length,
+			record->coldOffset) != (ssize_t) length) {
+		putSysErrmsg("Can't read handed-over cold tier",
+				itoa(record->coldSegment));
+		MRELEASE(bundle->data);
+		bundle->data = NULL;
+	}
+
+	return 0;
+}
+
+int delayCliTakeOver(DelayCli *cli)
+{
+	DelayHandoff *handoff = &cli->handoff;
+	DelayTier *tier = &cli->tier;
+	DelayHandoffHeader header;
+	DelayHandoffSegment segment;
+	DelayHandoffRecord record;
+	DelayHandoffStream *stream;
+	DelayedBundle bundle;
+	DelayDedupEntry *slot;
+	struct timeval started, now;
+	int fds[DELAY_HANDOFF_MAX_FDS];
+	int segmentFds[DELAY_TIER_SEGMENTS];
+	int fdCount, sockets = cli->ductCount > 0 ? cli->ductCount : 1;
+	int duplicate;
+	unsigned int late = 0, staged = 0;
+	unsigned long long bytes = 0;
+	long long lateUsec, maxLateUsec = 0;
+	uint64_t n, key;
+	char memoBuf[256];
+
+	stream = MTAKE(sizeof(DelayHandoffStream));
+	if (stream == NULL) {
+		putErrmsg("Can't allocate handoff stream.", NULL);
+		return -1;
+	}
+
+	if (requestDelayHandoff(handoff->fd) < 0
+	|| (fdCount = receiveHandoffHeader(handoff->fd, &header, fds)) < 0) {
+		MRELEASE(stream);
+		return -1;
+	}
+
+	if (header.ductCount != (uint32_t) cli->ductCount
+	|| header.sockets != (uint32_t) sockets
+	|| header.segments > DELAY_TIER_SEGMENTS) {
+		putErrmsg("Handing-over daemon serves other inducts.",
+				itoa(header.ductCount));
+		while (fdCount > 0) {
+			close(fds[--fdCount]);
+		}
+
+		MRELEASE(stream);
+		return -1;
+	}
+
+	/* Datagrams queued in the old process's sockets are ours now */
+	if (cli->ductCount == 0) {
+		if (cli->ductSocket >= 0) {
+			closesocket(cli->ductSocket);
+		}
+
+		cli->ductSocket = fds[0];
+	}
+
+	for (int i = 0; i < cli->ductCount; i++) {
+		if (cli->ducts[i].ductSocket >= 0) {
+			closesocket(cli->ducts[i].ductSocket);
+		}
+
+		cli->ducts[i].ductSocket = fds[i];
+	}
+
+	/* Cold-tier segments, adopted before the tier thread starts */
+	stream->fd = handoff->fd;
+	stream->length = 0;
+	stream->offset = 0;
+	for (int i = 0; i < DELAY_TIER_SEGMENTS; i++) {
+		segmentFds[i] = -1;
+	}
+
+	for (uint32_t i = 0; i < header.segments; i++) {
+		int fd = fds[sockets + i];
+
+		if (readHandoff(stream, &segment, sizeof segment) < 0
+		|| segment.index >= DELAY_TIER_SEGMENTS) {
+			close(fd);
+			continue;
+		}
+
+		if (tier->horizonUsec == 0) {
+			segmentFds[segment.index] = fd;
+			continue;
+		}
+
+		tier->segments[segment.index].fd = fd;
+		tier->segments[segment.index].length = segment.length;
+		tier->segments[segment.index].live = segment.live;
+	}
+
+	if (startDelayCli(cli) < 0) {
+		for (int i = 0; i < DELAY_TIER_SEGMENTS; i++) {
+			if (segmentFds[i] >= 0) {
+				close(segmentFds[i]);
+			}
+		}
+
+		MRELEASE(stream);
+		close(handoff->fd);
+		handoff->fd = -1;
+		handoff->connected = 0;
+		return -1;
+	}
+
+	/* Release resumes now; the rest of the queue follows */
+	delayNow(&started);
+	for (n = 0; n < header.bundles; n++) {
+		if (readHandoff(stream, &record, sizeof record) < 0) {
+			putSysErrmsg("Handoff stream ended early",
+					itoa((int) n));
+			break;
+		}
+
+		if (record.coldSegment >= DELAY_TIER_SEGMENTS) {
+			putErrmsg("Bad handoff record.",
+					itoa(record.coldSegment));
+			break;
+		}
+
+		unpackHandoffRecord(&record, &bundle);
+		if (record.duct >= 0 && record.duct < cli->ductCount) {
+			bundle.induct = &cli->ducts[record.duct];
+		}
+
+		bundle.source = findDelaySource(&cli->sources,
+				&bundle.fromAddr);
+		if (takeBundleData(cli, stream, &record, segmentFds, &bundle)
+				< 0) {
+			break;
+		}
+
+		if (bundle.data == NULL && bundle.coldSegment < 0) {
+			continue;	/* Lost with its segment */
+		}
+
+		if (bundle.packedLength > 0) {
+			__atomic_add_fetch(&cli->compressor.stats.heldSaving,
+					bundle.length - bundle.packedLength,
+					__ATOMIC_RELAXED);
+		}
+
+		if (record.coldSegment < 0) {
+			bytes += bundle.packedLength > 0 ? bundle.packedLength
+					: bundle.length;
+		}
+		delayNow(&now);
+		if (cli->dedup.slots && (key = bundleKey(&bundle.id)) != 0) {
+			slot = findDedupSlot(&cli->dedup, key, now.tv_sec
+					* 1000000ULL + now.tv_usec, &duplicate);
+			if (!duplicate) {
+				rememberBundle(&cli->dedup, slot, key, &bundle);
+			}
+		}
+
+		lateUsec = (now.tv_sec - bundle.releaseTime.tv_sec) * 1000000LL
+				+ now.tv_usec - bundle.releaseTime.tv_usec;
+		if (lateUsec > 0) {
+			late++;
+			if (lateUsec > maxLateUsec) {
+				maxLateUsec = lateUsec;
+			}
+		}
+
+		if (pushDelayStage(bundle.data ? &cli->scheduleStage
+				: &tier->spillStage, &bundle, 1) < 0) {
+			freeBundleData(cli, &bundle);
+			continue;
+		}
+
+		staged++;
+	}
+
+	for (int i = 0; i < DELAY_TIER_SEGMENTS; i++) {
+		if (segmentFds[i] >= 0) {
+			close(segmentFds[i]);
+		}
+	}
+
+	MRELEASE(stream);
+	close(handoff->fd);
+	handoff->fd = -1;
+	handoff->connected = 0;
+	handoff->bundles = staged;
+	handoff->lost = header.bundles - staged;
+	handoff->late = late;
+	handoff->maxLateUsec = maxLateUsec;
+	handoff->gapUsec = started.tv_sec * 1000000LL + started.tv_usec
+			- (long long) header.lastReleaseUsec;
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: took over %u of %llu "
+			"bundles, %u lost (%llu bytes streamed) from pid %d; "
+			"release gap %.1f ms, %u bundles fell due in it (at "
+			"most %.1f ms late).", cli->model->daemonName,
+			handoff->bundles, (unsigned long long) header.bundles,
+			handoff->lost, bytes, handoff->peerPid,
+			handoff->gapUsec / 1000.0, late, maxLateUsec / 1000.0);
+	writeMemo(memoBuf);
+	return 0;
+}
+
+static void freeData(DelayedBundle *bundle, void *arg)
+{
+	if (bundle->data) {
+		MRELEASE(bundle->data);
+	}
+}
+
+/* Cleanup queue */
+static void destroyQueue(DelayQueue *queue)
+{
+	/* Free any remaining data */
+	drainDelayed(queue, freeData, NULL);
+	destroyDelayQueue(queue);
+}
+
+static void interruptThread(int signum)
+{
+	char memoBuf[128];
+
+	isignal(SIGTERM, interruptThread);
+	isignal(SIGINT, interruptThread);
+	isignal(SIGHUP, interruptThread);
+	cli.running = 0;
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s received shutdown signal, terminating gracefully...", cli.model->daemonName);
+	writeMemo(memoBuf);
+	ionKillMainThread(cli.model->daemonName);
+}
+
+/* Parses an endpoint spec, with its optional @<delay>[/<loss>], finds
+ * the induct and binds its socket */
+static int	attachDuct(DelayCliDuct *duct, char *endpointSpec)
+{
+	PsmAddress		vductElt;
+	char			*profile;
+	struct sockaddr_storage	socketName;
+	int			optval = 1;
+
+	duct->cli = &cli;
+	duct->ductName = endpointSpec;
+	duct->ductSocket = -1;
+	duct->fixedDelay = -1.0;
+	duct->lossPercentage = cli.model->lossPercentage;
+	profile = strchr(endpointSpec, '@');
+	if (profile)
+	{
+		*profile++ = '\0';
+		duct->fixedDelay = atof(profile);
+		profile = strchr(profile, '/');
+		if (profile)
+		{
+			duct->lossPercentage = atof(profile + 1);
+		}
+
+		if (duct->fixedDelay < 0.0 || duct->lossPercentage < 0.0
+		|| duct->lossPercentage > 100.0)
+		{
+			putErrmsg("Bad induct delay or loss.", endpointSpec);
+			return -1;
+		}
+	}
+
+	findInduct("udp", endpointSpec, &duct->vduct, &vductElt);
+	if (vductElt == 0)
+	{
+		putErrmsg("No such udp duct.", endpointSpec);
+		return -1;
+	}
+
+	/* Enhanced process check with cleanup for stale PIDs */
+	if (duct->vduct->cliPid != ERROR
+	&& duct->vduct->cliPid != sm_TaskIdSelf()
+	&& !(cli.handoff.connected
+		&& duct->vduct->cliPid == cli.handoff.peerPid))
+	{
+		/* Check if the PID is actually running */
+		if (sm_TaskExists(duct->vduct->cliPid))
+		{
+			putErrmsg("CLI task is already started for this duct.",
+					itoa(duct->vduct->cliPid));
+			return -1;
+		}
+		else
+		{
+			/* Stale PID - clear it and continue */
+			writeMemo("[i] Clearing stale CLI PID for duct.");
+			duct->vduct->cliPid = ERROR;
+		}
+	}
+
+	if (strncmp(endpointSpec, DELAY_SHM_PREFIX, strlen(DELAY_SHM_PREFIX)) == 0)
+	{
+		if (cli.handoff.connected)
+		{
+			putErrmsg("Can't take over a shared-memory induct.",
+					endpointSpec);
+			return -1;
+		}
+
+		duct->ring = openDelayShmRing(endpointSpec
+				+ strlen(DELAY_SHM_PREFIX), 1);
+		return duct->ring ? 0 : -1;
+	}
+
+	if (parseDelaySocketSpec(endpointSpec, &socketName) < 0)
+	{
+		return -1;
+	}
+
+	/* The running daemon hands over its bound socket */
+	if (cli.handoff.connected)
+	{
+		return 0;
+	}
+
+	duct->ductSocket = openDelaySocket(socketName.ss_family);
+	if (duct->ductSocket < 0)
+	{
+		putSysErrmsg("Can't open UDP socket", NULL);
+		return -1;
+	}
+
+	/* Enhanced socket options for better restart behavior */
+	if (setsockopt(duct->ductSocket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+	{
+		putSysErrmsg("Can't set SO_REUSEADDR", NULL);
+	}
+
+#ifdef SO_REUSEPORT
+	if (setsockopt(duct->ductSocket, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+	{
+		/* SO_REUSEPORT not critical - continue without error */
+		writeMemo("[w] SO_REUSEPORT not available, continuing.");
+	}
+#endif
+
+	if (bind(duct->ductSocket, (struct sockaddr *) &socketName,
+			delayAddressLength(&socketName)) < 0)
+	{
+		closesocket(duct->ductSocket);
+		duct->ductSocket = -1;
+		putSysErrmsg("Can't initialize socket", endpointSpec);
+		return -1;
+	}
+
+	sizeDelayReceiveBuffer(duct->ductSocket, cli.model->daemonName);
+	return 0;
+}
+
+/* Closes the sockets and work areas of the first count inducts, and
+ * frees the source table */
+static void	closeDucts(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (cli.ducts[i].ductSocket >= 0)
+		{
+			closesocket(cli.ducts[i].ductSocket);
+		}
+
+		if (cli.ducts[i].ring)
+		{
+			closeDelayShmRing(cli.ducts[i].ring);
+		}
+
+		closeDelayCliDuct(&cli.ducts[i]);
+	}
+
+	cli.ductCount = 0;
+	MRELEASE(cli.ducts);
+	cli.ducts = NULL;
+	freeDelaySources(&cli.sources);
+}
+
+/* Loads the source table named by UDPDELAY_SOURCES, else the daemon's
+ * own if there is one.  Returns 0, or -1 if the table is bad. */
+static int	loadSourceTable(DelayModel *model)
+{
+	char	fileName[256];
+	char	memoBuf[320];
+	char	*envName = getenv(DELAY_SOURCES_ENV);
+	int	count;
+
+	if (envName && *envName)
+	{
+		istrcpy(fileName, envName, sizeof fileName);
+	}
+	else
+	{
+		isprintf(fileName, sizeof fileName, "%s.sources", model->daemonName);
+		if (access(fileName, F_OK) < 0)
+		{
+			return 0;	/* One delay for every sender */
+		}
+	}
+
+	count = loadDelaySources(&cli.sources, fileName);
+	if (count < 0)
+	{
+		return -1;
+	}
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: %d sources with their own delay and loss, from %s.",
+			model->daemonName, count, fileName);
+	writeMemo(memoBuf);
+	return 0;
+}
+
+int	udpDelayCli(DelayModel *model, char *endpointSpec)
+{
+	char	memoBuf[256];
+
+	if (endpointSpec == NULL)
+	{
+		isprintf(memoBuf, sizeof memoBuf, "Usage: %s <local host name>[:<port number>][@<delay sec>[/<loss %%>]] ...", model->daemonName);
+		PUTS(memoBuf);
+		return 0;
+	}
+
+	return udpDelayCliDucts(model, 1, &endpointSpec);
+}
+
+int	udpDelayCliDucts(DelayModel *model, int ductCount, char **endpointSpecs)
+{
+	char			memoBuf[256];
+
+	if (ductCount < 1 || ductCount > DELAY_MAX_CLI_DUCTS)
+	{
+		putErrmsg("Bad induct count.", itoa(ductCount));
+		return -1;
+	}
+
+	memset(&cli, 0, sizeof cli);
+	cli.model = model;
+	cli.running = 1;
+	cli.ductSocket = -1;
+	initDelayRealtime(&cli.rt);
+	if (bpAttach() < 0)
+	{
+		putErrmsg("Delay CLI can't attach to BP.", model->daemonName);
+		return -1;
+	}
+
+	/* A new binary taking over from the running daemon */
+	if (DELAY_HANDOFF && getenv(DELAY_HANDOFF_ENV))
+	{
+		cli.handoff.fd = connectDelayHandoff(model->daemonName,
+				&cli.handoff.peerPid);
+		if (cli.handoff.fd < 0)
+		{
+			return -1;
+		}
+
+		cli.handoff.connected = 1;
+	}
+
+	cli.ducts = MTAKE(ductCount * sizeof(DelayCliDuct));
+	if (cli.ducts == NULL)
+	{
+		putErrmsg("Can't allocate inducts.", model->daemonName);
+		return -1;
+	}
+
+	memset(cli.ducts, 0, ductCount * sizeof(DelayCliDuct));
+	for (int i = 0; i < ductCount; i++)
+	{
+		if (attachDuct(&cli.ducts[i], endpointSpecs[i]) < 0)
+		{
+			closeDucts(i + 1);
+			return -1;
+		}
+	}
+
+	/* All command-line arguments are now validated. */
+	cli.ductCount = ductCount;
+	if (loadSourceTable(model) < 0)
+	{
+		closeDucts(ductCount);
+		return -1;
+	}
+
+	/* Initialize random number generator for link loss simulation */
+	srand((unsigned int)time(NULL));
+
+	/* Initialize bundle queue */
+	if (initDelayQueue(&cli.queue, MAX_QUEUED_BUNDLES * ductCount) < 0)
+	{
+		closeDucts(ductCount);
+		return -1;
+	}
+
+	if (initDelayCliPipeline(&cli, NULL, DELAY_ACQ_WORKERS) < 0)
+	{
+		destroyDelayQueue(&cli.queue);
+		closeDucts(ductCount);
+		return -1;
+	}
+
+	for (int i = 0; i < ductCount; i++)
+	{
+		if (openDelayCliDuct(&cli, &cli.ducts[i]) < 0)
+		{
+			closeDelayCliPipeline(&cli);
+			destroyDelayQueue(&cli.queue);
+			closeDucts(ductCount);
+			return -1;
+		}
+	}
+
+	if (openDelayTrace(model->daemonName) < 0)
+	{
+		closeDelayCliPipeline(&cli);
+		destroyDelayQueue(&cli.queue);
+		closeDucts(ductCount);
+		return -1;
+	}
+
+	/* Set up signal handling for clean shutdown */
+	ionNoteMainThread(model->daemonName);
+	isignal(SIGTERM, interruptThread);
+	isignal(SIGINT, interruptThread);
+	isignal(SIGHUP, interruptThread);
+	initProfile(model->daemonName);
+
+	/* Register this CLI with the vducts */
+	for (int i = 0; i < ductCount; i++)
+	{
+		cli.ducts[i].vduct->cliPid = sm_TaskIdSelf();
+	}
+
+	/* Allocate receive buffer */
+	cli.buffer = MTAKE(UDPCLA_BUFSZ);
+	if (cli.buffer == NULL)
+	{
+		putErrmsg("Delay CLI can't get UDP buffer.", model->daemonName);
+		closeDelayCliPipeline(&cli);
+		destroyQueue(&cli.queue);
+		closeDucts(ductCount);
+		return -1;
+	}
+
+	/* Can now start receiving bundles. */
+	{
+		double	currentDelay = model->delay();
+
+		isprintf(memoBuf, sizeof(memoBuf),
+				"[i] %s is running, %d induct%s, %s delay = %.1f sec, link loss = %.1f%% (%d acquisition workers%s).",
+				model->daemonName, ductCount, ductCount == 1 ? "" : "s", model->modelName, currentDelay, model->lossPercentage,
+				cli.acqWorkers, cli.acqOrdered ? ", ordered per source" : "");
+		writeMemo(memoBuf);
+		for (int i = 0; i < ductCount; i++)
+		{
+			DelayCliDuct	*duct = &cli.ducts[i];
+
+			if (duct->fixedDelay >= 0.0)
+			{
+				isprintf(memoBuf, sizeof memoBuf, "[i] %s: spec=[%s], delay = %.1f sec, link loss = %.1f%%.",
+						model->daemonName, duct->ductName, duct->fixedDelay, duct->lossPercentage);
+			}
+			else
+			{
+				isprintf(memoBuf, sizeof memoBuf, "[i] %s: spec=[%s], %s delay.",
+						model->daemonName, duct->ductName, model->modelName);
+			}
+
+			writeMemo(memoBuf);
+		}
+	}
+
+	/* Release and acquisition run on their own threads, with the
+	 * queue of the daemon we take over from, if any */
+	if ((cli.handoff.connected ? delayCliTakeOver(&cli)
+			: startDelayCli(&cli)) < 0)
+	{
+		if (cli.handoff.connected)
+		{
+			close(cli.handoff.fd);
+			cli.handoff.connected = 0;
+		}
+
+		MRELEASE(cli.buffer);
+		closeDelayCliPipeline(&cli);
+		destroyQueue(&cli.queue);
+		closeDucts(ductCount);
+		return -1;
+	}
+
+	if (DELAY_HANDOFF && listenDelayCliHandoff(&cli) < 0)
+	{
+		writeMemo("[w] Can't accept a handoff, continuing.");
+	}
+
+	/* Thread stacks exist now, so they are locked too */
+	oK(lockDelayMemory(&cli.rt, model->daemonName));
+	reportDelayRealtime(&cli.rt, model->daemonName);
+
+	/* Main processing loop - receive only, one event loop for all inducts */
+	oK(delayCliServe(&cli));
+	stopDelayCli(&cli);
+	closeDelayCliHandoff(&cli);
+	if (cli.handoff.requested)
+	{
+		oK(delayCliHandOff(&cli));
+	}
+
+	/* Clear CLI PID from the vducts */
+	for (int i = 0; i < ductCount; i++)
+	{
+		if (cli.ducts[i].vduct->cliPid == sm_TaskIdSelf())
+		{
+			cli.ducts[i].vduct->cliPid = ERROR;
+		}
+	}
+
+	MRELEASE(cli.buffer);
+	delayCliReport(&cli);
+	closeDelayCliPipeline(&cli);
+	destroyQueue(&cli.queue);
+	closeDucts(ductCount);
+	writeProfileReport();
+	closeDelayTrace();
+	writeErrmsgMemos();
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s duct has ended.", model->daemonName);
+	writeMemo(memoBuf);
+	ionDetach();
+	return 0;
+}
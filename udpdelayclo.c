@@ -0,0 +1,1927 @@
+/*
+	udpdelayclo.c:	UDP delay convergence-layer output engine shared by
+			the Mars, Moon and preset delay output daemons.
+
+	Based on original ION UDP convergence layer (udpclo.c)
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#include "udpdelay.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <linux/net_tstamp.h>
+#endif
+
+static DelayClo clo;
+
+/* Counts against the CLO and, for bundles from an outduct, the duct */
+#define cloCount(clo, bundle, counter, amount) do { \
+	delayCount((clo)->stats.counter, amount); \
+	if ((bundle)->duct) { \
+		delayCount((bundle)->duct->stats.counter, amount); \
+	} \
+} while (0)
+
+/* Where a bundle is sent */
+static struct sockaddr_storage *destination(DelayClo *clo,
+		DelayedBundle *bundle)
+{
+	return bundle->duct ? &bundle->duct->socketName : &clo->socketName;
+}
+
+/* Wakes the release thread if it is sleeping past a newly staged
+ * bundle */
+static void wakeRelease(DelayClo *clo, DelayedBundle *bundle)
+{
+	long long releaseUsec = bundle->releaseTime.tv_sec * 1000000LL
+			+ bundle->releaseTime.tv_usec;
+	uint64_t one = 1;
+
+	if (clo->releaseMode != DELAY_RELEASE_POLL && releaseUsec
+			< __atomic_load_n(&clo->armedUsec, __ATOMIC_SEQ_CST)) {
+		oK(write(clo->wakeFd, &one, sizeof one));
+	}
+}
+
+/* Release thread: a dequeued bundle joins the delay queue */
+static void scheduleBundle(DelayClo *clo, DelayedBundle *bundle)
+{
+	Sdr sdr = getIonsdr();
+	int depth;
+
+	depth = insertDelayed(&clo->queue, bundle);
+	if (depth < 0) {
+		putErrmsg("Can't queue bundle - queue full.", NULL);
+		cloCount(clo, bundle, queueFull, 1);
+		traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+		/* Still need to clean up the ZCO */
+		if (sdr_begin_xn(sdr)) {
+			zco_destroy(sdr, bundle->bundleZco);
+			if (sdr_end_xn(sdr) < 0) {
+				putErrmsg("Can't destroy bundle ZCO.", NULL);
+			}
+		}
+
+		return;
+	}
+
+	traceBundle(&bundle->id, DTR_CLO_DEADLINE, bundle->length,
+			&bundle->releaseTime);
+}
+
+/* Hand the bundle to the kernel with its release time as the SO_TXTIME
+ * transmit time (CLOCK_MONOTONIC) */
+static int sendAtReleaseTime(DelayClo *clo, unsigned char *buffer,
+		int length, DelayedBundle *bundle)
+{
+#if defined(SO_TXTIME) && defined(SCM_TXTIME)
+	struct timespec monotonic, realtime;
+	struct iovec iov;
+	struct msghdr msg;
+	char control[CMSG_SPACE(sizeof(uint64_t))];
+	struct cmsghdr *cmsg;
+	uint64_t txtime;
+	int result;
+
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	txtime = (monotonic.tv_sec * 1000000000ULL) + monotonic.tv_nsec
+			+ ((bundle->releaseTime.tv_sec - realtime.tv_sec)
+			* 1000000000LL) + (bundle->releaseTime.tv_usec * 1000LL)
+			- realtime.tv_nsec;
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	memset(&msg, 0, sizeof msg);
+	msg.msg_name = destination(clo, bundle);
+	msg.msg_namelen = delayAddressLength(destination(clo, bundle));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+	memcpy(CMSG_DATA(cmsg), &txtime, sizeof txtime);
+	do {
+		result = sendmsg(clo->ductSocket, &msg, 0);
+	} while (result < 0 && errno == EINTR);
+
+	return result;
+#else
+	return isendto(clo->ductSocket, (char *) buffer, length, 0,
+			(struct sockaddr *) destination(clo, bundle),
+			delayAddressLength(destination(clo, bundle)));
+#endif
+}
+
+/* A bundle that can't be sent is dropped like a lost one: its ZCO is
+ * destroyed, so a failing duct doesn't fill the SDR */
+static void dropUnsent(DelayedBundle *bundle)
+{
+	Sdr sdr = getIonsdr();
+
+	if (sdr_begin_xn(sdr)) {
+		zco_destroy(sdr, bundle->bundleZco);
+		if (sdr_end_xn(sdr) < 0) {
+			putErrmsg("Can't destroy bundle ZCO.", NULL);
+		}
+	}
+}
+
+/* Copy a due bundle out of its ZCO, in the transaction that destroys
+ * the ZCO, then into the duct's shared-memory ring.  The ring's lock
+ * is held only for the copy into it, never across a transaction. */
+static int sendToRing(DelayClo *clo, unsigned char *buffer,
+		DelayedBundle *bundle, DelayShmRing *ring)
+{
+	Sdr sdr = getIonsdr();
+	unsigned char *copy = buffer;
+	unsigned char *into;
+	ZcoReader reader;
+	vast bytesCopied;
+	int result = 0;
+
+	/* Bundles too large for the transmit buffer are copied to the
+	 * heap first */
+	if (bundle->length > UDPCLA_BUFSZ) {
+		copy = MTAKE(bundle->length);
+		if (copy == NULL) {
+			putErrmsg("Can't copy bundle for ring.",
+					itoa(bundle->length));
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length,
+					NULL);
+			dropUnsent(bundle);
+			return -1;
+		}
+	}
+
+	unsigned long long stageStart = profileStart();
+	if (sdr_begin_xn(sdr) == 0) {
+		if (copy != buffer) {
+			MRELEASE(copy);
+		}
+
+		putErrmsg("Can't start transaction.", NULL);
+		cloCount(clo, bundle, sendFailed, 1);
+		traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+		dropUnsent(bundle);
+		return -1;
+	}
+
+	profileStop(PROF_SDR_BEGIN, stageStart);
+	stageStart = profileStart();
+	zco_start_transmitting(bundle->bundleZco, &reader);
+	bytesCopied = zco_transmit(sdr, &reader, bundle->length, (char *) copy);
+	profileStop(PROF_ZCO_TRANSMIT, stageStart);
+	if (bytesCopied != bundle->length) {
+		sdr_exit_xn(sdr);
+		putErrmsg("Can't read bundle content.", NULL);
+		cloCount(clo, bundle, sendFailed, 1);
+		traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+		dropUnsent(bundle);
+		result = -1;
+	} else {
+		stageStart = profileStart();
+		zco_destroy(sdr, bundle->bundleZco);
+		if (sdr_end_xn(sdr) < 0) {
+			putErrmsg("Can't destroy bundle ZCO.", NULL);
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length,
+					NULL);
+			result = -1;
+		} else {
+			profileStop(PROF_ZCO_DESTROY, stageStart);
+			into = beginShmWrite(ring, bundle->length);
+			if (into == NULL) {
+				/* Reader behind: dropped, as by a full
+				 * socket buffer */
+				cloCount(clo, bundle, sendFailed, 1);
+				traceBundle(&bundle->id, DTR_CLO_DROP,
+						bundle->length, NULL);
+			} else {
+				memcpy(into, copy, bundle->length);
+				endShmWrite(ring, bundle->length);
+				traceBundle(&bundle->id, DTR_CLO_SEND,
+						bundle->length, NULL);
+				cloCount(clo, bundle, sent, 1);
+				cloCount(clo, bundle, bytesSent,
+						bundle->length);
+			}
+		}
+	}
+
+	if (copy != buffer) {
+		MRELEASE(copy);
+	}
+
+	return result;
+}
+
+/* Send one datagram of a due bundle */
+static int sendDatagram(DelayClo *clo, unsigned char *buffer, int length,
+		DelayedBundle *bundle)
+{
+	unsigned long long stageStart = profileStart();
+	int bytesSent;
+
+	if (clo->releaseMode == DELAY_RELEASE_TXTIME) {
+		bytesSent = sendAtReleaseTime(clo, buffer, length, bundle);
+	} else {
+		bytesSent = isendto(clo->ductSocket, (char *) buffer, length, 0,
+				(struct sockaddr *) destination(clo, bundle),
+				delayAddressLength(destination(clo, bundle)));
+	}
+
+	profileStop(PROF_SENDTO, stageStart);
+	if (bytesSent >= 0) {
+		cloCount(clo, bundle, datagramsSent, 1);
+	}
+
+	return bytesSent;
+}
+
+/* Send a bundle too large for one datagram as segments, reading each
+ * from the ZCO in turn.  Every segment carries the bundle's release
+ * time, so in txtime mode the kernel sends them all at once.  On
+ * failure the caller drops the bundle. */
+static int sendSegments(DelayClo *clo, unsigned char *buffer,
+		DelayedBundle *bundle)
+{
+#if DELAY_SEGMENTS
+	Sdr sdr = getIonsdr();
+	int payloadMax = DELAY_SEGMENT_BYTES - DELAY_SEGMENT_HEADER_BYTES;
+	DelayFrame frame;
+	ZcoReader reader;
+	int headerLength;
+	int payloadLength;
+	vast bytesCopied;
+
+	memset(&frame, 0, sizeof frame);
+	frame.kind = DELAY_FRAME_SEGMENT;
+	frame.bundleTag = __atomic_add_fetch(&clo->segmentTag, 1,
+			__ATOMIC_RELAXED);
+	frame.bundleLength = bundle->length;
+	frame.count = (bundle->length + payloadMax - 1) / payloadMax;
+	zco_start_transmitting(bundle->bundleZco, &reader);
+	for (frame.index = 0; frame.index < frame.count; frame.index++) {
+		frame.offset = frame.index * payloadMax;
+		payloadLength = bundle->length - frame.offset;
+		if (payloadLength > payloadMax) {
+			payloadLength = payloadMax;
+		}
+
+		headerLength = encodeDelayFrame(&frame, buffer);
+		unsigned long long stageStart = profileStart();
+		if (sdr_begin_xn(sdr) == 0) {
+			putErrmsg("Can't start transaction.", NULL);
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length,
+					NULL);
+			return -1;
+		}
+
+		bytesCopied = zco_transmit(sdr, &reader, payloadLength,
+				(char *) buffer + headerLength);
+		sdr_exit_xn(sdr);
+		profileStop(PROF_ZCO_TRANSMIT, stageStart);
+		if (bytesCopied != payloadLength) {
+			putErrmsg("Can't read bundle content.", NULL);
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length,
+					NULL);
+			return -1;
+		}
+
+		if (sendDatagram(clo, buffer, headerLength + payloadLength,
+				bundle) < 0) {
+			putSysErrmsg("Can't send bundle segment.", NULL);
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length,
+					NULL);
+			return -1;
+		}
+	}
+
+	cloCount(clo, bundle, segmented, 1);
+	cloCount(clo, bundle, segmentsSent, frame.count);
+	return bundle->length;
+#else
+	putErrmsg("Bundle too large for one datagram.",
+			itoa(bundle->length));
+	cloCount(clo, bundle, sendFailed, 1);
+	traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+	return -1;
+#endif
+}
+
+/* Send the bundles packed so far: as an aggregate frame, or bare if
+ * there is only one */
+static void flushAggregate(DelayClo *clo, DelayAggregate *aggregate)
+{
+	unsigned char *datagram;
+	int length, bundleBytes;
+	DelayFrame frame;
+
+	if (aggregate == NULL || aggregate->count == 0) {
+		return;
+	}
+
+	datagram = aggregate->buffer;
+	length = aggregate->length;
+	bundleBytes = length - DELAY_AGGREGATE_HEADER_BYTES
+			- aggregate->count * DELAY_AGGREGATE_ENTRY_BYTES;
+
+	if (aggregate->count == 1) {
+		datagram += DELAY_AGGREGATE_HEADER_BYTES
+				+ DELAY_AGGREGATE_ENTRY_BYTES;
+		length = bundleBytes;
+	} else {
+		memset(&frame, 0, sizeof frame);
+		frame.kind = DELAY_FRAME_AGGREGATE;
+		frame.count = aggregate->count;
+		encodeDelayFrame(&frame, datagram);
+	}
+
+	if (sendDatagram(clo, datagram, length, &aggregate->latest) < 0) {
+		putSysErrmsg("Can't send aggregated bundles.",
+				itoa(aggregate->count));
+		cloCount(clo, &aggregate->latest, sendFailed, aggregate->count);
+		for (int i = 0; i < aggregate->count; i++) {
+			traceBundle(&aggregate->ids[i], DTR_CLO_DROP,
+					aggregate->lengths[i], NULL);
+		}
+	} else {
+		for (int i = 0; i < aggregate->count; i++) {
+			traceBundle(&aggregate->ids[i], DTR_CLO_SEND,
+					aggregate->lengths[i], NULL);
+		}
+
+		cloCount(clo, &aggregate->latest, sent, aggregate->count);
+		cloCount(clo, &aggregate->latest, bytesSent, bundleBytes);
+		if (aggregate->count > 1) {
+			cloCount(clo, &aggregate->latest, aggregated,
+					aggregate->count);
+			cloCount(clo, &aggregate->latest, aggregates, 1);
+		}
+	}
+
+	aggregate->count = 0;
+}
+
+/* Copy a small due bundle into the aggregate, first sending what is
+ * there if the bundle is for another duct or doesn't fit.  The ZCO is
+ * destroyed once copied. */
+static int aggregateBundle(DelayClo *clo, DelayAggregate *aggregate,
+		DelayedBundle *bundle)
+{
+	Sdr sdr = getIonsdr();
+	unsigned char *entry;
+	ZcoReader reader;
+	vast bytesCopied;
+
+	if (aggregate->count > 0 && (aggregate->duct != bundle->duct
+	|| aggregate->count == DELAY_AGGREGATE_MAX_BUNDLES
+	|| aggregate->length + DELAY_AGGREGATE_ENTRY_BYTES + bundle->length
+			> DELAY_AGGREGATE_BYTES)) {
+		flushAggregate(clo, aggregate);
+	}
+
+	if (aggregate->count == 0) {
+		aggregate->duct = bundle->duct;
+		aggregate->length = DELAY_AGGREGATE_HEADER_BYTES;
+	}
+
+	entry = aggregate->buffer + aggregate->length;
+	unsigned long long stageStart = profileStart();
+	if (sdr_begin_xn(sdr) == 0) {
+		putErrmsg("Can't start transaction.", NULL);
+		cloCount(clo, bundle, sendFailed, 1);
+		traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+		dropUnsent(bundle);
+		return -1;
+	}
+
+	zco_start_transmitting(bundle->bundleZco, &reader);
+	bytesCopied = zco_transmit(sdr, &reader, bundle->length,
+			(char *) entry + DELAY_AGGREGATE_ENTRY_BYTES);
+	profileStop(PROF_ZCO_TRANSMIT, stageStart);
+	if (bytesCopied != bundle->length) {
+		sdr_exit_xn(sdr);
+		putErrmsg("Can't read bundle content.", NULL);
+		cloCount(clo, bundle, sendFailed, 1);
+		traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+		dropUnsent(bundle);
+		return -1;
+	}
+
+	stageStart = profileStart();
+	zco_destroy(sdr, bundle->bundleZco);
+	if (sdr_end_xn(sdr) < 0) {
+		putErrmsg("Can't destroy bundle ZCO.", NULL);
+		cloCount(clo, bundle, sendFailed, 1);
+		traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+		return -1;
+	}
+
+	profileStop(PROF_ZCO_DESTROY, stageStart);
+	entry[0] = (bundle->length >> 8) & 0xff;
+	entry[1] = bundle->length & 0xff;
+	aggregate->length += DELAY_AGGREGATE_ENTRY_BYTES + bundle->length;
+	aggregate->ids[aggregate->count] = bundle->id;
+	aggregate->lengths[aggregate->count] = bundle->length;
+	if (aggregate->count++ == 0 || timercmp(&bundle->releaseTime,
+			&aggregate->latest.releaseTime, >)) {
+		aggregate->latest = *bundle;
+	}
+
+	return 0;
+}
+
+/* Send a bundle (after delay has elapsed), using the caller's buffer
+ * and, if aggregating, its aggregate */
+static int sendBundle(DelayClo *clo, unsigned char *buffer,
+		DelayAggregate *aggregate, DelayedBundle *bundle)
+{
+	traceBundle(&bundle->id, DTR_CLO_RELEASE, bundle->length, NULL);
+
+	/* Check for link loss; offloaded, netem drops its share */
+	if (!clo->netem.offloaded
+	&& simulateLinkLoss(clo->model->lossPercentage)) {
+		/* Simulate bundle loss - just drop it and release ZCO */
+		Sdr sdr = getIonsdr();
+
+		cloCount(clo, bundle, linkLoss, 1);
+		traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+		CHKERR(sdr_begin_xn(sdr));
+		zco_destroy(sdr, bundle->bundleZco);
+		return sdr_end_xn(sdr);
+	}
+
+	if (bundle->duct && bundle->duct->ring) {
+		return sendToRing(clo, buffer, bundle, bundle->duct->ring);
+	}
+
+	if (aggregate) {
+		if (bundle->length <= DELAY_AGGREGATE_BUNDLE_BYTES) {
+			return aggregateBundle(clo, aggregate, bundle);
+		}
+
+		/* Keep the duct's bundles in release order */
+		if (aggregate->count > 0 && aggregate->duct == bundle->duct) {
+			flushAggregate(clo, aggregate);
+		}
+	}
+
+	/* Extract bundle content from ZCO */
+	Sdr sdr = getIonsdr();
+	unsigned long long stageStart;
+	int bytesSent;
+
+	if (bundle->length > DELAY_MAX_DATAGRAM) {
+		bytesSent = sendSegments(clo, buffer, bundle);
+		if (bytesSent < 0) {
+			dropUnsent(bundle);
+			return -1;
+		}
+	} else {
+		stageStart = profileStart();
+		if (sdr_begin_xn(sdr) == 0) {
+			putErrmsg("Can't start transaction.", NULL);
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+			dropUnsent(bundle);
+			return -1;
+		}
+
+		profileStop(PROF_SDR_BEGIN, stageStart);
+		stageStart = profileStart();
+		ZcoReader reader;
+		zco_start_transmitting(bundle->bundleZco, &reader);
+		int bytesToSend = zco_transmit(sdr, &reader, bundle->length, (char *) buffer);
+		profileStop(PROF_ZCO_TRANSMIT, stageStart);
+		if (bytesToSend != bundle->length) {
+			sdr_exit_xn(sdr);
+			putErrmsg("Can't read bundle content.", NULL);
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+			dropUnsent(bundle);
+			return -1;
+		}
+		sdr_exit_xn(sdr);
+
+		/* Send the bundle via UDP */
+		bytesSent = sendDatagram(clo, buffer, bytesToSend, bundle);
+		if (bytesSent < 0) {
+			putSysErrmsg("Can't send bundle.", NULL);
+			cloCount(clo, bundle, sendFailed, 1);
+			traceBundle(&bundle->id, DTR_CLO_DROP, bundle->length, NULL);
+			dropUnsent(bundle);
+			return -1;
+		}
+	}
+
+	traceBundle(&bundle->id, DTR_CLO_SEND, bundle->length, NULL);
+	cloCount(clo, bundle, sent, 1);
+	cloCount(clo, bundle, bytesSent, bytesSent);
+
+	/* Clean up ZCO */
+	stageStart = profileStart();
+	CHKERR(sdr_begin_xn(sdr));
+	zco_destroy(sdr, bundle->bundleZco);
+	if (sdr_end_xn(sdr) < 0) {
+		putErrmsg("Can't destroy bundle ZCO.", NULL);
+		return -1;
+	}
+	profileStop(PROF_ZCO_DESTROY, stageStart);
+
+	return 0;
+}
+
+static void transmitBundle(DelayClo *clo, unsigned char *buffer,
+		DelayAggregate *aggregate, DelayedBundle *bundle)
+{
+	struct timeval now;
+
+	delayNow(&now);
+	if (timercmp(&now, &bundle->releaseTime, >)) {
+		profileRecord(PROF_RELEASE_LATE,
+				((now.tv_sec - bundle->releaseTime.tv_sec) * 1000000LL
+				+ now.tv_usec - bundle->releaseTime.tv_usec) * 1000);
+	}
+
+	if (sendBundle(clo, buffer, aggregate, bundle) < 0) {
+		putErrmsg("Can't send bundle.", NULL);
+	}
+}
+
+static void releaseBundle(DelayedBundle *bundle, void *arg)
+{
+	DelayClo *clo = (DelayClo *) arg;
+	Sdr sdr = getIonsdr();
+
+	if (clo->transmitThreads == 0) {
+		transmitBundle(clo, clo->buffer, clo->aggregate, bundle);
+		return;
+	}
+
+	if (pushDelayStage(&clo->transmitStage, bundle, 1) == 0) {
+		return;
+	}
+
+	/* CLO stopping */
+	if (sdr_begin_xn(sdr)) {
+		zco_destroy(sdr, bundle->bundleZco);
+		oK(sdr_end_xn(sdr));
+	}
+}
+
+int delayCloEnqueue(DelayClo *clo, DelayCloDuct *duct, Object bundleZco,
+		BpAncillaryData *ancillaryData)
+{
+	Sdr sdr = getIonsdr();
+	DelayedBundle bundle;
+	struct timeval now;
+
+	memset(&bundle, 0, sizeof bundle);
+	bundle.bundleZco = bundleZco;
+	bundle.ancillaryData = *ancillaryData;
+	bundle.releaseClass = delayBundleClass(ancillaryData);
+	bundle.ordinal = ancillaryData->ordinal;
+	bundle.duct = duct;
+	cloCount(clo, &bundle, dequeued, 1);
+
+	/* Get bundle length, identity and expiration time from ZCO */
+	unsigned long long lengthStart = profileStart();
+	CHKERR(sdr_begin_xn(sdr));
+	bundle.length = zco_length(sdr, bundleZco);
+	decodeZcoBundleId(sdr, bundleZco, bundle.length, &bundle.id,
+			&bundle.expiryTime);
+	sdr_exit_xn(sdr);
+	profileStop(PROF_ZCO_LENGTH, lengthStart);
+	traceBundle(&bundle.id, DTR_CLO_DEQUEUE, bundle.length, NULL);
+
+	/* Calculate send time = current time + delay */
+	double delaySeconds = clo->model->delay();
+	delayNow(&now);
+	computeReleaseTime(&now, delaySeconds, &bundle.releaseTime);
+	if (delayBundleExpires(&bundle)) {
+		cloCount(clo, &bundle, expired, 1);
+		traceBundle(&bundle.id, DTR_CLO_DROP, bundle.length, NULL);
+		CHKERR(sdr_begin_xn(sdr));
+		zco_destroy(sdr, bundleZco);
+		return sdr_end_xn(sdr);
+	}
+
+	/* Netem holds the datagrams for the delay: send the bundle now */
+	if (clo->netem.offloaded) {
+		if (sendBundle(clo, duct && duct->buffer ? duct->buffer
+				: clo->buffer, NULL, &bundle) < 0) {
+			putErrmsg("Can't send bundle.", NULL);
+		}
+
+		return 0;
+	}
+
+	/* The release thread puts it in the delay queue */
+	unsigned long long stageStart = profileStart();
+	if (pushDelayStage(&clo->scheduleStage, &bundle, 1) < 0) {
+		/* CLO stopping */
+		CHKERR(sdr_begin_xn(sdr));
+		zco_destroy(sdr, bundleZco);
+		return sdr_end_xn(sdr);
+	}
+
+	profileStop(PROF_STAGE_WAIT, stageStart);
+	wakeRelease(clo, &bundle);
+
+	return 0;
+}
+
+void delayCloRelease(DelayClo *clo)
+{
+	DelayedBundle bundle;
+	struct timeval now;
+
+	while (popDelayStage(&clo->scheduleStage, &bundle, 0)) {
+		scheduleBundle(clo, &bundle);
+	}
+
+	delayNow(&now);
+	releaseDelayed(&clo->queue, &now, releaseBundle, clo);
+	flushAggregate(clo, clo->aggregate);
+}
+
+/* Transmit thread: sends due bundles until the transmit stage is
+ * closed and drained.  An aggregate is sent whenever the stage runs
+ * dry, so that it holds only bundles released together. */
+static void *delayCloTransmitter(void *arg)
+{
+	DelayTransmitter *transmitter = (DelayTransmitter *) arg;
+	DelayAggregate *aggregate = transmitter->aggregate;
+	DelayedBundle bundle;
+	int pending;
+
+	oK(applyDelayRealtime(&transmitter->clo->rt, 0,
+			transmitter->clo->model->daemonName, "transmit"));
+	for (;;) {
+		pending = aggregate && aggregate->count > 0;
+		if (!popDelayStage(&transmitter->clo->transmitStage, &bundle,
+				!pending)) {
+			if (!pending) {
+				break;		/* Closed and drained */
+			}
+
+			flushAggregate(transmitter->clo, aggregate);
+			continue;
+		}
+
+		transmitBundle(transmitter->clo, transmitter->buffer,
+				aggregate, &bundle);
+	}
+
+	return NULL;
+}
+
+static DelayAggregate *newAggregate(void)
+{
+	DelayAggregate *aggregate = MTAKE(sizeof(DelayAggregate));
+
+	if (aggregate == NULL) {
+		putErrmsg("Can't allocate aggregation buffer.", NULL);
+		return NULL;
+	}
+
+	memset(aggregate, 0, sizeof(DelayAggregate));
+	return aggregate;
+}
+
+int initDelayCloPipeline(DelayClo *clo, int transmitThreads)
+{
+	clo->transmitThreads = 0;
+	if (transmitThreads < 0 || transmitThreads > DELAY_MAX_TRANSMIT_THREADS) {
+		putErrmsg("Bad transmit thread count.", itoa(transmitThreads));
+		return -1;
+	}
+
+	if (initDelayStage(&clo->scheduleStage, DELAY_STAGE_CAPACITY) < 0
+	|| initDelayStage(&clo->transmitStage, DELAY_STAGE_CAPACITY) < 0) {
+		closeDelayCloPipeline(clo);
+		return -1;
+	}
+
+	if (DELAY_AGGREGATE) {
+		clo->aggregate = newAggregate();
+		if (clo->aggregate == NULL) {
+			closeDelayCloPipeline(clo);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < transmitThreads; i++) {
+		clo->transmitters[i].clo = clo;
+		clo->transmitters[i].buffer = MTAKE(UDPCLA_BUFSZ);
+		clo->transmitters[i].aggregate = NULL;
+		if (clo->transmitters[i].buffer == NULL) {
+			putErrmsg("Can't allocate transmit buffer.", NULL);
+			closeDelayCloPipeline(clo);
+			return -1;
+		}
+
+		clo->transmitThreads++;
+		if (DELAY_AGGREGATE) {
+			clo->transmitters[i].aggregate = newAggregate();
+			if (clo->transmitters[i].aggregate == NULL) {
+				closeDelayCloPipeline(clo);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void destroyStagedZcos(DelayStage *stage)
+{
+	Sdr sdr = getIonsdr();
+	DelayedBundle bundle;
+
+	if (stage->slots == NULL || stage->count == 0) {
+		return;
+	}
+
+	if (sdr_begin_xn(sdr)) {
+		while (popDelayStage(stage, &bundle, 0)) {
+			zco_destroy(sdr, bundle.bundleZco);
+		}
+
+		if (sdr_end_xn(sdr) < 0) {
+			putErrmsg("Can't destroy staged bundle ZCOs.", NULL);
+		}
+	}
+}
+
+void closeDelayCloPipeline(DelayClo *clo)
+{
+	destroyStagedZcos(&clo->scheduleStage);
+	destroyStagedZcos(&clo->transmitStage);
+	destroyDelayStage(&clo->scheduleStage);
+	destroyDelayStage(&clo->transmitStage);
+	for (int i = 0; i < clo->transmitThreads; i++) {
+		MRELEASE(clo->transmitters[i].buffer);
+		clo->transmitters[i].buffer = NULL;
+		if (clo->transmitters[i].aggregate) {
+			MRELEASE(clo->transmitters[i].aggregate);
+			clo->transmitters[i].aggregate = NULL;
+		}
+	}
+
+	if (clo->aggregate) {
+		MRELEASE(clo->aggregate);
+		clo->aggregate = NULL;
+	}
+
+	clo->transmitThreads = 0;
+}
+
+int startDelayClo(DelayClo *clo)
+{
+	int started;
+
+	for (started = 0; started < clo->transmitThreads; started++) {
+		if (pthread_create(&clo->transmitters[started].thread, NULL,
+				delayCloTransmitter, &clo->transmitters[started])) {
+			break;
+		}
+	}
+
+	if (started < clo->transmitThreads
+	|| pthread_create(&clo->releaseThread, NULL, delayCloMonitor, clo)) {
+		putSysErrmsg("Can't create CLO thread", NULL);
+		closeDelayStage(&clo->transmitStage);
+		while (started > 0) {
+			pthread_join(clo->transmitters[--started].thread, NULL);
+		}
+
+		return -1;
+	}
+
+	clo->started = 1;
+	return 0;
+}
+
+void stopDelayClo(DelayClo *clo)
+{
+	clo->running = 0;
+	if (!clo->started) {
+		return;
+	}
+
+	pthread_join(clo->releaseThread, NULL);
+	closeDelayStage(&clo->transmitStage);
+	for (int i = 0; i < clo->transmitThreads; i++) {
+		pthread_join(clo->transmitters[i].thread, NULL);
+	}
+
+	clo->started = 0;
+}
+
+/* Has the kernel hold each datagram sent on fd until its transmit
+ * time.  Returns 0, or -1 if SO_TXTIME isn't supported. */
+static int enableTxtime(int fd)
+{
+#if defined(SO_TXTIME) && defined(SCM_TXTIME)
+	struct sock_txtime txtimeConfig;
+
+	txtimeConfig.clockid = CLOCK_MONOTONIC;
+	txtimeConfig.flags = 0;
+	return setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtimeConfig,
+			sizeof txtimeConfig);
+#else
+	return -1;
+#endif
+}
+
+int initDelayCloRelease(DelayClo *clo, int releaseMode)
+{
+	char memoBuf[128];
+
+	clo->releaseMode = DELAY_RELEASE_POLL;
+	clo->timerFd = -1;
+	clo->wakeFd = -1;
+	clo->armedUsec = 0;
+	clo->queue.leadUsec = 0;
+	if (releaseMode == DELAY_RELEASE_POLL) {
+		return 0;
+	}
+
+#ifdef __linux__
+	clo->timerFd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK);
+	clo->wakeFd = eventfd(0, EFD_NONBLOCK);
+	if (clo->timerFd < 0 || clo->wakeFd < 0) {
+		putSysErrmsg("Can't create release timer", NULL);
+		closeDelayCloRelease(clo);
+		return -1;
+	}
+
+	clo->releaseMode = DELAY_RELEASE_TIMERFD;
+	for (int i = 0; i < clo->ductCount; i++) {
+		if (releaseMode == DELAY_RELEASE_TXTIME && clo->ducts[i].ring) {
+			/* Nothing would hold bundles back until their time */
+			isprintf(memoBuf, sizeof memoBuf, "[w] %s: SO_TXTIME doesn't apply to shared-memory ducts, using timerfd release.", clo->model->daemonName);
+			writeMemo(memoBuf);
+			releaseMode = DELAY_RELEASE_TIMERFD;
+		}
+	}
+
+	if (releaseMode == DELAY_RELEASE_TXTIME) {
+		if (enableTxtime(clo->ductSocket) == 0) {
+			clo->releaseMode = DELAY_RELEASE_TXTIME;
+			clo->queue.leadUsec = DELAY_TXTIME_LEAD_USEC;
+		}
+
+		if (clo->releaseMode != DELAY_RELEASE_TXTIME) {
+			isprintf(memoBuf, sizeof memoBuf, "[w] %s: SO_TXTIME not available, using timerfd release.", clo->model->daemonName);
+			writeMemo(memoBuf);
+		}
+	}
+#else
+	isprintf(memoBuf, sizeof memoBuf, "[w] %s: timerfd not available, polling for release.", clo->model->daemonName);
+	writeMemo(memoBuf);
+#endif
+	return 0;
+}
+
+void closeDelayCloRelease(DelayClo *clo)
+{
+	if (clo->timerFd >= 0) {
+		close(clo->timerFd);
+		clo->timerFd = -1;
+	}
+
+	if (clo->wakeFd >= 0) {
+		close(clo->wakeFd);
+		clo->wakeFd = -1;
+	}
+}
+
+/* Polling: sleep 10 ms, or until the spin window before a release
+ * time that is nearer, then spin through the window */
+static void pollForRelease(DelayClo *clo)
+{
+	long long sleepUsec = 10000;
+
+	if (clo->rt.spinUsec > 0) {
+		long long untilUsec = usecToDeadline(&clo->queue);
+
+		if (untilUsec - clo->rt.spinUsec < sleepUsec) {
+			sleepUsec = untilUsec - clo->rt.spinUsec;
+		}
+	}
+
+	if (sleepUsec > 0) {
+		microsnooze((unsigned int) sleepUsec);
+	}
+
+	oK(spinToDeadline(&clo->queue, clo->rt.spinUsec));
+}
+
+/* Sleep until the earliest release time (less the SO_TXTIME lead and
+ * the spin window), a bundle with an earlier release time is queued,
+ * or 100 ms pass */
+static void waitForRelease(DelayClo *clo)
+{
+#ifdef __linux__
+	struct itimerspec timer;
+	struct timeval deadline;
+	struct pollfd fds[2];
+	uint64_t expirations;
+	long long deadlineUsec;
+	int pending;
+
+	if (clo->releaseMode == DELAY_RELEASE_POLL) {
+		pollForRelease(clo);
+		return;
+	}
+
+	/* Any bundle queued from here on wakes us until re-armed; one
+	 * queued since the last pass is scheduled right away */
+	__atomic_store_n(&clo->armedUsec, LLONG_MAX, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&clo->scheduleStage.mutex);
+	pending = clo->scheduleStage.count;
+	pthread_mutex_unlock(&clo->scheduleStage.mutex);
+	if (pending > 0) {
+		return;
+	}
+
+	memset(&timer, 0, sizeof timer);
+	if (nextDelayedDeadline(&clo->queue, &deadline) == 0) {
+		deadlineUsec = deadline.tv_sec * 1000000LL + deadline.tv_usec;
+		__atomic_store_n(&clo->armedUsec, deadlineUsec,
+				__ATOMIC_SEQ_CST);
+		deadlineUsec -= clo->queue.leadUsec + clo->rt.spinUsec;
+		if (DELAY_AGGREGATE) {
+			/* Gather the bundles due in the window */
+			deadlineUsec += DELAY_AGGREGATE_WINDOW_USEC;
+		}
+
+		if (deadlineUsec <= 0) {
+			deadlineUsec = 1;
+		}
+
+		timer.it_value.tv_sec = deadlineUsec / 1000000;
+		timer.it_value.tv_nsec = (deadlineUsec % 1000000) * 1000;
+	}
+
+	timerfd_settime(clo->timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+	fds[0].fd = clo->timerFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = clo->wakeFd;
+	fds[1].events = POLLIN;
+	if (poll(fds, 2, 100) > 0) {
+		oK(read(clo->timerFd, &expirations, sizeof expirations));
+		oK(read(clo->wakeFd, &expirations, sizeof expirations));
+	}
+
+	oK(spinToDeadline(&clo->queue, clo->rt.spinUsec));
+#else
+	pollForRelease(clo);
+#endif
+}
+
+/* Monitor thread function - continuously checks and sends ready bundles */
+void *delayCloMonitor(void *arg)
+{
+	DelayClo *clo = (DelayClo *) arg;
+	char memoBuf[128];
+
+	isprintf(memoBuf, sizeof memoBuf, "[DEBUG] %s: Monitor thread started", clo->model->daemonName);
+	writeMemo(memoBuf);
+	oK(applyDelayRealtime(&clo->rt, clo->rt.releaseCpus,
+			clo->model->daemonName, "release"));
+
+	while (clo->running) {
+		delayCloRelease(clo);
+		checkProfileReport();
+
+		/* Sleep until bundles are due (10 ms when polling) */
+		waitForRelease(clo);
+	}
+
+	/* The dequeue thread mustn't wait for room that never comes */
+	delayNow(&clo->handoff.lastRelease);
+	closeDelayStage(&clo->scheduleStage);
+	isprintf(memoBuf, sizeof memoBuf, "[DEBUG] %s: Monitor thread ending", clo->model->daemonName);
+	writeMemo(memoBuf);
+	return NULL;
+}
+
+void delayCloReport(DelayClo *clo)
+{
+	DelayNetemStats netemStats;
+	char memoBuf[256];
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: dequeued %llu, sent %llu "
+			"(%llu bytes), dropped: queue full %llu, expired %llu, "
+			"link loss %llu, send failed %llu, %d still queued.",
+			clo->model->daemonName, clo->stats.dequeued,
+			clo->stats.sent, clo->stats.bytesSent,
+			clo->stats.queueFull, clo->stats.expired,
+			clo->stats.linkLoss,
+			clo->stats.sendFailed, clo->queue.count);
+	writeMemo(memoBuf);
+	if (clo->stats.segmented > 0) {
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: %llu bundles sent "
+				"as %llu segments.", clo->model->daemonName,
+				clo->stats.segmented, clo->stats.segmentsSent);
+		writeMemo(memoBuf);
+	}
+
+	if (DELAY_AGGREGATE) {
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: %llu datagrams "
+				"sent, %llu bundles in %llu aggregate frames.",
+				clo->model->daemonName, clo->stats.datagramsSent,
+				clo->stats.aggregated, clo->stats.aggregates);
+		writeMemo(memoBuf);
+	}
+
+	for (int i = 0; clo->ductCount > 1 && i < clo->ductCount; i++) {
+		DelayCloStats *stats = &clo->ducts[i].stats;
+
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: duct %s: dequeued "
+				"%llu, sent %llu (%llu bytes), dropped: queue "
+				"full %llu, expired %llu, link loss %llu, send "
+				"failed %llu.",
+				clo->model->daemonName, clo->ducts[i].ductName,
+				stats->dequeued, stats->sent, stats->bytesSent,
+				stats->queueFull, stats->expired, stats->linkLoss,
+				stats->sendFailed);
+		writeMemo(memoBuf);
+	}
+
+	if (clo->netem.offloaded && readDelayNetem(&clo->netem, &netemStats)
+			== 0) {
+		isprintf(memoBuf, sizeof memoBuf, "[i] %s: netem on %s: %llu "
+				"datagrams (%llu bytes) past the delay, %u (%u "
+				"bytes) still held, %u dropped (link loss or "
+				"limit).", clo->model->daemonName,
+				clo->netem.ifName, netemStats.sent,
+				netemStats.bytesSent, netemStats.held,
+				netemStats.heldBytes, netemStats.dropped);
+		writeMemo(memoBuf);
+	}
+
+	reportDelayClasses(&clo->queue, clo->model->daemonName);
+	reportDelayStage(&clo->scheduleStage, clo->model->daemonName,
+			"schedule");
+	if (clo->transmitThreads > 0) {
+		reportDelayStage(&clo->transmitStage, clo->model->daemonName,
+				"transmit");
+	}
+}
+
+/*	*	*	Live handoff	*	*	*	*	*	*/
+
+/* Bundles streamed to the new instance */
+typedef struct {
+	DelayClo		*clo;
+	DelayHandoffStream	*stream;
+	int			failed;
+	unsigned int		handed;
+} DelayCloSender;
+
+/* Handoff thread: waits for a new instance, then ends the ducts so
+ * that the dequeue loops stop and the daemon hands over */
+static void *awaitCloHandoff(void *arg)
+{
+	DelayClo *clo = (DelayClo *) arg;
+	DelayHandoff *handoff = &clo->handoff;
+	char memoBuf[256];
+
+	handoff->fd = acceptDelayHandoff(handoff->listener,
+			clo->model->daemonName, &handoff->peerPid);
+	if (handoff->fd < 0) {
+		return NULL;
+	}
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: handing over to pid %d.",
+			clo->model->daemonName, handoff->peerPid);
+	writeMemo(memoBuf);
+	handoff->requested = 1;
+	for (int i = 0; i < clo->ductCount; i++) {
+		sm_SemEnd(clo->ducts[i].vduct->semaphore);
+	}
+
+	return NULL;
+}
+
+int listenDelayCloHandoff(DelayClo *clo)
+{
+	DelayHandoff *handoff = &clo->handoff;
+
+	handoff->listener = listenDelayHandoff(clo->model->daemonName);
+	if (handoff->listener < 0) {
+		return -1;
+	}
+
+	handoff->listening = 1;
+	if (pthread_create(&handoff->thread, NULL, awaitCloHandoff, clo)) {
+		putSysErrmsg("Can't create handoff thread", NULL);
+		closeDelayCloHandoff(clo);
+		return -1;
+	}
+
+	handoff->threadStarted = 1;
+	return 0;
+}
+
+void closeDelayCloHandoff(DelayClo *clo)
+{
+	closeDelayHandoff(&clo->handoff, clo->model->daemonName);
+}
+
+static void handOffBundle(DelayedBundle *bundle, void *arg)
+{
+	DelayCloSender *sender = (DelayCloSender *) arg;
+	DelayHandoffRecord record;
+	Sdr sdr = getIonsdr();
+
+	packHandoffRecord(bundle, &record);
+	if (bundle->duct) {
+		record.duct = bundle->duct - sender->clo->ducts;
+	}
+
+	if (!sender->failed
+	&& writeHandoff(sender->stream, &record, sizeof record) == 0) {
+		sender->handed++;
+		return;
+	}
+
+	/* The new instance is gone: the bundle is lost */
+	sender->failed = 1;
+	if (sdr_begin_xn(sdr)) {
+		zco_destroy(sdr, bundle->bundleZco);
+		oK(sdr_end_xn(sdr));
+	}
+}
+
+int delayCloHandOff(DelayClo *clo)
+{
+	DelayHandoff *handoff = &clo->handoff;
+	DelayHandoffHeader header;
+	DelayCloSender sender;
+	DelayedBundle bundle;
+	struct timeval now;
+	char memoBuf[256];
+
+	memset(&sender, 0, sizeof sender);
+	sender.clo = clo;
+	sender.stream = MTAKE(sizeof(DelayHandoffStream));
+	if (sender.stream == NULL) {
+		putErrmsg("Can't allocate handoff stream.", NULL);
+		sender.failed = 1;
+	} else {
+		sender.stream->fd = handoff->fd;
+		sender.stream->length = 0;
+	}
+
+	memset(&header, 0, sizeof header);
+	header.pid = sm_TaskIdSelf();
+	header.ductCount = clo->ductCount;
+	header.sockets = 1;
+	header.bundles = clo->queue.count + clo->scheduleStage.count;
+	header.lastReleaseUsec = handoff->lastRelease.tv_sec * 1000000ULL
+			+ handoff->lastRelease.tv_usec;
+	if (!sender.failed && sendHandoffHeader(handoff->fd, &header,
+			&clo->ductSocket, 1) < 0) {
+		sender.failed = 1;
+	}
+
+	/* Earliest release first, then bundles not yet scheduled */
+	drainDelayed(&clo->queue, handOffBundle, &sender);
+	while (popDelayStage(&clo->scheduleStage, &bundle, 0)) {
+		handOffBundle(&bundle, &sender);
+	}
+
+	if (!sender.failed && flushHandoff(sender.stream) < 0) {
+		sender.failed = 1;
+	}
+
+	if (sender.stream) {
+		MRELEASE(sender.stream);
+	}
+
+	close(handoff->fd);
+	handoff->fd = -1;
+	if (sender.failed) {
+		putSysErrmsg("Handoff failed", itoa(handoff->peerPid));
+		return -1;
+	}
+
+	delayNow(&now);
+	handoff->bundles = sender.handed;
+	handoff->gapUsec = (now.tv_sec - handoff->lastRelease.tv_sec)
+			* 1000000LL + now.tv_usec - handoff->lastRelease.tv_usec;
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: handed the socket and %u "
+			"bundles to pid %d, %.1f ms after the last release "
+			"pass.", clo->model->daemonName, sender.handed,
+			handoff->peerPid, handoff->gapUsec / 1000.0);
+	writeMemo(memoBuf);
+	return 0;
+}
+
+int delayCloTakeOver(DelayClo *clo)
+{
+	DelayHandoff *handoff = &clo->handoff;
+	DelayHandoffHeader header;
+	DelayHandoffRecord record;
+	DelayHandoffStream *stream;
+	DelayedBundle bundle;
+	struct timeval started, now;
+	int fds[DELAY_HANDOFF_MAX_FDS];
+	unsigned int late = 0, staged = 0;
+	long long lateUsec, maxLateUsec = 0;
+	char memoBuf[256];
+	uint64_t n;
+	Sdr sdr = getIonsdr();
+
+	stream = MTAKE(sizeof(DelayHandoffStream));
+	if (stream == NULL) {
+		putErrmsg("Can't allocate handoff stream.", NULL);
+		return -1;
+	}
+
+	if (requestDelayHandoff(handoff->fd) < 0
+	|| receiveHandoffHeader(handoff->fd, &header, fds) < 0) {
+		MRELEASE(stream);
+		return -1;
+	}
+
+	if (header.ductCount != (uint32_t) clo->ductCount
+	|| header.sockets != 1 || header.segments != 0) {
+		putErrmsg("Handing-over daemon serves other ducts.",
+				itoa(header.ductCount));
+		for (uint32_t i = 0; i < header.sockets + header.segments; i++) {
+			close(fds[i]);
+		}
+
+		MRELEASE(stream);
+		return -1;
+	}
+
+	/* The old process's socket, with its port, replaces ours */
+	if (clo->ductSocket >= 0) {
+		closesocket(clo->ductSocket);
+	}
+
+	clo->ductSocket = fds[0];
+	if (clo->releaseMode == DELAY_RELEASE_TXTIME) {
+		oK(enableTxtime(clo->ductSocket));
+	}
+
+	if (clo->netem.offloaded) {
+		oK(bindDelayNetem(&clo->netem, clo->ductSocket));
+	}
+
+	for (int i = 0; i < clo->ductCount; i++) {
+		sm_SemUnend(clo->ducts[i].vduct->semaphore);
+	}
+
+	if (startDelayClo(clo) < 0) {
+		MRELEASE(stream);
+		return -1;
+	}
+
+	/* Release resumes now; the rest of the queue follows */
+	delayNow(&started);
+	stream->fd = handoff->fd;
+	stream->length = 0;
+	stream->offset = 0;
+	for (n = 0; n < header.bundles; n++) {
+		if (readHandoff(stream, &record, sizeof record) < 0) {
+			putSysErrmsg("Handoff stream ended early",
+					itoa((int) n));
+			break;
+		}
+
+		unpackHandoffRecord(&record, &bundle);
+		if (record.duct >= 0 && record.duct < clo->ductCount) {
+			bundle.duct = &clo->ducts[record.duct];
+		}
+
+		delayNow(&now);
+		lateUsec = (now.tv_sec - bundle.releaseTime.tv_sec)
+				* 1000000LL + now.tv_usec
+				- bundle.releaseTime.tv_usec;
+		if (lateUsec > 0) {
+			late++;
+			if (lateUsec > maxLateUsec) {
+				maxLateUsec = lateUsec;
+			}
+		}
+
+		/* Netem will hold it for the delay again */
+		if (clo->netem.offloaded) {
+			uint64_t releaseUsec = record.releaseUsec
+					- clo->netem.delayUsec;
+
+			bundle.releaseTime.tv_sec = releaseUsec / 1000000;
+			bundle.releaseTime.tv_usec = releaseUsec % 1000000;
+		}
+
+		if (pushDelayStage(&clo->scheduleStage, &bundle, 1) < 0) {
+			if (sdr_begin_xn(sdr)) {
+				zco_destroy(sdr, bundle.bundleZco);
+				oK(sdr_end_xn(sdr));
+			}
+
+			continue;
+		}
+
+		staged++;
+		wakeRelease(clo, &bundle);
+	}
+
+	MRELEASE(stream);
+	close(handoff->fd);
+	handoff->fd = -1;
+	handoff->connected = 0;
+	handoff->bundles = staged;
+	handoff->lost = header.bundles - staged;
+	handoff->late = late;
+	handoff->maxLateUsec = maxLateUsec;
+	handoff->gapUsec = started.tv_sec * 1000000LL + started.tv_usec
+			- (long long) header.lastReleaseUsec;
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: took over %u of %llu "
+			"bundles, %u lost, from pid %d; release gap %.1f ms, %u "
+			"bundles fell due in it (at most %.1f ms late).",
+			clo->model->daemonName, handoff->bundles,
+			(unsigned long long) header.bundles, handoff->lost,
+			handoff->peerPid, handoff->gapUsec / 1000.0, late,
+			maxLateUsec / 1000.0);
+	writeMemo(memoBuf);
+	return 0;
+}
+
+/*	*	*	Kernel netem offload	*	*	*	*	*/
+
+int initDelayCloNetem(DelayClo *clo, char *ifName)
+{
+	unsigned int limit = DELAY_NETEM_LIMIT;
+	char rateBuf[32];
+	char memoBuf[256];
+
+	if (!clo->model->constantDelay) {
+		isprintf(memoBuf, sizeof memoBuf, "[w] %s: the %s delay "
+				"varies, so netem can't apply it; using the "
+				"delay queue.", clo->model->daemonName,
+				clo->model->modelName);
+		writeMemo(memoBuf);
+		return 0;
+	}
+
+	for (int i = 0; i < clo->ductCount; i++) {
+		if (clo->ducts[i].ring) {
+			isprintf(memoBuf, sizeof memoBuf, "[w] %s: netem "
+					"doesn't apply to shared-memory ducts; "
+					"using the delay queue.",
+					clo->model->daemonName);
+			writeMemo(memoBuf);
+			return 0;
+		}
+	}
+
+	if (limit == 0) {
+		limit = clo->queue.capacity;
+	}
+
+	if (openDelayNetem(&clo->netem, ifName, clo->model->delay(),
+			clo->model->lossPercentage, limit,
+			DELAY_NETEM_RATE_KBPS * 125ULL) < 0
+	|| bindDelayNetem(&clo->netem, clo->ductSocket) < 0) {
+		closeDelayNetem(&clo->netem, 0);
+		writeErrmsgMemos();
+		isprintf(memoBuf, sizeof memoBuf, "[w] %s: can't offload the "
+				"delay to netem on %s; using the delay queue.",
+				clo->model->daemonName, ifName);
+		writeMemo(memoBuf);
+		return 0;
+	}
+
+	/* Each dequeue thread sends from its own buffer */
+	for (int i = 0; i < clo->ductCount; i++) {
+		clo->ducts[i].buffer = MTAKE(UDPCLA_BUFSZ);
+		if (clo->ducts[i].buffer == NULL) {
+			putErrmsg("Can't allocate transmit buffer.",
+					clo->ducts[i].ductName);
+			closeDelayCloNetem(clo);
+			return -1;
+		}
+	}
+
+	/* Only a queue taken over is released by the CLO; netem spaces
+	 * those bundles out, not SO_TXTIME */
+	if (clo->releaseMode == DELAY_RELEASE_TXTIME) {
+		clo->releaseMode = DELAY_RELEASE_TIMERFD;
+		clo->queue.leadUsec = 0;
+	}
+
+	if (DELAY_NETEM_RATE_KBPS > 0) {
+		isprintf(rateBuf, sizeof rateBuf, "%d kbit/s",
+				DELAY_NETEM_RATE_KBPS);
+	} else {
+		istrcpy(rateBuf, "unlimited", sizeof rateBuf);
+	}
+
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s: delay offloaded to netem "
+			"on %s, limit %u datagrams, rate %s.",
+			clo->model->daemonName, ifName, limit, rateBuf);
+	writeMemo(memoBuf);
+	return 0;
+}
+
+void closeDelayCloNetem(DelayClo *clo)
+{
+	/* A new instance keeps the datagrams in flight */
+	closeDelayNetem(&clo->netem, clo->handoff.requested);
+	for (int i = 0; i < clo->ductCount; i++) {
+		if (clo->ducts[i].buffer) {
+			MRELEASE(clo->ducts[i].buffer);
+			clo->ducts[i].buffer = NULL;
+		}
+	}
+}
+
+static void destroyZco(DelayedBundle *bundle, void *arg)
+{
+	if (bundle->bundleZco != 0) {
+		zco_destroy(getIonsdr(), bundle->bundleZco);
+	}
+}
+
+/* Cleanup queue */
+static void destroyQueue(DelayQueue *queue)
+{
+	Sdr sdr = getIonsdr();
+
+	/* Clean up any remaining ZCOs */
+	if (sdr_begin_xn(sdr)) {
+		drainDelayed(queue, destroyZco, NULL);
+		if (sdr_end_xn(sdr) < 0) {
+			putErrmsg("Can't destroy queued bundle ZCOs.", NULL);
+		}
+	}
+
+	destroyDelayQueue(queue);
+}
+
+/* Stops the CLO and closes every duct, ending their dequeue loops */
+static void endDucts(void)
+{
+	clo.running = 0;
+	for (int i = 0; i < clo.ductCount; i++) {
+		sm_SemEnd(clo.ducts[i].vduct->semaphore);
+	}
+}
+
+static void shutDownClo(int signum)
+{
+	char memoBuf[128];
+
+	isignal(SIGTERM, shutDownClo);
+	isignal(SIGINT, shutDownClo);
+	isignal(SIGHUP, shutDownClo);
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s received shutdown signal, terminating gracefully...", clo.model->daemonName);
+	writeMemo(memoBuf);
+	endDucts();
+}
+
+int	delayCloServe(DelayClo *clo, DelayCloDuct *duct)
+{
+	Object		bundleZco;
+	BpAncillaryData	ancillaryData;
+
+	while (clo->running)
+	{
+		/* Dequeue a bundle from ION, blocking until one is ready.
+		 * UDP is unreliable, so no custody: stewardship 0 lets ION
+		 * forget the bundle once it is handed over. */
+		unsigned long long dequeueStart = profileStart();
+		if (bpDequeue(duct->vduct, &bundleZco, &ancillaryData, 0) < 0)
+		{
+			putErrmsg("Can't dequeue bundle.", duct->ductName);
+			return -1;
+		}
+
+		profileStop(PROF_DEQUEUE, dequeueStart);
+		if (bundleZco == 0)	/*	Outduct closed.		*/
+		{
+			break;
+		}
+
+		if (bundleZco == 1)	/*	Got a corrupt bundle.	*/
+		{
+			continue;	/*	Get next bundle.	*/
+		}
+
+		/* Valid bundle received - queue it for delayed sending */
+		if (delayCloEnqueue(clo, duct, bundleZco, &ancillaryData) < 0)
+		{
+			putErrmsg("Can't queue bundle.", duct->ductName);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Dequeue thread of each duct after the first, which the main thread
+ * serves */
+static void *delayCloDequeuer(void *arg)
+{
+	DelayCloDuct *duct = (DelayCloDuct *) arg;
+
+	if (delayCloServe(duct->clo, duct) < 0)
+	{
+		putErrmsg("Dequeue loop failed.", duct->ductName);
+	}
+
+	return NULL;
+}
+
+/* Closes the first count ducts' rings and frees the ducts */
+static void	releaseDucts(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (clo.ducts[i].ring)
+		{
+			closeDelayShmRing(clo.ducts[i].ring);
+		}
+	}
+
+	clo.ductCount = 0;
+	MRELEASE(clo.ducts);
+	clo.ducts = NULL;
+}
+
+/* Clears this CLO's PID from the vducts it registered with */
+static void	unregisterDucts(void)
+{
+	for (int i = 0; i < clo.ductCount; i++)
+	{
+		if (clo.ducts[i].vduct->cloPid == sm_TaskIdSelf())
+		{
+			clo.ducts[i].vduct->cloPid = ERROR;
+		}
+	}
+}
+
+/* Finds the outduct and its destination address, or shared-memory ring */
+static int	attachDuct(DelayCloDuct *duct, char *ductName)
+{
+	PsmAddress		vductElt;
+
+	duct->clo = &clo;
+	duct->ductName = ductName;
+	findOutduct("udp", ductName, &duct->vduct, &vductElt);
+	if (vductElt == 0)
+	{
+		putErrmsg("No such udp duct.", ductName);
+		return -1;
+	}
+
+	/* The process handing over to us is still registered */
+	if (duct->vduct->cloPid != ERROR
+	&& duct->vduct->cloPid != sm_TaskIdSelf()
+	&& !(clo.handoff.connected
+		&& duct->vduct->cloPid == clo.handoff.peerPid))
+	{
+		if (sm_TaskExists(duct->vduct->cloPid))
+		{
+			putErrmsg("CLO task is already started for this duct.",
+					itoa(duct->vduct->cloPid));
+			return -1;
+		}
+		else
+		{
+			writeMemo("[i] Clearing stale CLO PID for duct.");
+			duct->vduct->cloPid = ERROR;
+		}
+	}
+
+	if (strncmp(ductName, DELAY_SHM_PREFIX, strlen(DELAY_SHM_PREFIX)) == 0)
+	{
+		duct->ring = openDelayShmRing(ductName
+				+ strlen(DELAY_SHM_PREFIX), 0);
+		return duct->ring ? 0 : -1;
+	}
+
+	return parseDelaySocketSpec(ductName, &duct->socketName);
+}
+
+/* One socket sends for every duct: IPv4 unless some duct is IPv6, when
+ * it is a dual-stack IPv6 socket and IPv4 destinations are mapped */
+static int	openDuctSocket(int ductCount)
+{
+	int	family = AF_INET;
+
+	for (int i = 0; i < ductCount; i++)
+	{
+		if (clo.ducts[i].socketName.ss_family == AF_INET6)
+		{
+			family = AF_INET6;
+		}
+	}
+
+	for (int i = 0; family == AF_INET6 && i < ductCount; i++)
+	{
+		if (clo.ducts[i].ring == NULL)
+		{
+			mapDelayAddress(&clo.ducts[i].socketName);
+		}
+	}
+
+	return openDelaySocket(family);
+}
+
+int	udpDelayClo(DelayModel *model, char *ductName)
+{
+	char	memoBuf[256];
+
+	if (ductName == NULL)
+	{
+		isprintf(memoBuf, sizeof memoBuf, "Usage: %s <remote host name>[:<port number>] ...", model->daemonName);
+		PUTS(memoBuf);
+		return 0;
+	}
+
+	return udpDelayCloDucts(model, 1, &ductName);
+}
+
+int	udpDelayCloDucts(DelayModel *model, int ductCount, char **ductNames)
+{
+	char			memoBuf[256];
+
+	if (ductCount < 1 || ductCount > DELAY_MAX_CLO_DUCTS)
+	{
+		putErrmsg("Bad outduct count.", itoa(ductCount));
+		return -1;
+	}
+
+	memset(&clo, 0, sizeof clo);
+	clo.model = model;
+	clo.running = 1;
+	initDelayRealtime(&clo.rt);
+	if (bpAttach() < 0)
+	{
+		putErrmsg("Delay CLO can't attach to BP.", model->daemonName);
+		return -1;
+	}
+
+	/* A new binary taking over from the running daemon */
+	if (DELAY_HANDOFF && getenv(DELAY_HANDOFF_ENV))
+	{
+		clo.handoff.fd = connectDelayHandoff(model->daemonName,
+				&clo.handoff.peerPid);
+		if (clo.handoff.fd < 0)
+		{
+			return -1;
+		}
+
+		clo.handoff.connected = 1;
+	}
+
+	clo.ducts = MTAKE(ductCount * sizeof(DelayCloDuct));
+	if (clo.ducts == NULL)
+	{
+		putErrmsg("Can't allocate outducts.", model->daemonName);
+		return -1;
+	}
+
+	memset(clo.ducts, 0, ductCount * sizeof(DelayCloDuct));
+	for (int i = 0; i < ductCount; i++)
+	{
+		if (attachDuct(&clo.ducts[i], ductNames[i]) < 0)
+		{
+			releaseDucts(i + 1);
+			return -1;
+		}
+	}
+
+	clo.ductCount = ductCount;
+	clo.ductSocket = openDuctSocket(ductCount);
+	if (clo.ductSocket < 0)
+	{
+		putSysErrmsg("Can't open UDP socket", NULL);
+		releaseDucts(ductCount);
+		return -1;
+	}
+	/* Initialize random number generator for link loss simulation */
+	srand((unsigned int)time(NULL));
+
+	/* Initialize bundle queue */
+	if (initDelayQueue(&clo.queue, MAX_QUEUED_BUNDLES * ductCount) < 0)
+	{
+		closesocket(clo.ductSocket);
+		releaseDucts(ductCount);
+		return -1;
+	}
+
+	if (initDelayCloRelease(&clo, DELAY_RELEASE_MODE) < 0)
+	{
+		destroyDelayQueue(&clo.queue);
+		closesocket(clo.ductSocket);
+		releaseDucts(ductCount);
+		return -1;
+	}
+
+	/* A constant delay may be left to the kernel */
+	if (DELAY_NETEM && getenv(DELAY_NETEM_ENV)
+	&& initDelayCloNetem(&clo, getenv(DELAY_NETEM_ENV)) < 0)
+	{
+		closeDelayCloRelease(&clo);
+		destroyDelayQueue(&clo.queue);
+		closesocket(clo.ductSocket);
+		releaseDucts(ductCount);
+		return -1;
+	}
+
+	if (initDelayCloPipeline(&clo, DELAY_TRANSMIT_THREADS) < 0
+	|| openDelayTrace(model->daemonName) < 0)
+	{
+		closeDelayCloPipeline(&clo);
+		closeDelayCloNetem(&clo);
+		closeDelayCloRelease(&clo);
+		destroyDelayQueue(&clo.queue);
+		closesocket(clo.ductSocket);
+		releaseDucts(ductCount);
+		return -1;
+	}
+
+	initProfile(model->daemonName);
+
+	/* Set up signal handling for clean shutdown */
+	isignal(SIGTERM, shutDownClo);
+
+	/* Register this CLO with the vducts */
+	for (int i = 0; i < clo.ductCount; i++)
+	{
+		clo.ducts[i].vduct->cloPid = sm_TaskIdSelf();
+	}
+
+	/* Allocate send buffer */
+	clo.buffer = MTAKE(UDPCLA_BUFSZ);
+	if (clo.buffer == NULL)
+	{
+		putErrmsg("Delay CLO can't get UDP buffer.", model->daemonName);
+		unregisterDucts();
+		closeDelayCloPipeline(&clo);
+		closeDelayCloNetem(&clo);
+		closeDelayCloRelease(&clo);
+		destroyQueue(&clo.queue);
+		closesocket(clo.ductSocket);
+		releaseDucts(clo.ductCount);
+		return -1;
+	}
+
+	/* Can now start sending bundles. */
+	{
+		double	currentDelay = model->delay();
+		char	releaseBuf[64];
+
+		if (clo.netem.offloaded)
+		{
+			isprintf(releaseBuf, sizeof releaseBuf, "netem on %s", clo.netem.ifName);
+		}
+		else
+		{
+			isprintf(releaseBuf, sizeof releaseBuf, "%s release, %d transmit threads", delayReleaseModeNames[clo.releaseMode], clo.transmitThreads);
+		}
+
+		isprintf(memoBuf, sizeof(memoBuf),
+				"[i] %s is running, spec = '%s'%s, %s delay = %.1f sec, link loss = %.1f%% (%s).",
+				model->daemonName, ductNames[0], clo.ductCount > 1 ? " and more" : "",
+				model->modelName, currentDelay, model->lossPercentage,
+				releaseBuf);
+		writeMemo(memoBuf);
+		for (int i = 1; i < clo.ductCount; i++)
+		{
+			isprintf(memoBuf, sizeof memoBuf, "[i] %s is also serving spec = '%s'.", model->daemonName, ductNames[i]);
+			writeMemo(memoBuf);
+		}
+	}
+
+	/* Start the release (monitor) and transmit threads, with the
+	 * queue of the daemon we take over from, if any.  Offloaded to
+	 * netem, the dequeue loops send bundles themselves, and the
+	 * threads are needed only to release a queue taken over. */
+	if ((clo.handoff.connected ? delayCloTakeOver(&clo)
+			: clo.netem.offloaded ? 0 : startDelayClo(&clo)) < 0) {
+		putErrmsg("Can't start CLO threads.", NULL);
+		if (clo.handoff.connected)
+		{
+			close(clo.handoff.fd);
+			clo.handoff.connected = 0;
+		}
+
+		unregisterDucts();
+		MRELEASE(clo.buffer);
+		closeDelayCloPipeline(&clo);
+		closeDelayCloNetem(&clo);
+		closeDelayCloRelease(&clo);
+		destroyQueue(&clo.queue);
+		closesocket(clo.ductSocket);
+		releaseDucts(clo.ductCount);
+		return -1;
+	}
+
+	if (DELAY_HANDOFF && listenDelayCloHandoff(&clo) < 0)
+	{
+		writeMemo("[w] Can't accept a handoff, continuing.");
+	}
+
+	/* Thread stacks exist now, so they are locked too */
+	oK(lockDelayMemory(&clo.rt, model->daemonName));
+	reportDelayRealtime(&clo.rt, model->daemonName);
+	isprintf(memoBuf, sizeof memoBuf, "[DEBUG] %s: CLO threads created, starting ION dequeue loop", model->daemonName);
+	writeMemo(memoBuf);
+
+	/* Profile report requests are served by the monitor thread so that
+	 * SIGUSR1 never interrupts bpDequeue */
+	{
+		sigset_t profileSignals;
+
+		sigemptyset(&profileSignals);
+		sigaddset(&profileSignals, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &profileSignals, NULL);
+	}
+
+	/* Every duct after the first gets its own dequeue thread */
+	for (int i = 1; i < clo.ductCount; i++)
+	{
+		if (pthread_create(&clo.ducts[i].dequeueThread, NULL,
+				delayCloDequeuer, &clo.ducts[i]))
+		{
+			putSysErrmsg("Can't create dequeue thread",
+					clo.ducts[i].ductName);
+			break;
+		}
+
+		clo.ducts[i].threadStarted = 1;
+	}
+
+	/* Main processing loop - ION interface only (monitor thread handles sending) */
+	if (delayCloServe(&clo, &clo.ducts[0]) < 0)
+	{
+		putErrmsg("Dequeue loop failed.", NULL);
+		endDucts();
+	}
+
+	/* The daemon ends when every duct has closed */
+	for (int i = 1; i < clo.ductCount; i++)
+	{
+		if (clo.ducts[i].threadStarted)
+		{
+			pthread_join(clo.ducts[i].dequeueThread, NULL);
+		}
+	}
+
+	/* Stop processing and wait for the CLO threads to finish */
+	isprintf(memoBuf, sizeof memoBuf, "[DEBUG] %s: Waiting for CLO threads to finish", model->daemonName);
+	writeMemo(memoBuf);
+	stopDelayClo(&clo);
+	closeDelayCloHandoff(&clo);
+	if (clo.handoff.requested)
+	{
+		oK(delayCloHandOff(&clo));
+	}
+
+	unregisterDucts();
+
+	closesocket(clo.ductSocket);
+	closeDelayCloRelease(&clo);
+	MRELEASE(clo.buffer);
+	delayCloReport(&clo);
+	closeDelayCloNetem(&clo);
+	closeDelayCloPipeline(&clo);
+	destroyQueue(&clo.queue);
+	releaseDucts(clo.ductCount);
+	writeProfileReport();
+	closeDelayTrace();
+	writeErrmsgMemos();
+	isprintf(memoBuf, sizeof memoBuf, "[i] %s duct has ended.", model->daemonName);
+	writeMemo(memoBuf);
+	ionDetach();
+	return 0;
+}
@@ -0,0 +1,288 @@
+/*
+	udpdelaytrace.c:	offline join tool for UDP delay convergence-layer
+				bundle traces.
+
+	Reads the .dtr files written by delay CLOs and CLIs built with
+	TRACE=1, joins their records on primary-block bundle identity and
+	reports a per-bundle latency breakdown.  Cross-host traces assume
+	the hosts' clocks are synchronized (NTP/PTP); wire time absorbs any
+	residual offset.
+
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "udpdelaytrace.h"
+
+#define DTR_EVENTS	(DTR_CLI_DROP + 1)
+
+/* Latency stages, each the difference between two trace events */
+typedef struct {
+	const char *name;
+	int from;
+	int to;
+} Stage;
+
+static Stage stages[] = {
+	{ "clo-shaping",	DTR_CLO_DEQUEUE,	DTR_CLO_DEADLINE },
+	{ "clo-queue-wait",	DTR_CLO_DEADLINE,	DTR_CLO_RELEASE },
+	{ "clo-send",		DTR_CLO_RELEASE,	DTR_CLO_SEND },
+	{ "wire",		DTR_CLO_SEND,		DTR_CLI_RECEIVE },
+	{ "cli-shaping",	DTR_CLI_RECEIVE,	DTR_CLI_DEADLINE },
+	{ "cli-queue-wait",	DTR_CLI_DEADLINE,	DTR_CLI_RELEASE },
+	{ "acquisition",	DTR_CLI_RELEASE,	DTR_CLI_ACQUIRE },
+	{ "end-to-end",		DTR_CLO_DEQUEUE,	DTR_CLI_ACQUIRE }
+};
+
+#define STAGE_COUNT	(sizeof stages / sizeof stages[0])
+
+typedef struct {
+	long long *values;
+	size_t count;
+	size_t capacity;
+} Samples;
+
+static DelayTraceRecord *records = NULL;
+static size_t recordCount = 0;
+static size_t recordCapacity = 0;
+
+static int compareIds(const DelayBundleId *a, const DelayBundleId *b)
+{
+	if (a->scheme != b->scheme) return a->scheme < b->scheme ? -1 : 1;
+	if (a->sourceNode != b->sourceNode)
+		return a->sourceNode < b->sourceNode ? -1 : 1;
+	if (a->sourceService != b->sourceService)
+		return a->sourceService < b->sourceService ? -1 : 1;
+	if (a->creationMsec != b->creationMsec)
+		return a->creationMsec < b->creationMsec ? -1 : 1;
+	if (a->creationCount != b->creationCount)
+		return a->creationCount < b->creationCount ? -1 : 1;
+	if (a->fragmentOffset != b->fragmentOffset)
+		return a->fragmentOffset < b->fragmentOffset ? -1 : 1;
+	return 0;
+}
+
+static int compareRecords(const void *x, const void *y)
+{
+	const DelayTraceRecord *a = x;
+	const DelayTraceRecord *b = y;
+	int result = compareIds(&a->id, &b->id);
+
+	if (result != 0) return result;
+	if (a->usec != b->usec) return a->usec < b->usec ? -1 : 1;
+	return (int) a->event - (int) b->event;
+}
+
+static int compareValues(const void *x, const void *y)
+{
+	long long a = *(const long long *) x;
+	long long b = *(const long long *) y;
+
+	return (a > b) - (a < b);
+}
+
+static int addSample(Samples *samples, long long value)
+{
+	if (samples->count == samples->capacity) {
+		size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+		long long *values = realloc(samples->values,
+				capacity * sizeof(long long));
+
+		if (values == NULL) return -1;
+		samples->values = values;
+		samples->capacity = capacity;
+	}
+
+	samples->values[samples->count++] = value;
+	return 0;
+}
+
+static int loadTrace(const char *fileName)
+{
+	FILE *file = fopen(fileName, "rb");
+	DelayTraceHeader header;
+	DelayTraceRecord record;
+
+	if (file == NULL) {
+		perror(fileName);
+		return -1;
+	}
+
+	if (fread(&header, sizeof header, 1, file) != 1
+	|| header.magic != DTR_MAGIC || header.version != DTR_VERSION
+	|| header.recordSize != sizeof(DelayTraceRecord)) {
+		fprintf(stderr, "%s: not a version %d bundle trace.\n", fileName,
+				DTR_VERSION);
+		fclose(file);
+		return -1;
+	}
+
+	while (fread(&record, sizeof record, 1, file) == 1) {
+		/* Bundles whose primary block could not be decoded can't
+		 * be joined. */
+		if (record.id.scheme == DTR_SCHEME_UNKNOWN
+		|| record.event == 0 || record.event >= DTR_EVENTS) {
+			continue;
+		}
+
+		if (recordCount == recordCapacity) {
+			size_t capacity = recordCapacity ? recordCapacity * 2 : 4096;
+			DelayTraceRecord *grown = realloc(records,
+					capacity * sizeof(DelayTraceRecord));
+
+			if (grown == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				fclose(file);
+				return -1;
+			}
+
+			records = grown;
+			recordCapacity = capacity;
+		}
+
+		records[recordCount++] = record;
+	}
+
+	fprintf(stderr, "%s: %.20s pid %u\n", fileName, header.daemon,
+			header.pid);
+	fclose(file);
+	return 0;
+}
+
+static void printSummary(Samples *samples)
+{
+	printf("%-16s %10s %12s %12s %12s %12s\n", "stage", "bundles",
+			"mean_us", "p50_us", "p99_us", "max_us");
+	for (size_t i = 0; i < STAGE_COUNT; i++) {
+		Samples *s = &samples[i];
+		long long sum = 0;
+
+		if (s->count == 0) {
+			printf("%-16s %10d %12s %12s %12s %12s\n", stages[i].name,
+					0, "-", "-", "-", "-");
+			continue;
+		}
+
+		qsort(s->values, s->count, sizeof(long long), compareValues);
+		for (size_t j = 0; j < s->count; j++) {
+			sum += s->values[j];
+		}
+
+		printf("%-16s %10zu %12lld %12lld %12lld %12lld\n",
+				stages[i].name, s->count, sum / (long long) s->count,
+				s->values[s->count / 2],
+				s->values[(s->count * 99) / 100],
+				s->values[s->count - 1]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int perBundle = 0;
+	int first = 1;
+	Samples samples[STAGE_COUNT];
+	size_t bundles = 0, complete = 0, dropped = 0;
+
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		perBundle = 1;
+		first = 2;
+	}
+
+	if (first >= argc) {
+		fprintf(stderr, "Usage: udpdelaytrace [-b] <trace file>.dtr ...\n");
+		fprintf(stderr, "  -b  print one CSV line per bundle\n");
+		return 1;
+	}
+
+	for (int i = first; i < argc; i++) {
+		if (loadTrace(argv[i]) < 0) {
+			return 1;
+		}
+	}
+
+	qsort(records, recordCount, sizeof(DelayTraceRecord), compareRecords);
+	memset(samples, 0, sizeof samples);
+	if (perBundle) {
+		printf("source,service,creation_ms,count,fragment");
+		for (size_t i = 0; i < STAGE_COUNT; i++) {
+			printf(",%s_us", stages[i].name);
+		}
+
+		printf("\n");
+	}
+
+	for (size_t start = 0; start < recordCount; ) {
+		unsigned long long when[DTR_EVENTS];
+		int seen[DTR_EVENTS];
+		size_t end = start;
+		int isComplete;
+
+		/* Keep the first occurrence of each event for this bundle */
+		memset(when, 0, sizeof when);
+		memset(seen, 0, sizeof seen);
+		while (end < recordCount
+		&& compareIds(&records[start].id, &records[end].id) == 0) {
+			if (!seen[records[end].event]) {
+				seen[records[end].event] = 1;
+				when[records[end].event] = records[end].usec;
+			}
+
+			end++;
+		}
+
+		bundles++;
+		if (seen[DTR_CLO_DROP] || seen[DTR_CLI_DROP]) {
+			dropped++;
+		}
+
+		isComplete = (seen[DTR_CLO_DEQUEUE] && seen[DTR_CLI_ACQUIRE]);
+		if (isComplete) {
+			complete++;
+		}
+
+		if (perBundle) {
+			DelayBundleId *id = &records[start].id;
+
+			printf("%llu,%llu,%llu,%llu,%llu",
+					(unsigned long long) id->sourceNode,
+					(unsigned long long) id->sourceService,
+					(unsigned long long) id->creationMsec,
+					(unsigned long long) id->creationCount,
+					(unsigned long long) id->fragmentOffset);
+		}
+
+		for (size_t i = 0; i < STAGE_COUNT; i++) {
+			int from = stages[i].from;
+			int to = stages[i].to;
+
+			if (seen[from] && seen[to]) {
+				long long delta = (long long) (when[to] - when[from]);
+
+				if (addSample(&samples[i], delta) < 0) {
+					fprintf(stderr, "Out of memory.\n");
+					return 1;
+				}
+
+				if (perBundle) printf(",%lld", delta);
+			} else if (perBundle) {
+				printf(",");
+			}
+		}
+
+		if (perBundle) printf("\n");
+		start = end;
+	}
+
+	fprintf(stderr, "%zu records, %zu bundles, %zu complete, %zu dropped\n",
+			recordCount, bundles, complete, dropped);
+	if (!perBundle) {
+		printSummary(samples);
+	}
+
+	return 0;
+}
@@ -0,0 +1,78 @@
+/*
+	udpdelaytrace.h:	binary trace record format shared by the
+				UDP delay convergence-layer daemons and the
+				offline udpdelaytrace join tool.
+
+	This header has no ION dependencies so that trace files can be
+	analyzed on hosts without an ION installation.
+
+	Author: Samo Grasic (samo@grasic.net), LateLab AB, Sweden
+
+	Copyright (c) 2006, California Institute of Technology.
+	ALL RIGHTS RESERVED.  U.S. Government Sponsorship acknowledged.
+*/
+
+#ifndef _UDPDELAYTRACE_H_
+#define _UDPDELAYTRACE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Trace file layout: one DelayTraceHeader followed by any number of
+ * fixed-size DelayTraceRecords, all in host byte order. */
+#define DTR_MAGIC		0x52544455	/* "UDTR" */
+#define DTR_VERSION		1
+
+/* Source EID schemes recorded in DelayBundleId.scheme */
+#define DTR_SCHEME_UNKNOWN	0
+#define DTR_SCHEME_DTN		1	/* sourceNode is a hash of the SSP */
+#define DTR_SCHEME_IPN		2
+
+/* Trace events, in pipeline order */
+#define DTR_CLO_DEQUEUE		1	/* Bundle handed over by bpDequeue */
+#define DTR_CLO_DEADLINE	2	/* Timestamp is the scheduled release */
+#define DTR_CLO_RELEASE		3	/* Monitor thread picked the bundle up */
+#define DTR_CLO_SEND		4	/* Datagram handed to the kernel */
+#define DTR_CLO_DROP		5	/* Discarded (loss simulation, error) */
+#define DTR_CLI_RECEIVE		6	/* Datagram read from the socket */
+#define DTR_CLI_DEADLINE	7	/* Timestamp is the scheduled release */
+#define DTR_CLI_RELEASE		8	/* Bundle picked up for acquisition */
+#define DTR_CLI_ACQUIRE		9	/* bpEndAcq completed */
+#define DTR_CLI_DROP		10	/* Discarded (loss simulation, error) */
+
+/* Primary-block identity of a bundle.  Two records refer to the same
+ * bundle when all fields match. */
+typedef struct {
+	uint64_t sourceNode;		/* ipn node number or dtn SSP hash */
+	uint64_t sourceService;
+	uint64_t creationMsec;		/* DTN epoch (2000-01-01) */
+	uint64_t creationCount;
+	uint64_t fragmentOffset;
+	uint32_t scheme;		/* DTR_SCHEME_* */
+	uint32_t reserved;
+} DelayBundleId;
+
+typedef struct {
+	uint32_t magic;			/* DTR_MAGIC */
+	uint16_t version;		/* DTR_VERSION */
+	uint16_t recordSize;		/* sizeof(DelayTraceRecord) */
+	uint32_t pid;
+	char	 daemon[20];		/* e.g. "udpmarsdelayclo" */
+} DelayTraceHeader;
+
+typedef struct {
+	DelayBundleId id;
+	uint64_t usec;			/* CLOCK_REALTIME microseconds */
+	uint32_t length;		/* Bundle length in bytes */
+	uint8_t	 event;			/* DTR_* */
+	uint8_t	 reserved[3];
+} DelayTraceRecord;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* _UDPDELAYTRACE_H_ */